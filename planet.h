@@ -0,0 +1,53 @@
+/* planet.h */
+/* library interface to the planet generating program (libplanet) */
+
+/* A planet is opened with the same options as the program takes, and */
+/* can then be rendered any number of times into buffers of the caller, */
+/* or asked for single points, without reading the colour files or */
+/* seeding the planet again. */
+
+/* All state of a planet is in its context, so different contexts may be */
+/* used by different threads at the same time (if built with OpenMP, which */
+/* keeps the state of a point per thread); one context must only be used */
+/* by one call at a time. On errors, also when memory runs out in the */
+/* parallel loops, a message is written to stderr and NULL or -1 is */
+/* returned. No progress bars are written. */
+
+#ifndef PLANET_H
+#define PLANET_H
+
+/* the library is built with -fvisibility=hidden, so only these are exported */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define PLANET_API __attribute__((visibility("default")))
+#else
+#define PLANET_API
+#endif
+
+typedef struct PlanetContext planetcontext;
+
+/* make a planet from the options in av[1] .. av[ac - 1]; -pH, -O, */
+/* --nomap, --cubefaces, --daycycle, --mips and -M (which reads */
+/* standard input) are not allowed, and -o is ignored */
+PLANET_API planetcontext *planet_open(int ac, char **av);
+
+/* size in pixels of the rendered window */
+PLANET_API void planet_size(planetcontext *pc, int *w, int *h);
+
+/* render the window x, y, w, h of the map from now on (as --window), */
+/* or again the window of the options if w and h are 0 */
+PLANET_API int planet_window(planetcontext *pc, int x, int y, int w, int h);
+
+/* render the window: row j starts at rgb + j * stride, and holds w */
+/* red, green, blue triples; if alt is not NULL, row j of altitudes */
+/* (sea level at 0) starts at alt + j * altStride */
+/* (not with --supersample, --rivers or --flow, which change them) */
+PLANET_API int planet_render(planetcontext *pc, unsigned char *rgb, long stride, float *alt, long altStride);
+
+/* colour (unshaded) and altitude of the planet at longitude lon and */
+/* latitude lat in degrees; rgb or alt may be NULL */
+PLANET_API int planet_point(planetcontext *pc, double lon, double lat, unsigned char *rgb, double *alt);
+
+/* free the context */
+PLANET_API void planet_close(planetcontext *pc);
+
+#endif
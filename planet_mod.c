@@ -32,11 +32,18 @@ char version[] = "2024.08.14-mod-1";
 
 /* The primitive user interface is primarily a result of portability concerns */
 
+#if defined(__unix__) || defined(__APPLE__)
+#define SERVE 1 /* --serve and --tiles listen on sockets, --pyramid makes directories */
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <errno.h>
 #include <math.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef THINK_C
 #define macintosh 1
@@ -59,21 +66,51 @@ char version[] = "2024.08.14-mod-1";
 #define O_BINARY 0x8000
 #endif
 
-int BLACK = 0;
-int WHITE = 1;
-int BACK = 2;
-int GRID = 3;
-int OUTLINE1 = 4;
-int OUTLINE2 = 5;
-int LOWEST = 6;
-int SEA = 7;
-int LAND = 8;
-int HIGHEST = 9;
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef SERVE
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#include "planet.h"
+
+/* When used as a library (planet.h), an error returns from the library */
+/* call that ran into it instead of ending the program */
+jmp_buf *planetCatch = NULL; /* where to return to, if not NULL */
+int planetLevel = 0; /* and the level of OpenMP parallel regions there */
+#ifdef _OPENMP
+#pragma omp threadprivate(planetCatch, planetLevel)
+#endif
+
+void planetcatch(jmp_buf *env) { /* return errors to env from now on */
+	planetCatch = env;
+#ifdef _OPENMP
+	planetLevel = omp_get_level(); /* the --serve tasks are in a team already */
+#endif
+}
+
+void planetexit(int status) {
+#ifdef _OPENMP
+	if (omp_get_level() > planetLevel) exit(status); /* can not jump out of a parallel loop */
+#endif
+	if (planetCatch != NULL) longjmp(*planetCatch, 1);
+	exit(status);
+}
+
+#define exit(status) planetexit(status)
 
-int nonLinear = 0;
-char view;
-int nocols = 65536;
-int rtable[65536], gtable[65536], btable[65536];
+#define PI 3.14159265358979323846
+#define DEG2RAD 0.01745329251994329576923 /* pi/180 */
 
 /* Supported output file types:
 	BMP - Windows Bit MaPs
@@ -85,11 +122,9 @@ double log_2(double x) {
 }
 
 typedef enum ftype {
-	bmp, ppm, xpm, heightfield
+	bmp, ppm, xpm, heightfield, hpx
 } ftype;
 
-ftype file_type = bmp;
-
 char* file_ext(ftype file_type) {
 	switch (file_type) {
 	case bmp:
@@ -100,6 +135,8 @@ char* file_ext(ftype file_type) {
 		return (".xpm");
 	case heightfield:
 		return (".heightfield");
+	case hpx:
+		return (".hpx");
 	default:
 		return ("");
 	}
@@ -169,62 +206,17 @@ const char biomes[45][46] = { /* real size: [45][45] */
 	"IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIOOOOOOO"
 };
 
-#define PI 3.14159265358979323846
-#define DEG2RAD 0.01745329251994329576923 /* pi/180 */
-
-/* these three values can be changed to change world characteristica */
-
-double M  = -.02;   /* initial altitude (slightly below sea level) */
-double dd1 = 0.45;  /* weight for altitude difference */
-double POWA = 1.0; /* power for altitude difference */
-double dd2 = 0.035; /* weight for distance */
-double POW = 0.47;  /* power for distance function */
-
 int Depth; /* depth of subdivisions */
-double r1, r2, r3, r4; /* seeds */
-double longi, lat, scale;
-double vgrid, hgrid;
-
-int latic = 0; /* flag for latitude based colour */
-
-int Width = 800, Height = 600; /* default map size */
-
-unsigned short **col;  /* colour array */
-int **heights;         /* heightfield array */
-double **xxx, **yyy, **zzz; /* x,y,z arrays  (used for gridlines */
-int cl0[1000][1000]; /* match map */
-int MatchWidth = 48, MatchHeight = 24;
-
-int do_outline = 0;  /* if 1, draw coastal outline */
-int do_bw = 0;       /* if 1, reduce map to black outline on white */
-int contourLines = 0; /* if >0, # of contour lines */
-int coastContourLines = 0; /* if >0, # of coastal contour lines */
-int *outx, *outy;
-
-int doshade = 0;
 int shade;
-unsigned short **shades; /* shade array */
-
-/* original: 150.0 | Riviera71 modifications: 60.0 */
-double shade_angle = 150.0; /* angle of "light" on bumpmap */
-/* original: 20.0 | Riviera71 modifications: 21.0 */
-double shade_angle2 = 20.0; /* with daylight shading, these two are longitude/latitude */
-
-double cla, sla, clo, slo, rseed;
-
-int temperature = 0; /* if 1, show temperatures based on latitude and altitude*/
 double tempMin = 1000.0, tempMax = -1000.0;
-
-int rainfall = 0; /* if 1, calculate rainfall based on latitude and temperature */
 double rainMin = 1000.0, rainMax = -1000.0;
-
 double rainShadow = 0.0; /* approximate rain shadow */
 
-int makeBiomes = 0; /* 1 = make biome map, 2 = use alternate biome palette, 3 = use custom palette */
-int customColor = 0; /* 0 = use embedded Olsson.col, 1 = use custom palette */
-
-int matchMap = 0;
-double matchSize = 0.1;
+/* Points are rendered in parallel using OpenMP (if enabled), so state */
+/* left behind by planet() for a point must be per thread */
+#ifdef _OPENMP
+#pragma omp threadprivate(Depth, shade, rainShadow, tempMin, tempMax, rainMin, rainMax)
+#endif
 
 typedef struct Vertex {
 	double h; /* altitude */
@@ -233,6 +225,41 @@ typedef struct Vertex {
 	double shadow; /* approximate rain shadow */
 } vertex;
 
+typedef struct CoastEntry { /* sample or edge of the coastline tracer */
+	int i, j; /* position on grid, i = -1 if unused */
+	float alt;
+	char checked; /* edges east and south of sample looked at */
+} coastentry;
+
+typedef struct CoastTable { /* hash table of the above */
+	coastentry *e;
+	long size, count;
+} coasttable;
+
+typedef struct CoastTracer { /* state of coast() */
+	coasttable alts, seen; /* fine samples, and crossings traced */
+	FILE *cf;
+	double *pts;
+	int npts, svg, first, w, h; /* room for points, and fine grid size */
+} coasttracer;
+
+typedef struct ContourChain { /* line contours() has not finished yet */
+	double *pts; /* longitude, latitude pairs */
+	int n, size; /* points, and room for them */
+	int start, end; /* seam edges it starts and ends on, -1 if none */
+} contourchain;
+
+typedef struct FlowEntry { /* pixel waiting to be flooded (--rivers) */
+	float alt;
+	int k;
+} flowentry;
+
+typedef struct Component { /* connected land or sea area (--components) */
+	int land, edge, rank;
+	long pixels;
+	double area, x, y, z;
+} component;
+
 /* distance squared between vertices */
 double dist2(vertex a, vertex b) {
 	double abx, aby, abz;
@@ -242,13 +269,210 @@ double dist2(vertex a, vertex b) {
 	return abx*abx + aby*aby + abz*abz;
 }
 
-/* For the vertices of the tetrahedron */
-vertex tetra[4];
+/* A planet: its options and what is made to render it. main() has one, */
+/* and the library one for each planet_open() */
+struct PlanetContext {
+	int BLACK;
+	int WHITE;
+	int BACK;
+	int GRID;
+	int OUTLINE1;
+	int OUTLINE2;
+	int LOWEST;
+	int SEA;
+	int LAND;
+	int HIGHEST;
+
+	int nonLinear;
+	char view;
+	int nocols;
+	int rtable[65536], gtable[65536], btable[65536];
+
+	ftype file_type;
+
+	/* these three values can be changed to change world characteristica */
+
+	double M;   /* initial altitude (slightly below sea level) */
+	double dd1;  /* weight for altitude difference */
+	double POWA; /* power for altitude difference */
+	double dd2; /* weight for distance */
+	double POW;  /* power for distance function */
+
+	double r1, r2, r3, r4; /* seeds */
+	double longi, lat, scale;
+	double vgrid, hgrid;
+
+	int latic; /* flag for latitude based colour */
+
+	int Width, Height; /* default map size */
+	int winX, winY, winW, winH; /* part of map to output (--window) */
+	int planeX, planeY, planeW, planeH; /* part of map held in arrays (window and halo) */
+	int cubeSize; /* size of cube map faces */
+	int nside; /* HEALPix resolution (0 = from Height) */
+	int nested; /* if 1, HEALPix pixels in nested order, else in ring order */
+	int cubeFiles; /* if 1, write cube map faces to separate files */
+	int superN; /* points per pixel in each direction (--supersample) */
+	int superLanczos; /* if 1, filter them by Lanczos-2, else by box */
+	int mipLevels; /* if >0, # of halved maps written after the map (--mips) */
+	int mipW, mipH; /* size of the halved map being printed, else 0 */
+	unsigned char *mipRGB; /* its colours, top row first */
+	int *mipHeights; /* or its heights */
+	double camDist; /* distance from centre to camera in perspective view */
+	double relief; /* scale of altitudes above sea level in perspective view */
+	double reliefSlack; /* see perspective() */
+	double *reliefTop; /* highest altitude below each node of the bound tree */
+	int *reliefKids; /* the two halves of each node (-1 if not near sphere) */
+	int reliefNodes, reliefSize, reliefLevels; /* used, allocated, depth of tree */
+	char sessionName[256]; /* file keeping the plane between runs (--session) */
+	char contourName[256]; /* file for coastline and contour lines (--contours) */
+	int noMap; /* if 1, only write the contour lines (--nomap) */
+	char coastName[256]; /* file for traced coastline (--coast) */
+	double coastRes; /* grid spacing in degrees of coastline tracer */
+	char *reusedCols; /* columns of the plane copied from the session file */
+
+	unsigned short **col;  /* colour array */
+	unsigned short *lineCols; /* with --supersample, colour + 1 of grid and outline */
+	                          /* points (0 if none), drawn over the filtered pixels */
+	int **heights;         /* heightfield array */
+	unsigned short **lonCells, **latCells; /* grid cells of points (used for gridlines) */
+	int (*cl0)[1000]; /* match map (-M) */
+	int MatchWidth, MatchHeight;
+
+	int do_outline;  /* if 1, draw coastal outline */
+	int do_bw;       /* if 1, reduce map to black outline on white */
+	int contourLines; /* if >0, # of contour lines */
+	int coastContourLines; /* if >0, # of coastal contour lines */
+	unsigned int *inkBits;  /* with do_bw, one bit per pixel, set if black */
+	int bitWords;           /* words of bits per column of the plane */
+	char coastDistName[256]; /* file for distance to coast (--coastdist) */
+	double coastKm; /* if >0, radius in km to give distances in km */
+	int coastRings; /* if >0, # of rings at sea around the coast */
+	double coastRingStep; /* distance between rings, in pixels or km */
+	float *coastDist; /* signed distance to coast, positive on land */
+	float *globePos; /* (x,y,z) of points of plane, for distances and areas */
+	char componentsName[256]; /* file for land and sea components (--components) */
+	char labelsName[256]; /* file for component of each pixel (--labels) */
+	int riverMin; /* if >0, draw rivers where this many pixels drain (--rivers) */
+	char flowName[256]; /* file for flow accumulation (--flow) */
+	float *altPlane; /* altitudes of plane, for rivers */
+	int keepAlt; /* if 1, altPlane is made for planet_render() */
+	unsigned char *flowDir; /* direction of flow of pixels, and which are water */
+	char normalsName[256]; /* file for normal map (--normals) */
+	int nLights; /* number of lights for shading from the altitudes (--light) */
+	double lightAz[16], lightEl[16]; /* their azimuths and elevations in degrees */
+	int horizonDirs; /* if >0, # of directions of horizon map (--horizons) */
+	int dayFrames; /* if >0, # of maps with the sun going round (--daycycle) */
+	unsigned char *horizonMap; /* horizon angles of pixels in those directions */
+	float *hillNormals; /* normals of pixels from hillshade(), for sunshade() */
+	double erodeDrops; /* if >0, droplets per pixel for erosion (--erode) */
+	float *erodeAlt, *erodeShadow, *erodeY; /* altitude, rain shadow and y of */
+	                                        /* points, coloured after erosion */
+
+	int doshade; /* 1 = bump map, 2 = on land only, 3 = daylight, 4 = --light, */
+	             /* 5 = --horizons */
+	unsigned short **shades; /* shade array */
+
+	/* original: 150.0 | Riviera71 modifications: 60.0 */
+	double shade_angle; /* angle of "light" on bumpmap */
+	/* original: 20.0 | Riviera71 modifications: 21.0 */
+	double shade_angle2; /* with daylight shading, these two are longitude/latitude */
+
+	double cla, sla, clo, slo, rseed;
+
+	int temperature; /* if 1, show temperatures based on latitude and altitude*/
+
+	int rainfall; /* if 1, calculate rainfall based on latitude and temperature */
+
+	/* master texture (--master): altitude, shade and rain shadow of the */
+	/* planet sampled at the centres of an equirectangular grid, cached  */
+	/* in a file and resampled instead of calling planet1 */
+	char masterName[256];
+	int masterW, masterH, masterDepth;
+	int masterCubic; /* if 1, bicubic instead of bilinear interpolation */
+	float *masterAlt, *masterShadow;
+	unsigned char *masterShade;
+	long masterMisses; /* points rendered exactly as master was too coarse */
+
+	int makeBiomes; /* 1 = make biome map, 2 = use alternate biome palette, 3 = use custom palette */
+	int climateRows; /* if >0, latitudes of grid for moisture carried by winds (--climate) */
+	float *climateGrid; /* moisture on that grid, in the units of rain shadow */
+	int customColor; /* 0 = use embedded Olsson.col, 1 = use custom palette */
+
+	int matchMap;
+	double matchSize;
+
+	/* For the vertices of the tetrahedron */
+	vertex tetra[4];
+	int tetraMade; /* seeding of tetra, numbered over all contexts so */
+	               /* descents cached from another planet are not used */
+
+	double rotate1, rotate2;
+	double cR1, sR1, cR2, sR2;
+
+	char cmdLine[1000]; /* command line info */
+	int progressDone; /* rows of the progress bar done */
+	int library; /* if 1, made by planet_open(), which must not read standard input */
+	             /* or write progress bars */
+	int failed; /* set when memory ran out in a parallel loop, see planetfail() */
+	int depth; /* Depth of the options, for the library calls */
+	int x0, y0, w0, h0; /* window of the options */
+};
+
+#define INK(i, j) ((pc->inkBits[(i) * pc->bitWords + ((j) >> 5)] >> ((j) & 31)) & 1)
+
+int tetraSeeds = 0; /* seedings of tetra so far, in all contexts */
+
+void planetfail(planetcontext *pc) { /* memory ran out in a parallel loop, whose */
+	/* threads can not exit() back to a library caller: planetcheck() */
+	/* ends the call after the loop */
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+	pc->failed = 1;
+}
 
-double rotate1 = 0.0, rotate2 = 0.0;
-double cR1, sR1, cR2, sR2;
+void planetcheck(planetcontext *pc) { /* after a parallel loop */
+	if (pc->failed) {
+		pc->failed = 0;
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+}
 
-char cmdLine[1000]; /* command line info */
+planetcontext *newplanet(void) { /* context with the default options */
+	planetcontext *pc = (planetcontext*)calloc(1, sizeof(planetcontext));
+
+	if (pc == NULL) return(NULL);
+	pc->WHITE = 1;
+	pc->BACK = 2;
+	pc->GRID = 3;
+	pc->OUTLINE1 = 4;
+	pc->OUTLINE2 = 5;
+	pc->LOWEST = 6;
+	pc->SEA = 7;
+	pc->LAND = 8;
+	pc->HIGHEST = 9;
+	pc->nocols = 65536;
+	pc->file_type = bmp;
+	pc->M = -.02;
+	pc->dd1 = 0.45;
+	pc->POWA = 1.0;
+	pc->dd2 = 0.035;
+	pc->POW = 0.47;
+	pc->Width = 800;
+	pc->Height = 600;
+	pc->superN = 1;
+	pc->camDist = 3.0;
+	pc->relief = 0.3;
+	pc->coastRes = 0.01;
+	pc->MatchWidth = 48;
+	pc->MatchHeight = 24;
+	pc->shade_angle = 150.0;
+	pc->shade_angle2 = 20.0;
+	pc->masterH = 1024;
+	pc->matchSize = 0.1;
+	return(pc);
+}
 
 int min(int x, int y) {
 	return(x < y ? x : y);
@@ -258,39 +482,17 @@ int max(int x, int y) {
 	return(x < y ? y : x);
 }
 
+#ifndef PLANET_LIBRARY /* the library has no main() */
 int main(int ac, char **av) {
-	void printppm(FILE *outfile), printppmBW(FILE *outfile), printbmp(FILE *outfile), printbmpBW(FILE *outfile),
-	     printxpm(FILE *outfile), printxpmBW(FILE *outfile), printheights(FILE *outfile);
-	void print_help(void), print_error(void), print_error_args(char c);
-	void mercator(void), peter(void), squarep(void), mollweide(void), sinusoid(void), stereo(void),
-	     orthographic(void), orthographic2(void), gnomonic(void), icosahedral(void), azimuth(void), conical(void);
-	int i;
-	double rand2(double p, double q),  planet1(double x, double y, double z);
-	void readcolors(FILE *colfile, const char *colorsname, const char *biocolorsname);
-	void readmap(void), makeoutline(int do_bw), smoothshades(void);
-	FILE *outfile, *colfile = NULL;
+	void setup(planetcontext *pc, int ac, char **av, char *filename, int *do_file),
+	     printmap(planetcontext *pc, FILE *outfile), sunshade(planetcontext *pc, double lon),
+	     mips(planetcontext *pc, char *filename), freeplanes(planetcontext *pc),
+	     freeplanet(planetcontext *pc);
+	int makemap(planetcontext *pc, FILE *outfile);
+	planetcontext *newplanet(void), *pc;
+	FILE *outfile;
 	char filename[256];
-	char colorsname[256] = "Olsson.col";
-	char biocolorsname[256] = "default.bio";
-	int do_file = 0, tmp = 0;
-	double tx, ty, tz;
-
-	/* initialize vertices to slightly irregular tetrahedron */
-	tetra[0].x = -sqrt(3.0) - 0.20;
-	tetra[0].y = -sqrt(3.0) - 0.22;
-	tetra[0].z = -sqrt(3.0) - 0.23;
-
-	tetra[1].x = -sqrt(3.0) - 0.19;
-	tetra[1].y = sqrt(3.0) + 0.18;
-	tetra[1].z = sqrt(3.0) + 0.17;
-
-	tetra[2].x = sqrt(3.0) + 0.21;
-	tetra[2].y = -sqrt(3.0) - 0.24;
-	tetra[2].z = sqrt(3.0) + 0.15;
-
-	tetra[3].x = sqrt(3.0) + 0.24;
-	tetra[3].y = sqrt(3.0) + 0.22;
-	tetra[3].z = -sqrt(3.0) - 0.25;
+	int do_file = 0, i;
 
 #ifdef macintosh
 	_ftype = 'TEXT';
@@ -299,64 +501,221 @@ int main(int ac, char **av) {
 	do_file = 1;
 #endif
 
-	longi = 0.0;
-	lat = 0.0;
-	scale = 1.0;
-	rseed = 0.123;
-	view = 'm';
-	vgrid = hgrid = 0.0;
-	outfile = stdout;
+	if (ac == 3 && strcmp(av[1], "--serve") == 0) { /* no other options */
+#ifdef SERVE
+		int serve(const char *path);
+		return(serve(av[2]));
+#else
+		fprintf(stderr, "--serve needs Unix sockets\n");
+		exit(1);
+#endif
+	}
+#ifdef SERVE
+	for (i = 1; i < ac; i++) {
+		if (strcmp(av[i], "--tiles") == 0) { /* the other options are of the planet */
+			int tileserve(int ac, char **av);
+			return(tileserve(ac, av));
+		}
+		if (strcmp(av[i], "--pyramid") == 0) {
+			int pyramid(int ac, char **av);
+			return(pyramid(ac, av));
+		}
+	}
+#endif
+
+	pc = newplanet();
+	if (pc == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(1);
+	}
+	setup(pc, ac, av, filename, &do_file);
+	if (pc->noMap) {
+		freeplanet(pc);
+		free(pc);
+		return(0);
+	}
+
+#ifdef macintosh
+		switch (pc->file_type) {
+		case bmp:
+			_ftype = 'BMPf';
+			break;
+		case ppm:
+			_ftype = 'PPGM';
+			break;
+		case xpm:
+			_ftype = 'TEXT';
+			break;
+		}
+		_fcreator = 'GKON';
+#endif
+
+	if (do_file && '\0' != filename[0]) {
+		if (strchr (filename, '.') == 0) {
+			strcpy(&(filename[strlen(filename)]), file_ext(pc->file_type));
+		}
+		if (pc->cubeFiles || pc->dayFrames > 0) outfile = NULL; /* files are opened after rendering */
+		else outfile = fopen(filename, "wb");
+
+#ifdef macintosh
+		_ftype = 'TEXT';
+		_fcreator = 'ttxt';
+#endif
 
+		if (outfile == NULL && !pc->cubeFiles && pc->dayFrames == 0) {
+			fprintf(stderr, "Could not open output file %s, error code = %d\n", filename, errno);
+			exit(1);
+		}
+	} else {
+		outfile = stdout;
 #ifdef WIN32
-	_setmode(_fileno(outfile), O_BINARY);
+		_setmode(_fileno(outfile), O_BINARY);
 #elif _WIN32
-	_setmode(_fileno(outfile), O_BINARY);
+		_setmode(_fileno(outfile), O_BINARY);
+#endif
+	}
+
+	if (!makemap(pc, outfile)) {
+		freeplanes(pc);
+		freeplanet(pc);
+		free(pc);
+		return(0);
+	}
+
+	/* plot picture */
+	if (pc->dayFrames > 0) { /* write maps with the sun going west as in a day */
+		char framename[300], *ext;
+		ext = strrchr(filename, '.');
+		if (ext == NULL || strchr(ext, '/') != NULL || strchr(ext, '\\') != NULL) {
+			ext = filename + strlen(filename);
+		}
+		for (i = 0; i < pc->dayFrames; i++) {
+			if (i > 0) sunshade(pc, pc->shade_angle - 360.0 * i / pc->dayFrames);
+			sprintf(framename, "%.*s_%03d%s", (int)(ext - filename), filename, i, ext);
+			outfile = fopen(framename, "wb");
+			if (outfile == NULL) {
+				fprintf(stderr, "Could not open output file %s, error code = %d\n", framename, errno);
+				exit(1);
+			}
+			printmap(pc, outfile);
+		}
+	} else if (pc->cubeFiles) { /* write each face of cube map as a window of the cross */
+		static const char *faceName[6] = {"front", "right", "back", "left", "top", "bottom"};
+		static const int faceX[6] = {1, 2, 3, 0, 1, 1}, faceY[6] = {1, 1, 1, 1, 0, 2};
+		char facename[300], *ext;
+		ext = strrchr(filename, '.');
+		if (ext == NULL || strchr(ext, '/') != NULL || strchr(ext, '\\') != NULL) {
+			ext = filename + strlen(filename);
+		}
+		for (i = 0; i < 6; i++) {
+			sprintf(facename, "%.*s_%s%s", (int)(ext - filename), filename, faceName[i], ext);
+			outfile = fopen(facename, "wb");
+			if (outfile == NULL) {
+				fprintf(stderr, "Could not open output file %s, error code = %d\n", facename, errno);
+				exit(1);
+			}
+			pc->winX = faceX[i] * pc->cubeSize;
+			pc->winY = faceY[i] * pc->cubeSize;
+			pc->winW = pc->winH = pc->cubeSize;
+			printmap(pc, outfile);
+		}
+	} else {
+		printmap(pc, outfile);
+		if (pc->mipLevels > 0) mips(pc, filename);
+	}
+	/* print new line after making pictures */
+	fprintf(stderr, "\n");
+	freeplanes(pc);
+	freeplanet(pc);
+	free(pc);
+	return(0);
+}
 #endif
 
-	strcpy(cmdLine, "");
+void setup(planetcontext *pc, int ac, char **av, char *filename, int *do_file) {
+	/* read the options and make what does not depend on the window: */
+	/* the palette, the seeded tetrahedron, --climate, --master, */
+	/* --contours and --coast */
+	void print_help(void), print_error(void), print_error_args(char c), print_error_option(const char *option);
+	void contours(planetcontext *pc), coast(planetcontext *pc), windowplane(planetcontext *pc);
+	int i;
+	double rand2(double p, double q);
+	void readcolors(planetcontext *pc, FILE *colfile, const char *colorsname, const char *biocolorsname);
+	void readmap(planetcontext *pc), climate(planetcontext *pc), loadmaster(planetcontext *pc);
+	FILE *colfile = NULL;
+	char colorsname[256] = "Olsson.col";
+	char biocolorsname[256] = "default.bio";
+	int tmp = 0;
+	double tx, ty, tz;
+
+	/* initialize vertices to slightly irregular tetrahedron */
+	pc->tetra[0].x = -sqrt(3.0) - 0.20;
+	pc->tetra[0].y = -sqrt(3.0) - 0.22;
+	pc->tetra[0].z = -sqrt(3.0) - 0.23;
+
+	pc->tetra[1].x = -sqrt(3.0) - 0.19;
+	pc->tetra[1].y = sqrt(3.0) + 0.18;
+	pc->tetra[1].z = sqrt(3.0) + 0.17;
+
+	pc->tetra[2].x = sqrt(3.0) + 0.21;
+	pc->tetra[2].y = -sqrt(3.0) - 0.24;
+	pc->tetra[2].z = sqrt(3.0) + 0.15;
+
+	pc->tetra[3].x = sqrt(3.0) + 0.24;
+	pc->tetra[3].y = sqrt(3.0) + 0.22;
+	pc->tetra[3].z = -sqrt(3.0) - 0.25;
+
+	pc->longi = 0.0;
+	pc->lat = 0.0;
+	pc->scale = 1.0;
+	pc->rseed = 0.123;
+	pc->view = 'm';
+	pc->vgrid = pc->hgrid = 0.0;
+
+	strcpy(pc->cmdLine, "");
 	for (i = 0; i < ac; i++) {
-		strcat(cmdLine, av[i]);
-		strcat(cmdLine, " ");
+		strcat(pc->cmdLine, av[i]);
+		strcat(pc->cmdLine, " ");
 	}
 	for (i = 1; i < ac; i++) {
 		if (av[i][0] == '-') {
 			switch (av[i][1]) {
 			case 'V':
-				if (++i < ac && sscanf(av[i], "%lf", &dd2)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->dd2)) break;
 				print_error_args('V');
 				break;
 			case 'v':
-				if (++i < ac && sscanf(av[i], "%lf", &dd1)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->dd1)) break;
 				print_error_args('v');
 				break;
 			case 's':
-				if (++i < ac && sscanf(av[i], "%lf", &rseed)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->rseed)) break;
 				print_error_args('s');
 				break;
 			case 'w':
-				if (++i < ac && sscanf(av[i], "%d", &Width)) break;
+				if (++i < ac && sscanf(av[i], "%d", &pc->Width)) break;
 				print_error_args('w');
 				break;
 			case 'h':
-				if (++i < ac && sscanf(av[i], "%d", &Height)) break;
+				if (++i < ac && sscanf(av[i], "%d", &pc->Height)) break;
 				print_error_args('h');
 				break;
 			case 'm':
-				if (++i < ac && sscanf(av[i], "%lf", &scale)) {
-					if (scale < 0.1) {scale = 0.1;}
+				if (++i < ac && sscanf(av[i], "%lf", &pc->scale)) {
+					if (pc->scale < 0.1) {pc->scale = 0.1;}
 					break;
 				}
 				print_error_args('m');
 				break;
 			case 'o':
 				if (++i < ac && sscanf(av[i], "%255[^\n]", filename)) {
-					do_file = 1;
+					*do_file = 1;
 					break;
 				}
 				print_error_args('o');
 				break;
 			case 'x':
-				file_type = xpm;
+				pc->file_type = xpm;
 				break;
 			case 'R':
 				fprintf(stdout, "Torben Mogensen's planet map generator.\n");
@@ -364,135 +723,140 @@ int main(int ac, char **av) {
 				fprintf(stdout, "Homepage: https://topps.diku.dk/torbenm/maps.msp\n");
 				fprintf(stdout, "Modified: https://github.com/MagicalDrizzle/planet-generator\n");
 				exit(0);
+				break;
 			case 'C':
-				customColor = 1;
+				pc->customColor = 1;
 				if (++i < ac && sscanf(av[i], "%255[^\n]", colorsname)) break;
 				print_error_args('C');
 				break;
 			case 'l':
-				if (++i < ac && sscanf(av[i], "%lf", &longi)) {
-					while (longi < -180) longi += 360;
-					while (longi > 180) longi -= 360;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->longi)) {
+					while (pc->longi < -180) pc->longi += 360;
+					while (pc->longi > 180) pc->longi -= 360;
 					break;
 				}
 				print_error_args('l');
 				break;
 			case 'L':
-				if (++i < ac && sscanf(av[i], "%lf", &lat)) {
-					if (lat < -90) lat = -90;
-					if (lat > 90) lat = 90;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->lat)) {
+					if (pc->lat < -90) pc->lat = -90;
+					if (pc->lat > 90) pc->lat = 90;
 					break;
 				}
 				print_error_args('L');
 				break;
 			case 'g':
-				if (++i < ac && sscanf(av[i], "%lf", &vgrid)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->vgrid)) break;
 				print_error_args('g');
 				break;
 			case 'G':
-				if (++i < ac && sscanf(av[i], "%lf", &hgrid)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->hgrid)) break;
 				print_error_args('G');
 				break;
 			case 'c':
-				latic += 1;
+				pc->latic += 1;
 				break;
 			case 'S':
-				dd1 /= 2.0;
-				POWA = 0.75;
+				pc->dd1 /= 2.0;
+				pc->POWA = 0.75;
 				break;
 			case 'n':
-				nonLinear = 1;
+				pc->nonLinear = 1;
 				break;
 			case 'O':
-				do_outline = 1;
-				do_bw = 1;
+				pc->do_outline = 1;
+				pc->do_bw = 1;
 				if (strlen(av[i]) > 2) {
 					sscanf(av[i], "-O%d", &tmp);
-					if (tmp < 0) coastContourLines = -tmp;
-					else contourLines = tmp;
+					if (tmp < 0) pc->coastContourLines = -tmp;
+					else pc->contourLines = tmp;
 				}
 				break;
 			case 'E':
-				do_outline = 1;
+				pc->do_outline = 1;
 				if (strlen(av[i]) > 2) {
 					sscanf(av[i], "-E%d", &tmp);
-					if (tmp < 0) coastContourLines = -tmp;
-					else contourLines = tmp;
+					if (tmp < 0) pc->coastContourLines = -tmp;
+					else pc->contourLines = tmp;
 				}
 				break;
 			case 'B':
-				doshade = 1; /* bump map */
+				pc->doshade = 1; /* bump map */
 				break;
 			case 'b':
-				doshade = 2; /* bump map on land only */
+				pc->doshade = 2; /* bump map on land only */
 				break;
 			case 'd':
-				doshade = 3; /* daylight shading */
+				pc->doshade = 3; /* daylight shading */
 				break;
 			case 'P':
-				file_type = ppm;
+				pc->file_type = ppm;
 				break;
 			case 'H':
-				file_type = heightfield;
+				pc->file_type = heightfield;
 				break;
 			case 'M':
-				if (i + 1 < ac && sscanf(av[i + 1], "%lf", &matchSize)) {
+				if (pc->library) {
+					fprintf(stderr, "-M reads standard input, so it can not be used with planet_open\n");
+					exit(1);
+				}
+				if (i + 1 < ac && sscanf(av[i + 1], "%lf", &pc->matchSize)) {
 					i++;
 				} else {
-					matchSize = 0.1;
+					pc->matchSize = 0.1;
 				}
-				matchMap = 1;
+				pc->matchMap = 1;
 				break;
 			case 'a':
-				if (++i < ac && sscanf(av[i], "%lf", &shade_angle)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->shade_angle)) break;
 				print_error_args('a');
 				break;
 			case 'A':
-				if (++i < ac && sscanf(av[i], "%lf", &shade_angle2)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->shade_angle2)) break;
 				print_error_args('A');
 				break;
 			case 'i':
-				if (++i < ac && sscanf(av[i], "%lf", &M)) break;
+				if (++i < ac && sscanf(av[i], "%lf", &pc->M)) break;
 				print_error_args('i');
 				break;
 			case 'T':
-				if (++i < ac && sscanf(av[i], " %lf", &rotate1)) {
-					if (++i < ac && sscanf(av[i], " %lf", &rotate2)) {
-						while (rotate1 < -180) rotate1 += 360;
-						while (rotate1 > 180) rotate1 -= 360;
-						while (rotate2 < -180) rotate2 += 360;
-						while (rotate2 > 180) rotate2 += 360;
+				if (++i < ac && sscanf(av[i], " %lf", &pc->rotate1)) {
+					if (++i < ac && sscanf(av[i], " %lf", &pc->rotate2)) {
+						while (pc->rotate1 < -180) pc->rotate1 += 360;
+						while (pc->rotate1 > 180) pc->rotate1 -= 360;
+						while (pc->rotate2 < -180) pc->rotate2 += 360;
+						while (pc->rotate2 > 180) pc->rotate2 += 360;
 						break;
 					}
 				}
 				print_error_args('T');
 				break;
 			case 't':
-				temperature = 1;
+				pc->temperature = 1;
 				break;
 			case 'r':
-				rainfall = 1;
+				pc->rainfall = 1;
 				break;
 			case 'z':
-				makeBiomes += 1;
-				if (makeBiomes > 2) makeBiomes = 2;
+				pc->makeBiomes += 1;
+				if (pc->makeBiomes > 2) pc->makeBiomes = 2;
 				break;
 			case 'Z':
 				if (++i < ac && sscanf(av[i], "%255[^\n]", biocolorsname)) {
-					makeBiomes = 3;
+					pc->makeBiomes = 3;
 					break;
 				}
 				print_error_args('Z');
 				break;
 			case 'p':
 				if (strlen(av[i]) > 2) {
-					view = av[i][2];
+					pc->view = av[i][2];
 				} else if (++i < ac) {
-					view = av[i][0];
+					pc->view = av[i][0];
 				} else {
-					view = ' ';
+					pc->view = ' ';
 				}
-				switch (view) {
+				switch (pc->view) {
 				case 'm':
 				case 'p':
 				case 'q':
@@ -505,9 +869,14 @@ int main(int ac, char **av) {
 				case 'M':
 				case 'S':
 				case 'i':
+				case 'X':
+				case 'P':
 					break;
 				case 'h':
-					file_type = heightfield;
+					pc->file_type = heightfield;
+					break;
+				case 'H':
+					pc->file_type = hpx;
 					break;
 				default:
 					fprintf(stderr, "Unknown projection: %s\n", av[i]);
@@ -517,6 +886,146 @@ int main(int ac, char **av) {
 			case '?':
 				print_help();
 				break;
+			case '-':
+				if (strcmp(av[i], "--window") == 0) {
+					if (i + 4 < ac && sscanf(av[i + 1], "%d", &pc->winX) && sscanf(av[i + 2], "%d", &pc->winY)
+					    && sscanf(av[i + 3], "%d", &pc->winW) && sscanf(av[i + 4], "%d", &pc->winH)) {
+						i += 4;
+						break;
+					}
+					print_error_option(av[i]);
+				}
+				if (strcmp(av[i], "--cubefaces") == 0) {
+					pc->cubeFiles = 1;
+					break;
+				}
+				if (strcmp(av[i], "--nside") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->nside) && pc->nside > 0 && pc->nside <= 8192) break;
+					print_error_option("--nside");
+				}
+				if (strcmp(av[i], "--nested") == 0) {
+					pc->nested = 1;
+					break;
+				}
+				if (strcmp(av[i], "--master") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->masterName)) break;
+					print_error_option("--master");
+				}
+				if (strcmp(av[i], "--mastersize") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->masterH) && pc->masterH >= 16 && pc->masterH <= 16384) break;
+					print_error_option("--mastersize");
+				}
+				if (strcmp(av[i], "--bicubic") == 0) {
+					pc->masterCubic = 1;
+					break;
+				}
+				if (strcmp(av[i], "--camera") == 0) {
+					if (++i < ac && sscanf(av[i], "%lf", &pc->camDist) && pc->camDist > 1.0) break;
+					print_error_option("--camera");
+				}
+				if (strcmp(av[i], "--relief") == 0) {
+					if (++i < ac && sscanf(av[i], "%lf", &pc->relief) && pc->relief >= 0.0) break;
+					print_error_option("--relief");
+				}
+				if (strcmp(av[i], "--session") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->sessionName)) break;
+					print_error_option("--session");
+				}
+				if (strcmp(av[i], "--contours") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->contourName)) break;
+					print_error_option("--contours");
+				}
+				if (strcmp(av[i], "--coast") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->coastName)) break;
+					print_error_option("--coast");
+				}
+				if (strcmp(av[i], "--coastres") == 0) {
+					if (++i < ac && sscanf(av[i], "%lf", &pc->coastRes) && pc->coastRes >= 0.00001 && pc->coastRes <= 10.0) break;
+					print_error_option("--coastres");
+				}
+				if (strcmp(av[i], "--coastdist") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->coastDistName)) break;
+					print_error_option("--coastdist");
+				}
+				if (strcmp(av[i], "--coastkm") == 0) {
+					if (++i < ac && sscanf(av[i], "%lf", &pc->coastKm) && pc->coastKm > 0.0) break;
+					print_error_option("--coastkm");
+				}
+				if (strcmp(av[i], "--coastrings") == 0) {
+					if (i + 2 < ac && sscanf(av[i + 1], "%d", &pc->coastRings) && pc->coastRings > 0 &&
+					    sscanf(av[i + 2], "%lf", &pc->coastRingStep) && pc->coastRingStep > 0.0) {
+						i += 2;
+						pc->do_outline = 1;
+						break;
+					}
+					print_error_option("--coastrings");
+				}
+				if (strcmp(av[i], "--components") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->componentsName)) break;
+					print_error_option("--components");
+				}
+				if (strcmp(av[i], "--labels") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->labelsName)) break;
+					print_error_option("--labels");
+				}
+				if (strcmp(av[i], "--rivers") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->riverMin) && pc->riverMin > 0) break;
+					print_error_option("--rivers");
+				}
+				if (strcmp(av[i], "--flow") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->flowName)) break;
+					print_error_option("--flow");
+				}
+				if (strcmp(av[i], "--normals") == 0) {
+					if (++i < ac && sscanf(av[i], "%255[^\n]", pc->normalsName)) break;
+					print_error_option("--normals");
+				}
+				if (strcmp(av[i], "--light") == 0) {
+					if (i + 2 < ac && pc->nLights < 16 && sscanf(av[i + 1], "%lf", &pc->lightAz[pc->nLights]) &&
+					    sscanf(av[i + 2], "%lf", &pc->lightEl[pc->nLights]) && pc->lightEl[pc->nLights] > 0.0 &&
+					    pc->lightEl[pc->nLights] <= 90.0) {
+						i += 2;
+						pc->nLights++;
+						pc->doshade = 4;
+						break;
+					}
+					print_error_option("--light");
+				}
+				if (strcmp(av[i], "--horizons") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->horizonDirs) && pc->horizonDirs >= 4 && pc->horizonDirs <= 64) break;
+					print_error_option("--horizons");
+				}
+				if (strcmp(av[i], "--daycycle") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->dayFrames) && pc->dayFrames >= 2 && pc->dayFrames <= 1000) break;
+					print_error_option("--daycycle");
+				}
+				if (strcmp(av[i], "--supersample") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->superN) && pc->superN >= 1 && pc->superN <= 8) break;
+					print_error_option("--supersample");
+				}
+				if (strcmp(av[i], "--climate") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->climateRows) && pc->climateRows >= 8 && pc->climateRows <= 4096) break;
+					print_error_option("--climate");
+				}
+				if (strcmp(av[i], "--mips") == 0) {
+					if (++i < ac && sscanf(av[i], "%d", &pc->mipLevels) && pc->mipLevels >= 1 && pc->mipLevels <= 16) break;
+					print_error_option("--mips");
+				}
+				if (strcmp(av[i], "--lanczos") == 0) {
+					pc->superLanczos = 1;
+					break;
+				}
+				if (strcmp(av[i], "--erode") == 0) {
+					if (++i < ac && sscanf(av[i], "%lf", &pc->erodeDrops) && pc->erodeDrops > 0.0 && pc->erodeDrops <= 1000.0) break;
+					print_error_option("--erode");
+				}
+				if (strcmp(av[i], "--nomap") == 0) {
+					pc->noMap = 1;
+					break;
+				}
+				fprintf(stderr, "Unknown option: %s\n", av[i]);
+				print_error();
+				break;
 			default:
 				fprintf(stderr, "Unknown option: %s\n", av[i]);
 				print_error();
@@ -547,333 +1056,801 @@ int main(int ac, char **av) {
 		}
 		exit(1);
 	}
-	readcolors(colfile, colorsname, biocolorsname);
-
-#ifdef macintosh
-		switch (file_type) {
-		case bmp:
-			_ftype = 'BMPf';
-			break;
-		case ppm:
-			_ftype = 'PPGM';
-			break;
-		case xpm:
-			_ftype = 'TEXT';
-			break;
-		}
-		_fcreator = 'GKON';
-#endif
+	readcolors(pc, colfile, colorsname, biocolorsname);
 
-	if (do_file && '\0' != filename[0]) {
-		if (strchr (filename, '.') == 0) {
-			strcpy(&(filename[strlen(filename)]), file_ext(file_type));
-		}
-		outfile = fopen(filename, "wb");
+	if ((pc->coastKm > 0.0 || pc->componentsName[0] != '\0' || pc->riverMin > 0 || pc->flowName[0] != '\0' ||
+	     pc->erodeDrops > 0.0 || pc->normalsName[0] != '\0' || pc->nLights > 0 || pc->horizonDirs > 0) &&
+	    pc->sessionName[0] != '\0') {
+		fprintf(stderr, "--coastkm, --components, --rivers, --flow, --erode, --normals, --light\n");
+		fprintf(stderr, "and --horizons can not be used with --session\n");
+		exit(1);
+	}
 
-#ifdef macintosh
-		_ftype = 'TEXT';
-		_fcreator = 'ttxt';
-#endif
+	if ((pc->nLights > 0 || pc->horizonDirs > 0) && pc->view == 'H') {
+		fprintf(stderr, "--light and --horizons can not be used with -pH\n");
+		exit(1);
+	}
 
-		if (outfile == NULL) {
-			fprintf(stderr, "Could not open output file %s, error code = %d\n", filename, errno);
+	if (pc->horizonDirs > 0) {
+		if (pc->nLights > 0) {
+			fprintf(stderr, "--horizons can not be used with --light\n");
 			exit(1);
 		}
-	} else {
-		outfile = stdout;
-#ifdef WIN32
-		_setmode(_fileno(outfile), O_BINARY);
-#elif _WIN32
-		_setmode(_fileno(outfile), O_BINARY);
-#endif
+		pc->doshade = 5; /* instead of -d or -b */
 	}
 
-	longi = longi * DEG2RAD;
-	lat = lat * DEG2RAD;
-
-	sla = sin(lat);
-	cla = cos(lat);
-	slo = sin(longi);
-	clo = cos(longi);
-
-	rotate1 = -rotate1 * DEG2RAD;
-	rotate2 = -rotate2 * DEG2RAD;
-
-	sR1 = sin(rotate1);
-	cR1 = cos(rotate1);
-	sR2 = sin(rotate2);
-	cR2 = cos(rotate2);
-
-	for (i = 0; i < 4; i++) { /* rotate around y axis */
-		tx = tetra[i].x;
-		ty = tetra[i].y;
-		tz = tetra[i].z;
-		tetra[i].x = cR2 * tx + sR2 * tz;
-		tetra[i].y = ty;
-		tetra[i].z = -sR2 * tx + cR2 * tz;
+	if (pc->dayFrames > 0 && (pc->horizonDirs == 0 || !*do_file || '\0' == filename[0] || pc->cubeFiles)) {
+		fprintf(stderr, "--daycycle needs --horizons, an output file name and no --cubefaces\n");
+		exit(1);
 	}
 
-	for (i = 0; i < 4; i++) { /* rotate around x axis */
-		tx = tetra[i].x;
-		ty = tetra[i].y;
-		tz = tetra[i].z;
-		tetra[i].x = tx;
-		tetra[i].y = cR1 * ty - sR1 * tz;
-		tetra[i].z = sR1 * ty + cR1 * tz;
+	if (pc->erodeDrops > 0.0 && (pc->view == 'P' || pc->view == 'H')) {
+		fprintf(stderr, "--erode can not be used with -pP or -pH\n");
+		exit(1);
 	}
 
-	if (matchMap) readmap();
-
-	if (file_type == heightfield) {
-		heights = (int**)calloc(Width, sizeof(int*));
-		if (heights == 0) {
-			fprintf(stderr, "Memory allocation failed.");
-			exit(1);
-		}
-		for (i = 0; i < Width; i++) {
-			heights[i] = (int*)calloc(Height, sizeof(int));
-			if (heights[i] == 0) {
-				fprintf(stderr, "Memory allocation failed at %d out of %d heights\n", i + 1, Width);
-				exit(1);
-			}
-		}
+	if (pc->noMap && pc->contourName[0] == '\0' && pc->coastName[0] == '\0') {
+		fprintf(stderr, "--nomap needs --contours or --coast\n");
+		exit(1);
 	}
 
-	col = (unsigned short**)calloc(Width, sizeof(unsigned short*));
-	if (col == 0) {
-		fprintf(stderr, "Memory allocation failed.");
+	if (pc->climateRows > 0 && !(pc->rainfall || pc->makeBiomes)) {
+		fprintf(stderr, "--climate needs -r, -z or -Z\n");
 		exit(1);
 	}
-	for (i = 0; i < Width; i++) {
-		col[i] = (unsigned short*)calloc(Height, sizeof(unsigned short));
-		if (col[i] == 0) {
-			fprintf(stderr, "Memory allocation failed at %d out of %d cols\n", i + 1, Width);
-			exit(1);
-		}
+
+	if (pc->mipLevels > 0 && (!*do_file || '\0' == filename[0] || pc->cubeFiles || pc->dayFrames > 0 || pc->do_bw ||
+	                      (pc->file_type != bmp && pc->file_type != ppm && pc->file_type != heightfield))) {
+		fprintf(stderr, "--mips needs an output file name, a colour BMP or PPM map or a heightfield,\n");
+		fprintf(stderr, "and no --cubefaces or --daycycle\n");
+		exit(1);
 	}
 
-	if (doshade > 0) {
-		shades = (unsigned short**)calloc(Width, sizeof(unsigned short*));
-		if (shades == 0) {
-			fprintf(stderr, "Memory allocation failed.");
+	if (pc->superN > 1) { /* map is made superN times larger, and filtered down when printed */
+		if (pc->view == 'H' || pc->file_type == heightfield || pc->file_type == xpm || pc->do_bw || pc->sessionName[0] != '\0' ||
+		    pc->coastDistName[0] != '\0' || pc->componentsName[0] != '\0' || pc->labelsName[0] != '\0' ||
+		    pc->flowName[0] != '\0' || pc->normalsName[0] != '\0' || pc->contourName[0] != '\0') {
+			fprintf(stderr, "--supersample needs a colour BMP or PPM map, and can not be used with --session,\n");
+			fprintf(stderr, "--coastdist, --components, --labels, --flow, --normals or --contours\n");
 			exit(1);
 		}
-		for (i = 0; i < Width; i++) {
-			shades[i] = (unsigned short*)calloc(Height, sizeof(unsigned short));
-			if (shades[i] == 0) {
-				fprintf(stderr, "Memory allocation failed at %d out of %d shades\n", i, Width);
-				exit(1);
-			}
-		}
+		pc->Width *= pc->superN;
+		pc->Height *= pc->superN;
+		pc->winX *= pc->superN;
+		pc->winY *= pc->superN;
+		pc->winW *= pc->superN;
+		pc->winH *= pc->superN;
+		pc->riverMin *= pc->superN * pc->superN;
+		if (pc->coastKm == 0.0) pc->coastRingStep *= pc->superN;
+	} else if (pc->superLanczos) {
+		fprintf(stderr, "--lanczos needs --supersample\n");
+		exit(1);
 	}
 
-	if (vgrid != 0.0) {
-		xxx = (double**)calloc(Width, sizeof(double*));
-		if (xxx == 0) {
-			fprintf(stderr, "Memory allocation failed xxx.");
+	if (pc->view == 'H') { /* HEALPix has its own binary file format */
+		if (pc->winW != 0 || pc->winH != 0) { /* which always holds every pixel */
+			fprintf(stderr, "--window can not be used with -pH\n");
 			exit(1);
 		}
-		for (i = 0; i < Width; i++) {
-			xxx[i] = (double*)calloc(Height, sizeof(double));
-			if (xxx[i] == 0) {
-				fprintf(stderr, "Memory allocation failed at %d out of %d xxx\n", i + 1, Width);
-				exit(1);
-			}
+		pc->file_type = hpx;
+		if (pc->nside == 0) {
+			for (pc->nside = 1; 4 * pc->nside < pc->Height; pc->nside *= 2) ;
 		}
-
-		zzz = (double**)calloc(Width, sizeof(double*));
-		if (zzz == 0) {
-			fprintf(stderr, "Memory allocation failed zzz.");
+		if (pc->nested && (pc->nside & (pc->nside - 1)) != 0) {
+			fprintf(stderr, "Nested HEALPix ordering needs nside to be a power of 2\n");
 			exit(1);
 		}
-		for (i = 0; i < Width; i++) {
-			zzz[i] = (double*)calloc(Height, sizeof(double));
-			if (zzz[i] == 0) {
-				fprintf(stderr, "Memory allocation failed at %d out of %d zzz\n", i + 1, Width);
-				exit(1);
-			}
-		}
 	}
 
-	if (hgrid != 0.0 || vgrid != 0.0) {
-		yyy = (double**)calloc(Width, sizeof(double*));
-		if (yyy == 0) {
-			fprintf(stderr, "Memory allocation failed yyy.");
+	if (pc->view == 'X') { /* cube map faces are laid out in a 4 x 3 cross */
+		pc->cubeSize = pc->Height;
+		pc->Width = 4 * pc->cubeSize;
+		pc->Height = 3 * pc->cubeSize;
+		if (pc->cubeFiles && (!*do_file || '\0' == filename[0] || pc->winW != 0 || pc->winH != 0)) {
+			fprintf(stderr, "--cubefaces needs an output file name and no --window\n");
 			exit(1);
 		}
-		for (i = 0; i < Width; i++) {
-			yyy[i] = (double*)calloc(Height, sizeof(double));
-			if (yyy[i] == 0) {
-				fprintf(stderr, "Memory allocation failed at %d out of %d yyy\n", i + 1, Width);
-				exit(1);
-			}
-		}
 	}
 
-	if (view == 'c' || view == 'm') {
-		if (lat == 0) view = 'm';
-		/* Conical approaches mercator when lat -> 0 */
-		if (fabs(lat) >= PI - 0.000001) view = 's';
-		/* Conical approaches stereo when lat -> +/- 90 */
-		/* Also to avoid division by 0 for Mercator when lat -> +/- 90 */
+	if (pc->winW == 0 && pc->winH == 0) { /* no window, so output whole map */
+		pc->winW = pc->Width;
+		pc->winH = pc->Height;
+	}
+	if (pc->winX < 0 || pc->winY < 0 || pc->winW <= 0 || pc->winH <= 0 ||
+	    pc->winX + pc->winW > pc->Width || pc->winY + pc->winH > pc->Height) {
+		fprintf(stderr, "Window %d %d %d %d is not inside the %d x %d map\n",
+		        pc->winX, pc->winY, pc->winW, pc->winH, pc->Width, pc->Height);
+		exit(1);
 	}
+	windowplane(pc);
+
+	pc->longi = pc->longi * DEG2RAD;
+	pc->lat = pc->lat * DEG2RAD;
 
-	Depth = 3 * ((int)(log_2(scale * Height))) + 6;
+	pc->sla = sin(pc->lat);
+	pc->cla = cos(pc->lat);
+	pc->slo = sin(pc->longi);
+	pc->clo = cos(pc->longi);
 
-	r1 = rseed;
+	pc->rotate1 = -pc->rotate1 * DEG2RAD;
+	pc->rotate2 = -pc->rotate2 * DEG2RAD;
 
-	r1 = rand2(r1, r1);
-	r2 = rand2(r1, r1);
-	r3 = rand2(r1, r2);
-	r4 = rand2(r2, r3);
+	pc->sR1 = sin(pc->rotate1);
+	pc->cR1 = cos(pc->rotate1);
+	pc->sR2 = sin(pc->rotate2);
+	pc->cR2 = cos(pc->rotate2);
 
-	tetra[0].s = r1;
-	tetra[1].s = r2;
-	tetra[2].s = r3;
-	tetra[3].s = r4;
+	for (i = 0; i < 4; i++) { /* rotate around y axis */
+		tx = pc->tetra[i].x;
+		ty = pc->tetra[i].y;
+		tz = pc->tetra[i].z;
+		pc->tetra[i].x = pc->cR2 * tx + pc->sR2 * tz;
+		pc->tetra[i].y = ty;
+		pc->tetra[i].z = -pc->sR2 * tx + pc->cR2 * tz;
+	}
 
-	tetra[0].h = M;
-	tetra[1].h = M;
-	tetra[2].h = M;
-	tetra[3].h = M;
+	for (i = 0; i < 4; i++) { /* rotate around x axis */
+		tx = pc->tetra[i].x;
+		ty = pc->tetra[i].y;
+		tz = pc->tetra[i].z;
+		pc->tetra[i].x = tx;
+		pc->tetra[i].y = pc->cR1 * ty - pc->sR1 * tz;
+		pc->tetra[i].z = pc->sR1 * ty + pc->cR1 * tz;
+	}
 
-	tetra[0].shadow = 0.0;
-	tetra[1].shadow = 0.0;
-	tetra[2].shadow = 0.0;
-	tetra[3].shadow = 0.0;
+	if (pc->matchMap) readmap(pc);
 
-	fprintf(stderr, "Progress:\n0----------50---------100%%\n");
-	if (Height < 25) {
-		fprintf(stderr, "Note: The progress bar is disabled for map heights below 25 to\n");
-		fprintf(stderr, "      workaround a weird bug that prevent maps from being made.");
+	if (pc->view == 'P' && pc->matchMap) { /* altitudes from the map are not bounded */
+		fprintf(stderr, "Perspective view (-pP) can not be used with -M\n");
+		exit(1);
 	}
 
-	switch (view) {
-	case 'm': /* Mercator projection */
-		mercator();
-		break;
-	case 'p': /* Peters projection (area preserving cylindrical) */
-		peter();
+	if (pc->view == 'c' || pc->view == 'm') {
+		if (pc->lat == 0) pc->view = 'm';
+		/* Conical approaches mercator when lat -> 0 */
+		if (fabs(pc->lat) >= PI - 0.000001) pc->view = 's';
+		/* Conical approaches stereo when lat -> +/- 90 */
+		/* Also to avoid division by 0 for Mercator when lat -> +/- 90 */
+	}
+
+	Depth = 3 * ((int)(log_2(pc->scale * pc->Height))) + 6;
+
+	pc->r1 = pc->rseed;
+
+	pc->r1 = rand2(pc->r1, pc->r1);
+	pc->r2 = rand2(pc->r1, pc->r1);
+	pc->r3 = rand2(pc->r1, pc->r2);
+	pc->r4 = rand2(pc->r2, pc->r3);
+
+	pc->tetra[0].s = pc->r1;
+	pc->tetra[1].s = pc->r2;
+	pc->tetra[2].s = pc->r3;
+	pc->tetra[3].s = pc->r4;
+
+	pc->tetra[0].h = pc->M;
+	pc->tetra[1].h = pc->M;
+	pc->tetra[2].h = pc->M;
+	pc->tetra[3].h = pc->M;
+
+	pc->tetra[0].shadow = 0.0;
+	pc->tetra[1].shadow = 0.0;
+	pc->tetra[2].shadow = 0.0;
+	pc->tetra[3].shadow = 0.0;
+#ifdef _OPENMP
+#pragma omp critical (tetraseeds)
+#endif
+	pc->tetraMade = ++tetraSeeds;
+
+	if (pc->climateRows > 0) {
+		if (!pc->library) fprintf(stderr, "Climate:\n0----------50---------100%%\n");
+		climate(pc);
+		if (!pc->library) fprintf(stderr, "\n");
+	}
+
+	if (pc->masterName[0] != '\0') {
+		if (pc->matchMap) {
+			fprintf(stderr, "--master can not be used with -M\n");
+			exit(1);
+		}
+		loadmaster(pc);
+	}
+
+	if (pc->contourName[0] != '\0') {
+		if (!pc->library) fprintf(stderr, "Contours:\n0----------50---------100%%\n");
+		contours(pc);
+		if (!pc->library) fprintf(stderr, "\n");
+	}
+	if (pc->coastName[0] != '\0') {
+		if (!pc->library) fprintf(stderr, "Coastline:\n0----------50---------100%%\n");
+		coast(pc);
+		if (!pc->library) fprintf(stderr, "\n");
+	}
+}
+
+int makemap(planetcontext *pc, FILE *outfile) { /* make the map, 0 if it is written already */
+	void mercator(planetcontext *pc), peter(planetcontext *pc), squarep(planetcontext *pc),
+	     mollweide(planetcontext *pc), sinusoid(planetcontext *pc), stereo(planetcontext *pc),
+	     orthographic(planetcontext *pc), orthographic2(planetcontext *pc),
+	     gnomonic(planetcontext *pc), icosahedral(planetcontext *pc), azimuth(planetcontext *pc),
+	     conical(planetcontext *pc), cubemap(planetcontext *pc), perspective(planetcontext *pc);
+	void makeoutline(planetcontext *pc, int do_bw), smoothshades(planetcontext *pc),
+	     allocplanes(planetcontext *pc), coastdistance(planetcontext *pc),
+	     components(planetcontext *pc), rivers(planetcontext *pc), drawrivers(planetcontext *pc),
+	     erode(planetcontext *pc), hillshade(planetcontext *pc), horizons(planetcontext *pc),
+	     sunshade(planetcontext *pc, double lon);
+	void healpix(planetcontext *pc, FILE *outfile), loadsession(planetcontext *pc),
+	     savesession(planetcontext *pc);
+
+	if (pc->view != 'H') allocplanes(pc);
+
+	if (pc->sessionName[0] != '\0') loadsession(pc);
+
+	if (!pc->library) fprintf(stderr, "Progress:\n0----------50---------100%%\n");
+	if (pc->planeH < 25 && !pc->library) {
+		fprintf(stderr, "Note: The progress bar is disabled for map heights below 25 to\n");
+		fprintf(stderr, "      workaround a weird bug that prevent maps from being made.");
+	}
+
+	switch (pc->view) {
+	case 'm': /* Mercator projection */
+		mercator(pc);
+		break;
+	case 'p': /* Peters projection (area preserving cylindrical) */
+		peter(pc);
 		break;
 	case 'q': /* Square projection (equidistant latitudes) */
-		squarep();
+		squarep(pc);
 		break;
 	case 'M': /* Mollweide projection (area preserving) */
-		mollweide();
+		mollweide(pc);
 		break;
 	case 'S': /* Sinusoid projection (area preserving) */
-		sinusoid();
+		sinusoid(pc);
 		break;
 	case 's': /* Stereographic projection */
-		stereo();
+		stereo(pc);
 		break;
 	case 'o': /* Orthographic projection */
-		orthographic();
+		orthographic(pc);
 		break;
 	case 'O': /* Orthographic 2 hemispheres projection */
-		orthographic2();
+		orthographic2(pc);
 		break;
 	case 'g': /* Gnomonic projection */
-		gnomonic();
+		gnomonic(pc);
 		break;
 	case 'i': /* Icosahedral projection */
-		icosahedral();
+		icosahedral(pc);
 		break;
 	case 'a': /* Area preserving azimuthal projection */
-		azimuth();
+		azimuth(pc);
 		break;
 	case 'c': /* Conical projection (conformal) */
-		conical();
+		conical(pc);
 		break;
 	case 'h': /* heightfield (obsolete) */
-		orthographic();
+		orthographic(pc);
+		break;
+	case 'X': /* Cube map */
+		cubemap(pc);
 		break;
+	case 'P': /* Perspective view with relief */
+		perspective(pc);
+		break;
+	case 'H': /* HEALPix (written directly, no post-processing) */
+		healpix(pc, outfile);
+		fprintf(stderr, "\n");
+		return(0);
+	}
+
+	if (pc->erodeDrops > 0.0) {
+		if (!pc->library) fprintf(stderr, "\nErosion:\n0----------50---------100%%\n");
+		erode(pc);
 	}
 
-	if (do_outline) makeoutline(do_bw);
+	if (pc->sessionName[0] != '\0') savesession(pc);
 
-	if (vgrid != 0.0) { /* draw longitudes */
-		int i, j;
-		for (i = 0; i < Width - 1; i++) {
-			for (j = 0; j < Height - 1; j++) {
-				double t;
-				int g = 0;
-				if (fabs(yyy[i][j]) == 1.0) {
+	if (pc->masterMisses > 0 && !pc->library) {
+		fprintf(stderr, "\nMaster texture too coarse for %ld points, these were rendered exactly", pc->masterMisses);
+	}
+
+	if (pc->normalsName[0] != '\0' || pc->nLights > 0 || pc->horizonDirs > 0) hillshade(pc);
+
+	if (pc->horizonDirs > 0) {
+		if (!pc->library) fprintf(stderr, "\nHorizons:\n0----------50---------100%%\n");
+		horizons(pc);
+	}
+
+	if (pc->coastDistName[0] != '\0' || pc->coastRings > 0) coastdistance(pc);
+
+	if (pc->componentsName[0] != '\0' || pc->labelsName[0] != '\0') components(pc);
+
+	if (pc->riverMin > 0 || pc->flowName[0] != '\0') rivers(pc);
+
+	if (pc->do_outline) makeoutline(pc, pc->do_bw);
+
+	if (pc->riverMin > 0) drawrivers(pc);
+
+	if (pc->vgrid != 0.0) { /* draw longitudes */
+		int i;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (i = 0; i < pc->planeW - 1; i++) {
+			int j, t, g;
+			for (j = 0; j < pc->planeH - 1; j++) {
+				/* poles are always on the grid */
+				g = pc->lonCells[i][j] >= 0x8000;
+				t = pc->lonCells[i][j] & 0x7fff;
+				if (t == 0x7fff || t != (pc->lonCells[i + 1][j] & 0x7fff) ||
+				    t != (pc->lonCells[i][j + 1] & 0x7fff)) {
 					g = 1;
-				} else {
-					t = floor((atan2(xxx[i][j], zzz[i][j]) * 180 / PI + 360) / vgrid);
-					if (t != floor((atan2(xxx[i + 1][j], zzz[i + 1][j]) * 180 / PI + 360) / vgrid)) {
-						g = 1;
-					}
-					if (t != floor((atan2(xxx[i][j + 1], zzz[i][j + 1]) * 180 / PI + 360) / vgrid)) {
-						g = 1;
-					}
 				}
 				if (g) {
-					if (do_bw) {
-						col[i][j] = 0;
+					if (pc->do_bw) {
+						pc->inkBits[i * pc->bitWords + (j >> 5)] |= 1u << (j & 31);
+					} else if (pc->lineCols != NULL) {
+						pc->lineCols[(size_t)i * pc->planeH + j] = pc->GRID + 1;
+						continue;
 					} else {
-						col[i][j] = GRID;
+						pc->col[i][j] = pc->GRID;
 					}
-					if (doshade > 0) {shades[i][j] = 255;}
+					if (pc->doshade > 0) {pc->shades[i][j] = 255;}
 				}
 			}
 		}
 	}
 
-	if (hgrid != 0.0) { /* draw latitudes */
-		int i, j;
-		for (i = 0; i < Width - 1; i++) {
-			for (j = 0; j < Height - 1; j++) {
-				double t;
-				int g = 0;
-				t = floor((asin(yyy[i][j]) * 180 / PI + 360) / hgrid);
-				if (t != floor((asin(yyy[i + 1][j]) * 180 / PI + 360) / hgrid)) {
-					g = 1;
+	if (pc->hgrid != 0.0) { /* draw latitudes */
+		int i;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (i = 0; i < pc->planeW - 1; i++) {
+			int j, t;
+			for (j = 0; j < pc->planeH - 1; j++) {
+				t = pc->latCells[i][j];
+				if (t == 0xffff || t != pc->latCells[i + 1][j] || t != pc->latCells[i][j + 1]) {
+					if (pc->do_bw) {
+						pc->inkBits[i * pc->bitWords + (j >> 5)] |= 1u << (j & 31);
+					} else if (pc->lineCols != NULL) {
+						pc->lineCols[(size_t)i * pc->planeH + j] = pc->GRID + 1;
+						continue;
+					} else {
+						pc->col[i][j] = pc->GRID;
+					}
+					if (pc->doshade > 0) {pc->shades[i][j] = 255;}
 				}
-				if (t != floor((asin(yyy[i][j + 1]) * 180 / PI + 360) / hgrid)) {
-					g = 1;
+			}
+		}
+	}
+
+	if (pc->doshade > 0 && pc->doshade < 4) smoothshades(pc);
+
+	if (pc->doshade == 5) sunshade(pc, pc->shade_angle);
+
+	return(1);
+}
+
+FILE *mipopen(char *filename, char *ext, int l, const char *suffix) {
+	/* open file_l.suffix of the mip chain, for ext the extension of file */
+	char mipname[300];
+	FILE *mf;
+
+	if (l > 0) sprintf(mipname, "%.*s_%d%s", (int)(ext - filename), filename, l, suffix);
+	else sprintf(mipname, "%.*s%s", (int)(ext - filename), filename, suffix);
+	mf = fopen(mipname, "wb");
+	if (mf == NULL) {
+		fprintf(stderr, "Could not open output file %s, error code = %d\n", mipname, errno);
+		exit(1);
+	}
+	return(mf);
+}
+
+double *mipplane(planetcontext *pc, int p) {
+	/* the printed window of heights (p = 0) or shades (p = 1), with the */
+	/* superN x superN points of a pixel averaged */
+	int w, h, i;
+	double *v;
+	void mapsize(planetcontext *pc, int *w, int *h);
+
+	mapsize(pc, &w, &h);
+	v = (double*)malloc((size_t)w * h * sizeof(double));
+	if (v == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < h; i++) {
+		int x, a, b, pi, pj;
+		double sum;
+		for (x = 0; x < w; x++) {
+			sum = 0.0;
+			for (a = 0; a < pc->superN; a++) {
+				for (b = 0; b < pc->superN; b++) {
+					pi = pc->winX - pc->planeX + pc->superN * x + a;
+					pj = pc->winY - pc->planeY + pc->superN * i + b;
+					sum += p == 0 ? pc->heights[pi][pj] : pc->shades[pi][pj];
 				}
-				if (g) {
-					if (do_bw) {
-						col[i][j] = 0;
-					} else {
-						col[i][j] = GRID;
+			}
+			v[(size_t)i * w + x] = sum / (pc->superN * pc->superN);
+		}
+	}
+	return(v);
+}
+
+double *miphalve(double *v, int w, int h) { /* halve (and free) w x h values */
+	int w2 = (w + 1) / 2, h2 = (h + 1) / 2, i;
+	double *half;
+
+	half = (double*)malloc((size_t)w2 * h2 * sizeof(double));
+	if (half == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	for (i = 0; i < w2 * h2; i++) {
+		int x = i % w2, y = i / w2;
+		int x1 = 2 * x + 1 < w ? 2 * x + 1 : 2 * x, y1 = 2 * y + 1 < h ? 2 * y + 1 : 2 * y;
+		half[i] = 0.25 * (v[(size_t)2 * y * w + 2 * x] + v[(size_t)2 * y * w + x1] +
+		                  v[(size_t)y1 * w + 2 * x] + v[(size_t)y1 * w + x1]);
+	}
+	free(v);
+	return(half);
+}
+
+void mips(planetcontext *pc, char *filename) {
+	/* Halve the printed map mipLevels times, writing each level to     */
+	/* file_1.ext, file_2.ext and so on as soon as it is made. Colours  */
+	/* are averaged over 2 x 2 pixels in linear light (from sRGB) and   */
+	/* heights and shades as they are; an odd last row or column is     */
+	/* averaged with itself. Each level is made from the one before, so */
+	/* they cost a third of the map's pixels together. The heights of a */
+	/* colour map are written with it, as file.heightfield,             */
+	/* file_1.heightfield and so on, and the colours of a heightfield   */
+	/* as file.bmp, file_1.bmp ...; with shading the shades are too, as */
+	/* file_shade.pgm, file_1_shade.pgm ...                             */
+	int l, w, h, i;
+	ftype type = pc->file_type;
+	float *lin, *half;
+	double *hts, *shd;
+	char *ext;
+	FILE *mf;
+	void maprow(planetcontext *pc, unsigned char *p, int j, int bgr),
+	     mapsize(planetcontext *pc, int *w, int *h), printmap(planetcontext *pc, FILE *outfile);
+	FILE *mipopen(char *filename, char *ext, int l, const char *suffix);
+	double *mipplane(planetcontext *pc, int p), *miphalve(double *v, int w, int h);
+
+	mapsize(pc, &w, &h);
+	hts = mipplane(pc, 0);
+	shd = pc->doshade > 0 ? mipplane(pc, 1) : NULL;
+	/* colours of the map in linear light */
+	lin = (float*)malloc((size_t)3 * w * h * sizeof(float));
+	if (lin == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < h; i++) {
+		int k;
+		double c;
+		unsigned char *row = (unsigned char*)malloc((size_t)3 * w);
+		if (row == 0) {
+			planetfail(pc);
+			continue;
+		}
+		maprow(pc, row, i, 0);
+		for (k = 0; k < 3 * w; k++) {
+			c = row[k] / 255.0;
+			lin[(size_t)3 * w * i + k] = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+		}
+		free(row);
+	}
+	planetcheck(pc);
+
+	ext = strrchr(filename, '.');
+	if (ext == NULL || strchr(ext, '/') != NULL || strchr(ext, '\\') != NULL) {
+		ext = filename + strlen(filename);
+	}
+	for (l = 0; l <= pc->mipLevels && (l == 0 || w > 1 || h > 1); l++) {
+		if (l > 0) {
+			int w2 = (w + 1) / 2, h2 = (h + 1) / 2;
+			half = (float*)malloc((size_t)3 * w2 * h2 * sizeof(float));
+			if (half == 0) {
+				fprintf(stderr, "Memory allocation failed.");
+				exit(1);
+			}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+			for (i = 0; i < h2; i++) {
+				int x, k, x1, y0 = 2 * i, y1 = 2 * i + 1 < h ? 2 * i + 1 : 2 * i;
+				for (x = 0; x < w2; x++) {
+					x1 = 2 * x + 1 < w ? 2 * x + 1 : 2 * x;
+					for (k = 0; k < 3; k++) {
+						half[3 * ((size_t)i * w2 + x) + k] =
+						    0.25 * (lin[3 * ((size_t)y0 * w + 2 * x) + k] + lin[3 * ((size_t)y0 * w + x1) + k] +
+						            lin[3 * ((size_t)y1 * w + 2 * x) + k] + lin[3 * ((size_t)y1 * w + x1) + k]);
 					}
-					if (doshade > 0) {shades[i][j] = 255;}
 				}
 			}
+			free(lin);
+			lin = half;
+			hts = miphalve(hts, w, h);
+			if (shd != NULL) shd = miphalve(shd, w, h);
+			w = w2;
+			h = h2;
+		}
+		pc->mipW = w;
+		pc->mipH = h;
+
+		if (l > 0 || type == heightfield) { /* colours */
+			pc->mipRGB = (unsigned char*)malloc((size_t)3 * w * h);
+			if (pc->mipRGB == 0) {
+				fprintf(stderr, "Memory allocation failed.");
+				exit(1);
+			}
+			for (i = 0; i < 3 * w * h; i++) {
+				double c = lin[i];
+				c = c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+				pc->mipRGB[i] = (unsigned char)(255.0 * c + 0.5);
+			}
+			mf = mipopen(filename, ext, l, type == heightfield ? ".bmp" : ext);
+			pc->file_type = type == heightfield ? bmp : type;
+			printmap(pc, mf);
+			pc->file_type = type;
+			free(pc->mipRGB);
+			pc->mipRGB = NULL;
+		}
+		if (l > 0 || type != heightfield) { /* heights */
+			pc->mipHeights = (int*)malloc((size_t)w * h * sizeof(int));
+			if (pc->mipHeights == 0) {
+				fprintf(stderr, "Memory allocation failed.");
+				exit(1);
+			}
+			for (i = 0; i < w * h; i++) pc->mipHeights[i] = (int)floor(hts[i] + 0.5);
+			mf = mipopen(filename, ext, l, type == heightfield ? ext : ".heightfield");
+			pc->file_type = heightfield;
+			printmap(pc, mf);
+			pc->file_type = type;
+			free(pc->mipHeights);
+			pc->mipHeights = NULL;
+		}
+		if (shd != NULL) { /* shades, as a PGM file */
+			mf = mipopen(filename, ext, l, "_shade.pgm");
+			fprintf(mf, "P5\n%d %d 255\n", w, h);
+			for (i = 0; i < w * h; i++) putc(min(255, (int)floor(shd[i] + 0.5)), mf);
+			fclose(mf);
 		}
 	}
+	pc->mipW = pc->mipH = 0;
+	free(lin);
+	free(hts);
+	free(shd);
+}
 
-	if (doshade > 0) smoothshades();
+void printmap(planetcontext *pc, FILE *outfile) { /* print window of map in chosen format */
+	void printppm(planetcontext *pc, FILE *outfile), printppmBW(planetcontext *pc, FILE *outfile),
+	     printbmp(planetcontext *pc, FILE *outfile), printbmpBW(planetcontext *pc, FILE *outfile),
+	     printxpm(planetcontext *pc, FILE *outfile), printxpmBW(planetcontext *pc, FILE *outfile),
+	     printheights(planetcontext *pc, FILE *outfile);
 
-	/* plot picture */
-	switch (file_type) {
+	switch (pc->file_type) {
 	case ppm:
-		if (do_bw) printppmBW(outfile);
-		else printppm(outfile);
+		if (pc->do_bw) printppmBW(pc, outfile);
+		else printppm(pc, outfile);
 		break;
 	case xpm:
-		if (do_bw) printxpmBW(outfile);
-		else printxpm(outfile);
+		if (pc->do_bw) printxpmBW(pc, outfile);
+		else printxpm(pc, outfile);
 		break;
 	case bmp:
-		if (do_bw) printbmpBW(outfile);
-		else printbmp(outfile);
+		if (pc->do_bw) printbmpBW(pc, outfile);
+		else printbmp(pc, outfile);
 		break;
 	case heightfield:
-		printheights(outfile);
+		printheights(pc, outfile);
+		break;
+	case hpx:
 		break;
 	}
-	/* print new line after making pictures */
-	fprintf(stderr, "\n");
-	return(0);
 }
 
-void readcolors(FILE *colfile, const char* colorsname, const char* biocolorsname) {
+void windowplane(planetcontext *pc) { /* part of map held in the arrays for the window */
+	int i;
+
+	/* the arrays hold the window plus a halo, so outlines, gridlines and */
+	/* smoothed shading inside the window are the same as for the whole map */
+	/* (and so is --lanczos, which reaches two pixels further) */
+	i = pc->superLanczos ? 2 * pc->superN : 1;
+	pc->planeX = max(0, pc->winX - i);
+	pc->planeY = max(0, pc->winY - i);
+	pc->planeW = min(pc->Width, pc->winX + pc->winW + i + 1) - pc->planeX;
+	pc->planeH = min(pc->Height, pc->winY + pc->winH + i + 1) - pc->planeY;
+}
+
+void allocplanes(planetcontext *pc) { /* allocate arrays for the plane */
+	int i, j;
+	unsigned short gridcell(double a, double grid, unsigned short nan);
+
+	if (pc->file_type == heightfield || pc->mipLevels > 0) {
+		pc->heights = (int**)calloc(pc->planeW, sizeof(int*));
+		if (pc->heights == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		for (i = 0; i < pc->planeW; i++) {
+			pc->heights[i] = (int*)calloc(pc->planeH, sizeof(int));
+			if (pc->heights[i] == 0) {
+				fprintf(stderr, "Memory allocation failed at %d out of %d heights\n", i + 1, pc->planeW);
+				exit(1);
+			}
+		}
+	}
+
+	pc->col = (unsigned short**)calloc(pc->planeW, sizeof(unsigned short*));
+	if (pc->col == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	/* the columns are kept in one block, so the plane can be run */
+	/* through as a whole */
+	pc->col[0] = (unsigned short*)calloc((size_t)pc->planeW * pc->planeH, sizeof(unsigned short));
+	if (pc->col[0] == 0) {
+		fprintf(stderr, "Memory allocation failed for %d x %d cols\n", pc->planeW, pc->planeH);
+		exit(1);
+	}
+	for (i = 1; i < pc->planeW; i++) pc->col[i] = pc->col[0] + (size_t)i * pc->planeH;
+
+	if (pc->superN > 1 && (pc->do_outline || pc->vgrid != 0.0 || pc->hgrid != 0.0)) {
+		pc->lineCols = (unsigned short*)calloc((size_t)pc->planeW * pc->planeH, sizeof(unsigned short));
+		if (pc->lineCols == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+	}
+
+	if (pc->erodeDrops > 0.0) { /* y = 2 marks points not on the globe */
+		pc->erodeAlt = (float*)calloc((size_t)pc->planeW * pc->planeH, sizeof(float));
+		pc->erodeShadow = (float*)calloc((size_t)pc->planeW * pc->planeH, sizeof(float));
+		pc->erodeY = (float*)malloc((size_t)pc->planeW * pc->planeH * sizeof(float));
+		if (pc->erodeAlt == 0 || pc->erodeShadow == 0 || pc->erodeY == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		for (i = 0; i < pc->planeW * pc->planeH; i++) pc->erodeY[i] = 2.0f;
+	}
+
+	if (pc->riverMin > 0 || pc->flowName[0] != '\0' || pc->normalsName[0] != '\0' || pc->nLights > 0 || pc->horizonDirs > 0 ||
+	    pc->keepAlt) {
+		pc->altPlane = (float*)calloc((size_t)pc->planeW * pc->planeH, sizeof(float));
+		if (pc->altPlane == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+	}
+
+	if (pc->coastKm > 0.0 || pc->componentsName[0] != '\0' || pc->normalsName[0] != '\0' || pc->nLights > 0 ||
+	    pc->horizonDirs > 0) {
+		/* points not on the globe stay (0,0,0) */
+		pc->globePos = (float*)calloc((size_t)3 * pc->planeW * pc->planeH, sizeof(float));
+		if (pc->globePos == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+	}
+
+	if (pc->doshade > 0) {
+		pc->shades = (unsigned short**)calloc(pc->planeW, sizeof(unsigned short*));
+		if (pc->shades == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		pc->shades[0] = (unsigned short*)calloc((size_t)pc->planeW * pc->planeH, sizeof(unsigned short));
+		if (pc->shades[0] == 0) {
+			fprintf(stderr, "Memory allocation failed for %d x %d shades\n", pc->planeW, pc->planeH);
+			exit(1);
+		}
+		for (i = 1; i < pc->planeW; i++) pc->shades[i] = pc->shades[0] + (size_t)i * pc->planeH;
+	}
+
+	/* points not on the globe count as (0,0,0) */
+	if (pc->vgrid != 0.0) {
+		pc->lonCells = (unsigned short**)calloc(pc->planeW, sizeof(unsigned short*));
+		if (pc->lonCells == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		for (i = 0; i < pc->planeW; i++) {
+			pc->lonCells[i] = (unsigned short*)malloc(pc->planeH * sizeof(unsigned short));
+			if (pc->lonCells[i] == 0) {
+				fprintf(stderr, "Memory allocation failed at %d out of %d lonCells\n", i + 1, pc->planeW);
+				exit(1);
+			}
+			for (j = 0; j < pc->planeH; j++) pc->lonCells[i][j] = gridcell(0.0, pc->vgrid, 0x7fff);
+		}
+	}
+
+	if (pc->hgrid != 0.0) {
+		pc->latCells = (unsigned short**)calloc(pc->planeW, sizeof(unsigned short*));
+		if (pc->latCells == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		for (i = 0; i < pc->planeW; i++) {
+			pc->latCells[i] = (unsigned short*)malloc(pc->planeH * sizeof(unsigned short));
+			if (pc->latCells[i] == 0) {
+				fprintf(stderr, "Memory allocation failed at %d out of %d latCells\n", i + 1, pc->planeW);
+				exit(1);
+			}
+			for (j = 0; j < pc->planeH; j++) pc->latCells[i][j] = gridcell(0.0, pc->hgrid, 0xffff);
+		}
+	}
+}
+
+void freeplanes(planetcontext *pc) { /* free what was made for the plane, so another */
+	int i;                 /* window can be made */
+
+	if (pc->heights != NULL) {
+		for (i = 0; i < pc->planeW; i++) free(pc->heights[i]);
+		free(pc->heights);
+	}
+	if (pc->lonCells != NULL) {
+		for (i = 0; i < pc->planeW; i++) free(pc->lonCells[i]);
+		free(pc->lonCells);
+	}
+	if (pc->latCells != NULL) {
+		for (i = 0; i < pc->planeW; i++) free(pc->latCells[i]);
+		free(pc->latCells);
+	}
+	if (pc->col != NULL) free(pc->col[0]);
+	if (pc->shades != NULL) free(pc->shades[0]);
+	free(pc->col);
+	free(pc->shades);
+	free(pc->lineCols);
+	free(pc->erodeAlt);
+	free(pc->erodeShadow);
+	free(pc->erodeY);
+	free(pc->altPlane);
+	free(pc->globePos);
+	free(pc->inkBits);
+	free(pc->coastDist);
+	free(pc->flowDir);
+	free(pc->horizonMap);
+	free(pc->hillNormals);
+	free(pc->reusedCols);
+	free(pc->reliefTop);
+	free(pc->reliefKids);
+	pc->heights = NULL;
+	pc->lonCells = pc->latCells = NULL;
+	pc->col = pc->shades = NULL;
+	pc->lineCols = NULL;
+	pc->erodeAlt = pc->erodeShadow = pc->erodeY = pc->altPlane = pc->globePos = pc->coastDist = pc->hillNormals = NULL;
+	pc->inkBits = NULL;
+	pc->flowDir = pc->horizonMap = NULL;
+	pc->reusedCols = NULL;
+	pc->reliefTop = NULL;
+	pc->reliefKids = NULL;
+	pc->reliefNodes = pc->reliefSize = 0;
+}
+
+unsigned short gridcell(double a, double grid, unsigned short nan) { /* grid cell of angle a */
+	double t;
+
+	/* cells are numbered modulo nan, which marks undefined angles; */
+	/* neighbouring pixels can only get the same number by accident */
+	/* for grids finer than 360/nan degrees */
+	t = floor((a * 180 / PI + 360) / grid);
+	if (t != t) return(nan);
+	return((unsigned short)fmod(t, (double)nan));
+}
+
+void readcolors(planetcontext *pc, FILE *colfile, const char* colorsname, const char* biocolorsname) {
 	int cNum = 0, oldcNum, i;
-	if (customColor == 1) {
+	if (pc->customColor == 1) {
 		if (NULL == (colfile = fopen(colorsname, "r"))) {
 			fprintf(stderr, "Cannot open %s\n", colorsname);
 			exit(1);
@@ -908,14 +1885,14 @@ void readcolors(FILE *colfile, const char* colorsname, const char* biocolorsname
 				}
 				if (cNum < oldcNum) cNum = oldcNum;
 				if (cNum > 65535) cNum = 65535;
-				rtable[cNum] = rValue;
-				gtable[cNum] = gValue;
-				btable[cNum] = bValue;
+				pc->rtable[cNum] = rValue;
+				pc->gtable[cNum] = gValue;
+				pc->btable[cNum] = bValue;
 				/* interpolate colours between oldcNum and cNum */
 				for (i = oldcNum + 1; i < cNum; i++) {
-					rtable[i] = (rtable[oldcNum] * (cNum - i) + rtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
-					gtable[i] = (gtable[oldcNum] * (cNum - i) + gtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
-					btable[i] = (btable[oldcNum] * (cNum - i) + btable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
+					pc->rtable[i] = (pc->rtable[oldcNum] * (cNum - i) + pc->rtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
+					pc->gtable[i] = (pc->gtable[oldcNum] * (cNum - i) + pc->gtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
+					pc->btable[i] = (pc->btable[oldcNum] * (cNum - i) + pc->btable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
 				}
 			} else {
 				fprintf(stderr, "Incorrect format in %s.\n", colorsname);
@@ -968,62 +1945,62 @@ void readcolors(FILE *colfile, const char* colorsname, const char* biocolorsname
 			if (result == 4) {
 				if (cNum < oldcNum) cNum = oldcNum;
 				if (cNum > 65535) cNum = 65535;
-				rtable[cNum] = rValue;
-				gtable[cNum] = gValue;
-				btable[cNum] = bValue;
+				pc->rtable[cNum] = rValue;
+				pc->gtable[cNum] = gValue;
+				pc->btable[cNum] = bValue;
 				/* interpolate colours between oldcNum and cNum */
 				for (i = oldcNum + 1; i < cNum; i++) {
-					rtable[i] = (rtable[oldcNum] * (cNum - i) + rtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
-					gtable[i] = (gtable[oldcNum] * (cNum - i) + gtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
-					btable[i] = (btable[oldcNum] * (cNum - i) + btable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
+					pc->rtable[i] = (pc->rtable[oldcNum] * (cNum - i) + pc->rtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
+					pc->gtable[i] = (pc->gtable[oldcNum] * (cNum - i) + pc->gtable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
+					pc->btable[i] = (pc->btable[oldcNum] * (cNum - i) + pc->btable[cNum] * (i - oldcNum)) / (cNum - oldcNum);
 				}
 			}
 		}
 	}
 
-	nocols = cNum + 1;
-	if (nocols < 10) nocols = 10;
+	pc->nocols = cNum + 1;
+	if (pc->nocols < 10) pc->nocols = 10;
 
-	HIGHEST = nocols - 1;
-	SEA = (HIGHEST + LOWEST) / 2;
-	LAND = SEA + 1;
+	pc->HIGHEST = pc->nocols - 1;
+	pc->SEA = (pc->HIGHEST + pc->LOWEST) / 2;
+	pc->LAND = pc->SEA + 1;
 
-	for (i = cNum + 1; i < nocols; i++) {
+	for (i = cNum + 1; i < pc->nocols; i++) {
 		/* fill up rest of colour table with last read colour */
-		rtable[i] = rtable[cNum];
-		gtable[i] = gtable[cNum];
-		btable[i] = btable[cNum];
+		pc->rtable[i] = pc->rtable[cNum];
+		pc->gtable[i] = pc->gtable[cNum];
+		pc->btable[i] = pc->btable[cNum];
 	}
 
-	switch (makeBiomes) {
+	switch (pc->makeBiomes) {
 	case 0: break;
 	case 1:
 		/* set default biome colours */
-		rtable['I' - 64 + LAND] = 255, gtable['I' - 64 + LAND] = 255, btable['I' - 64 + LAND] = 255;
-		rtable['T' - 64 + LAND] = 210, gtable['T' - 64 + LAND] = 210, btable['T' - 64 + LAND] = 210;
-		rtable['G' - 64 + LAND] = 250, gtable['G' - 64 + LAND] = 215, btable['G' - 64 + LAND] = 165;
-		rtable['B' - 64 + LAND] = 105, gtable['B' - 64 + LAND] = 155, btable['B' - 64 + LAND] = 120;
-		rtable['D' - 64 + LAND] = 220, gtable['D' - 64 + LAND] = 195, btable['D' - 64 + LAND] = 175;
-		rtable['S' - 64 + LAND] = 225, gtable['S' - 64 + LAND] = 155, btable['S' - 64 + LAND] = 100;
-		rtable['F' - 64 + LAND] = 155, gtable['F' - 64 + LAND] = 215, btable['F' - 64 + LAND] = 170;
-		rtable['R' - 64 + LAND] = 170, gtable['R' - 64 + LAND] = 195, btable['R' - 64 + LAND] = 200;
-		rtable['W' - 64 + LAND] = 185, gtable['W' - 64 + LAND] = 150, btable['W' - 64 + LAND] = 160;
-		rtable['E' - 64 + LAND] = 130, gtable['E' - 64 + LAND] = 190, btable['E' - 64 + LAND] =  25;
-		rtable['O' - 64 + LAND] = 110, gtable['O' - 64 + LAND] = 160, btable['O' - 64 + LAND] = 170;
+		pc->rtable['I' - 64 + pc->LAND] = 255, pc->gtable['I' - 64 + pc->LAND] = 255, pc->btable['I' - 64 + pc->LAND] = 255;
+		pc->rtable['T' - 64 + pc->LAND] = 210, pc->gtable['T' - 64 + pc->LAND] = 210, pc->btable['T' - 64 + pc->LAND] = 210;
+		pc->rtable['G' - 64 + pc->LAND] = 250, pc->gtable['G' - 64 + pc->LAND] = 215, pc->btable['G' - 64 + pc->LAND] = 165;
+		pc->rtable['B' - 64 + pc->LAND] = 105, pc->gtable['B' - 64 + pc->LAND] = 155, pc->btable['B' - 64 + pc->LAND] = 120;
+		pc->rtable['D' - 64 + pc->LAND] = 220, pc->gtable['D' - 64 + pc->LAND] = 195, pc->btable['D' - 64 + pc->LAND] = 175;
+		pc->rtable['S' - 64 + pc->LAND] = 225, pc->gtable['S' - 64 + pc->LAND] = 155, pc->btable['S' - 64 + pc->LAND] = 100;
+		pc->rtable['F' - 64 + pc->LAND] = 155, pc->gtable['F' - 64 + pc->LAND] = 215, pc->btable['F' - 64 + pc->LAND] = 170;
+		pc->rtable['R' - 64 + pc->LAND] = 170, pc->gtable['R' - 64 + pc->LAND] = 195, pc->btable['R' - 64 + pc->LAND] = 200;
+		pc->rtable['W' - 64 + pc->LAND] = 185, pc->gtable['W' - 64 + pc->LAND] = 150, pc->btable['W' - 64 + pc->LAND] = 160;
+		pc->rtable['E' - 64 + pc->LAND] = 130, pc->gtable['E' - 64 + pc->LAND] = 190, pc->btable['E' - 64 + pc->LAND] =  25;
+		pc->rtable['O' - 64 + pc->LAND] = 110, pc->gtable['O' - 64 + pc->LAND] = 160, pc->btable['O' - 64 + pc->LAND] = 170;
 		break;
 	case 2:
 		/* alternate biome colors from: https://space.geometrian.com/calcs/climate-sim.php) */
-		rtable['I' - 64 + LAND] = 255, gtable['I' - 64 + LAND] = 255, btable['I' - 64 + LAND] = 255;
-		rtable['T' - 64 + LAND] = 151, gtable['T' - 64 + LAND] = 169, btable['T' - 64 + LAND] = 173;
-		rtable['G' - 64 + LAND] = 144, gtable['G' - 64 + LAND] = 126, btable['G' - 64 + LAND] =  46;
-		rtable['B' - 64 + LAND] =  99, gtable['B' - 64 + LAND] = 143, btable['B' - 64 + LAND] =  82;
-		rtable['D' - 64 + LAND] = 193, gtable['D' - 64 + LAND] = 113, btable['D' - 64 + LAND] =  54;
-		rtable['S' - 64 + LAND] = 153, gtable['S' - 64 + LAND] = 165, btable['S' - 64 + LAND] =  38;
-		rtable['F' - 64 + LAND] =  64, gtable['F' - 64 + LAND] = 138, btable['F' - 64 + LAND] = 161;
-		rtable['R' - 64 + LAND] =  29, gtable['R' - 64 + LAND] =  84, btable['R' - 64 + LAND] = 109;
-		rtable['W' - 64 + LAND] = 185, gtable['W' - 64 + LAND] = 150, btable['W' - 64 + LAND] = 160;
-		rtable['E' - 64 + LAND] = 130, gtable['E' - 64 + LAND] = 190, btable['E' - 64 + LAND] =  25;
-		rtable['O' - 64 + LAND] =  26, gtable['O' - 64 + LAND] =  82, btable['O' - 64 + LAND] =  44;
+		pc->rtable['I' - 64 + pc->LAND] = 255, pc->gtable['I' - 64 + pc->LAND] = 255, pc->btable['I' - 64 + pc->LAND] = 255;
+		pc->rtable['T' - 64 + pc->LAND] = 151, pc->gtable['T' - 64 + pc->LAND] = 169, pc->btable['T' - 64 + pc->LAND] = 173;
+		pc->rtable['G' - 64 + pc->LAND] = 144, pc->gtable['G' - 64 + pc->LAND] = 126, pc->btable['G' - 64 + pc->LAND] =  46;
+		pc->rtable['B' - 64 + pc->LAND] =  99, pc->gtable['B' - 64 + pc->LAND] = 143, pc->btable['B' - 64 + pc->LAND] =  82;
+		pc->rtable['D' - 64 + pc->LAND] = 193, pc->gtable['D' - 64 + pc->LAND] = 113, pc->btable['D' - 64 + pc->LAND] =  54;
+		pc->rtable['S' - 64 + pc->LAND] = 153, pc->gtable['S' - 64 + pc->LAND] = 165, pc->btable['S' - 64 + pc->LAND] =  38;
+		pc->rtable['F' - 64 + pc->LAND] =  64, pc->gtable['F' - 64 + pc->LAND] = 138, pc->btable['F' - 64 + pc->LAND] = 161;
+		pc->rtable['R' - 64 + pc->LAND] =  29, pc->gtable['R' - 64 + pc->LAND] =  84, pc->btable['R' - 64 + pc->LAND] = 109;
+		pc->rtable['W' - 64 + pc->LAND] = 185, pc->gtable['W' - 64 + pc->LAND] = 150, pc->btable['W' - 64 + pc->LAND] = 160;
+		pc->rtable['E' - 64 + pc->LAND] = 130, pc->gtable['E' - 64 + pc->LAND] = 190, pc->btable['E' - 64 + pc->LAND] =  25;
+		pc->rtable['O' - 64 + pc->LAND] =  26, pc->gtable['O' - 64 + pc->LAND] =  82, pc->btable['O' - 64 + pc->LAND] =  44;
 		break;
 	case 3:
 		if (NULL == (colfile = fopen(biocolorsname, "r"))) {
@@ -1039,9 +2016,9 @@ void readcolors(FILE *colfile, const char* colorsname, const char* biocolorsname
 					fprintf(stderr, "Color values can only be in range 0 - 255, check %s.\n", biocolorsname);
 					exit(1);
 				}
-				rtable[letter-64+LAND] = rValue;
-				gtable[letter-64+LAND] = gValue;
-				btable[letter-64+LAND] = bValue;
+				pc->rtable[letter-64+pc->LAND] = rValue;
+				pc->gtable[letter-64+pc->LAND] = gValue;
+				pc->btable[letter-64+pc->LAND] = bValue;
 			} else {
 				fprintf(stderr, "Incorrect format in %s.\n", biocolorsname);
 				exit(1);
@@ -1051,988 +2028,3540 @@ void readcolors(FILE *colfile, const char* colorsname, const char* biocolorsname
 	}
 }
 
-void makeoutline(int do_bw) {
-	int i, j, k, t;
-	int contourstep = 0;
+void makeoutline(planetcontext *pc, int do_bw) {
+	int i, contourstep, coaststep;
+	unsigned int *land, *mask;
 
-	outx = (int*)calloc(Width * Height, sizeof(int));
-	outy = (int*)calloc(Width * Height, sizeof(int));
-	k = 0;
-	for (i = 1; i < Width - 1; i++) {
-		for (j = 1; j < Height - 1; j++) {
-			if ((col[i][j] >= LOWEST && col[i][j] <= SEA) &&
-			    (col[i - 1][j] >= LAND || col[i + 1][j] >= LAND ||
-			     col[i][j - 1] >= LAND || col[i][j + 1] >= LAND ||
-			     col[i - 1][j - 1] >= LAND || col[i - 1][j + 1] >= LAND ||
-			     col[i + 1][j - 1] >= LAND || col[i + 1][j + 1] >= LAND)) {
-				/* if point is sea and any neighbour is not, add to outline */
-				outx[k] = i;
-				outy[k++] = j;
-			}
+	/* bit planes packed 32 pixels to a word along the columns; */
+	/* bit j of a plane is set where pixel j of that column is marked */
+	pc->bitWords = (pc->planeH + 31) >> 5;
+	land = (unsigned int*)calloc(pc->planeW * pc->bitWords, sizeof(unsigned int));
+	mask = (unsigned int*)calloc(pc->planeW * pc->bitWords, sizeof(unsigned int));
+	if (land == 0 || mask == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	contourstep = (pc->HIGHEST - pc->LAND) / (pc->contourLines + 1);
+	coaststep = (pc->LAND - pc->LOWEST) / 20;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW; i++) {
+		int j;
+		for (j = 0; j < pc->planeH; j++) {
+			if (pc->col[i][j] >= pc->LAND) land[i * pc->bitWords + (j >> 5)] |= 1u << (j & 31);
 		}
 	}
 
-	if (contourLines > 0) {
-		contourstep = (HIGHEST - LAND) / (contourLines + 1);
-		for (i = 1; i < Width - 1; i++) {
-			for (j = 1; j < Height - 1; j++) {
-				t = (col[i][j] - LAND) / contourstep;
-				if (col[i][j] >= LAND &&
-				    ((col[i - 1][j] - LAND) / contourstep > t ||
-				     (col[i + 1][j] - LAND) / contourstep > t ||
-				     (col[i][j - 1] - LAND) / contourstep > t ||
-				     (col[i][j + 1] - LAND) / contourstep > t)) {
+	/* one pass marking sea next to land (in any of the 8 directions) */
+	/* a word at a time, then contour lines pixel by pixel if asked for */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 1; i < pc->planeW - 1; i++) {
+		int j, k, t;
+		unsigned int *l = land + i * pc->bitWords, *m = mask + i * pc->bitWords;
+		unsigned int near, sea, below = 0, above;
+
+		for (k = 0; k < pc->bitWords; k++) {
+			near = l[k - pc->bitWords] | l[k] | l[k + pc->bitWords];
+			above = k + 1 < pc->bitWords ?
+			        l[k + 1 - pc->bitWords] | l[k + 1] | l[k + 1 + pc->bitWords] : 0;
+			sea = 0;
+			for (j = k << 5; j < pc->planeH && j < (k + 1) << 5; j++) {
+				if (pc->col[i][j] >= pc->LOWEST && pc->col[i][j] <= pc->SEA) sea |= 1u << (j & 31);
+			}
+			m[k] = sea & (near | near << 1 | near >> 1 | below >> 31 | above << 31);
+			below = near;
+		}
+		/* the outermost pixels are never part of the outline */
+		m[0] &= ~1u;
+		m[(pc->planeH - 1) >> 5] &= ~(1u << ((pc->planeH - 1) & 31));
+
+		if (pc->contourLines > 0) {
+			for (j = 1; j < pc->planeH - 1; j++) {
+				t = (pc->col[i][j] - pc->LAND) / contourstep;
+				if (pc->col[i][j] >= pc->LAND &&
+				    ((pc->col[i - 1][j] - pc->LAND) / contourstep > t ||
+				     (pc->col[i + 1][j] - pc->LAND) / contourstep > t ||
+				     (pc->col[i][j - 1] - pc->LAND) / contourstep > t ||
+				     (pc->col[i][j + 1] - pc->LAND) / contourstep > t)) {
 					/* if point is at contour line and any neighbour is higher */
-					outx[k] = i;
-					outy[k++] = j;
+					m[j >> 5] |= 1u << (j & 31);
 				}
 			}
 		}
-	}
-	if (coastContourLines > 0) {
-		contourstep = (LAND - LOWEST) / 20;
-		for (i = 1; i < Width - 1; i++) {
-			for (j = 1; j < Height - 1; j++) {
-				t = (col[i][j] - LAND) / contourstep;
-				if (col[i][j] <= SEA && t >= -coastContourLines &&
-				    ((col[i - 1][j] - LAND) / contourstep > t ||
-				     (col[i + 1][j] - LAND) / contourstep > t ||
-				     (col[i][j - 1] - LAND) / contourstep > t ||
-				     (col[i][j + 1] - LAND) / contourstep > t)) {
+		if (pc->coastContourLines > 0) {
+			for (j = 1; j < pc->planeH - 1; j++) {
+				t = (pc->col[i][j] - pc->LAND) / coaststep;
+				if (pc->col[i][j] <= pc->SEA && t >= -pc->coastContourLines &&
+				    ((pc->col[i - 1][j] - pc->LAND) / coaststep > t ||
+				     (pc->col[i + 1][j] - pc->LAND) / coaststep > t ||
+				     (pc->col[i][j - 1] - pc->LAND) / coaststep > t ||
+				     (pc->col[i][j + 1] - pc->LAND) / coaststep > t)) {
 					/* if point is at contour line and any neighbour is higher */
-					outx[k] = i;
-					outy[k++] = j;
+					m[j >> 5] |= 1u << (j & 31);
 				}
 			}
 		}
 	}
-	if (do_bw) { /* if outline only, clear colours */
-		for (i = 0; i < Width; i++) {
-			for (j = 0; j < Height; j++) {
-				if (col[i][j] >= LOWEST) {
-					col[i][j] = WHITE;
-				} else {
-					col[i][j] = BLACK;
+	free(land);
+
+	if (pc->coastRings > 0) { /* rings at sea every coastRingStep from the coast */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (i = 1; i < pc->planeW - 1; i++) {
+			int j, k, t, n[4];
+			float *d = pc->coastDist + (size_t)i * pc->planeH;
+			for (j = 1; j < pc->planeH - 1; j++) {
+				if (pc->col[i][j] < pc->LOWEST || pc->col[i][j] > pc->SEA) continue;
+				t = (int)(-d[j] / pc->coastRingStep);
+				if (t >= pc->coastRings) continue;
+				n[0] = d[j - pc->planeH] < 0.0f ? (int)(-d[j - pc->planeH] / pc->coastRingStep) : -1;
+				n[1] = d[j + pc->planeH] < 0.0f ? (int)(-d[j + pc->planeH] / pc->coastRingStep) : -1;
+				n[2] = d[j - 1] < 0.0f ? (int)(-d[j - 1] / pc->coastRingStep) : -1;
+				n[3] = d[j + 1] < 0.0f ? (int)(-d[j + 1] / pc->coastRingStep) : -1;
+				for (k = 0; k < 4; k++) {
+					/* if point is at a ring and any neighbour is further out */
+					if (n[k] > t) mask[i * pc->bitWords + (j >> 5)] |= 1u << (j & 31);
 				}
 			}
 		}
+		free(pc->coastDist);
+		pc->coastDist = NULL;
 	}
-	/* draw outline (in black if outline only) */
-	contourstep = (HIGHEST - LAND) / (contourLines + 1);
-	for (j = 0; j < k; j++) {
-		if (do_bw) {
-			t = BLACK;
-		} else {
-			t = col[outx[j]][outy[j]];
-			if (t != OUTLINE1 && t != OUTLINE2) {
-				if (contourLines > 0 && t >= LAND) {
-					if (((t - LAND) / contourstep) % 2 == 1) {
-						t = OUTLINE1;
+
+	if (do_bw) { /* if outline only, the mask and the background are black */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (i = 0; i < pc->planeW; i++) {
+			int j;
+			for (j = 0; j < pc->planeH; j++) {
+				if (pc->col[i][j] < pc->LOWEST) mask[i * pc->bitWords + (j >> 5)] |= 1u << (j & 31);
+			}
+		}
+		pc->inkBits = mask;
+		return;
+	}
+
+	/* draw outline */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 1; i < pc->planeW - 1; i++) {
+		int j, t;
+		for (j = 1; j < pc->planeH - 1; j++) {
+			if (!((mask[i * pc->bitWords + (j >> 5)] >> (j & 31)) & 1)) continue;
+			t = pc->col[i][j];
+			if (t != pc->OUTLINE1 && t != pc->OUTLINE2) {
+				if (pc->contourLines > 0 && t >= pc->LAND) {
+					if (((t - pc->LAND) / contourstep) % 2 == 1) {
+						t = pc->OUTLINE1;
 					} else {
-						t = OUTLINE2;
+						t = pc->OUTLINE2;
 					}
-				} else if (t <= SEA) {
-					t = OUTLINE1;
+				} else if (t <= pc->SEA) {
+					t = pc->OUTLINE1;
 				}
 			}
+			if (pc->lineCols != NULL) {
+				if (t != pc->col[i][j]) pc->lineCols[(size_t)i * pc->planeH + j] = t + 1;
+			} else {
+				pc->col[i][j] = t;
+			}
 		}
-		col[outx[j]][outy[j]] = t;
 	}
+	free(mask);
 }
 
-void readmap(void) { /* reads in a map for matching */
-	int i, j = 0, step = 1;
-	char c, cs[1001];
-	int Width, Height = 0;
-
-	do {
-		scanf("%1000[^\n]\n", cs); /* read line */
-		/* fprintf(stderr,"%s\n",cs); */
+void edtcolumns(planetcontext *pc, int *g, int land) { /* distances along columns to land or sea */
+	int i, inf = pc->planeW + pc->planeH;
 
-		Width = strlen(cs);
-		if (Width < 48) {
-			MatchWidth = 2 * Width;
-			step = 2;
-		} else {
-			MatchWidth = Width;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW; i++) {
+		int j, f;
+		int *c = g + (size_t)i * pc->planeH;
+		for (j = 0; j < pc->planeH; j++) {
+			f = land ? pc->col[i][j] >= pc->LAND : pc->col[i][j] >= pc->LOWEST && pc->col[i][j] <= pc->SEA;
+			c[j] = f ? 0 : j > 0 && c[j - 1] < inf ? c[j - 1] + 1 : inf;
 		}
-
-		for (i = 0; i < MatchWidth ; i += step) {
-			c = cs[i / step];
-			switch (c) {
-				case '.':
-					cl0[i][j] = -8;
-					break;
-				case ',':
-					cl0[i][j] = -6;
-					break;
-				case ':':
-					cl0[i][j] = -4;
-					break;
-				case ';':
-					cl0[i][j] = -2;
-					break;
-				case '-':
-					cl0[i][j] = 0;
-					break;
-				case '*':
-					cl0[i][j] = 2;
-					break;
-				case 'o':
-					cl0[i][j] = 4;
-					break;
-				case 'O':
-					cl0[i][j] = 6;
-					break;
-				case '@':
-					cl0[i][j] = 8;
-					break;
-				default:
-					fprintf(stderr, "Wrong map symbol: %c\n", c);
-			}
+		for (j = pc->planeH - 2; j >= 0; j--) {
+			if (c[j + 1] < c[j]) c[j] = c[j + 1] + 1;
 		}
-		Height++;
-		j += step;
 	}
-	while (!feof(stdin));
+}
 
-	MatchHeight = step * Height;
-	/* fprintf(stderr,"%d %d\n",MatchWidth,MatchHeight); */
+void edtrows(planetcontext *pc, int *g, int land) { /* finish distances along rows */
+	int j;
 
-	if (step == 2) {
-		/* interpolate */
-		for (j = 1; j < MatchHeight; j += 2) {
-			for (i = 0; i < MatchWidth; i += 2) {
-				cl0[i][j] = (cl0[i][j - 1] + cl0[i][(j + 1)]) / 2;
-			}
+	/* for each point the nearest of the column distances of the row */
+	/* is found from the lower envelope of the parabolas through them */
+	/* (Meijster, Roerdink and Hesselink 2000), row by row in parallel */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (j = 0; j < pc->planeH; j++) {
+		int q, u, *s, *t;
+		double w, gu, gs;
+		s = (int*)malloc(2 * pc->planeW * sizeof(int));
+		if (s == 0) {
+			planetfail(pc);
+			continue;
 		}
-		for (j = 0; j < MatchHeight; j++) {
-			for (i = 1; i < MatchWidth; i += 2) {
-				cl0[i][j] = (cl0[i - 1][j] + cl0[(i + 1) % MatchWidth][j]) / 2;
+		t = s + pc->planeW;
+		q = 0;
+		s[0] = t[0] = 0;
+		for (u = 1; u < pc->planeW; u++) {
+			gu = g[(size_t)u * pc->planeH + j];
+			for (; q >= 0; q--) {
+				gs = g[(size_t)s[q] * pc->planeH + j];
+				if ((t[q] - s[q]) * (double)(t[q] - s[q]) + gs * gs <=
+				    (t[q] - u) * (double)(t[q] - u) + gu * gu) break;
 			}
-		}
+			if (q < 0) {
+				q = 0;
+				s[0] = u;
+			} else {
+				gs = g[(size_t)s[q] * pc->planeH + j];
+				w = 1 + floor(((double)u * u - (double)s[q] * s[q] + gu * gu - gs * gs) / (2.0 * (u - s[q])));
+				if (w < pc->planeW) {
+					q++;
+					s[q] = u;
+					t[q] = (int)w;
+				}
+			}
+		}
+		for (u = pc->planeW - 1; u >= 0; u--) {
+			int c = pc->col[u][j];
+			if (land ? c >= pc->LOWEST && c <= pc->SEA : c >= pc->LAND) {
+				gs = g[(size_t)s[q] * pc->planeH + j];
+				/* measured from the edge of the nearest pixel */
+				w = sqrt((u - s[q]) * (double)(u - s[q]) + gs * gs) - 0.5;
+				pc->coastDist[(size_t)u * pc->planeH + j] = land ? -w : w;
+			}
+			if (u == t[q]) q--;
+		}
+		free(s);
 	}
+	planetcheck(pc);
 }
 
-void smoothshades(void) {
+void writepfm(planetcontext *pc, const char *name, float *plane) {
+	/* window of plane as PFM, a grey map of little endian floats */
+	/* from the bottom up, NaN off the globe */
+	FILE *df;
 	int i, j;
-	for (i = 0; i < Width - 2; i++) {
-		for (j = 0; j < Height - 2; j++) {
-			shades[i][j] = (4 * shades[i][j] + 2 * shades[i][j + 1]
-			                + 2 * shades[i + 1][j] + shades[i + 1][j + 1] + 4) / 9;
+	float v;
+	unsigned int u; /* as many bits as a float */
+	void putint32(unsigned long v, FILE *outfile);
+
+	df = fopen(name, "wb");
+	if (df == NULL) {
+		fprintf(stderr, "Could not open file %s, error code = %d\n", name, errno);
+		exit(1);
+	}
+	fprintf(df, "Pf\n%d %d\n-1.0\n", pc->winW, pc->winH);
+	for (j = pc->winH - 1; j >= 0; j--) {
+		for (i = 0; i < pc->winW; i++) {
+			if (pc->col[i + pc->winX - pc->planeX][j + pc->winY - pc->planeY] < pc->LOWEST) {
+				u = 0x7fc00000U;
+			} else {
+				v = plane[(size_t)(i + pc->winX - pc->planeX) * pc->planeH + j + pc->winY - pc->planeY];
+				memcpy(&u, &v, sizeof(float));
+			}
+			putint32(u, df);
 		}
 	}
+	fclose(df);
 }
 
-void mercator(void) {
-	double y, scale1, cos2, theta1;
-	int i, j, k;
-	void planet0(double x, double y, double z, int i, int j);
-
-	y = sin(lat);
-	y = (1.0 + y) / (1.0 - y);
-	y = 0.5 * log(y);
-	k = (int)(0.5 * y * Width * scale / PI + 0.5);
-
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
+void coastdistance(planetcontext *pc) {
+	/* signed distance from each point of the plane to the coast, by an */
+	/* exact Euclidean distance transform of land and of sea; only the  */
+	/* coast inside the plane is seen */
+	int i, *g;
+	void edtcolumns(planetcontext *pc, int *g, int land),
+	     edtrows(planetcontext *pc, int *g, int land);
+	void writepfm(planetcontext *pc, const char *name, float *plane);
+
+	pc->coastDist = (float*)calloc((size_t)pc->planeW * pc->planeH, sizeof(float));
+	g = (int*)malloc((size_t)pc->planeW * pc->planeH * sizeof(int));
+	if (pc->coastDist == 0 || g == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	edtcolumns(pc, g, 1);
+	edtrows(pc, g, 1);
+	edtcolumns(pc, g, 0);
+	edtrows(pc, g, 0);
+	free(g);
+
+	if (pc->coastKm > 0.0) {
+		/* pixels to km by the scale of the projection at each point, */
+		/* the mean angle to the neighbours on the globe */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (i = 0; i < pc->planeW; i++) {
+			int j, k, n;
+			float *p, *q;
+			double a, dx, dy, dz;
+			for (j = 0; j < pc->planeH; j++) {
+				p = pc->globePos + 3 * ((size_t)i * pc->planeH + j);
+				if (p[0] == 0.0f && p[1] == 0.0f && p[2] == 0.0f) continue;
+				a = 0.0;
+				n = 0;
+				for (k = 0; k < 4; k++) {
+					if (k == 0 && i + 1 < pc->planeW) q = p + 3 * pc->planeH;
+					else if (k == 1 && i > 0) q = p - 3 * pc->planeH;
+					else if (k == 2 && j + 1 < pc->planeH) q = p + 3;
+					else if (k == 3 && j > 0) q = p - 3;
+					else continue;
+					if (q[0] == 0.0f && q[1] == 0.0f && q[2] == 0.0f) continue;
+					dx = p[0] - q[0];
+					dy = p[1] - q[1];
+					dz = p[2] - q[2];
+					a += 2.0 * asin(0.5 * sqrt(dx * dx + dy * dy + dz * dz));
+					n++;
+				}
+				if (n > 0) pc->coastDist[(size_t)i * pc->planeH + j] *= pc->coastKm * a / n;
 			}
 		}
-		y = PI * (2.0 * (j - k) - Height) / Width / scale;
-		y = exp(2. * y);
-		y = (y - 1.) / (y + 1.);
-		scale1 = scale * Width / Height / sqrt(1.0 - y * y) / PI;
-		cos2 = sqrt(1.0 - y * y);
-		Depth = 3 * ((int)(log_2(scale1 * Height))) + 3;
-		for (i = 0; i < Width ; i++) {
-			theta1 = longi - 0.5 * PI + PI * (2.0 * i - Width) / Width / scale;
-			planet0(cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
-		}
+	}
+
+	if (pc->coastDistName[0] != '\0') writepfm(pc, pc->coastDistName, pc->coastDist);
+	if (pc->coastRings == 0) {
+		free(pc->coastDist);
+		pc->coastDist = NULL;
 	}
 }
 
-void peter(void) {
-	double y, cos2, theta1, scale1;
-	int k, i, j, water, land;
-	void planet0(double x, double y, double z, int i, int j);
+int ufind(int *parent, int k) { /* root of k, halving the path */
+	while (parent[k] != k) k = parent[k] = parent[parent[k]];
+	return(k);
+}
 
-	y = 2.0 * sin(lat);
-	k = (int)(0.5 * y * Width * scale / PI + 0.5);
-	water = land = 0;
+void uunion(int *parent, int a, int b) { /* join sets, smallest index is root */
+	int ufind(int *parent, int k);
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
-			}
-		}
-		y = 0.5 * PI * (2.0 * (j - k) - Height) / Width / scale;
-		if (fabs(y) > 1.0) {
-			for (i = 0; i < Width ; i++) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
-			}
-		} else {
-			cos2 = sqrt(1.0 - y * y);
-			if (cos2 > 0.0) {
-				scale1 = scale * Width / Height / cos2 / PI;
-				Depth = 3 * ((int)(log_2(scale1 * Height))) + 3;
-				for (i = 0; i < Width ; i++) {
-					theta1 = longi - 0.5 * PI + PI * (2.0 * i - Width) / Width / scale;
-					planet0(cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
-					if (col[i][j] < LAND) {
-						water++;
-					} else {
-						land++;
-					}
-				}
-			}
-		}
+	a = ufind(parent, a);
+	b = ufind(parent, b);
+	if (a < b) parent[b] = a;
+	else parent[a] = b;
+}
+
+double pixelarea(planetcontext *pc, int i, int j) { /* area of pixel on unit sphere */
+	float *p, *a, *b;
+	double u[3], v[3], w[3];
+	int k;
+
+	p = pc->globePos + 3 * ((size_t)i * pc->planeH + j);
+	if (p[0] == 0.0f && p[1] == 0.0f && p[2] == 0.0f) return(0.0);
+	a = i + 1 < pc->planeW ? p + 3 * pc->planeH : p - 3 * pc->planeH;
+	b = j + 1 < pc->planeH ? p + 3 : p - 3;
+	if ((a[0] == 0.0f && a[1] == 0.0f && a[2] == 0.0f) ||
+	    (b[0] == 0.0f && b[1] == 0.0f && b[2] == 0.0f)) {
+		/* at the rim, use the neighbours on the other side */
+		a = i > 0 ? p - 3 * pc->planeH : p + 3 * pc->planeH;
+		b = j > 0 ? p - 3 : p + 3;
+		if ((a[0] == 0.0f && a[1] == 0.0f && a[2] == 0.0f) ||
+		    (b[0] == 0.0f && b[1] == 0.0f && b[2] == 0.0f)) return(0.0);
 	}
-	fprintf(stderr, "\n");
-	fprintf(stderr, "water percentage: %d%%", 100 * water / (water + land));
+	for (k = 0; k < 3; k++) {
+		u[k] = a[k] - p[k];
+		v[k] = b[k] - p[k];
+	}
+	w[0] = u[1] * v[2] - u[2] * v[1];
+	w[1] = u[2] * v[0] - u[0] * v[2];
+	w[2] = u[0] * v[1] - u[1] * v[0];
+	return(sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]));
 }
 
-void squarep(void) {
-	double y, scale1, theta1, cos2;
-	int k, i, j;
-	void planet0(double x, double y, double z, int i, int j);
+int comparecomponents(const void *a, const void *b) { /* largest first */
+	const component *p = (const component*)a, *q = (const component*)b;
 
-	k = (int)(0.5 * lat * Width * scale / PI + 0.5);
+	if (p->area != q->area) return(p->area > q->area ? -1 : 1);
+	if (p->pixels != q->pixels) return(p->pixels > q->pixels ? -1 : 1);
+	return(p->rank - q->rank);
+}
+
+void components(planetcontext *pc) {
+	/* Label connected land and sea areas (4-neighbours) with union-find:  */
+	/* blocks of columns are joined in parallel, then the blocks to each   */
+	/* other, and the first and last column if the map wraps around. As a */
+	/* root is always the smallest index of its set, one pass in index     */
+	/* order then numbers the sets and points every pixel at its number.  */
+	int *parent, i, j, k, n, b, blocks, wrap, land, total[2];
+	long pixels[2];
+	double area[2], a;
+	component *comp;
+	int ufind(int *parent, int k);
+	void uunion(int *parent, int a, int b);
+	double pixelarea(planetcontext *pc, int i, int j);
+	int comparecomponents(const void *a, const void *b);
+
+	parent = (int*)malloc((size_t)pc->planeW * pc->planeH * sizeof(int));
+	if (parent == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	/* land is 1, sea 0, and off the globe -1 */
+#define LANDSEA(c) ((c) >= pc->LAND ? 1 : (c) >= pc->LOWEST && (c) <= pc->SEA ? 0 : -1)
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
+	blocks = (pc->planeW + 63) / 64;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (b = 0; b < blocks; b++) {
+		int i, j, k, t;
+		for (i = 64 * b; i < min(64 * (b + 1), pc->planeW); i++) {
+			for (j = 0; j < pc->planeH; j++) {
+				k = i * pc->planeH + j;
+				t = LANDSEA(pc->col[i][j]);
+				parent[k] = t < 0 ? -1 : k;
+				if (t < 0) continue;
+				if (j > 0 && LANDSEA(pc->col[i][j - 1]) == t) uunion(parent, k - 1, k);
+				if (i > 64 * b && LANDSEA(pc->col[i - 1][j]) == t) uunion(parent, k - pc->planeH, k);
 			}
 		}
-		y = (2.0 * (j - k) - Height) / Width / scale * PI;
-		if (fabs(y + y) > PI) {
-			for (i = 0; i < Width ; i++) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
-			}
-		} else {
-			cos2 = cos(y);
-			if (cos2 > 0.0) {
-				scale1 = scale * Width / Height / cos2 / PI;
-				Depth = 3 * ((int)(log_2(scale1 * Height))) + 3;
-				for (i = 0; i < Width ; i++) {
-					theta1 = longi - 0.5 * PI + PI * (2.0 * i - Width) / Width / scale;
-					planet0(cos(theta1) * cos2, sin(y), -sin(theta1) * cos2, i, j);
-				}
+	}
+	/* the cylindrical projections wrap around if they show all longitudes */
+	/* (not zoomed in by -m) and the whole width is kept */
+	wrap = (pc->view == 'm' || pc->view == 'p' || pc->view == 'q') && pc->scale == 1.0 && pc->planeX == 0 && pc->planeW == pc->Width;
+	for (b = 1; b <= blocks; b++) {
+		i = b < blocks ? 64 * b : 0;
+		if (b == blocks && !wrap) break;
+		for (j = 0; j < pc->planeH; j++) {
+			k = (i > 0 ? i - 1 : pc->planeW - 1) * pc->planeH + j;
+			if (parent[k] >= 0 && LANDSEA(pc->col[i][j]) == LANDSEA(pc->col[k / pc->planeH][j])) {
+				uunion(parent, k, i * pc->planeH + j);
 			}
 		}
 	}
-}
-
-void mollweide(void) {
-	double y, y1, zz, scale1, cos2, theta1;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
-			}
-		}
-		y1 = 2 * (2.0 * j - Height) / Width / scale;
-		if (fabs(y1) >= 1.0) {
-			for (i = 0; i < Width ; i++) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
+	/* number the sets, n is the number of the next one found */
+	n = 0;
+	for (k = 0; k < pc->planeW * pc->planeH; k++) {
+		if (parent[k] == k) parent[k] = -2 - n++;
+		else if (parent[k] >= 0) parent[k] = parent[parent[k]];
+	}
+	comp = (component*)calloc(n + 1, sizeof(component));
+	if (comp == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	for (i = 0; i < pc->planeW; i++) {
+		for (j = 0; j < pc->planeH; j++) {
+			k = parent[i * pc->planeH + j];
+			if (k == -1) continue;
+			k = -2 - k;
+			comp[k].land = LANDSEA(pc->col[i][j]);
+			comp[k].rank = k;
+			comp[k].pixels++;
+			if ((!wrap && (i == 0 || i == pc->planeW - 1)) || j == 0 || j == pc->planeH - 1 ||
+			    (i > 0 && parent[(i - 1) * pc->planeH + j] == -1) ||
+			    (i < pc->planeW - 1 && parent[(i + 1) * pc->planeH + j] == -1) ||
+			    parent[i * pc->planeH + j - 1] == -1 || parent[i * pc->planeH + j + 1] == -1) {
+				comp[k].edge = 1; /* may go on beyond what is seen */
 			}
-		} else {
-			zz = sqrt(1.0 - y1 * y1);
-			y = 2.0 / PI * (y1 * zz + asin(y1));
-			cos2 = sqrt(1.0 - y * y);
-			if (cos2 > 0.0) {
-				scale1 = scale * Width / Height / cos2 / PI;
-				Depth = 3 * ((int)(log_2(scale1 * Height))) + 3;
-				for (i = 0; i < Width ; i++) {
-					theta1 = PI / zz * (2.0 * i - Width) / Width / scale;
-					if (fabs(theta1) > PI) {
-						col[i][j] = BACK;
-						if (doshade > 0) {shades[i][j] = 255;}
-					} else {
-						double x2, y2, z2, x3, y3, z3;
-						theta1 += -0.5 * PI;
-						x2 = cos(theta1) * cos2;
-						y2 = y;
-						z2 = -sin(theta1) * cos2;
-						x3 = clo * x2 + slo * sla * y2 + slo * cla * z2;
-						y3 = cla * y2 - sla * z2;
-						z3 = -slo * x2 + clo * sla * y2 + clo * cla * z2;
-						planet0(x3, y3, z3, i, j);
-					}
-				}
+			if (pc->globePos != NULL) {
+				float *p = pc->globePos + 3 * ((size_t)i * pc->planeH + j);
+				a = pixelarea(pc, i, j);
+				comp[k].area += a;
+				comp[k].x += a * p[0];
+				comp[k].y += a * p[1];
+				comp[k].z += a * p[2];
 			}
 		}
 	}
-}
-
-void sinusoid(void) {
-	double y, theta1, theta2, cos2, l1, i1, scale1;
-	int k, i, j, l;
-	void planet0(double x, double y, double z, int i, int j);
-
-	k = (int)(lat * Width * scale / PI + 0.5);
+#undef LANDSEA
+
+	/* number by size, largest first; parent[] keeps the old numbers */
+	qsort(comp, n, sizeof(component), comparecomponents);
+	total[0] = total[1] = 0;
+	pixels[0] = pixels[1] = 0;
+	area[0] = area[1] = 0.0;
+	for (k = 0; k < n; k++) {
+		total[comp[k].land]++;
+		pixels[comp[k].land] += comp[k].pixels;
+		area[comp[k].land] += comp[k].area;
+	}
+	{
+		int *order = (int*)malloc((n + 1) * sizeof(int));
+		if (order == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		for (k = 0; k < n; k++) order[comp[k].rank] = k + 1;
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
+		if (pc->componentsName[0] != '\0') {
+			FILE *cf = fopen(pc->componentsName, "w");
+			if (cf == NULL) {
+				fprintf(stderr, "Could not open file %s, error code = %d\n", pc->componentsName, errno);
+				exit(1);
+			}
+			fprintf(cf, "{\"command\": \"");
+			for (k = 0; pc->cmdLine[k] != '\0'; k++) {
+				if (pc->cmdLine[k] == '"' || pc->cmdLine[k] == '\\') putc('\\', cf);
+				putc(pc->cmdLine[k], cf);
+			}
+			fprintf(cf, "\",\n\"wrap\": %d,\n", wrap);
+			/* areas are fractions of the surface of the planet */
+			for (land = 1; land >= 0; land--) {
+				fprintf(cf, "\"%s\": {\"count\": %d, \"pixels\": %ld, \"area\": %.6g},\n",
+				        land ? "land" : "sea", total[land], pixels[land], area[land] / (4.0 * PI));
+			}
+			fprintf(cf, "\"components\": [\n");
+			for (k = 0; k < n; k++) {
+				a = sqrt(comp[k].x * comp[k].x + comp[k].y * comp[k].y + comp[k].z * comp[k].z);
+				fprintf(cf, "{\"id\": %d, \"land\": %d, \"edge\": %d, \"pixels\": %ld, \"area\": %.6g",
+				        k + 1, comp[k].land, comp[k].edge, comp[k].pixels, comp[k].area / (4.0 * PI));
+				if (a > 0.0) { /* centre of mass on the globe */
+					fprintf(cf, ", \"lon\": %.4f, \"lat\": %.4f",
+					        atan2(comp[k].x, comp[k].z) * 180.0 / PI, -asin(comp[k].y / a) * 180.0 / PI);
+				}
+				fprintf(cf, "}%s\n", k < n - 1 ? "," : "");
 			}
+			fprintf(cf, "]}\n");
+			fclose(cf);
 		}
-		y = (2.0 * (j - k) - Height) / Width / scale * PI;
-		if (fabs(y + y) > PI) {
-			for (i = 0; i < Width ; i++) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
+
+		if (pc->labelsName[0] != '\0') {
+			/* window as 16 bit PGM, 0 off the globe, numbers above */
+			/* 65535 are written as 65535 */
+			FILE *lf = fopen(pc->labelsName, "wb");
+			if (lf == NULL) {
+				fprintf(stderr, "Could not open file %s, error code = %d\n", pc->labelsName, errno);
+				exit(1);
 			}
-		} else {
-			cos2 = cos(y);
-			if (cos2 > 0.0) {
-				scale1 = scale * Width / Height / cos2 / PI;
-				Depth = 3 * ((int)(log_2(scale1 * Height))) + 3;
-				for (i = 0; i < Width; i++) {
-					l = i * 12 / Width / scale;
-					l1 = l * Width * scale / 12.0;
-					i1 = i - l1;
-					theta2 = longi - 0.5 * PI + PI * (2.0 * l1 - Width) / Width / scale;
-					theta1 = (PI * (2.0 * i1 - Width * scale / 12.0) / Width / scale) / cos2;
-					if (fabs(theta1) > PI / 12.0) {
-						col[i][j] = BACK;
-						if (doshade > 0) {shades[i][j] = 255;}
-					} else {
-						planet0(cos(theta1 + theta2) * cos2, sin(y), -sin(theta1 + theta2) * cos2, i, j);
-					}
+			fprintf(lf, "P5\n# Command line:\n# %s\n%d %d 65535\n", pc->cmdLine, pc->winW, pc->winH);
+			for (j = 0; j < pc->winH; j++) {
+				for (i = 0; i < pc->winW; i++) {
+					k = parent[(i + pc->winX - pc->planeX) * pc->planeH + j + pc->winY - pc->planeY];
+					k = k == -1 ? 0 : min(order[-2 - k], 65535);
+					putc(k >> 8, lf);
+					putc(k & 255, lf);
 				}
 			}
+			fclose(lf);
 		}
+		free(order);
 	}
+	fprintf(stderr, "\n%d land and %d sea areas", total[1], total[0]);
+	free(comp);
+	free(parent);
 }
 
-void stereo(void) {
-	double x, y, z, zz, x1, y1, z1;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
+int flowmove(planetcontext *pc, int i, int j, int d, int wrap) { /* neighbour of (i,j) in direction d */
+	static const int di[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+	static const int dj[8] = {0, 1, 1, 1, 0, -1, -1, -1};
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
-			}
-		}
-		for (i = 0; i < Width ; i++) {
-			x = (2.0 * i - Width) / Height / scale;
-			y = (2.0 * j - Height) / Height / scale;
-			z = x * x + y * y;
-			zz = 0.25 * (4.0 + z);
-			x = x / zz;
-			y = y / zz;
-			z = (1.0 - 0.25 * z) / zz;
-			x1 = clo * x + slo * sla * y + slo * cla * z;
-			y1 = cla * y - sla * z;
-			z1 = -slo * x + clo * sla * y + clo * cla * z;
-			if (scale < 1.0) {Depth = 3 * ((int)(log_2(scale * Height))) + 6 + 1.5 / scale;}
-			planet0(x1, y1, z1, i, j);
-		}
+	i += di[d];
+	j += dj[d];
+	if (j < 0 || j >= pc->planeH) return(-1);
+	if (i < 0 || i >= pc->planeW) {
+		if (!wrap) return(-1);
+		i = (i + pc->planeW) % pc->planeW;
 	}
+	return(i * pc->planeH + j);
 }
 
-void orthographic(void) {
-	double x, y, z, x1, y1, z1;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
+void flowpush(flowentry *heap, int *n, flowentry e) { /* add to heap */
+	int c, p;
+
+	for (c = (*n)++; c > 0; c = p) {
+		p = (c - 1) / 2;
+		if (e.alt >= heap[p].alt) break;
+		heap[c] = heap[p];
+	}
+	heap[c] = e;
+}
+
+flowentry flowpop(flowentry *heap, int *n) { /* remove first from heap */
+	flowentry top = heap[0], e = heap[--*n];
+	int c, p;
+
+	for (p = 0; (c = 2 * p + 1) < *n; p = c) {
+		if (c + 1 < *n && heap[c + 1].alt < heap[c].alt) c++;
+		if (heap[c].alt >= e.alt) break;
+		heap[p] = heap[c];
+	}
+	heap[p] = e;
+	return(top);
+}
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
+void rivers(planetcontext *pc) {
+	/* Rivers follow the order in which land is flooded from the sea     */
+	/* (priority-flood, Barnes et al. 2014): each pixel drains to the    */
+	/* pixel it was reached from, and pits are filled to the level they  */
+	/* spill at, making lakes. The pixels draining through each pixel    */
+	/* are then counted in parallel, walking down from the pixels        */
+	/* nothing drains into, where the last of the pixels draining into a */
+	/* pixel carries on below it. Only the plane is seen, so with       */
+	/* --window the rivers are those of the window, not a crop of the   */
+	/* rivers of the whole map.                                         */
+	flowentry *heap, e, f;
+	unsigned int *acc;
+	unsigned char *ins;
+	int *parent, i, j, k, m, n, nheap, head, tail, d, wrap, lakes = 0;
+	int flowmove(planetcontext *pc, int i, int j, int d, int wrap);
+	void flowpush(flowentry *heap, int *n, flowentry e);
+	flowentry flowpop(flowentry *heap, int *n);
+	void writepfm(planetcontext *pc, const char *name, float *plane);
+	int ufind(int *parent, int k);
+	void uunion(int *parent, int a, int b);
+
+	n = pc->planeW * pc->planeH;
+	/* bits 0-3 of flowDir are the direction, 8 if off the map, */
+	/* 16 marks pixels reached, 32 lakes, 64 pixels of water and */
+	/* 128 pixels nothing drains into */
+	pc->flowDir = (unsigned char*)calloc(n, 1);
+	acc = (unsigned int*)calloc(n, sizeof(unsigned int));
+	ins = (unsigned char*)calloc(n, 1);
+	heap = (flowentry*)malloc(n * sizeof(flowentry));
+	if (pc->flowDir == 0 || acc == 0 || ins == 0 || heap == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	/* as in components() */
+	wrap = (pc->view == 'm' || pc->view == 'p' || pc->view == 'q') && pc->scale == 1.0 && pc->planeX == 0 && pc->planeW == pc->Width;
+#define FLOWLAND(k) (pc->col[0][k] >= pc->LAND)
+
+	/* start from land next to sea or the edge of the map */
+	nheap = 0;
+	for (i = 0; i < pc->planeW; i++) {
+		for (j = 0; j < pc->planeH; j++) {
+			k = i * pc->planeH + j;
+			if (!FLOWLAND(k)) continue;
+			for (d = 0; d < 8; d++) {
+				m = flowmove(pc, i, j, d, wrap);
+				if (m < 0 || !FLOWLAND(m)) break;
 			}
+			if (d == 8) continue;
+			pc->flowDir[k] = 16 | (m < 0 ? 8 : d);
+			e.alt = pc->altPlane[k];
+			e.k = k;
+			flowpush(heap, &nheap, e);
 		}
-		for (i = 0; i < Width ; i++) {
-			x = (2.0 * i - Width) / Height / scale;
-			y = (2.0 * j - Height) / Height / scale;
-			if (x * x + y * y > 1.0) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
+	}
+	/* pixels in pits are at the level being flooded, so they are */
+	/* kept in a queue (in acc, not used yet) instead of the heap, */
+	/* which also floods the flat lakes evenly from where they spill */
+	head = tail = 0;
+	while (nheap > 0 || head < tail) {
+		if (head < tail) {
+			e.k = acc[head++];
+			e.alt = pc->altPlane[e.k];
+		} else {
+			e = flowpop(heap, &nheap);
+			head = tail = 0;
+		}
+		i = e.k / pc->planeH;
+		j = e.k % pc->planeH;
+		for (d = 0; d < 8; d++) {
+			m = flowmove(pc, i, j, d, wrap);
+			if (m < 0 || !FLOWLAND(m) || pc->flowDir[m] & 16) continue;
+			pc->flowDir[m] = 16 | ((d + 4) & 7);
+			if (pc->altPlane[m] <= e.alt) {
+				pc->altPlane[m] = e.alt; /* filled */
+				pc->flowDir[m] |= 32;
+				acc[tail++] = m;
 			} else {
-				z = sqrt(1.0 - x * x - y * y);
-				x1 = clo * x + slo * sla * y + slo * cla * z;
-				y1 = cla * y - sla * z;
-				z1 = -slo * x + clo * sla * y + clo * cla * z;
-				planet0(x1, y1, z1, i, j);
+				f.alt = pc->altPlane[m];
+				f.k = m;
+				flowpush(heap, &nheap, f);
 			}
 		}
 	}
-}
-
-void orthographic2(void) {
-	double x, y, z, x1, y1, z1, ymin, ymax;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
-	double lat1, longi1;
-
-	ymin = 2.0;
-	ymax = -2.0;
+	free(heap);
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
+	/* count the pixels draining into each pixel */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW; i++) {
+		int j, k, d, m;
+		for (j = 0; j < pc->planeH; j++) {
+			k = i * pc->planeH + j;
+			acc[k] = FLOWLAND(k);
+			if (!acc[k]) continue;
+			for (d = 0; d < 8; d++) {
+				m = flowmove(pc, i, j, d, wrap);
+				if (m >= 0 && FLOWLAND(m) && (pc->flowDir[m] & 15) == ((d + 4) & 7)) ins[k]++;
 			}
+			if (ins[k] == 0) pc->flowDir[k] |= 128;
 		}
-		for (i = 0; i < Width / 2 ; i++) {
-			x = (2.0 * i - Width / 2) / Height / scale;
-			y = (2.0 * j - Height) / Height / scale;
-			if (x * x + y * y > 1.0) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
-			} else {
-				z = sqrt(1.0 - x * x - y * y);
-				x1 = clo * x + slo * sla * y + slo * cla * z;
-				y1 = cla * y - sla * z;
-				z1 = -slo * x + clo * sla * y + clo * cla * z;
-				if (y1 < ymin) ymin = y1;
-				if (y1 > ymax) ymax = y1;
-				planet0(x1, y1, z1, i, j);
+	}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 4096)
+#endif
+	for (k = 0; k < n; k++) {
+		int c, r, left;
+		if (!(pc->flowDir[k] & 128)) continue;
+		for (c = k; (pc->flowDir[c] & 15) != 8; c = r) {
+			r = flowmove(pc, c / pc->planeH, c % pc->planeH, pc->flowDir[c] & 15, wrap);
+			if (!FLOWLAND(r)) break;
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+			acc[r] += acc[c];
+#ifdef _OPENMP
+#pragma omp flush
+#pragma omp atomic capture
+#endif
+			left = --ins[r];
+			if (left > 0) break;
+#ifdef _OPENMP
+#pragma omp flush
+#endif
+		}
+	}
+	free(ins);
+
+	if (pc->riverMin > 0) {
+		/* a lake, a flat of filled pixels, is water if a river goes */
+		/* through it; the pixels of a flat are joined with union-find */
+		parent = (int*)malloc(n * sizeof(int));
+		if (parent == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		/* (all set first: across the seam of a wrapped map the */
+		/* neighbour in the last column comes after the pixel) */
+		for (k = 0; k < n; k++) parent[k] = k;
+		for (i = 0; i < pc->planeW; i++) {
+			for (j = 0; j < pc->planeH; j++) {
+				k = i * pc->planeH + j;
+				if (!(pc->flowDir[k] & 32)) continue;
+				for (d = 4; d < 8; d++) { /* the others join from their side */
+					m = flowmove(pc, i, j, d, wrap);
+					if (m >= 0 && pc->flowDir[m] & 32 && pc->altPlane[m] == pc->altPlane[k]) uunion(parent, m, k);
+				}
 			}
 		}
-		longi1 = longi + PI;
-		lat1 = -lat;
-		for (i = Width / 2; i < Width ; i++) {
-			x = (2.0 * i - 3 * Width / 2) / Height / scale;
-			y = (2.0 * j - Height) / Height / scale;
-			if (x * x + y * y > 1.0) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
-			} else {
-				z = sqrt(1.0 - x * x - y * y);
-				x1 = cos(longi1) * x + sin(longi1) * sin(lat1) * y + sin(longi1) * cos(lat1) * z;
-				y1 = cos(lat1) * y - sin(lat1) * z;
-				z1 = -sin(longi1) * x + cos(longi1) * sin(lat1) * y + cos(longi1) * cos(lat1) * z;
-				if (y1 < ymin) ymin = y1;
-				if (y1 > ymax) ymax = y1;
-				planet0(x1, y1, z1, i, j);
+		for (k = 0; k < n; k++) {
+			if (pc->flowDir[k] & 32 && acc[k] >= (unsigned int)pc->riverMin) {
+				m = ufind(parent, k);
+				if (!(pc->flowDir[m] & 64)) lakes++;
+				pc->flowDir[m] |= 64;
 			}
 		}
+		for (k = 0; k < n; k++) {
+			if (pc->flowDir[k] & 32 && pc->flowDir[ufind(parent, k)] & 64) pc->flowDir[k] |= 64;
+			else if (acc[k] >= (unsigned int)pc->riverMin) pc->flowDir[k] |= 64;
+		}
+		free(parent);
+		if (!pc->library) fprintf(stderr, "\n%d lakes on rivers", lakes);
 	}
-}
+#undef FLOWLAND
 
-void icosahedral(void) { /* modified version of gnomonic */
-	double x, y, z, x1, y1, z1, zz;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
-	double lat1, longi1, x0, y0, sq3;
-	double L1, L2, S;
+	if (pc->flowName[0] != '\0') { /* accumulation as PFM, reusing altPlane */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (k = 0; k < n; k++) pc->altPlane[k] = (float)acc[k];
+		writepfm(pc, pc->flowName, pc->altPlane);
+	}
+	free(acc);
+	if (!pc->keepAlt) {
+		free(pc->altPlane);
+		pc->altPlane = NULL;
+	}
+}
 
-	sq3 = sqrt(3.0);
-	L1 =  10.812317;/* theoretically 10.9715145571469; */
-	L2 = -52.622632; /* theoretically -48.3100310579607; */
-	S = 55.6; /* found by experimentation */
+void drawrivers(planetcontext *pc) { /* water found by rivers() in the shallow sea colour */
+	int i;
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
-			}
-		}
-		for (i = 0; i < Width ; i++) {
-			x0 = 198.0 * (2.0 * i - Width) / Width / scale - 36;
-			y0 = 198.0 * (2.0 * j - Height) / Width / scale - lat / DEG2RAD;
-			longi1 = 0.0;
-			lat1 = 500.0;
-			if (y0 / sq3 <= 18.0 && y0 / sq3 >= -18.0) { /* middle row of triangles */
-				/* upward triangles */
-				if (x0 - y0 / sq3 < 144.0 && x0 + y0 / sq3 >= 108.0) {
-					lat1 = -L1;
-					longi1 = 126.0;
-				} else if (x0 - y0 / sq3 < 72.0 && x0 + y0 / sq3 >= 36.0) {
-					lat1 = -L1;
-					longi1 = 54.0;
-				} else if (x0 - y0 / sq3 < 0.0 && x0 + y0 / sq3 >= -36.0) {
-					lat1 = -L1;
-					longi1 = -18.0;
-				} else if (x0 - y0 / sq3 < -72.0 && x0 + y0 / sq3 >= -108.0) {
-					lat1 = -L1;
-					longi1 = -90.0;
-				} else if (x0 - y0 / sq3 < -144.0 && x0 + y0 / sq3 >= -180.0) {
-					lat1 = -L1;
-					longi1 = -162.0;
-				}
-				/* downward triangles */
-				else if (x0 + y0 / sq3 < 108.0 && x0 - y0 / sq3 >= 72.0) {
-					lat1 = L1;
-					longi1 = 90.0;
-				} else if (x0 + y0 / sq3 < 36.0 && x0 - y0 / sq3 >= 0.0) {
-					lat1 = L1;
-					longi1 = 18.0;
-				} else if (x0 + y0 / sq3 < -36.0 && x0 - y0 / sq3 >= -72.0) {
-					lat1 = L1;
-					longi1 = -54.0;
-				} else if (x0 + y0 / sq3 < -108.0 && x0 - y0 / sq3 >= -144.0) {
-					lat1 = L1;
-					longi1 = -126.0;
-				} else if (x0 + y0 / sq3 < -180.0 && x0 - y0 / sq3 >= -216.0) {
-					lat1 = L1;
-					longi1 = -198.0;
-				}
-			}
-			if (y0 / sq3 > 18.0) { /* bottom row of triangles */
-				if (x0 + y0 / sq3 < 180.0 && x0 - y0 / sq3 >= 72.0) {
-					lat1 = L2;
-					longi1 = 126.0;
-				} else if (x0 + y0 / sq3 < 108.0 && x0 - y0 / sq3 >= 0.0) {
-					lat1 = L2;
-					longi1 = 54.0;
-				} else if (x0 + y0 / sq3 < 36.0 && x0 - y0 / sq3 >= -72.0) {
-					lat1 = L2;
-					longi1 = -18.0;
-				} else if (x0 + y0 / sq3 < -36.0 && x0 - y0 / sq3 >= -144.0) {
-					lat1 = L2;
-					longi1 = -90.0;
-				} else if (x0 + y0 / sq3 < -108.0 && x0 - y0 / sq3 >= -216.0) {
-					lat1 = L2;
-					longi1 = -162.0;
-				}
-			}
-			if (y0 / sq3 < -18.0) { /* top row of triangles */
-				if (x0 - y0 / sq3 < 144.0 && x0 + y0 / sq3 >= 36.0) {
-					lat1 = -L2;
-					longi1 = 90.0;
-				} else if (x0 - y0 / sq3 < 72.0 && x0 + y0 / sq3 >= -36.0) {
-					lat1 = -L2;
-					longi1 = 18.0;
-				} else if (x0 - y0 / sq3 < 0.0 && x0 + y0 / sq3 >= -108.0) {
-					lat1 = -L2;
-					longi1 = -54.0;
-				} else if (x0 - y0 / sq3 < -72.0 && x0 + y0 / sq3 >= -180.0) {
-					lat1 = -L2;
-					longi1 = -126.0;
-				} else if (x0 - y0 / sq3 < -144.0 && x0 + y0 / sq3 >= -252.0) {
-					lat1 = -L2;
-					longi1 = -198.0;
-				}
-			}
-			if (lat1 > 400.0) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
-			} else {
-				x = (x0 - longi1) / S;
-				y = (y0 + lat1) / S;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW; i++) {
+		int j;
+		for (j = 0; j < pc->planeH; j++) {
+			if (!(pc->flowDir[(size_t)i * pc->planeH + j] & 64)) continue;
+			if (pc->do_bw) pc->inkBits[i * pc->bitWords + (j >> 5)] |= 1u << (j & 31);
+			else pc->col[i][j] = pc->SEA;
+			if (pc->lineCols != NULL) pc->lineCols[(size_t)i * pc->planeH + j] = 0;
+		}
+	}
+	free(pc->flowDir);
+	pc->flowDir = NULL;
+}
 
-				longi1 = longi1 * DEG2RAD - longi;
-				lat1 = lat1 * DEG2RAD;
+unsigned long eroderandom(unsigned long *r) { /* 32 bit xorshift */
+	*r ^= (*r << 13) & 0xffffffffUL;
+	*r ^= *r >> 17;
+	*r ^= (*r << 5) & 0xffffffffUL;
+	return(*r);
+}
 
-				sla = sin(lat1);
-				cla = cos(lat1);
-				slo = sin(longi1);
-				clo = cos(longi1);
+double erodeheight(planetcontext *pc, double x, double y, double *gx, double *gy) {
+	/* bilinear height at (x,y) of erodeAlt, and its gradient */
+	int i = (int)x, j = (int)y;
+	float *h = pc->erodeAlt + (size_t)i * pc->planeH + j;
+	double u = x - i, v = y - j;
 
-				zz = sqrt(1.0 / (1.0 + x * x + y * y));
-				x = x * zz;
-				y = y * zz;
-				z = sqrt(1.0 - x * x - y * y);
-				x1 = clo * x + slo * sla * y + slo * cla * z;
-				y1 = cla * y - sla * z;
-				z1 = -slo * x + clo * sla * y + clo * cla * z;
+	*gx = (h[pc->planeH] - h[0]) * (1 - v) + (h[pc->planeH + 1] - h[1]) * v;
+	*gy = (h[1] - h[0]) * (1 - u) + (h[pc->planeH + 1] - h[pc->planeH]) * u;
+	return(h[0] * (1 - u) * (1 - v) + h[pc->planeH] * u * (1 - v) + h[1] * (1 - u) * v + h[pc->planeH + 1] * u * v);
+}
 
-				planet0(x1, y1, z1, i, j);
+long erodetile(planetcontext *pc, int ti, int tj, int n, unsigned long r, long *drops) {
+	/* n droplets starting in tile (ti,tj), which may not go further */
+	/* than 31 pixels out of it; returns the number of steps taken   */
+	/* and adds the droplets that started on land to drops           */
+	int d, t, i, j, i0, j0, i1, j1;
+	double x, y, dx, dy, gx, gy, h, h1, dh, u, v, c, a, speed, water, sediment;
+	long steps = 0;
+	unsigned long eroderandom(unsigned long *r);
+	double erodeheight(planetcontext *pc, double x, double y, double *gx, double *gy);
+	/* droplet parameters as in Beyer (2015) */
+	const double inertia = 0.05, capacity = 4.0, minSlope = 0.01, erosion = 0.3,
+	             deposition = 0.3, evaporation = 0.01, gravity = 4.0;
+
+	i0 = max(0, 64 * ti - 31);
+	j0 = max(0, 64 * tj - 31);
+	i1 = min(pc->planeW - 2, 64 * ti + 64 + 31);
+	j1 = min(pc->planeH - 2, 64 * tj + 64 + 31);
+	for (d = 0; d < n; d++) {
+		x = 64 * ti + (eroderandom(&r) & 0xffff) / 1024.0;
+		y = 64 * tj + (eroderandom(&r) & 0xffff) / 1024.0;
+		if (x >= i1 || y >= j1) continue;
+		i = (int)x;
+		j = (int)y;
+		if (pc->erodeY[(size_t)i * pc->planeH + j] > 1.0f || pc->erodeAlt[(size_t)i * pc->planeH + j] <= 0.0f) continue;
+		++*drops;
+		dx = dy = sediment = 0.0;
+		speed = water = 1.0;
+		for (t = 0; t < 30; t++) {
+			i = (int)x;
+			j = (int)y;
+			u = x - i;
+			v = y - j;
+			h = erodeheight(pc, x, y, &gx, &gy);
+			dx = dx * inertia - gx * (1 - inertia);
+			dy = dy * inertia - gy * (1 - inertia);
+			a = sqrt(dx * dx + dy * dy);
+			if (a == 0.0) break;
+			x += dx / a;
+			y += dy / a;
+			if (x < i0 || x >= i1 || y < j0 || y >= j1) break;
+			if (pc->erodeY[(size_t)(int)x * pc->planeH + (int)y] > 1.0f) break;
+			steps++;
+			h1 = erodeheight(pc, x, y, &gx, &gy);
+			dh = h1 - h;
+			c = (-dh > minSlope ? -dh : minSlope) * speed * water * capacity;
+			if (h1 < 0.0) c = 0.0; /* drops its load in the sea */
+			if (sediment > c || dh > 0.0) {
+				a = dh > 0.0 ? (dh < sediment ? dh : sediment) : (sediment - c) * deposition;
+				sediment -= a;
+			} else {
+				a = (c - sediment) * erosion;
+				if (a > -dh) a = -dh;
+				a = -a;
+				sediment -= a;
+			}
+			/* add (or take) a spread over the corners of the old cell */
+			{
+				float *p = pc->erodeAlt + (size_t)i * pc->planeH + j;
+				p[0] += a * (1 - u) * (1 - v);
+				p[pc->planeH] += a * u * (1 - v);
+				p[1] += a * (1 - u) * v;
+				p[pc->planeH + 1] += a * u * v;
 			}
+			if (h1 < 0.0) break;
+			speed = speed * speed - dh * gravity;
+			speed = speed > 0.0 ? sqrt(speed) : 0.0;
+			water *= 1 - evaporation;
 		}
 	}
+	return(steps);
 }
 
-void gnomonic(void) {
-	double x, y, z, x1, y1, z1, zz;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
-
-	if (scale < 1.0) {
-		Depth = 3 * ((int)(log_2(scale * Height))) + 6 + 1.5 / scale;
-	}
+void erode(planetcontext *pc) {
+	/* Hydraulic erosion by droplets running down the altitude plane,  */
+	/* picking up and dropping sediment (Beyer 2015). Droplets start in */
+	/* tiles of 64 x 64 pixels and die 31 pixels out of them, so tiles  */
+	/* two apart in both directions are done in parallel, in four       */
+	/* phases of rounds of droplets. Each tile and round has its own    */
+	/* random numbers, so the result is the same for any threads. The  */
+	/* tiles start at the corner of the plane and droplets stop at its  */
+	/* edges, so a --window is not a crop of the whole map eroded.      */
+	int tilesW, tilesH, rounds, round, phase, i;
+	long steps = 0, drops, landDrops = 0;
+	double hs, t0;
+	int altcolour(planetcontext *pc, double y, double alt, double shadow, double *altp);
+	long erodetile(planetcontext *pc, int ti, int tj, int n, unsigned long r, long *drops);
+	unsigned long eroderandom(unsigned long *r);
+	void progresstick(planetcontext *pc, int total);
+#ifdef _OPENMP
+	double omp_get_wtime(void);
+	t0 = omp_get_wtime();
+#else
+	t0 = (double)clock() / CLOCKS_PER_SEC;
+#endif
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
+	/* heights in pixels, with mountains (altitude 0.1) Height / 100 high */
+	hs = pc->Height / 10.0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW * pc->planeH; i++) pc->erodeAlt[i] *= hs;
+
+	tilesW = (pc->planeW + 63) / 64;
+	tilesH = (pc->planeH + 63) / 64;
+	progresstick(pc, 0);
+	drops = (long)(pc->erodeDrops * 64 * 64);
+	rounds = drops >= 16 * 64 ? 16 : drops >= 64 ? (int)(drops / 64) : 1;
+	for (round = 0; round < rounds; round++) {
+		for (phase = 0; phase < 4; phase++) {
+			int tile;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:steps, landDrops)
+#endif
+			for (tile = 0; tile < tilesW * tilesH; tile++) {
+				int ti = tile % tilesW, tj = tile / tilesW, k;
+				unsigned long r;
+				if ((ti & 1) + 2 * (tj & 1) != phase) continue;
+				r = ((unsigned long)(fabs(pc->rseed) * 1000003.0) ^ (unsigned long)tile * 2654435761UL ^
+				     (unsigned long)round * 40503UL) & 0xffffffffUL;
+				if (r == 0) r = 1;
+				for (k = 0; k < 4; k++) eroderandom(&r);
+				steps += erodetile(pc, ti, tj, (int)(drops * (round + 1) / rounds - drops * round / rounds), r, &landDrops);
+				progresstick(pc, rounds * tilesW * tilesH);
 			}
 		}
-		for (i = 0; i < Width ; i++) {
-			x = (2.0 * i - Width) / Height / scale;
-			y = (2.0 * j - Height) / Height / scale;
-			zz = sqrt(1.0 / (1.0 + x * x + y * y));
-			x = x * zz;
-			y = y * zz;
-			z = sqrt(1.0 - x * x - y * y);
-			x1 = clo * x + slo * sla * y + slo * cla * z;
-			y1 = cla * y - sla * z;
-			z1 = -slo * x + clo * sla * y + clo * cla * z;
-			planet0(x1, y1, z1, i, j);
+	}
+
+	/* colour the eroded points */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW; i++) {
+		int j;
+		size_t k;
+		double alt;
+		for (j = 0; j < pc->planeH; j++) {
+			k = (size_t)i * pc->planeH + j;
+			if (pc->erodeY[k] > 1.0f) continue;
+			pc->col[i][j] = altcolour(pc, pc->erodeY[k], pc->erodeAlt[k] / hs, pc->erodeShadow[k], &alt);
+			if (pc->heights != NULL) {pc->heights[i][j] = 10000000 * alt;}
+			if (pc->altPlane != NULL) {pc->altPlane[k] = alt;}
 		}
 	}
+#ifdef _OPENMP
+	t0 = omp_get_wtime() - t0;
+#else
+	t0 = (double)clock() / CLOCKS_PER_SEC - t0;
+#endif
+	if (!pc->library) fprintf(stderr, "\nEroded by %ld droplets in %ld steps, %.0f steps/s",
+	                          landDrops, steps, steps / (t0 > 0.001 ? t0 : 0.001));
+	free(pc->erodeAlt);
+	free(pc->erodeShadow);
+	free(pc->erodeY);
+	pc->erodeAlt = pc->erodeShadow = pc->erodeY = NULL;
 }
 
-void azimuth(void) {
-	double x, y, z, x1, y1, z1, zz;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
+void hillshade(planetcontext *pc) {
+	/* Normals from the altitudes of the plane, by Sobel filters scaled */
+	/* by the distance on the globe between pixels, so any projection   */
+	/* can be used. Altitudes above sea level are raised ten times more */
+	/* than in -pP (relief), as they would look flat from above. Each   */
+	/* light is at an azimuth (clockwise from north) and elevation      */
+	/* above the local horizon, and the shades from all of them are     */
+	/* summed in one pass, flat ground getting the neutral shade 150.   */
+	/* For --horizons the normals are kept for sunshade().              */
+	int i;
+	double flat = 0.0, ca[16], sa[16], ce[16], se[16];
+	unsigned char *normals = NULL;
+
+	for (i = 0; i < pc->nLights; i++) {
+		ca[i] = cos(pc->lightAz[i] * PI / 180.0);
+		sa[i] = sin(pc->lightAz[i] * PI / 180.0);
+		ce[i] = cos(pc->lightEl[i] * PI / 180.0);
+		se[i] = sin(pc->lightEl[i] * PI / 180.0);
+		flat += se[i];
+	}
+	if (pc->normalsName[0] != '\0') {
+		normals = (unsigned char*)calloc((size_t)3 * pc->planeW * pc->planeH, 1);
+		if (normals == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+	}
+	if (pc->horizonDirs > 0) {
+		pc->hillNormals = (float*)calloc((size_t)3 * pc->planeW * pc->planeH, sizeof(float));
+		if (pc->hillNormals == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+	}
 
-	for (j = 0; j < Height; j++) {
-		if (Height >= 25) { /* check line 743 for reasons */
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW; i++) {
+		int j, k, l, im, ip, jm, jp, c[9];
+		float *p, *q, *r;
+		double a[9], gi, gj, ti[3], tj[3], n[3], e[3], no[3], d, si, sj, light, s;
+		for (j = 0; j < pc->planeH; j++) {
+			p = pc->globePos + 3 * ((size_t)i * pc->planeH + j);
+			if (p[0] == 0.0f && p[1] == 0.0f && p[2] == 0.0f) continue;
+#define ONGLOBE(i, j) (pc->globePos[3 * ((size_t)(i) * pc->planeH + (j))] != 0.0f || \
+                       pc->globePos[3 * ((size_t)(i) * pc->planeH + (j)) + 1] != 0.0f || \
+                       pc->globePos[3 * ((size_t)(i) * pc->planeH + (j)) + 2] != 0.0f)
+			/* neighbours on the globe, or the point itself */
+			im = i > 0 && ONGLOBE(i - 1, j) ? i - 1 : i;
+			ip = i < pc->planeW - 1 && ONGLOBE(i + 1, j) ? i + 1 : i;
+			jm = j > 0 && ONGLOBE(i, j - 1) ? j - 1 : j;
+			jp = j < pc->planeH - 1 && ONGLOBE(i, j + 1) ? j + 1 : j;
+			c[0] = im; c[1] = i; c[2] = ip;
+			c[3] = jm; c[4] = j; c[5] = jp;
+			for (k = 0; k < 9; k++) {
+				int ci = c[k % 3], cj = c[3 + k / 3];
+				if (!ONGLOBE(ci, cj)) ci = i, cj = j;
+				a[k] = pc->altPlane[(size_t)ci * pc->planeH + cj];
+				if (a[k] < 0.0) a[k] = 0.0; /* sea is flat */
 			}
-		}
-		for (i = 0; i < Width ; i++) {
-			x = (2.0 * i - Width) / Height / scale;
-			y = (2.0 * j - Height) / Height / scale;
-			zz = x * x + y * y;
-			z = 1.0 - 0.5 * zz;
-			if (z < -1.0) {
-				col[i][j] = BACK;
-				if (doshade > 0) {shades[i][j] = 255;}
-			} else {
-				zz = sqrt(1.0 - 0.25 * zz);
-				x = x * zz;
-				y = y * zz;
-				x1 = clo * x + slo * sla * y + slo * cla * z;
-				y1 = cla * y - sla * z;
-				z1 = -slo * x + clo * sla * y + clo * cla * z;
-				planet0(x1, y1, z1, i, j);
+#undef ONGLOBE
+			/* Sobel, in altitude per pixel */
+			gi = ip == im ? 0.0 :
+			     (a[2] + 2 * a[5] + a[8] - a[0] - 2 * a[3] - a[6]) / (4.0 * (ip - im));
+			gj = jp == jm ? 0.0 :
+			     (a[6] + 2 * a[7] + a[8] - a[0] - 2 * a[1] - a[2]) / (4.0 * (jp - jm));
+
+			/* directions of i and j on the globe, and pixel sizes */
+			q = pc->globePos + 3 * ((size_t)ip * pc->planeH + j);
+			r = pc->globePos + 3 * ((size_t)im * pc->planeH + j);
+			for (k = 0; k < 3; k++) ti[k] = q[k] - r[k];
+			q = pc->globePos + 3 * ((size_t)i * pc->planeH + jp);
+			r = pc->globePos + 3 * ((size_t)i * pc->planeH + jm);
+			for (k = 0; k < 3; k++) tj[k] = q[k] - r[k];
+			si = sqrt(ti[0] * ti[0] + ti[1] * ti[1] + ti[2] * ti[2]);
+			sj = sqrt(tj[0] * tj[0] + tj[1] * tj[1] + tj[2] * tj[2]);
+			for (k = 0; k < 3; k++) {
+				ti[k] = si > 0.0 ? ti[k] / si : 0.0;
+				tj[k] = sj > 0.0 ? tj[k] / sj : 0.0;
+			}
+			si = si > 0.0 ? 10.0 * pc->relief * gi * (ip - im) / si : 0.0;
+			sj = sj > 0.0 ? 10.0 * pc->relief * gj * (jp - jm) / sj : 0.0;
+			for (k = 0; k < 3; k++) n[k] = p[k] - si * ti[k] - sj * tj[k];
+			d = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			for (k = 0; k < 3; k++) n[k] /= d;
+			if (pc->hillNormals != NULL) {
+				for (k = 0; k < 3; k++) pc->hillNormals[3 * ((size_t)i * pc->planeH + j) + k] = n[k];
+			}
+
+			if (normals != NULL) { /* x right, y up and z out of the image */
+				unsigned char *o = normals + 3 * ((size_t)i * pc->planeH + j);
+				s = n[0] * ti[0] + n[1] * ti[1] + n[2] * ti[2];
+				o[0] = (unsigned char)(127.5 * (s + 1.0));
+				s = -(n[0] * tj[0] + n[1] * tj[1] + n[2] * tj[2]);
+				o[1] = (unsigned char)(127.5 * (s + 1.0));
+				s = n[0] * p[0] + n[1] * p[1] + n[2] * p[2];
+				o[2] = (unsigned char)(127.5 * (s + 1.0));
+			}
+
+			if (pc->nLights > 0) {
+				/* east and north at the point (north is y = -1) */
+				d = sqrt(p[0] * p[0] + p[2] * p[2]);
+				if (d < 1e-6) { /* at a pole, any direction will do */
+					e[0] = ti[0]; e[1] = ti[1]; e[2] = ti[2];
+				} else {
+					e[0] = p[2] / d; e[1] = 0.0; e[2] = -p[0] / d;
+				}
+				no[0] = e[1] * p[2] - e[2] * p[1];
+				no[1] = e[2] * p[0] - e[0] * p[2];
+				no[2] = e[0] * p[1] - e[1] * p[0];
+				light = 0.0;
+				for (l = 0; l < pc->nLights; l++) {
+					s = 0.0;
+					for (k = 0; k < 3; k++) {
+						s += n[k] * (ce[l] * (sa[l] * e[k] + ca[l] * no[k]) + se[l] * p[k]);
+					}
+					if (s > 0.0) light += s;
+				}
+				k = (int)(150.0 * light / flat + 0.5);
+				pc->shades[i][j] = k < 10 ? 10 : k > 255 ? 255 : k;
 			}
 		}
 	}
-}
 
-void conical(void) {
-	double k1, c, y2, x, y, zz, theta1, theta2, cos2;
-	int i, j;
-	void planet0(double x, double y, double z, int i, int j);
+	if (normals != NULL) { /* window as PPM */
+		FILE *nf;
+		int j;
 
-	if (scale < 1.0) {
-		Depth = 3 * ((int)(log_2(scale * Height))) + 6 + 1.5 / scale;
+		nf = fopen(pc->normalsName, "wb");
+		if (nf == NULL) {
+			fprintf(stderr, "Could not open file %s, error code = %d\n", pc->normalsName, errno);
+			exit(1);
+		}
+		fprintf(nf, "P6\n# normal map\n# Command line:\n# %s\n%d %d 255\n", pc->cmdLine, pc->winW, pc->winH);
+		for (j = 0; j < pc->winH; j++) {
+			for (i = 0; i < pc->winW; i++) {
+				fwrite(normals + 3 * ((size_t)(i + pc->winX - pc->planeX) * pc->planeH + j + pc->winY - pc->planeY), 1, 3, nf);
+			}
+		}
+		fclose(nf);
+		free(normals);
 	}
-	if (lat > 0) {
-		k1 = 1.0 / sin(lat);
-		c = k1 * k1;
-		y2 = sqrt(c * (1.0 - sin(lat / k1)) / (1.0 + sin(lat / k1)));
-		for (j = 0; j < Height; j++) {
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
-			}
-			for (i = 0; i < Width ; i++) {
-				x = (2.0 * i - Width) / Height / scale;
-				y = (2.0 * j - Height) / Height / scale + y2;
-				zz = x * x + y * y;
-				if (zz == 0.0) {
-					theta1 = 0.0;
-				} else {
-					theta1 = k1 * atan2(x, y);
-				}
-				if (theta1 < -PI || theta1 > PI) {
-					col[i][j] = BACK;
-					if (doshade > 0) {shades[i][j] = 255;}
-				} else {
-					theta1 += longi - 0.5 * PI; /* theta1 is longitude */
-					theta2 = k1 * asin((zz - c) / (zz + c)); /* theta2 is latitude */
-					if (theta2 > 0.5 * PI || theta2 < -0.5 * PI) {
-						col[i][j] = BACK;
-						if (doshade > 0) {shades[i][j] = 255;}
-					} else {
-						cos2 = cos(theta2);
-						y = sin(theta2);
-						planet0(cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
-					}
-				}
+}
+
+void horizons(planetcontext *pc) {
+	/* Angle of the horizon of each pixel in horizonDirs directions of  */
+	/* the image, from 0 to 90 degrees in 255 steps. Each direction is  */
+	/* swept by parallel lines going through every pixel once, done     */
+	/* from their far end back while keeping the upper convex hull of   */
+	/* the points passed, so the horizon is at the first point of the   */
+	/* hull that is not below the line to the next one and each point   */
+	/* is pushed and popped once. Heights are those of hillshade(),     */
+	/* less s^2/2 at distance s along the line for the curvature of the */
+	/* globe; as the hull of (s, height - s^2/2) has the same points    */
+	/* seen from anywhere on the line, only the slopes need correcting. */
+	/* A line is cut where it leaves the globe.                         */
+	int d, b;
+	void progresstick(planetcontext *pc, int total);
+
+	pc->horizonMap = (unsigned char*)malloc((size_t)pc->horizonDirs * pc->planeW * pc->planeH);
+	if (pc->horizonMap == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	progresstick(pc, 0);
+	for (d = 0; d < pc->horizonDirs; d++) {
+		double dx = cos(2.0 * PI * d / pc->horizonDirs), dy = sin(2.0 * PI * d / pc->horizonDirs), m;
+		int alongI = fabs(dx) >= fabs(dy), back, len, across, lo, hi, lines;
+
+		/* pixel t of line c is at t along the longer axis of the direction */
+		/* and c - hi + floor(t * m + 0.5) across it, so the lines do not   */
+		/* overlap; back if the far end is at t = len - 1                   */
+		len = alongI ? pc->planeW : pc->planeH;
+		across = alongI ? pc->planeH : pc->planeW;
+		m = alongI ? dy / dx : dx / dy;
+		back = (alongI ? dx : dy) > 0.0;
+		lo = (int)floor((len - 1) * m + 0.5);
+		hi = lo > 0 ? lo : 0;
+		lo = lo < 0 ? lo : 0;
+		lines = across + hi - lo;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (b = 0; b < 32; b++) {
+			int c, t, u, v, top;
+			size_t k;
+			float *p, *r;
+			double *x, *g, xq, gq, hq, e, a, a1;
+
+			x = (double*)malloc(2 * (size_t)len * sizeof(double));
+			if (x == 0) {
+				planetfail(pc);
+				continue;
 			}
-		}
-	} else {
-		k1 = 1.0 / sin(lat);
-		c = k1 * k1;
-		y2 = sqrt(c * (1.0 - sin(lat / k1)) / (1.0 + sin(lat / k1)));
-		for (j = 0; j < Height; j++) {
-			if ((j % (Height / 25)) == 0) {
-				fprintf(stderr, ">");
-				fflush(stderr);
-			}
-			for (i = 0; i < Width ; i++) {
-				x = (2.0 * i - Width) / Height / scale;
-				y = (2.0 * j - Height) / Height / scale - y2;
-				zz = x * x + y * y;
-				if (zz == 0.0) {
-					theta1 = 0.0;
-				} else {
-					theta1 = -k1*atan2(x, -y);
-				}
-				if (theta1 < -PI || theta1 > PI) {
-					col[i][j] = BACK;
-					if (doshade > 0) {shades[i][j] = 255;}
-				} else {
-					theta1 += longi - 0.5 * PI; /* theta1 is longitude */
-					theta2 = k1 * asin((zz - c) / (zz + c)); /* theta2 is latitude */
-					if (theta2 > 0.5 * PI || theta2 < -0.5 * PI) {
-						col[i][j] = BACK;
-						if (doshade > 0) {shades[i][j] = 255;}
-					} else {
-						cos2 = cos(theta2);
-						y = sin(theta2);
-						planet0(cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
+			g = x + len;
+			for (c = (int)((long)lines * b / 32); c < (int)((long)lines * (b + 1) / 32); c++) {
+				top = 0;
+				xq = 0.0;
+				r = NULL;
+				for (t = 0; t < len; t++) {
+					u = back ? len - 1 - t : t;
+					v = c - hi + (int)floor(u * m + 0.5);
+					if (v < 0 || v >= across) continue;
+					k = alongI ? (size_t)u * pc->planeH + v : (size_t)v * pc->planeH + u;
+					p = pc->globePos + 3 * k;
+					if (p[0] == 0.0f && p[1] == 0.0f && p[2] == 0.0f) {
+						top = 0;
+						r = NULL;
+						continue;
 					}
+					if (r != NULL) {
+						e = sqrt((p[0] - r[0]) * (p[0] - r[0]) + (p[1] - r[1]) * (p[1] - r[1]) +
+						         (p[2] - r[2]) * (p[2] - r[2]));
+						xq -= e > 1e-9 ? e : 1e-9;
+					}
+					r = p;
+					hq = pc->altPlane[k] > 0.0f ? 10.0 * pc->relief * pc->altPlane[k] : 0.0;
+					gq = hq - 0.5 * xq * xq;
+					while (top >= 2 && (g[top - 1] - gq) / (x[top - 1] - xq) <=
+					                   (g[top - 2] - gq) / (x[top - 2] - xq)) top--;
+					a = top > 0 ? atan((g[top - 1] - gq) / (x[top - 1] - xq) + xq) : 0.0;
+					a1 = a > 0.0 ? 255.0 * a / (0.5 * PI) + 0.5 : 0.0;
+					pc->horizonMap[(size_t)pc->horizonDirs * k + d] = (unsigned char)a1;
+					x[top] = xq;
+					g[top++] = gq;
 				}
 			}
+			free(x);
+			progresstick(pc, 32 * pc->horizonDirs);
 		}
+		planetcheck(pc);
 	}
 }
 
-double rand2(double p, double q) {
-	/* random number generator taking two seeds */
-	/* rand2(p,q) = rand2(q,p) is important     */
-	double r;
-	r = (p + 3.14159265) * (q + 3.14159265);
-	return(2. * (r - (int)r) - 1.);
-}
-
-void planet0(double x, double y, double z, int i, int j) {
-	double alt, y2, sun, temp, rain;
-	double planet1(double x, double y, double z);
-	int colour;
+void sunshade(planetcontext *pc, double lon) {
+	/* Daylight shading as in -d from the normals of hillshade(), with  */
+	/* the sun at longitude lon and latitude shade_angle2. Points where */
+	/* the sun is below the horizon get a quarter of the light, as from */
+	/* the sky; the horizon towards the sun is found from the direction */
+	/* of the sun in the image, by expressing it in the steps to the    */
+	/* next pixels, between the two nearest directions of the map.     */
+	/* Points of the grid keep their shade.                             */
+	int i;
+	double s[3];
 
-	alt = planet1(x, y, z);
+	s[0] = cos(PI * lon / 180.0 - 0.5 * PI) * cos(PI * pc->shade_angle2 / 180.0);
+	s[1] = -sin(PI * pc->shade_angle2 / 180.0);
+	s[2] = -sin(PI * lon / 180.0 - 0.5 * PI) * cos(PI * pc->shade_angle2 / 180.0);
 
-	/* calculate temperature based on altitude and latitude */
-	/* scale: -0.1 to 0.1 corresponds to -30 to +30 degrees Celsius */
-	sun = sqrt(1.0 - y * y); /* approximate amount of sunlight at latitude ranged from 0.1 to 1.1 */
-	if (alt < 0) {
-		temp = sun / 8.0 + alt * 0.3; /* deep water colder */
-	} else {
-		temp = sun / 8.0 - alt * 1.2; /* high altitudes colder */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (i = 0; i < pc->planeW; i++) {
+		int j, k, h0, h1, im, ip, jm, jp;
+		float *p, *n, *q, *r;
+		unsigned char *h;
+		double light, el, ti[3], tj[3], aa, ab, bb, sa, sb, f, hz;
+		for (j = 0; j < pc->planeH; j++) {
+			p = pc->globePos + 3 * ((size_t)i * pc->planeH + j);
+			if (p[0] == 0.0f && p[1] == 0.0f && p[2] == 0.0f) continue;
+			if (pc->col[i][j] == pc->GRID) continue;
+			n = pc->hillNormals + 3 * ((size_t)i * pc->planeH + j);
+			light = n[0] * s[0] + n[1] * s[1] + n[2] * s[2];
+			if (light > 0.0) {
+#define ONGLOBE(i, j) (pc->globePos[3 * ((size_t)(i) * pc->planeH + (j))] != 0.0f || \
+                       pc->globePos[3 * ((size_t)(i) * pc->planeH + (j)) + 1] != 0.0f || \
+                       pc->globePos[3 * ((size_t)(i) * pc->planeH + (j)) + 2] != 0.0f)
+				im = i > 0 && ONGLOBE(i - 1, j) ? i - 1 : i;
+				ip = i < pc->planeW - 1 && ONGLOBE(i + 1, j) ? i + 1 : i;
+				jm = j > 0 && ONGLOBE(i, j - 1) ? j - 1 : j;
+				jp = j < pc->planeH - 1 && ONGLOBE(i, j + 1) ? j + 1 : j;
+#undef ONGLOBE
+				q = pc->globePos + 3 * ((size_t)ip * pc->planeH + j);
+				r = pc->globePos + 3 * ((size_t)im * pc->planeH + j);
+				for (k = 0; k < 3; k++) ti[k] = q[k] - r[k];
+				q = pc->globePos + 3 * ((size_t)i * pc->planeH + jp);
+				r = pc->globePos + 3 * ((size_t)i * pc->planeH + jm);
+				for (k = 0; k < 3; k++) tj[k] = q[k] - r[k];
+				/* s = a ti + b tj + c p by least squares, as ti and tj */
+				/* need not be at right angles; a and b scaled by det  */
+				aa = ti[0] * ti[0] + ti[1] * ti[1] + ti[2] * ti[2];
+				ab = ti[0] * tj[0] + ti[1] * tj[1] + ti[2] * tj[2];
+				bb = tj[0] * tj[0] + tj[1] * tj[1] + tj[2] * tj[2];
+				sa = s[0] * ti[0] + s[1] * ti[1] + s[2] * ti[2];
+				sb = s[0] * tj[0] + s[1] * tj[1] + s[2] * tj[2];
+				f = atan2(aa * sb - ab * sa, bb * sa - ab * sb) / (2.0 * PI) * pc->horizonDirs;
+				if (f < 0.0) f += pc->horizonDirs;
+				h0 = (int)f;
+				f -= h0;
+				h0 %= pc->horizonDirs;
+				h1 = (h0 + 1) % pc->horizonDirs;
+				h = pc->horizonMap + (size_t)pc->horizonDirs * ((size_t)i * pc->planeH + j);
+				hz = ((1.0 - f) * h[h0] + f * h[h1]) * 0.5 * PI / 255.0;
+				el = p[0] * s[0] + p[1] * s[1] + p[2] * s[2];
+				if (el < sin(hz)) light *= 0.25;
+			}
+			k = (int)(light * 170.0 + 10);
+			pc->shades[i][j] = k < 10 ? 10 : k > 255 ? 255 : k;
+		}
 	}
-	if (temp < tempMin && alt > 0) {tempMin = temp;}
-	if (temp > tempMax && alt > 0) {tempMax = temp;}
-	if (temperature) {alt = temp - 0.05;}
+}
 
-	/* calculate rainfall based on temperature and latitude */
-	/* rainfall approximately proportional to temperature but reduced near
-	   horse latitudes (+/- 30 degrees, y=0.5) and reduced for rain shadow */
-	y2 = fabs(y) - 0.5;
-	rain = temp * 0.65 + 0.1 - 0.011 / (y2 * y2 + 0.1);
-	rain += 0.03 * rainShadow;
-	if (rain < 0.0) {rain = 0.0;}
-	if (rain < rainMin && alt > 0) {rainMin = rain;}
-	if (rain > rainMax && alt > 0) {rainMax = rain;}
-	if (rainfall) {alt = rain - 0.02;}
-	/* non-linear scaling to make flatter near sea level */
-	if (nonLinear) {alt = alt * alt * alt * 300;}
+void readmap(planetcontext *pc) { /* reads in a map for matching */
+	int i, j = 0, step = 1;
+	char c, cs[1001];
+	int Width, Height = 0;
 
-	/* store height for heightfield */
-	if (file_type == heightfield) {heights[i][j] = 10000000 * alt;}
+	pc->cl0 = (int(*)[1000])calloc(1000, sizeof(*pc->cl0));
+	if (pc->cl0 == NULL) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	do {
+		scanf("%1000[^\n]\n", cs); /* read line */
+		/* fprintf(stderr,"%s\n",cs); */
 
-	y2 = y * y;
-	y2 = y2 * y2;
-	y2 = y2 * y2;
+		Width = strlen(cs);
+		if (Width < 48) {
+			pc->MatchWidth = 2 * Width;
+			step = 2;
+		} else {
+			pc->MatchWidth = Width;
+		}
 
-	/* calculate colour */
+		for (i = 0; i < pc->MatchWidth ; i += step) {
+			c = cs[i / step];
+			switch (c) {
+				case '.':
+					pc->cl0[i][j] = -8;
+					break;
+				case ',':
+					pc->cl0[i][j] = -6;
+					break;
+				case ':':
+					pc->cl0[i][j] = -4;
+					break;
+				case ';':
+					pc->cl0[i][j] = -2;
+					break;
+				case '-':
+					pc->cl0[i][j] = 0;
+					break;
+				case '*':
+					pc->cl0[i][j] = 2;
+					break;
+				case 'o':
+					pc->cl0[i][j] = 4;
+					break;
+				case 'O':
+					pc->cl0[i][j] = 6;
+					break;
+				case '@':
+					pc->cl0[i][j] = 8;
+					break;
+				default:
+					fprintf(stderr, "Wrong map symbol: %c\n", c);
+			}
+		}
+		Height++;
+		j += step;
+	}
+	while (!feof(stdin));
 
-	if (makeBiomes) { /* make biome colours */
-		int tt = min(44, max(0, (int)(rain * 300.0 - 9)));
-		int rr = min(44, max(0, (int)(temp * 300.0 + 10)));
-		char bio = biomes[tt][rr];
-		if (alt <= 0.0) {
-			colour = SEA + (int)((SEA - LOWEST + 1) * (10 * alt));
-			if (colour < LOWEST) colour = LOWEST;
-		} else {
-			colour = bio - 64 + LAND; /* from LAND+2 to LAND+23 */
+	pc->MatchHeight = step * Height;
+	/* fprintf(stderr,"%d %d\n",MatchWidth,MatchHeight); */
+
+	if (step == 2) {
+		/* interpolate */
+		for (j = 1; j < pc->MatchHeight; j += 2) {
+			for (i = 0; i < pc->MatchWidth; i += 2) {
+				pc->cl0[i][j] = (pc->cl0[i][j - 1] + pc->cl0[i][(j + 1)]) / 2;
+			}
 		}
-	} else if (alt <= 0.0) { /* if below sea level then */
-		if (latic > 0 && y2 + alt >= 1.0 - 0.02 * latic * latic) {
-			colour = HIGHEST; /* icecap if close to poles */
-		} else {
-			colour = SEA + (int)((SEA - LOWEST + 1) * (10 * alt));
-			if (colour < LOWEST) {colour = LOWEST;}
+		for (j = 0; j < pc->MatchHeight; j++) {
+			for (i = 1; i < pc->MatchWidth; i += 2) {
+				pc->cl0[i][j] = (pc->cl0[i - 1][j] + pc->cl0[(i + 1) % pc->MatchWidth][j]) / 2;
+			}
 		}
-	} else {
-		if (latic) {alt += 0.1 * latic * y2;} /* altitude adjusted with latitude */
-		if (alt >= 0.1) { /* if high then */
-			colour = HIGHEST;
-		} else {
-			colour = LAND + (int)((HIGHEST - LAND + 1) * (10 * alt));
-			if (colour > HIGHEST) {colour = HIGHEST;}
+	}
+}
+
+void smoothshades(planetcontext *pc) {
+	int b, blocks, w, h;
+	unsigned short *edges;
+
+	/* the last two columns and rows of the map are left unsmoothed */
+	w = min(pc->planeW - 1, pc->Width - 2 - pc->planeX);
+	h = min(pc->planeH - 1, pc->Height - 2 - pc->planeY);
+	if (w <= 0 || h <= 0) return;
+
+	/* each point is smoothed with the points after it, which are not */
+	/* smoothed yet when going through the plane in order; so blocks */
+	/* of columns can be done in parallel if the column after each */
+	/* block is saved before the block before it gets to it */
+	blocks = (w + 63) / 64;
+	edges = (unsigned short*)malloc((size_t)blocks * (h + 1) * sizeof(unsigned short));
+	if (edges == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (b = 0; b < blocks; b++) {
+		int i = min(64 * (b + 1), w);
+		memcpy(edges + (size_t)b * (h + 1), pc->shades[i], (h + 1) * sizeof(unsigned short));
+	}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (b = 0; b < blocks; b++) {
+		int i, j;
+		unsigned short *s, *t;
+		for (i = 64 * b; i < min(64 * (b + 1), w); i++) {
+			s = pc->shades[i];
+			t = i + 1 < 64 * (b + 1) ? pc->shades[i + 1] : edges + (size_t)b * (h + 1);
+			for (j = 0; j < h; j++) {
+				s[j] = (4 * s[j] + 2 * s[j + 1] + 2 * t[j] + t[j + 1] + 4) / 9;
+			}
 		}
 	}
+	free(edges);
+}
 
-	/* store colour */
-	col[i][j] = colour;
+int reused(planetcontext *pc, int i) { /* column i of map was copied from session file */
+	return(pc->reusedCols != NULL && pc->reusedCols[i - pc->planeX]);
+}
 
-	/* store (x,y,z) coordinates for grid drawing */
-	if (vgrid != 0.0) {
-		xxx[i][j] = x;
-		zzz[i][j] = z;
+void *planecolumn(planetcontext *pc, int p, int i) { /* column i of plane p, NULL if not used */
+	switch (p) {
+	case 0: return(pc->col[i]);
+	case 1: return(pc->doshade > 0 ? (void*)pc->shades[i] : NULL);
+	case 2: return(pc->heights != NULL ? (void*)pc->heights[i] : NULL);
+	case 3: return(pc->vgrid != 0.0 ? (void*)pc->lonCells[i] : NULL);
+	default: return(pc->hgrid != 0.0 ? (void*)pc->latCells[i] : NULL);
 	}
-	if (hgrid != 0.0 || vgrid != 0.0) {yyy[i][j] = y;}
-	/* store shading info */
-	if (doshade > 0) {shades[i][j] = shade;}
 }
 
-vertex ssa, ssb, ssc, ssd;
+int sessionparams(planetcontext *pc, double *p) { /* everything but longitude the plane depends on */
+	int n = 0;
+	p[n++] = pc->rseed;
+	p[n++] = pc->M;
+	p[n++] = pc->dd1;
+	p[n++] = pc->POWA;
+	p[n++] = pc->dd2;
+	p[n++] = pc->POW;
+	p[n++] = pc->rotate1;
+	p[n++] = pc->rotate2;
+	p[n++] = pc->shade_angle;
+	p[n++] = pc->shade_angle2;
+	p[n++] = pc->doshade;
+	p[n++] = pc->rainfall;
+	p[n++] = pc->temperature;
+	p[n++] = pc->makeBiomes;
+	p[n++] = pc->climateRows;
+	p[n++] = pc->latic;
+	p[n++] = pc->nonLinear;
+	p[n++] = pc->lat;
+	p[n++] = pc->scale;
+	p[n++] = pc->view;
+	p[n++] = pc->Width;
+	p[n++] = pc->Height;
+	p[n++] = pc->planeX;
+	p[n++] = pc->planeY;
+	p[n++] = pc->planeW;
+	p[n++] = pc->planeH;
+	p[n++] = pc->file_type;
+	p[n++] = pc->heights != NULL;
+	p[n++] = pc->vgrid;
+	p[n++] = pc->hgrid;
+	p[n++] = pc->LOWEST;
+	p[n++] = pc->SEA;
+	p[n++] = pc->LAND;
+	p[n++] = pc->HIGHEST;
+	p[n++] = pc->masterName[0] != '\0' ? pc->masterH : 0;
+	p[n++] = pc->masterCubic;
+	p[n++] = pc->matchMap;
+	if (pc->matchMap) { /* and the map matched, summed up */
+		unsigned long h = 0;
+		int i, j;
+		for (i = 0; i < pc->MatchWidth; i++) {
+			for (j = 0; j < pc->MatchHeight; j++) h = (h * 31 + (unsigned long)(pc->cl0[i][j] + 8)) & 0xffffffffUL;
+		}
+		p[n++] = pc->matchSize;
+		p[n++] = pc->MatchWidth;
+		p[n++] = pc->MatchHeight;
+		p[n++] = h;
+	}
+	return(n);
+}
 
-double planet(vertex a, vertex b, vertex c, vertex d, double x, double y, double z, int level)
-/* vertex a,b,c,d;    tetrahedron vertices */
-/* double x,y,z;      goal point */
-/* int level;         levels to go */
-{
-	vertex e;
-	double lab, lac, lad, lbc, lbd, lcd, maxlength;
-	double es1, es2, es3;
-	double eax, eay, eaz, epx, epy, epz;
-	double ecx, ecy, ecz, edx, edy, edz;
-	double x1, y1, z1, x2, y2, z2, l1, tmp;
+void loadsession(planetcontext *pc) { /* reuse the columns of the last map if it was only panned */
+	static const size_t planeSize[5] = {
+		sizeof(unsigned short), sizeof(unsigned short), sizeof(int),
+		sizeof(unsigned short), sizeof(unsigned short)
+	};
+	FILE *sf;
+	char magic[8];
+	double params[48], fparams[48], oldlongi, shift;
+	int n, k, i, io, p, count = 0;
+	void *dest, *scratch;
+	int sessionparams(planetcontext *pc, double *p);
+	void *planecolumn(planetcontext *pc, int p, int i);
+
+	/* only cylindrical projections sample the same points when panned */
+	if (pc->view != 'm' && pc->view != 'p' && pc->view != 'q') return;
+	sf = fopen(pc->sessionName, "rb");
+	if (sf == NULL) return;
+	n = sessionparams(pc, params);
+	if (fread(magic, 1, 8, sf) != 8 || memcmp(magic, "PLSESSN2", 8) != 0 ||
+	    fread(fparams, sizeof(double), n, sf) != (size_t)n ||
+	    memcmp(params, fparams, n * sizeof(double)) != 0 ||
+	    fread(&oldlongi, sizeof(double), 1, sf) != 1) {
+		fclose(sf);
+		return;
+	}
 
-	if (level > 0) {
-		/* make sure ab is longest edge */
-		lab = dist2(a, b);
-		lac = dist2(a, c);
-		lad = dist2(a, d);
-		lbc = dist2(b, c);
-		lbd = dist2(b, d);
-		lcd = dist2(c, d);
+	/* moving the centre one column width east moves the map one column left */
+	shift = pc->longi - oldlongi;
+	shift -= 2.0 * PI * floor(shift / (2.0 * PI) + 0.5);
+	shift = shift * pc->Width * pc->scale / (2.0 * PI);
+	k = (int)floor(shift + 0.5);
+	if (fabs(shift - k) > 1e-6) { /* not a whole number of columns */
+		fclose(sf);
+		return;
+	}
 
-		maxlength = lab;
-		if (lac > maxlength) maxlength = lac;
-		if (lad > maxlength) maxlength = lad;
-		if (lbc > maxlength) maxlength = lbc;
-		if (lbd > maxlength) maxlength = lbd;
-		if (lcd > maxlength) maxlength = lcd;
+	pc->reusedCols = (char*)calloc(pc->planeW, 1);
+	scratch = malloc(pc->planeH * sizeof(double));
+	if (pc->reusedCols == 0 || scratch == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	for (p = 0; p < 5; p++) {
+		if (planecolumn(pc, p, 0) == NULL) continue;
+		for (io = 0; io < pc->planeW; io++) {
+			i = pc->planeX + io - k; /* map column showing old column io now */
+			if (pc->scale == 1.0) i = (i % pc->Width + pc->Width) % pc->Width; /* map goes all the way round */
+			dest = i >= pc->planeX && i < pc->planeX + pc->planeW ? planecolumn(pc, p, i - pc->planeX) : scratch;
+			if (fread(dest, planeSize[p], pc->planeH, sf) != (size_t)pc->planeH) { /* render it all */
+				memset(pc->reusedCols, 0, pc->planeW);
+				fclose(sf);
+				free(scratch);
+				return;
+			}
+			if (p == 0 && dest != scratch) pc->reusedCols[i - pc->planeX] = 1;
+		}
+	}
+	fclose(sf);
+	free(scratch);
 
-		if (lac == maxlength) return(planet(a,c,b,d, x,y,z, level));
-		if (lad == maxlength) return(planet(a,d,b,c, x,y,z, level));
-		if (lbc == maxlength) return(planet(b,c,a,d, x,y,z, level));
-		if (lbd == maxlength) return(planet(b,d,a,c, x,y,z, level));
-		if (lcd == maxlength) return(planet(c,d,a,b, x,y,z, level));
+	for (i = 0; i < pc->planeW; i++) count += pc->reusedCols[i];
+	fprintf(stderr, "Reusing %d of %d columns from %s\n", count, pc->planeW, pc->sessionName);
+}
 
-		if (level == 11) { /* save tetrahedron for caching */
-			ssa = a;
-			ssb = b;
-			ssc = c;
-			ssd = d;
+void savesession(planetcontext *pc) { /* keep plane before outlines, grid and smoothing */
+	static const size_t planeSize[5] = {
+		sizeof(unsigned short), sizeof(unsigned short), sizeof(int),
+		sizeof(unsigned short), sizeof(unsigned short)
+	};
+	FILE *sf;
+	double params[48];
+	int n, i, p;
+	int sessionparams(planetcontext *pc, double *p);
+	void *planecolumn(planetcontext *pc, int p, int i);
+
+	if (pc->view != 'm' && pc->view != 'p' && pc->view != 'q') return;
+	sf = fopen(pc->sessionName, "wb");
+	if (sf == NULL) {
+		fprintf(stderr, "Could not open session file %s, error code = %d\n", pc->sessionName, errno);
+		exit(1);
+	}
+	n = sessionparams(pc, params);
+	fwrite("PLSESSN2", 1, 8, sf);
+	fwrite(params, sizeof(double), n, sf);
+	fwrite(&pc->longi, sizeof(double), 1, sf);
+	for (p = 0; p < 5; p++) {
+		if (planecolumn(pc, p, 0) == NULL) continue;
+		for (i = 0; i < pc->planeW; i++) {
+			fwrite(planecolumn(pc, p, i), planeSize[p], pc->planeH, sf);
+		}
+	}
+	fclose(sf);
+}
+
+void background(planetcontext *pc, int i, int j) { /* map point (i,j) is outside the globe */
+	pc->col[i - pc->planeX][j - pc->planeY] = pc->BACK;
+	if (pc->doshade > 0) {pc->shades[i - pc->planeX][j - pc->planeY] = 255;}
+}
+
+void mercator(planetcontext *pc) {
+	double y, scale1, cos2, theta1;
+	int i, j, k;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+	int reused(planetcontext *pc, int i);
+
+	y = sin(pc->lat);
+	y = (1.0 + y) / (1.0 - y);
+	y = 0.5 * log(y);
+	k = (int)(0.5 * y * pc->Width * pc->scale / PI + 0.5);
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, y, scale1, cos2, theta1) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		y = PI * (2.0 * (j - k) - pc->Height) / pc->Width / pc->scale;
+		y = exp(2. * y);
+		y = (y - 1.) / (y + 1.);
+		scale1 = pc->scale * pc->Width / pc->Height / sqrt(1.0 - y * y) / PI;
+		cos2 = sqrt(1.0 - y * y);
+		Depth = 3 * ((int)(log_2(scale1 * pc->Height))) + 3;
+		for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+			theta1 = pc->longi - 0.5 * PI + PI * (2.0 * i - pc->Width) / pc->Width / pc->scale;
+			if (!reused(pc, i)) planet0(pc, cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
 		}
+	}
+}
 
-		/* ab is longest, so cut ab */
-		e.s = rand2(a.s, b.s);
-		es1 = rand2(e.s, e.s);
-		es2 = 0.5 + 0.1 * rand2(es1, es1); /* find cut point */
-		es3 = 1.0 - es2;
-
-		if (a.s < b.s) {
-			e.x = es2 * a.x + es3 * b.x;
-			e.y = es2 * a.y + es3 * b.y;
-			e.z = es2 * a.z + es3 * b.z;
-		} else if (a.s > b.s) {
-			e.x = es3 * a.x + es2 * b.x;
-			e.y = es3 * a.y + es2 * b.y;
-			e.z = es3 * a.z + es2 * b.z;
-		} else { /* as==bs, very unlikely to ever happen */
-			e.x = 0.5 * a.x + 0.5 * b.x;
-			e.y = 0.5 * a.y + 0.5 * b.y;
-			e.z = 0.5 * a.z + 0.5 * b.z;
-		}
-
-		/* new altitude is: */
-		if (matchMap && lab > matchSize) { /* use map height */
-			double l, xx, yy;
-			l = sqrt(e.x * e.x + e.y * e.y + e.z * e.z);
-			yy = asin(e.y / l) * (MatchHeight - 1) / PI + (MatchHeight - 1) / 2.0;
-			xx = atan2(e.x, e.z) * (MatchWidth - 1) / 2.0 / PI + (MatchWidth - 1) / 2.0;
-			e.h = cl0[(int)(xx + 0.5)][(int)(yy + 0.5)] * 0.1 / 8.0;
+void peter(planetcontext *pc) {
+	double y, cos2, theta1, scale1;
+	int k, i, j, water, land;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+	int reused(planetcontext *pc, int i);
+
+	y = 2.0 * sin(pc->lat);
+	k = (int)(0.5 * y * pc->Width * pc->scale / PI + 0.5);
+	water = land = 0;
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, y, cos2, theta1, scale1) reduction(+:water, land) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		y = 0.5 * PI * (2.0 * (j - k) - pc->Height) / pc->Width / pc->scale;
+		if (fabs(y) > 1.0) {
+			for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+				background(pc, i, j);
+			}
 		} else {
-			if (lab > 1.0) {lab = pow(lab, 0.5);}
-			/* decrease contribution for very long distances */
-			e.h = 0.5 * (a.h + b.h) /* average of end points */
-			      + e.s * dd1 * pow(fabs(a.h - b.h), POWA) /* plus contribution for altitude diff */
-			      + es1 * dd2 * pow(lab, POW); /* plus contribution for distance */
-		}
-
-		/* calculate approximate rain shadow for new point */
-		if (e.h <= 0.0 || !(rainfall || makeBiomes)) {e.shadow = 0.0;}
-		else {
-			x1 = 0.5 * (a.x + b.x);
-			x1 = a.h * (x1 - a.x) + b.h * (x1 - b.x);
-			y1 = 0.5 * (a.y + b.y);
-			y1 = a.h * (y1 - a.y) + b.h * (y1 - b.y);
-			z1 = 0.5 * (a.z + b.z);
-			z1 = a.h * (z1 - a.z) + b.h * (z1 - b.z);
-			l1 = sqrt(x1 * x1 + y1 * y1 + z1 * z1);
-			if (l1 == 0.0) l1 = 1.0;
-			tmp = sqrt(1.0 - y * y);
-			if (tmp < 0.0001) tmp = 0.0001;
-			z2 = -z / tmp * x1 + x / tmp * z1;
-			if (lab > 0.04) {
-				e.shadow = (a.shadow + b.shadow - cos(PI * shade_angle / 180.0) * z2 / l1) / 3.0;
-			} else {
-				e.shadow = (a.shadow + b.shadow) / 2.0;
+			cos2 = sqrt(1.0 - y * y);
+			if (cos2 > 0.0) {
+				scale1 = pc->scale * pc->Width / pc->Height / cos2 / PI;
+				Depth = 3 * ((int)(log_2(scale1 * pc->Height))) + 3;
+				for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+					theta1 = pc->longi - 0.5 * PI + PI * (2.0 * i - pc->Width) / pc->Width / pc->scale;
+					if (!reused(pc, i)) planet0(pc, cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
+					if (pc->col[i - pc->planeX][j - pc->planeY] < pc->LAND) {
+						water++;
+					} else {
+						land++;
+					}
+				}
 			}
 		}
-		/* find out in which new tetrahedron target point is */
-		eax = a.x - e.x;
-		eay = a.y - e.y;
-		eaz = a.z - e.z;
-		ecx = c.x - e.x;
-		ecy = c.y - e.y;
-		ecz = c.z - e.z;
-		edx = d.x - e.x;
-		edy = d.y - e.y;
-		edz = d.z - e.z;
-		epx =   x - e.x;
-		epy =   y - e.y;
-		epz =   z - e.z;
-		if ((eax*ecy*edz + eay*ecz*edx + eaz*ecx*edy
-		   - eaz*ecy*edx - eay*ecx*edz - eax*ecz*edy) *
-		    (epx*ecy*edz + epy*ecz*edx + epz*ecx*edy
-		   - epz*ecy*edx - epy*ecx*edz - epx*ecz*edy) > 0.0) {
-			/* point is inside acde */
-			return(planet(c, d, a, e, x, y, z, level - 1));
+	}
+	if (!pc->library) fprintf(stderr, "\nwater percentage: %d%%", 100 * water / (water + land));
+}
+
+void squarep(planetcontext *pc) {
+	double y, scale1, theta1, cos2;
+	int k, i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+	int reused(planetcontext *pc, int i);
+
+	k = (int)(0.5 * pc->lat * pc->Width * pc->scale / PI + 0.5);
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, y, scale1, theta1, cos2) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		y = (2.0 * (j - k) - pc->Height) / pc->Width / pc->scale * PI;
+		if (fabs(y + y) > PI) {
+			for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+				background(pc, i, j);
+			}
 		} else {
-			/* point is inside bcde */
-			return(planet(c, d, b, e, x, y, z, level - 1));
+			cos2 = cos(y);
+			if (cos2 > 0.0) {
+				scale1 = pc->scale * pc->Width / pc->Height / cos2 / PI;
+				Depth = 3 * ((int)(log_2(scale1 * pc->Height))) + 3;
+				for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+					theta1 = pc->longi - 0.5 * PI + PI * (2.0 * i - pc->Width) / pc->Width / pc->scale;
+					if (!reused(pc, i)) planet0(pc, cos(theta1) * cos2, sin(y), -sin(theta1) * cos2, i, j);
+				}
+			}
 		}
-	} else { /* level == 0 */
-		if (doshade == 1 || doshade == 2) { /* bump map */
-			x1 = 0.25 * (a.x + b.x + c.x + d.x);
-			x1 = a.h * (x1 - a.x) + b.h * (x1 - b.x) + c.h * (x1 - c.x) + d.h * (x1 - d.x);
-			y1 = 0.25 * (a.y + b.y + c.y + d.y);
-			y1 = a.h * (y1 - a.y) + b.h * (y1 - b.y) + c.h * (y1 - c.y) + d.h * (y1 - d.y);
-			z1 = 0.25 * (a.z + b.z + c.z + d.z);
-			z1 = a.h * (z1 - a.z) + b.h * (z1 - b.z) + c.h * (z1 - c.z) + d.h * (z1 - d.z);
-			l1 = sqrt(x1 * x1 + y1 * y1 + z1 * z1);
-			if (l1 == 0.0) {l1 = 1.0;}
-			tmp = sqrt(1.0 - y * y);
+	}
+}
+
+void mollweide(planetcontext *pc) {
+	double y, y1, zz, scale1, cos2, theta1;
+	int i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, y, y1, zz, scale1, cos2, theta1) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		y1 = 2 * (2.0 * j - pc->Height) / pc->Width / pc->scale;
+		if (fabs(y1) >= 1.0) {
+			for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+				background(pc, i, j);
+			}
+		} else {
+			zz = sqrt(1.0 - y1 * y1);
+			y = 2.0 / PI * (y1 * zz + asin(y1));
+			cos2 = sqrt(1.0 - y * y);
+			if (cos2 > 0.0) {
+				scale1 = pc->scale * pc->Width / pc->Height / cos2 / PI;
+				Depth = 3 * ((int)(log_2(scale1 * pc->Height))) + 3;
+				for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+					theta1 = PI / zz * (2.0 * i - pc->Width) / pc->Width / pc->scale;
+					if (fabs(theta1) > PI) {
+						background(pc, i, j);
+					} else {
+						double x2, y2, z2, x3, y3, z3;
+						theta1 += -0.5 * PI;
+						x2 = cos(theta1) * cos2;
+						y2 = y;
+						z2 = -sin(theta1) * cos2;
+						x3 = pc->clo * x2 + pc->slo * pc->sla * y2 + pc->slo * pc->cla * z2;
+						y3 = pc->cla * y2 - pc->sla * z2;
+						z3 = -pc->slo * x2 + pc->clo * pc->sla * y2 + pc->clo * pc->cla * z2;
+						planet0(pc, x3, y3, z3, i, j);
+					}
+				}
+			}
+		}
+	}
+}
+
+void sinusoid(planetcontext *pc) {
+	double y, theta1, theta2, cos2, l1, i1, scale1;
+	int k, i, j, l;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	k = (int)(pc->lat * pc->Width * pc->scale / PI + 0.5);
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, y, theta1, theta2, cos2, l1, i1, scale1, l) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		y = (2.0 * (j - k) - pc->Height) / pc->Width / pc->scale * PI;
+		if (fabs(y + y) > PI) {
+			for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+				background(pc, i, j);
+			}
+		} else {
+			cos2 = cos(y);
+			if (cos2 > 0.0) {
+				scale1 = pc->scale * pc->Width / pc->Height / cos2 / PI;
+				Depth = 3 * ((int)(log_2(scale1 * pc->Height))) + 3;
+				for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+					l = i * 12 / pc->Width / pc->scale;
+					l1 = l * pc->Width * pc->scale / 12.0;
+					i1 = i - l1;
+					theta2 = pc->longi - 0.5 * PI + PI * (2.0 * l1 - pc->Width) / pc->Width / pc->scale;
+					theta1 = (PI * (2.0 * i1 - pc->Width * pc->scale / 12.0) / pc->Width / pc->scale) / cos2;
+					if (fabs(theta1) > PI / 12.0) {
+						background(pc, i, j);
+					} else {
+						planet0(pc, cos(theta1 + theta2) * cos2, sin(y), -sin(theta1 + theta2) * cos2, i, j);
+					}
+				}
+			}
+		}
+	}
+}
+
+void stereo(planetcontext *pc) {
+	double x, y, z, zz, x1, y1, z1;
+	int i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, z, zz, x1, y1, z1) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+			x = (2.0 * i - pc->Width) / pc->Height / pc->scale;
+			y = (2.0 * j - pc->Height) / pc->Height / pc->scale;
+			z = x * x + y * y;
+			zz = 0.25 * (4.0 + z);
+			x = x / zz;
+			y = y / zz;
+			z = (1.0 - 0.25 * z) / zz;
+			x1 = pc->clo * x + pc->slo * pc->sla * y + pc->slo * pc->cla * z;
+			y1 = pc->cla * y - pc->sla * z;
+			z1 = -pc->slo * x + pc->clo * pc->sla * y + pc->clo * pc->cla * z;
+			if (pc->scale < 1.0) {Depth = 3 * ((int)(log_2(pc->scale * pc->Height))) + 6 + 1.5 / pc->scale;}
+			planet0(pc, x1, y1, z1, i, j);
+		}
+	}
+}
+
+void orthographic(planetcontext *pc) {
+	double x, y, z, x1, y1, z1;
+	int i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, z, x1, y1, z1) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+			x = (2.0 * i - pc->Width) / pc->Height / pc->scale;
+			y = (2.0 * j - pc->Height) / pc->Height / pc->scale;
+			if (x * x + y * y > 1.0) {
+				background(pc, i, j);
+			} else {
+				z = sqrt(1.0 - x * x - y * y);
+				x1 = pc->clo * x + pc->slo * pc->sla * y + pc->slo * pc->cla * z;
+				y1 = pc->cla * y - pc->sla * z;
+				z1 = -pc->slo * x + pc->clo * pc->sla * y + pc->clo * pc->cla * z;
+				planet0(pc, x1, y1, z1, i, j);
+			}
+		}
+	}
+}
+
+double reliefslack(planetcontext *pc) {
+	/* largest rise of a cut beyond its ends from the altitude difference */
+	double slack = 0.0;
+
+	if (pc->POWA < 1.0) {
+		double d = pow(2.0 * fabs(pc->dd1) * pc->POWA, 1.0 / (1.0 - pc->POWA));
+		slack = fabs(pc->dd1) * pow(d, pc->POWA) - 0.5 * d;
+	} else if (fabs(pc->dd1) > 0.5) {
+		slack = fabs(pc->dd1) - 0.5;
+	}
+	return(slack > 0.0 ? slack : 0.0);
+}
+
+void perspective(planetcontext *pc) {
+	/* perspective view from a camera camDist from the centre, with  */
+	/* altitudes above sea level raised by relief, rendered in tiles */
+	double k = 1.0 / sqrt(pc->camDist * pc->camDist - 1.0); /* view covers the globe at scale 1 */
+	int tile, tiles, tilesX;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+	int reliefhit(planetcontext *pc, double *p, double *v, double pixel, vertex *path, int *side, double *hit);
+	int reliefbuild(planetcontext *pc, vertex *t, int levels);
+	double reliefslack(planetcontext *pc);
+
+	pc->reliefSlack = reliefslack(pc);
+
+	/* pixels are (camDist - 1) * 2k / (scale * Height) across at the */
+	/* point of the globe closest to the camera */
+	Depth = 3 * ((int)(log_2(pc->scale * pc->Height / k / (pc->camDist - 1.0)))) + 6;
+
+	/* tree of the tetrahedra near the sphere, whose bounds are the */
+	/* highest of their halves, so much tighter than reliefbound() */
+	pc->reliefLevels = min(Depth, 24);
+	pc->reliefNodes = 0;
+	reliefbuild(pc, pc->tetra, pc->reliefLevels);
+
+	tilesX = (pc->planeW + 15) / 16;
+	tiles = tilesX * ((pc->planeH + 15) / 16);
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) copyin(Depth)
+#endif
+	for (tile = 0; tile < tiles; tile++) {
+		int i, j, i0, j0, *side;
+		double x, y, l, p[3], v[3], hit[3];
+		vertex *path;
+
+		path = (vertex*)malloc(9 * (Depth + 1) * sizeof(vertex));
+		side = (int*)malloc(2 * (Depth + 1) * sizeof(int));
+		if (path == 0 || side == 0) {
+			free(path);
+			free(side);
+			planetfail(pc);
+			continue;
+		}
+		i0 = pc->planeX + 16 * (tile % tilesX);
+		j0 = pc->planeY + 16 * (tile / tilesX);
+		/* camera at (0,0,camDist) looking along -z before rotation */
+		p[0] = pc->slo * pc->cla * pc->camDist;
+		p[1] = -pc->sla * pc->camDist;
+		p[2] = pc->clo * pc->cla * pc->camDist;
+		for (j = j0; j < min(j0 + 16, pc->planeY + pc->planeH); j++) {
+			for (i = i0; i < min(i0 + 16, pc->planeX + pc->planeW); i++) {
+				x = (2.0 * i - pc->Width) / pc->Height / pc->scale * k;
+				y = (2.0 * j - pc->Height) / pc->Height / pc->scale * k;
+				l = sqrt(x * x + y * y + 1.0);
+				x = x / l;
+				y = y / l;
+				v[0] = pc->clo * x + pc->slo * pc->sla * y - pc->slo * pc->cla / l;
+				v[1] = pc->cla * y + pc->sla / l;
+				v[2] = -pc->slo * x + pc->clo * pc->sla * y - pc->clo * pc->cla / l;
+				if (reliefhit(pc, p, v, 2.0 * k / (pc->scale * pc->Height), path, side, hit)) {
+					planet0(pc, hit[0], hit[1], hit[2], i, j);
+				} else {
+					background(pc, i, j);
+				}
+			}
+		}
+		free(path);
+		free(side);
+		progresstick(pc, tiles);
+	}
+	planetcheck(pc);
+}
+
+void orthographic2(planetcontext *pc) {
+	double x, y, z, x1, y1, z1, ymin, ymax;
+	int i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+	double lat1, longi1;
+
+	ymin = 2.0;
+	ymax = -2.0;
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, z, x1, y1, z1, lat1, longi1) reduction(min:ymin) reduction(max:ymax) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		for (i = pc->planeX; i < min(pc->planeX + pc->planeW, pc->Width / 2); i++) {
+			x = (2.0 * i - pc->Width / 2) / pc->Height / pc->scale;
+			y = (2.0 * j - pc->Height) / pc->Height / pc->scale;
+			if (x * x + y * y > 1.0) {
+				background(pc, i, j);
+			} else {
+				z = sqrt(1.0 - x * x - y * y);
+				x1 = pc->clo * x + pc->slo * pc->sla * y + pc->slo * pc->cla * z;
+				y1 = pc->cla * y - pc->sla * z;
+				z1 = -pc->slo * x + pc->clo * pc->sla * y + pc->clo * pc->cla * z;
+				if (y1 < ymin) ymin = y1;
+				if (y1 > ymax) ymax = y1;
+				planet0(pc, x1, y1, z1, i, j);
+			}
+		}
+		longi1 = pc->longi + PI;
+		lat1 = -pc->lat;
+		for (i = max(pc->planeX, pc->Width / 2); i < pc->planeX + pc->planeW; i++) {
+			x = (2.0 * i - 3 * pc->Width / 2) / pc->Height / pc->scale;
+			y = (2.0 * j - pc->Height) / pc->Height / pc->scale;
+			if (x * x + y * y > 1.0) {
+				background(pc, i, j);
+			} else {
+				z = sqrt(1.0 - x * x - y * y);
+				x1 = cos(longi1) * x + sin(longi1) * sin(lat1) * y + sin(longi1) * cos(lat1) * z;
+				y1 = cos(lat1) * y - sin(lat1) * z;
+				z1 = -sin(longi1) * x + cos(longi1) * sin(lat1) * y + cos(longi1) * cos(lat1) * z;
+				if (y1 < ymin) ymin = y1;
+				if (y1 > ymax) ymax = y1;
+				planet0(pc, x1, y1, z1, i, j);
+			}
+		}
+	}
+}
+
+void icosahedral(planetcontext *pc) { /* modified version of gnomonic */
+	double x, y, z, x1, y1, z1, zz;
+	int i, j, f, k, u, v;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+	double lat1, longi1, x0, y0, w, sq3;
+	double L1, L2, S;
+	double faceLat[20], faceLongi[20]; /* centre of each face in degrees */
+	double rot[20][3][3]; /* rotation from face plane to globe */
+	/* face row by row of triangles (top, middle, bottom) and by whether */
+	/* the (x0+y0/sq3, x0-y0/sq3) cell is on or above the diagonal */
+	static const int faceRow[3][2] = {{0, -1}, {2, 1}, {-1, 3}};
+
+	sq3 = sqrt(3.0);
+	L1 =  10.812317;/* theoretically 10.9715145571469; */
+	L2 = -52.622632; /* theoretically -48.3100310579607; */
+	S = 55.6; /* found by experimentation */
+
+	/* faces 0-4: top row, 5-9: middle row upward, 10-14: middle row */
+	/* downward, 15-19: bottom row, each row from east to west */
+	for (k = 0; k < 5; k++) {
+		faceLat[k] = -L2;
+		faceLongi[k] = 90.0 - 72.0 * k;
+		faceLat[k + 5] = -L1;
+		faceLongi[k + 5] = 126.0 - 72.0 * k;
+		faceLat[k + 10] = L1;
+		faceLongi[k + 10] = 90.0 - 72.0 * k;
+		faceLat[k + 15] = L2;
+		faceLongi[k + 15] = 126.0 - 72.0 * k;
+	}
+	for (f = 0; f < 20; f++) {
+		double sla1, cla1, slo1, clo1;
+		longi1 = faceLongi[f] * DEG2RAD - pc->longi;
+		lat1 = faceLat[f] * DEG2RAD;
+		sla1 = sin(lat1);
+		cla1 = cos(lat1);
+		slo1 = sin(longi1);
+		clo1 = cos(longi1);
+		rot[f][0][0] = clo1;
+		rot[f][0][1] = slo1 * sla1;
+		rot[f][0][2] = slo1 * cla1;
+		rot[f][1][0] = 0.0;
+		rot[f][1][1] = cla1;
+		rot[f][1][2] = -sla1;
+		rot[f][2][0] = -slo1;
+		rot[f][2][1] = clo1 * sla1;
+		rot[f][2][2] = clo1 * cla1;
+	}
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, z, x1, y1, z1, zz, f, k, u, v, x0, y0, w) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+			x0 = 198.0 * (2.0 * i - pc->Width) / pc->Width / pc->scale - 36;
+			y0 = 198.0 * (2.0 * j - pc->Height) / pc->Width / pc->scale - pc->lat / DEG2RAD;
+			w = y0 / sq3;
+			/* triangle edges are at x0-w = 72u and x0+w = 36+72v */
+			u = (int)floor((x0 - w) / 72.0);
+			if (x0 - w < 72.0 * u) u--;
+			else if (x0 - w >= 72.0 * (u + 1)) u++;
+			v = (int)floor((x0 + w - 36.0) / 72.0);
+			if (x0 + w < 36.0 + 72.0 * v) v--;
+			else if (x0 + w >= 36.0 + 72.0 * (v + 1)) v++;
+			k = 1 - u; /* triangle number within row */
+			f = -1;
+			if (k >= 0 && k < 5 && (v == u || v == u - 1)) {
+				f = faceRow[w < -18.0 ? 0 : w > 18.0 ? 2 : 1][v - u + 1];
+				if (f >= 0) f = 5 * f + k;
+			}
+			if (f < 0) {
+				background(pc, i, j);
+			} else {
+				x = (x0 - faceLongi[f]) / S;
+				y = (y0 + faceLat[f]) / S;
+
+				zz = sqrt(1.0 / (1.0 + x * x + y * y));
+				x = x * zz;
+				y = y * zz;
+				z = sqrt(1.0 - x * x - y * y);
+				x1 = rot[f][0][0] * x + rot[f][0][1] * y + rot[f][0][2] * z;
+				y1 = rot[f][1][1] * y + rot[f][1][2] * z;
+				z1 = rot[f][2][0] * x + rot[f][2][1] * y + rot[f][2][2] * z;
+
+				planet0(pc, x1, y1, z1, i, j);
+			}
+		}
+	}
+}
+
+void progresstick(planetcontext *pc, int total) { /* advance progress bar when a */
+	/* thread has done one of total rows (total = 0 starts a new bar); */
+	/* the library draws no bars */
+	if (pc->library) return;
+#ifdef _OPENMP
+#pragma omp critical (progressbar)
+#endif
+	{
+		if (total == 0) {
+			pc->progressDone = 0;
+		} else if (++pc->progressDone, total >= 25 && pc->progressDone % (total / 25) == 0) {
+			fprintf(stderr, ">");
+			fflush(stderr);
+		}
+	}
+}
+
+void cubemap(planetcontext *pc) {
+	int f, i, j, rows = 0;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+	/* faces in the order front, right, back, left, top, bottom: their */
+	/* position in the cross and their forward, right and down vectors */
+	static const int faceX[6] = {1, 2, 3, 0, 1, 1}, faceY[6] = {1, 1, 1, 1, 0, 2};
+	static const double faceVec[6][3][3] = {
+		{{ 0.0,  0.0,  1.0}, { 1.0, 0.0,  0.0}, {0.0, 1.0,  0.0}},
+		{{ 1.0,  0.0,  0.0}, { 0.0, 0.0, -1.0}, {0.0, 1.0,  0.0}},
+		{{ 0.0,  0.0, -1.0}, {-1.0, 0.0,  0.0}, {0.0, 1.0,  0.0}},
+		{{-1.0,  0.0,  0.0}, { 0.0, 0.0,  1.0}, {0.0, 1.0,  0.0}},
+		{{ 0.0, -1.0,  0.0}, { 1.0, 0.0,  0.0}, {0.0, 0.0,  1.0}},
+		{{ 0.0,  1.0,  0.0}, { 1.0, 0.0,  0.0}, {0.0, 0.0, -1.0}}
+	};
+
+	/* parts of the cross not covered by a face */
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+			for (f = 0; f < 6; f++) {
+				if (i / pc->cubeSize == faceX[f] && j / pc->cubeSize == faceY[f]) break;
+			}
+			if (f == 6) background(pc, i, j);
+		}
+		for (f = 0; f < 6; f++) { /* count face rows for progress bar */
+			if (j / pc->cubeSize == faceY[f] && pc->planeX < (faceX[f] + 1) * pc->cubeSize
+			    && pc->planeX + pc->planeW > faceX[f] * pc->cubeSize) rows++;
+		}
+	}
+
+	/* each face is rendered by its own thread with its own cache */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, j)
+#endif
+	for (f = 0; f < 6; f++) {
+		int i0, i1, j0, j1;
+		double a, b, x, y, z, zz, x1, y1, z1;
+		const double (*v)[3] = faceVec[f];
+
+		Depth = 3 * ((int)(log_2((double)pc->cubeSize))) + 6;
+		i0 = max(pc->planeX, faceX[f] * pc->cubeSize);
+		i1 = min(pc->planeX + pc->planeW, (faceX[f] + 1) * pc->cubeSize);
+		j0 = max(pc->planeY, faceY[f] * pc->cubeSize);
+		j1 = min(pc->planeY + pc->planeH, (faceY[f] + 1) * pc->cubeSize);
+		for (j = j0; j < j1; j++) {
+			/* sample pixel centres, so no point is on two faces */
+			/* and samples on either side of an edge match up */
+			b = (2.0 * (j - faceY[f] * pc->cubeSize) + 1.0) / pc->cubeSize - 1.0;
+			for (i = i0; i < i1; i++) {
+				a = (2.0 * (i - faceX[f] * pc->cubeSize) + 1.0) / pc->cubeSize - 1.0;
+				x = v[0][0] + a * v[1][0] + b * v[2][0];
+				y = v[0][1] + a * v[1][1] + b * v[2][1];
+				z = v[0][2] + a * v[1][2] + b * v[2][2];
+				zz = sqrt(1.0 / (x * x + y * y + z * z));
+				x = x * zz;
+				y = y * zz;
+				z = z * zz;
+				x1 = pc->clo * x + pc->slo * pc->sla * y + pc->slo * pc->cla * z;
+				y1 = pc->cla * y - pc->sla * z;
+				z1 = -pc->slo * x + pc->clo * pc->sla * y + pc->clo * pc->cla * z;
+				planet0(pc, x1, y1, z1, i, j);
+			}
+			progresstick(pc, rows);
+		}
+	}
+}
+
+long nestindex(planetcontext *pc, long pix) { /* HEALPix nested index of ring index pix */
+	static const int jrll[12] = {2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4};
+	static const int jpll[12] = {1, 3, 5, 7, 0, 2, 4, 6, 1, 3, 5, 7};
+	long npix = 12L * pc->nside * pc->nside, ncap = 2L * pc->nside * (pc->nside - 1);
+	long iring, iphi, nr, ip, ix, iy, irt, ipt, nest;
+	int face, kshift, b;
+
+	if (pix < ncap) { /* north polar cap */
+		iring = (1 + (long)sqrt(1.0 + 2.0 * pix)) / 2;
+		if (2 * iring * (iring - 1) > pix) iring--; /* guard against rounding */
+		iphi = pix + 1 - 2 * iring * (iring - 1);
+		kshift = 0;
+		nr = iring;
+		face = (int)((iphi - 1) / nr);
+	} else if (pix < npix - ncap) { /* equatorial belt */
+		long ire, irm, ifm, ifp;
+		ip = pix - ncap;
+		iring = ip / (4 * pc->nside) + pc->nside;
+		iphi = ip % (4 * pc->nside) + 1;
+		kshift = (int)((iring + pc->nside) & 1);
+		nr = pc->nside;
+		ire = iring - pc->nside + 1;
+		irm = 2 * pc->nside + 2 - ire;
+		ifm = (iphi - ire / 2 + pc->nside - 1) / pc->nside;
+		ifp = (iphi - irm / 2 + pc->nside - 1) / pc->nside;
+		if (ifp == ifm) face = (int)(ifp | 4);
+		else if (ifp < ifm) face = (int)ifp;
+		else face = (int)(ifm + 8);
+	} else { /* south polar cap */
+		ip = npix - pix;
+		iring = (1 + (long)sqrt(2.0 * ip - 1.0)) / 2;
+		if (2 * iring * (iring + 1) < ip) iring++; /* guard against rounding */
+		iphi = 4 * iring + 1 - (ip - 2 * iring * (iring - 1));
+		kshift = 0;
+		nr = iring;
+		iring = 4 * pc->nside - iring;
+		face = (int)(8 + (iphi - 1) / nr);
+	}
+	irt = iring - jrll[face] * pc->nside + 1;
+	ipt = 2 * iphi - jpll[face] * nr - kshift - 1;
+	if (ipt >= 2 * pc->nside) ipt -= 8 * pc->nside;
+	ix = (ipt - irt) / 2; /* both differences are even */
+	iy = (-ipt - irt) / 2;
+
+	/* interleave bits of ix and iy */
+	nest = 0;
+	for (b = 0; (1L << b) < pc->nside; b++) {
+		nest |= ((ix >> b) & 1) << (2 * b);
+		nest |= ((iy >> b) & 1) << (2 * b + 1);
+	}
+	return face * (long)pc->nside * pc->nside + nest;
+}
+
+void putint32(unsigned long v, FILE *outfile) { /* 32 bit little endian */
+	putc(v & 255, outfile);
+	putc((v >> 8) & 255, outfile);
+	putc((v >> 16) & 255, outfile);
+	putc((v >> 24) & 255, outfile);
+}
+
+void healpix(planetcontext *pc, FILE *outfile) {
+	/* HEALPix (Gorski et al. 2005) has equal area pixels on rings of */
+	/* constant latitude. The file is made to be memory mapped:       */
+	/*   bytes  0-7  "HEALPIX" and a zero byte                        */
+	/*   bytes  8-11 nside, 12-15 ordering (0 = ring, 1 = nested)     */
+	/*   bytes 16-19 number of pixels (12 * nside * nside)            */
+	/*   bytes 20-23 offset of altitudes (64), as 32 bit floats       */
+	/*   bytes 24-27 offset of colours, as red, green, blue bytes     */
+	/*   bytes 28-63 zero                                             */
+	/* All numbers are little endian. North is the top of other maps. */
+	long npix = 12L * pc->nside * pc->nside, ncap = 2L * pc->nside * (pc->nside - 1), k;
+	int ring;
+	int colourpoint(planetcontext *pc, double x, double y, double z, double *altp);
+	long nestindex(planetcontext *pc, long pix);
+	float *alts;
+	unsigned char *rgb, *bytes, t;
+	unsigned short one = 1;
+
+	alts = (float*)malloc(npix * sizeof(float));
+	rgb = (unsigned char*)malloc(3 * npix);
+	if (alts == 0 || rgb == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+
+	/* pixels are about 1/nside radians across */
+	Depth = 3 * ((int)(log_2(2.0 * pc->nside))) + 6;
+
+	/* each ring is done by one thread */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) copyin(Depth)
+#endif
+	for (ring = 1; ring < 4 * pc->nside; ring++) {
+		long first, pix;
+		int n, j, colour, c, s;
+		double z, st, phi0, dphi, alt;
+		if (ring < pc->nside) { /* north polar cap */
+			n = 4 * ring;
+			first = 2L * ring * (ring - 1);
+			z = 1.0 - (double)ring * ring / (3.0 * pc->nside * pc->nside);
+			dphi = 0.5 * PI / ring;
+			phi0 = 0.5 * dphi;
+		} else if (ring <= 3 * pc->nside) { /* equatorial belt */
+			n = 4 * pc->nside;
+			first = ncap + (long)(ring - pc->nside) * n;
+			z = (2.0 * pc->nside - ring) * 2.0 / (3.0 * pc->nside);
+			dphi = 0.5 * PI / pc->nside;
+			phi0 = ((ring + pc->nside) & 1) ? 0.0 : 0.5 * dphi;
+		} else { /* south polar cap */
+			n = 4 * (4 * pc->nside - ring);
+			first = npix - 2L * (n / 4) * (n / 4 + 1);
+			z = (double)(n / 4) * (n / 4) / (3.0 * pc->nside * pc->nside) - 1.0;
+			dphi = 2.0 * PI / n;
+			phi0 = 0.5 * dphi;
+		}
+		st = sqrt((1.0 - z) * (1.0 + z));
+		for (j = 0; j < n; j++) {
+			double phi = phi0 + j * dphi;
+			/* north (z = 1) is y = -1, longitude is atan2(x,z) */
+			colour = colourpoint(pc, st * sin(phi), -z, st * cos(phi), &alt);
+			pix = pc->nested ? nestindex(pc, first + j) : first + j;
+			alts[pix] = (float)alt;
+			s = pc->doshade ? shade : 150;
+			c = s * pc->rtable[colour] / 150;
+			rgb[3 * pix] = c > 255 ? 255 : c;
+			c = s * pc->gtable[colour] / 150;
+			rgb[3 * pix + 1] = c > 255 ? 255 : c;
+			c = s * pc->btable[colour] / 150;
+			rgb[3 * pix + 2] = c > 255 ? 255 : c;
+		}
+		progresstick(pc, 4 * pc->nside - 1);
+	}
+
+	fprintf(outfile, "HEALPIX");
+	putc(0, outfile);
+	putint32(pc->nside, outfile);
+	putint32(pc->nested, outfile);
+	putint32(npix, outfile);
+	putint32(64, outfile);
+	putint32(64 + 4 * npix, outfile);
+	for (k = 28; k < 64; k++) putc(0, outfile);
+
+	if (*(unsigned char *)&one == 0) { /* big endian host */
+		bytes = (unsigned char *)alts;
+		for (k = 0; k < 4 * npix; k += 4) {
+			t = bytes[k]; bytes[k] = bytes[k + 3]; bytes[k + 3] = t;
+			t = bytes[k + 1]; bytes[k + 1] = bytes[k + 2]; bytes[k + 2] = t;
+		}
+	}
+	fwrite(alts, sizeof(float), npix, outfile);
+	fwrite(rgb, 1, 3 * npix, outfile);
+	fclose(outfile);
+	free(alts);
+	free(rgb);
+}
+
+void crossing(int i, int j, int south, double a, double b, int w, int h, double *p) {
+	/* where altitude crosses 0 between sample (i,j) at altitude a and */
+	/* the one east (or south) of it at altitude b, on a grid of w x h */
+	/* samples at longitudes -180 + 360 * i / w and latitudes */
+	/* 90 - 180 * (j + 0.5) / h */
+	double t = a / (a - b);
+	p[0] = -180.0 + 360.0 * (i + (south ? 0.0 : t)) / w;
+	if (p[0] >= 180.0) p[0] -= 360.0;
+	p[1] = 90.0 - 180.0 * (j + 0.5 + (south ? t : 0.0)) / h;
+}
+
+double *growpoints(double *pts, int *npts) { /* double room for points */
+	*npts *= 2;
+	pts = (double*)realloc(pts, 2 * *npts * sizeof(double));
+	if (pts == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	return(pts);
+}
+
+FILE *vectorfile(planetcontext *pc, const char *name, int *svg) { /* open GeoJSON or SVG file */
+	FILE *cf;
+	int n;
+
+	cf = fopen(name, "w");
+	if (cf == NULL) {
+		fprintf(stderr, "Could not open file %s, error code = %d\n", name, errno);
+		exit(1);
+	}
+	n = strlen(name);
+	*svg = n >= 4 && (strcmp(name + n - 4, ".svg") == 0 || strcmp(name + n - 4, ".SVG") == 0);
+	if (*svg) {
+		fprintf(cf, "<?xml version=\"1.0\"?>\n");
+		fprintf(cf, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"-180 -90 360 180\">\n",
+		        pc->Width, pc->Height);
+		fprintf(cf, "<desc>");
+		for (n = 0; pc->cmdLine[n] != '\0'; n++) {
+			if (pc->cmdLine[n] == '<') fprintf(cf, "&lt;");
+			else if (pc->cmdLine[n] == '&') fprintf(cf, "&amp;");
+			else putc(pc->cmdLine[n], cf);
+		}
+		fprintf(cf, "</desc>\n");
+	} else {
+		fprintf(cf, "{\"type\": \"FeatureCollection\",\n\"command\": \"");
+		for (n = 0; pc->cmdLine[n] != '\0'; n++) {
+			if (pc->cmdLine[n] == '"' || pc->cmdLine[n] == '\\') putc('\\', cf);
+			putc(pc->cmdLine[n], cf);
+		}
+		fprintf(cf, "\",\n\"features\": [\n");
+	}
+	return(cf);
+}
+
+void vectorlevel(planetcontext *pc, FILE *cf, int svg, int line, double level, double width, int first) {
+	/* start the lines of one level, numbered as the contour lines of -E */
+	if (svg) {
+		int c = line > 0 && (line - 1) % 2 == 0 ? pc->OUTLINE2 : pc->OUTLINE1;
+		fprintf(cf, "<g fill=\"none\" stroke=\"#%02x%02x%02x\" stroke-width=\"%g\" class=\"level%d\">\n",
+		        pc->rtable[c], pc->gtable[c], pc->btable[c], width, line);
+	} else {
+		fprintf(cf, "%s{\"type\": \"Feature\", \"properties\": {\"level\": %d, \"altitude\": %.6g},\n",
+		        first ? "" : ",\n", line, level);
+		fprintf(cf, "\"geometry\": {\"type\": \"MultiLineString\", \"coordinates\": [\n");
+	}
+}
+
+void contourline(FILE *cf, int svg, double *pts, int n, int *first) { /* write polyline */
+	int k, k0, k1;
+
+	/* lines are cut where they cross longitude 180 */
+	for (k0 = 0; k0 < n; k0 = k) {
+		for (k = k0 + 1; k < n && fabs(pts[2 * k] - pts[2 * k - 2]) < 180.0; k++) ;
+		if (k - k0 < 2) continue;
+		if (svg) {
+			fprintf(cf, "<polyline points=\"");
+		} else {
+			fprintf(cf, *first ? "[" : ",\n[");
+		}
+		*first = 0;
+		for (k1 = k0; k1 < k; k1++) {
+			if (svg) fprintf(cf, "%s%.5f,%.5f", k1 > k0 ? " " : "", pts[2 * k1], -pts[2 * k1 + 1]);
+			else fprintf(cf, "%s[%.5f,%.5f]", k1 > k0 ? "," : "", pts[2 * k1], pts[2 * k1 + 1]);
+		}
+		fprintf(cf, svg ? "\"/>\n" : "]");
+	}
+}
+
+#define CONTOURBAND 64 /* rows of cells contours() traces at a time */
+
+void chainpoints(contourchain *c, double *pts, int n) { /* append points */
+	while (c->n + n > c->size) {
+		c->size = c->size > 0 ? 2 * c->size : 256;
+		c->pts = (double*)realloc(c->pts, 2 * c->size * sizeof(double));
+		if (c->pts == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+	}
+	memcpy(c->pts + 2 * c->n, pts, 2 * n * sizeof(double));
+	c->n += n;
+}
+
+int contourseam(int e, int gw, int band, int above, int below) {
+	/* seam edge i that edge e of a band is on: i above the band, */
+	/* 2 * gw + i below it, or -1 if it is not on a seam */
+	if ((e & 1) != 0) return(-1);
+	e >>= 1;
+	if (above && e < gw) return(e);
+	if (below && e >= (band - 1) * gw) return(2 * gw + e - (band - 1) * gw);
+	return(-1);
+}
+
+void contours(planetcontext *pc) {
+	/* Coastline and contour lines are traced by marching squares on  */
+	/* altitudes sampled at Width x Height longitudes and latitudes   */
+	/* (the columns and rows of them in --window). Crossings are      */
+	/* named by the grid edge they are on, and the cell with the high */
+	/* side of its edge on the left owns it, so the tiles of cells    */
+	/* can be done in parallel and joined afterwards. The grid is     */
+	/* sampled and traced in bands of CONTOURBAND rows, and only the  */
+	/* lines still open at the seam below a band are kept, by the     */
+	/* seam edges they start or end on, to go on in the next band.    */
+	/* Finished lines are spooled to a temporary file per level.      */
+	FILE *cf, **spool;
+	float *alts;
+	int *next, *seam;
+	char *incoming;
+	double *levels, *pts;
+	contourchain *chains;
+	char buf[4096];
+	int *lines, *first, nlevels, nchains, freechain, l, tile, tiles, tilesW, e, e0, i, k, n, npts, svg, j;
+	int x0, y0, gw, gh, cw, r0, r1, band, s, t, c, c2;
+	size_t got;
+	int colourpoint(planetcontext *pc, double x, double y, double z, double *altp);
+	void progresstick(planetcontext *pc, int total);
+	void crossing(int i, int j, int south, double a, double b, int w, int h, double *p);
+	double *growpoints(double *pts, int *npts);
+	FILE *vectorfile(planetcontext *pc, const char *name, int *svg);
+	void vectorlevel(planetcontext *pc, FILE *cf, int svg, int line, double level, double width, int first);
+	void contourline(FILE *cf, int svg, double *pts, int n, int *first);
+	void chainpoints(contourchain *c, double *pts, int n);
+	int contourseam(int e, int gw, int band, int above, int below);
+
+	/* the grid wraps around only if the window has all longitudes */
+	x0 = pc->winX;
+	y0 = pc->winY;
+	gw = pc->winW;
+	gh = pc->winH;
+	cw = gw == pc->Width ? gw : gw - 1; /* cells in a row */
+	if (2.0 * gw * (CONTOURBAND + 1) >= 2147483647.0 || gh < 2 || cw < 1) {
+		fprintf(stderr, "Contours can not be traced on a %d x %d grid\n", gw, gh);
+		exit(1);
+	}
+
+	/* sea level, then the altitudes where the colour crosses contour */
+	/* lines of -E (ignoring -a), numbered as in the map from the coast */
+	nlevels = 1 + pc->contourLines + pc->coastContourLines;
+	levels = (double*)malloc(nlevels * sizeof(double));
+	lines = (int*)malloc(nlevels * sizeof(int));
+	first = (int*)malloc(nlevels * sizeof(int));
+	spool = (FILE**)malloc(nlevels * sizeof(FILE*));
+	/* seam[4 * gw * l + k] is the chain of level l starting (k < gw) or */
+	/* ending (k < 2 * gw) at the seam above the band, and the same for  */
+	/* the seam below it at 2 * gw + k; -1 if none                       */
+	seam = (int*)malloc((size_t)4 * gw * nlevels * sizeof(int));
+	nlevels = 1 + pc->contourLines;
+	alts = (float*)malloc((size_t)(CONTOURBAND + 1) * gw * sizeof(float));
+	next = (int*)malloc((size_t)2 * (CONTOURBAND + 1) * gw * sizeof(int));
+	incoming = (char*)malloc((size_t)2 * (CONTOURBAND + 1) * gw);
+	npts = 1024;
+	pts = (double*)malloc(2 * npts * sizeof(double));
+	nchains = 64;
+	chains = (contourchain*)malloc(nchains * sizeof(contourchain));
+	if (levels == 0 || lines == 0 || first == 0 || spool == 0 || seam == 0 || alts == 0 ||
+	    next == 0 || incoming == 0 || pts == 0 || chains == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	levels[0] = 0.0;
+	lines[0] = 0;
+	for (l = 1; l <= pc->contourLines; l++) {
+		levels[l] = (double)(l * ((pc->HIGHEST - pc->LAND) / (pc->contourLines + 1)))
+		            / (10.0 * (pc->HIGHEST - pc->LAND + 1));
+		lines[l] = l;
+	}
+	for (l = 1; l <= pc->coastContourLines; l++) {
+		levels[nlevels] = (double)(pc->LAND - l * ((pc->LAND - pc->LOWEST) / 20) - pc->SEA)
+		                  / (10.0 * (pc->SEA - pc->LOWEST + 1));
+		lines[nlevels] = -l;
+		if (levels[nlevels] < 0.0) nlevels++; /* else it is the coastline */
+	}
+	for (l = 0; l < nlevels; l++) {
+		first[l] = 1;
+		spool[l] = tmpfile();
+		if (spool[l] == NULL) {
+			fprintf(stderr, "Could not open a temporary file, error code = %d\n", errno);
+			exit(1);
+		}
+	}
+	for (k = 0; k < 4 * gw * nlevels; k++) seam[k] = -1;
+	/* unused chains are linked through end, from freechain */
+	for (c = 0; c < nchains; c++) {
+		chains[c].pts = 0;
+		chains[c].n = chains[c].size = 0;
+		chains[c].end = c + 1 < nchains ? c + 1 : -1;
+	}
+	freechain = 0;
+
+	cf = vectorfile(pc, pc->contourName, &svg);
+
+	/* samples are 1/Height of a half circle apart */
+	Depth = 3 * ((int)(log_2(pc->Height))) + 6;
+	progresstick(pc, 0);
+	tilesW = (cw + 63) / 64;
+	for (r0 = 0; r0 < gh - 1; r0 = r1) {
+		r1 = min(r0 + CONTOURBAND, gh - 1);
+		band = r1 - r0 + 1; /* rows of samples */
+		/* the last row of the band above is the first of this one */
+		if (r0 > 0) memmove(alts, alts + (size_t)CONTOURBAND * gw, gw * sizeof(float));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) copyin(Depth)
+#endif
+		for (j = r0 > 0 ? 1 : 0; j < band; j++) {
+			int i;
+			double lo, la, alt;
+			la = PI * (0.5 - (y0 + r0 + j + 0.5) / pc->Height);
+			for (i = 0; i < gw; i++) {
+				lo = 2.0 * PI * (x0 + i) / pc->Width - PI;
+				/* north is y = -1, longitude is atan2(x,z) */
+				colourpoint(pc, sin(lo) * cos(la), -sin(la), cos(lo) * cos(la), &alt);
+				alts[j * gw + i] = (float)alt;
+			}
+			progresstick(pc, gh);
+		}
+
+		/* edge 2k is from sample k = j * gw + i of the band to the one */
+		/* east of it (wrapping around), edge 2k + 1 to the one south of it */
+		tiles = tilesW * ((band + 62) / 64);
+		for (l = 0; l < nlevels; l++) {
+			double level = levels[l];
+			int *ls = seam + 4 * gw * l;
+
+			for (e = 0; e < 2 * band * gw; e++) next[e] = -1;
+
+			/* each cell links the crossing where its high corners end (going */
+			/* clockwise) to the one where they start, cutting off the high   */
+			/* corners one at a time at saddles */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+			for (tile = 0; tile < tiles; tile++) {
+				int i, j, k, m, in[4], edge[4];
+				for (j = tile / tilesW * 64; j < min(tile / tilesW * 64 + 64, band - 1); j++) {
+					for (i = tile % tilesW * 64; i < min(tile % tilesW * 64 + 64, cw); i++) {
+						/* corners and edges clockwise from the north-west */
+						in[0] = alts[j * gw + i] > level;
+						in[1] = alts[j * gw + (i + 1) % gw] > level;
+						in[2] = alts[(j + 1) * gw + (i + 1) % gw] > level;
+						in[3] = alts[(j + 1) * gw + i] > level;
+						if (in[0] == in[1] && in[1] == in[2] && in[2] == in[3]) continue;
+						edge[0] = 2 * (j * gw + i);
+						edge[1] = 2 * (j * gw + (i + 1) % gw) + 1;
+						edge[2] = 2 * ((j + 1) * gw + i);
+						edge[3] = 2 * (j * gw + i) + 1;
+						for (k = 0; k < 4; k++) {
+							if (!in[k] || in[(k + 1) & 3]) continue;
+							for (m = (k + 3) & 3; in[m] || !in[(m + 1) & 3]; m = (m + 3) & 3) ;
+							next[edge[k]] = edge[m];
+						}
+					}
+				}
+			}
+
+			/* pieces from the edge of the band first, then closed loops */
+			memset(incoming, 0, (size_t)2 * band * gw);
+			for (e = 0; e < 2 * band * gw; e++) {
+				if (next[e] >= 0) incoming[next[e]] = 1;
+			}
+			for (j = 0; j < 2; j++) {
+				for (e0 = 0; e0 < 2 * band * gw; e0++) {
+					if (next[e0] < 0 || (j == 0 && incoming[e0])) continue;
+					n = 0;
+					for (e = t = e0; e >= 0; e = k) {
+						if (n == npts) pts = growpoints(pts, &npts);
+						/* a loop ends where it started, as next[e0] is gone */
+						i = (e >> 1) % gw;
+						k = (e >> 1) / gw;
+						crossing(x0 + i, y0 + r0 + k, e & 1, alts[k * gw + i] - level,
+						         e & 1 ? alts[(k + 1) * gw + i] - level : alts[k * gw + (i + 1) % gw] - level,
+						         pc->Width, pc->Height, pts + 2 * n++);
+						k = next[e];
+						next[e] = -1;
+						t = e;
+					}
+					if (j == 1) {
+						contourline(spool[l], svg, pts, n, &first[l]);
+						continue;
+					}
+
+					/* a piece from the seam above goes on with the chain */
+					/* ending there, else it starts a chain */
+					s = contourseam(e0, gw, band, r0 > 0, r1 < gh - 1);
+					if (s >= 0 && s < gw) {
+						c = ls[gw + s];
+						ls[gw + s] = -1;
+						chainpoints(&chains[c], pts + 2, n - 1);
+					} else {
+						if (freechain < 0) {
+							chains = (contourchain*)realloc(chains, 2 * nchains * sizeof(contourchain));
+							if (chains == 0) {
+								fprintf(stderr, "Memory allocation failed.");
+								exit(1);
+							}
+							for (c = nchains; c < 2 * nchains; c++) {
+								chains[c].pts = 0;
+								chains[c].n = chains[c].size = 0;
+								chains[c].end = c + 1 < 2 * nchains ? c + 1 : -1;
+							}
+							freechain = nchains;
+							nchains *= 2;
+						}
+						c = freechain;
+						freechain = chains[c].end;
+						chains[c].n = 0;
+						chainpoints(&chains[c], pts, n);
+						chains[c].start = s;
+						if (s >= 0) ls[s] = c;
+					}
+
+					/* a piece into the seam above joins the chain starting */
+					/* there, which closes it if that is the same chain */
+					s = contourseam(t, gw, band, r0 > 0, r1 < gh - 1);
+					if (s >= 0 && s < gw) {
+						c2 = ls[s];
+						ls[s] = -1;
+						if (c2 == c) {
+							chains[c].start = chains[c].end = -1;
+						} else {
+							chainpoints(&chains[c], chains[c2].pts + 2, chains[c2].n - 1);
+							chains[c].end = chains[c2].end;
+							if (chains[c].end >= 0) ls[chains[c].end] = c;
+							free(chains[c2].pts);
+							chains[c2].pts = 0;
+							chains[c2].n = chains[c2].size = 0;
+							chains[c2].end = freechain;
+							freechain = c2;
+						}
+					} else {
+						chains[c].end = s >= 0 ? gw + s : -1;
+						if (s >= 0) ls[gw + s] = c;
+					}
+					if (chains[c].start < 0 && chains[c].end < 0) {
+						contourline(spool[l], svg, chains[c].pts, chains[c].n, &first[l]);
+						free(chains[c].pts);
+						chains[c].pts = 0;
+						chains[c].n = chains[c].size = 0;
+						chains[c].end = freechain;
+						freechain = c;
+					}
+				}
+			}
+
+			/* the seam below is the one above the next band */
+			for (k = 0; k < 2 * gw; k++) {
+				c = ls[k] = ls[2 * gw + k];
+				ls[2 * gw + k] = -1;
+				if (c >= 0 && k < gw) chains[c].start = k;
+				else if (c >= 0) chains[c].end = k;
+			}
+		}
+	}
+
+	for (l = 0; l < nlevels; l++) {
+		vectorlevel(pc, cf, svg, lines[l], levels[l], 180.0 / pc->Height, l == 0);
+		rewind(spool[l]);
+		while ((got = fread(buf, 1, sizeof(buf), spool[l])) > 0) fwrite(buf, 1, got, cf);
+		fclose(spool[l]);
+		fprintf(cf, svg ? "</g>\n" : "]}}");
+	}
+	fprintf(cf, svg ? "</svg>\n" : "\n]}\n");
+	fclose(cf);
+	free(levels);
+	free(lines);
+	free(first);
+	free(spool);
+	free(seam);
+	free(alts);
+	free(next);
+	free(incoming);
+	free(pts);
+	for (c = 0; c < nchains; c++) free(chains[c].pts);
+	free(chains);
+}
+
+coastentry *coastfind(coasttable *t, int i, int j) { /* entry of (i,j) */
+	unsigned long h;
+	long k;
+
+	if (2 * (t->count + 1) > t->size) { /* keep table at most half full */
+		coastentry *old = t->e;
+		long n = t->size;
+		t->size = n > 0 ? 2 * n : 4096;
+		t->e = (coastentry*)malloc(t->size * sizeof(coastentry));
+		if (t->e == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+		for (k = 0; k < t->size; k++) t->e[k].i = -1;
+		t->count = 0;
+		for (k = 0; k < n; k++) {
+			if (old[k].i >= 0) *coastfind(t, old[k].i, old[k].j) = old[k];
+		}
+		free(old);
+	}
+	h = ((unsigned long)i * 2654435761UL) ^ ((unsigned long)j * 40503UL);
+	for (k = h % t->size; t->e[k].i >= 0; k = (k + 1) % t->size) {
+		if (t->e[k].i == i && t->e[k].j == j) return(&t->e[k]);
+	}
+	t->e[k].i = i;
+	t->e[k].j = j;
+	t->e[k].alt = 1e30f; /* new */
+	t->e[k].checked = 0;
+	t->count++;
+	return(&t->e[k]);
+}
+
+double coastalt(planetcontext *pc, coasttable *t, int i, int j, int w, int h) { /* altitude of sample */
+	coastentry *e;
+	double lo, la, alt;
+	int colourpoint(planetcontext *pc, double x, double y, double z, double *altp);
+	coastentry *coastfind(coasttable *t, int i, int j);
+
+	i = (i % w + w) % w;
+	e = coastfind(t, i, j);
+	if (e->alt == 1e30f) {
+		la = PI * (0.5 - (j + 0.5) / h);
+		lo = 2.0 * PI * i / w - PI;
+		colourpoint(pc, sin(lo) * cos(la), -sin(la), cos(lo) * cos(la), &alt);
+		e->alt = (float)alt;
+	}
+	return(e->alt);
+}
+
+int coaststep(planetcontext *pc, coasttable *t, int *i, int *j, int *d, int forward, int w, int h) {
+	/* move to the next (or previous) edge crossing the coastline, as in */
+	/* contours(); returns 0 if the line leaves the grid */
+	int ci, cj, k, m, in[4];
+	double a, b;
+	double coastalt(planetcontext *pc, coasttable *t, int i, int j, int w, int h);
+
+	a = coastalt(pc, t, *i, *j, w, h);
+	b = *d ? coastalt(pc, t, *i, *j + 1, w, h) : coastalt(pc, t, *i + 1, *j, w, h);
+	/* the cell with the edge going from land to sea, or sea to land */
+	if (*d == 0) {
+		ci = *i;
+		if ((forward ? a : b) > 0.0) {cj = *j; k = 0;} else {cj = *j - 1; k = 2;}
+	} else {
+		cj = *j;
+		if ((forward ? b : a) > 0.0) {ci = *i; k = 3;} else {ci = *i - 1; k = 1;}
+	}
+	if (cj < 0 || cj >= h - 1) return(0);
+	in[0] = coastalt(pc, t, ci, cj, w, h) > 0.0;
+	in[1] = coastalt(pc, t, ci + 1, cj, w, h) > 0.0;
+	in[2] = coastalt(pc, t, ci + 1, cj + 1, w, h) > 0.0;
+	in[3] = coastalt(pc, t, ci, cj + 1, w, h) > 0.0;
+	if (forward) {
+		for (m = (k + 3) & 3; in[m] || !in[(m + 1) & 3]; m = (m + 3) & 3) ;
+	} else {
+		for (m = (k + 1) & 3; !in[m] || in[(m + 1) & 3]; m = (m + 1) & 3) ;
+	}
+	*i = ((m == 1 ? ci + 1 : ci) % w + w) % w;
+	*j = m == 2 ? cj + 1 : cj;
+	*d = m & 1;
+	return(1);
+}
+
+#define COASTTICK 10 /* level of the subdivision coast() counts progress at */
+
+int coastsimplify(double *pts, int n, double tol) {
+	/* drop the points of a polyline that stay within tol degrees of the */
+	/* chord between the points kept, so the step between points grows  */
+	/* where the line is straight and shrinks where it bends. Each point */
+	/* after the last one kept narrows the cone of directions from it   */
+	/* that pass within tol of them all, and the point before one that  */
+	/* is outside the cone (or turns back) is kept. Returns points left */
+	double ax, ay, px, py, x = 0.0, y = 0.0, dx, dy, d, ang, wide, far = 0.0, lo = 0.0, hi = 0.0, ref = 0.0;
+	int k, m = 1, a = 0, open = 0;
+
+	if (n <= 2) return(n);
+	ax = px = pts[0];
+	ay = py = pts[1];
+	for (k = 1; k < n; k++, px = x, py = y) {
+		x = pts[2 * k];
+		y = pts[2 * k + 1];
+		if (k == n - 1 || fabs(x - px) >= 180.0) {
+			/* keep the end, and both sides of a cut by contourline() */
+			if (a < k - 1) {
+				pts[2 * m] = px;
+				pts[2 * m + 1] = py;
+				m++;
+			}
+			pts[2 * m] = ax = x;
+			pts[2 * m + 1] = ay = y;
+			m++;
+			a = k;
+			open = 0;
+			continue;
+		}
+		dx = (x - ax) * cos(ay * DEG2RAD);
+		dy = y - ay;
+		d = sqrt(dx * dx + dy * dy);
+		ang = atan2(dy, dx) - ref;
+		if (ang > PI) ang -= 2.0 * PI;
+		if (ang < -PI) ang += 2.0 * PI;
+		if (open && (d < far || (d > tol && (ang < lo || ang > hi)))) {
+			pts[2 * m] = ax = px;
+			pts[2 * m + 1] = ay = py;
+			m++;
+			a = k - 1;
+			open = 0;
+			dx = (x - ax) * cos(ay * DEG2RAD);
+			dy = y - ay;
+			d = sqrt(dx * dx + dy * dy);
+		}
+		if (d <= tol) continue;
+		wide = asin(tol / d);
+		if (!open) {
+			ref = atan2(dy, dx);
+			lo = -wide;
+			hi = wide;
+			far = d;
+			open = 1;
+		} else {
+			if (ang - wide > lo) lo = ang - wide;
+			if (ang + wide < hi) hi = ang + wide;
+			if (d > far) far = d;
+		}
+	}
+	return(m);
+}
+
+void coastfrom(planetcontext *pc, coasttracer *c, int i, int j, int d) {
+	/* trace and write the line through the crossing on edge d of fine */
+	/* sample (i,j) (as in contours()), unless it is traced already    */
+	int si, sj, sd, n, loop;
+	double a, b;
+	double coastalt(planetcontext *pc, coasttable *t, int i, int j, int w, int h);
+	int coaststep(planetcontext *pc, coasttable *t, int *i, int *j, int *d, int forward, int w, int h);
+	coastentry *coastfind(coasttable *t, int i, int j);
+	void crossing(int i, int j, int south, double a, double b, int w, int h, double *p);
+	double *growpoints(double *pts, int *npts);
+	void contourline(FILE *cf, int svg, double *pts, int n, int *first);
+	int coastsimplify(double *pts, int n, double tol);
+
+	if (coastfind(&c->seen, 2 * i + d, j)->alt == 0.0f) return;
+
+	/* go back to where the line starts, or once round a loop */
+	si = i; sj = j; sd = d;
+	while (coaststep(pc, &c->alts, &i, &j, &d, 0, c->w, c->h) && (i != si || j != sj || d != sd)) ;
+	si = i; sj = j; sd = d;
+
+	n = 0;
+	do {
+		if (n == c->npts) c->pts = growpoints(c->pts, &c->npts);
+		a = coastalt(pc, &c->alts, i, j, c->w, c->h);
+		b = d ? coastalt(pc, &c->alts, i, j + 1, c->w, c->h) : coastalt(pc, &c->alts, i + 1, j, c->w, c->h);
+		crossing(i, j, d, a, b, c->w, c->h, c->pts + 2 * n++);
+		coastfind(&c->seen, 2 * i + d, j)->alt = 0.0f;
+		loop = coaststep(pc, &c->alts, &i, &j, &d, 1, c->w, c->h);
+	} while (loop && (i != si || j != sj || d != sd));
+	if (loop) { /* back at the start */
+		if (n == c->npts) c->pts = growpoints(c->pts, &c->npts);
+		c->pts[2 * n] = c->pts[0];
+		c->pts[2 * n + 1] = c->pts[1];
+		n++;
+	}
+	n = coastsimplify(c->pts, n, 0.25 * pc->coastRes);
+	contourline(c->cf, c->svg, c->pts, n, &c->first);
+}
+
+void coasttetra(planetcontext *pc, coasttracer *c, vertex *t, int n) {
+	/* go down the subdivision from tetrahedron t at level n, leaving out */
+	/* the halves whose altitude bounds rule out both land and sea, and  */
+	/* trace from the crossings of the fine grid around the tetrahedra   */
+	/* as small as a fine cell (or at Depth)                             */
+	vertex o[5], half[4];
+	double l = 0.0, cell, lo0, lo, la, lomin, lomax, lamin, lamax, r;
+	int k, i, j, i0, i1, j0, j1;
+	double reliefbound(planetcontext *pc, vertex *t, int levels);
+	int tetrasphere(vertex *t);
+	void splittetra(planetcontext *pc, vertex *t, vertex *o, vertex *e, double x, double y, double z);
+	void halftetra(vertex *o, vertex *e, int first, vertex *t);
+	double coastalt(planetcontext *pc, coasttable *t, int i, int j, int w, int h);
+	void coastfrom(planetcontext *pc, coasttracer *c, int i, int j, int d);
+	coastentry *coastfind(coasttable *t, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	if (tetrasphere(t)) {
+		/* the lowest altitude is minus the highest of t upside down */
+		for (k = 0; k < 4; k++) half[k] = t[k], half[k].h = -t[k].h;
+		if (reliefbound(pc, t, Depth - n) > 0.0 && reliefbound(pc, half, Depth - n) >= 0.0) {
+			for (k = 0; k < 4; k++) {
+				for (i = k + 1; i < 4; i++) {
+					if (dist2(t[k], t[i]) > l) l = dist2(t[k], t[i]);
+				}
+			}
+			cell = PI / c->h;
+			if (l > cell * cell && n < Depth) {
+				splittetra(pc, t, o, o + 4, 0.0, 0.0, 0.0); /* rain shadow of e is not used */
+				for (k = 0; k < 2; k++) {
+					halftetra(o, o + 4, k == 0, half);
+					coasttetra(pc, c, half, n + 1);
+				}
+				if (n == COASTTICK) progresstick(pc, 1 << COASTTICK);
+				return;
+			}
+
+			/* longitudes and latitudes of the corners, around the */
+			/* one of the first corner                              */
+			lo0 = atan2(t[0].x, t[0].z);
+			lomin = lomax = lo0;
+			lamin = lamax = 0.0;
+			for (k = 0; k < 4; k++) {
+				r = sqrt(t[k].x * t[k].x + t[k].y * t[k].y + t[k].z * t[k].z);
+				la = asin(-t[k].y / r);
+				lo = atan2(t[k].x, t[k].z) - lo0;
+				if (lo > PI) lo -= 2.0 * PI;
+				if (lo < -PI) lo += 2.0 * PI;
+				lo += lo0;
+				if (lo < lomin) lomin = lo;
+				if (lo > lomax) lomax = lo;
+				if (k == 0 || la < lamin) lamin = la;
+				if (k == 0 || la > lamax) lamax = la;
+			}
+			j0 = max(0, (int)floor((0.5 - lamax / PI) * c->h - 0.5) - 1);
+			j1 = min(c->h - 1, (int)ceil((0.5 - lamin / PI) * c->h - 0.5));
+			if (lamax > 0.5 * PI - 4.0 * cell || lamin < -0.5 * PI + 4.0 * cell) {
+				i0 = 0; /* all longitudes meet at the pole */
+				i1 = c->w - 1;
+			} else {
+				i0 = (int)floor((lomin + PI) * c->w / (2.0 * PI)) - 1;
+				i1 = (int)ceil((lomax + PI) * c->w / (2.0 * PI));
+			}
+			/* the edges east and south of the samples in it and */
+			/* a sample more to the west and north */
+			for (j = j0; j <= j1; j++) {
+				for (i = i0; i <= i1; i++) {
+					int ii = (i % c->w + c->w) % c->w;
+					double a;
+					coastentry *e = coastfind(&c->alts, ii, j);
+					if (e->checked) continue;
+					e->checked = 1;
+					a = coastalt(pc, &c->alts, ii, j, c->w, c->h);
+					if ((a > 0.0) != (coastalt(pc, &c->alts, ii + 1, j, c->w, c->h) > 0.0)) coastfrom(pc, c, ii, j, 0);
+					if (j < c->h - 1 && (a > 0.0) != (coastalt(pc, &c->alts, ii, j + 1, c->w, c->h) > 0.0))
+						coastfrom(pc, c, ii, j, 1);
+				}
+			}
+		}
+	}
+	/* count the ticks of the levels left out */
+	for (k = n <= COASTTICK ? 1 << (COASTTICK - n) : 0; k > 0; k--) progresstick(pc, 1 << COASTTICK);
+}
+
+void coast(planetcontext *pc) {
+	/* The coastline is followed cell by cell on a fine grid of longitudes */
+	/* and latitudes coastRes degrees apart, computing only the samples    */
+	/* next to it, so the work is proportional to the length of the coast. */
+	/* Lines are started by going down the subdivision of planet() only as */
+	/* far as reliefbound() allows both land and sea, down to tetrahedra   */
+	/* the size of a fine cell, so no island or lake that crosses the fine */
+	/* grid is missed. The bound does not hold for the altitudes of -M,    */
+	/* --master, -t or -r, so then every fine sample on the lines of the   */
+	/* coarse grid of Width x Height samples is looked at instead, missing */
+	/* what falls between them. Each line is simplified to within a       */
+	/* quarter of coastRes and written as soon as it is done.              */
+	coasttracer c = {{NULL, 0, 0}, {NULL, 0, 0}, NULL, NULL, 0, 0, 1, 0, 0};
+	float *line;
+	int K, ci, cj, n, d;
+	void coasttetra(planetcontext *pc, coasttracer *c, vertex *t, int n);
+	void coastfrom(planetcontext *pc, coasttracer *c, int i, int j, int d);
+	int colourpoint(planetcontext *pc, double x, double y, double z, double *altp);
+	double reliefslack(planetcontext *pc);
+	void progresstick(planetcontext *pc, int total);
+	FILE *vectorfile(planetcontext *pc, const char *name, int *svg);
+	void vectorlevel(planetcontext *pc, FILE *cf, int svg, int line, double level, double width, int first);
+
+	c.h = (int)(180.0 / pc->coastRes + 0.5);
+	c.w = 2 * c.h;
+	Depth = 3 * ((int)(log_2(c.h))) + 6;
+
+	c.npts = 1024;
+	c.pts = (double*)malloc(2 * c.npts * sizeof(double));
+	line = (float*)malloc(c.w * sizeof(float));
+	if (c.pts == 0 || line == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	c.cf = vectorfile(pc, pc->coastName, &c.svg);
+	vectorlevel(pc, c.cf, c.svg, 0, 0.0, 180.0 / pc->Height, 1);
+
+	progresstick(pc, 0);
+	if (!pc->matchMap && pc->masterAlt == NULL && !pc->temperature && !pc->rainfall) {
+		pc->reliefSlack = reliefslack(pc);
+		coasttetra(pc, &c, pc->tetra, 0);
+	} else {
+		/* the coarse grid uses every K'th row and column of the fine grid */
+		K = max(1, c.h / max(1, pc->Height));
+		for (d = 0; d < 2; d++) {
+			for (cj = 0; cj * K < (d ? c.w : c.h); cj++) {
+				/* samples of a coarse row (or column), then the */
+				/* crossings between them */
+				n = d ? c.h : c.w;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) copyin(Depth)
+#endif
+				for (ci = 0; ci < n; ci++) {
+					int i = d ? cj * K : ci, j = d ? ci : cj * K;
+					double lo, la, alt;
+					la = PI * (0.5 - (j + 0.5) / c.h);
+					lo = 2.0 * PI * i / c.w - PI;
+					colourpoint(pc, sin(lo) * cos(la), -sin(la), cos(lo) * cos(la), &alt);
+					line[ci] = (float)alt; /* as coastalt() */
+				}
+				for (ci = 0; ci < (d ? n - 1 : n); ci++) {
+					if ((line[ci] > 0.0f) != (line[(ci + 1) % n] > 0.0f)) {
+						if (d) coastfrom(pc, &c, cj * K, ci, 1);
+						else coastfrom(pc, &c, ci, cj * K, 0);
+					}
+				}
+				progresstick(pc, (c.h + K - 1) / K + (c.w + K - 1) / K);
+			}
+		}
+	}
+	fprintf(c.cf, c.svg ? "</g>\n</svg>\n" : "]}}\n]}\n");
+	fclose(c.cf);
+	fprintf(stderr, "\n%ld altitudes computed for the coastline", c.alts.count);
+	free(c.alts.e);
+	free(c.seen.e);
+	free(c.pts);
+	free(line);
+}
+
+void gnomonic(planetcontext *pc) {
+	double x, y, z, x1, y1, z1, zz;
+	int i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	if (pc->scale < 1.0) {
+		Depth = 3 * ((int)(log_2(pc->scale * pc->Height))) + 6 + 1.5 / pc->scale;
+	}
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, z, x1, y1, z1, zz) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+			x = (2.0 * i - pc->Width) / pc->Height / pc->scale;
+			y = (2.0 * j - pc->Height) / pc->Height / pc->scale;
+			zz = sqrt(1.0 / (1.0 + x * x + y * y));
+			x = x * zz;
+			y = y * zz;
+			z = sqrt(1.0 - x * x - y * y);
+			x1 = pc->clo * x + pc->slo * pc->sla * y + pc->slo * pc->cla * z;
+			y1 = pc->cla * y - pc->sla * z;
+			z1 = -pc->slo * x + pc->clo * pc->sla * y + pc->clo * pc->cla * z;
+			planet0(pc, x1, y1, z1, i, j);
+		}
+	}
+}
+
+void azimuth(planetcontext *pc) {
+	double x, y, z, x1, y1, z1, zz;
+	int i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, z, x1, y1, z1, zz) copyin(Depth)
+#endif
+	for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+		progresstick(pc, pc->planeH);
+		for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+			x = (2.0 * i - pc->Width) / pc->Height / pc->scale;
+			y = (2.0 * j - pc->Height) / pc->Height / pc->scale;
+			zz = x * x + y * y;
+			z = 1.0 - 0.5 * zz;
+			if (z < -1.0) {
+				background(pc, i, j);
+			} else {
+				zz = sqrt(1.0 - 0.25 * zz);
+				x = x * zz;
+				y = y * zz;
+				x1 = pc->clo * x + pc->slo * pc->sla * y + pc->slo * pc->cla * z;
+				y1 = pc->cla * y - pc->sla * z;
+				z1 = -pc->slo * x + pc->clo * pc->sla * y + pc->clo * pc->cla * z;
+				planet0(pc, x1, y1, z1, i, j);
+			}
+		}
+	}
+}
+
+void conical(planetcontext *pc) {
+	double k1, c, y2, x, y, zz, theta1, theta2, cos2;
+	int i, j;
+	void planet0(planetcontext *pc, double x, double y, double z, int i, int j);
+	void progresstick(planetcontext *pc, int total);
+
+	if (pc->scale < 1.0) {
+		Depth = 3 * ((int)(log_2(pc->scale * pc->Height))) + 6 + 1.5 / pc->scale;
+	}
+	if (pc->lat > 0) {
+		k1 = 1.0 / sin(pc->lat);
+		c = k1 * k1;
+		y2 = sqrt(c * (1.0 - sin(pc->lat / k1)) / (1.0 + sin(pc->lat / k1)));
+		progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, zz, theta1, theta2, cos2) copyin(Depth)
+#endif
+		for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+			progresstick(pc, pc->planeH);
+			for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+				x = (2.0 * i - pc->Width) / pc->Height / pc->scale;
+				y = (2.0 * j - pc->Height) / pc->Height / pc->scale + y2;
+				zz = x * x + y * y;
+				if (zz == 0.0) {
+					theta1 = 0.0;
+				} else {
+					theta1 = k1 * atan2(x, y);
+				}
+				if (theta1 < -PI || theta1 > PI) {
+					background(pc, i, j);
+				} else {
+					theta1 += pc->longi - 0.5 * PI; /* theta1 is longitude */
+					theta2 = k1 * asin((zz - c) / (zz + c)); /* theta2 is latitude */
+					if (theta2 > 0.5 * PI || theta2 < -0.5 * PI) {
+						background(pc, i, j);
+					} else {
+						cos2 = cos(theta2);
+						y = sin(theta2);
+						planet0(pc, cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
+					}
+				}
+			}
+		}
+	} else {
+		k1 = 1.0 / sin(pc->lat);
+		c = k1 * k1;
+		y2 = sqrt(c * (1.0 - sin(pc->lat / k1)) / (1.0 + sin(pc->lat / k1)));
+		progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i, x, y, zz, theta1, theta2, cos2) copyin(Depth)
+#endif
+		for (j = pc->planeY; j < pc->planeY + pc->planeH; j++) {
+			progresstick(pc, pc->planeH);
+			for (i = pc->planeX; i < pc->planeX + pc->planeW; i++) {
+				x = (2.0 * i - pc->Width) / pc->Height / pc->scale;
+				y = (2.0 * j - pc->Height) / pc->Height / pc->scale - y2;
+				zz = x * x + y * y;
+				if (zz == 0.0) {
+					theta1 = 0.0;
+				} else {
+					theta1 = -k1*atan2(x, -y);
+				}
+				if (theta1 < -PI || theta1 > PI) {
+					background(pc, i, j);
+				} else {
+					theta1 += pc->longi - 0.5 * PI; /* theta1 is longitude */
+					theta2 = k1 * asin((zz - c) / (zz + c)); /* theta2 is latitude */
+					if (theta2 > 0.5 * PI || theta2 < -0.5 * PI) {
+						background(pc, i, j);
+					} else {
+						cos2 = cos(theta2);
+						y = sin(theta2);
+						planet0(pc, cos(theta1) * cos2, y, -sin(theta1) * cos2, i, j);
+					}
+				}
+			}
+		}
+	}
+}
+
+double rand2(double p, double q) {
+	/* random number generator taking two seeds */
+	/* rand2(p,q) = rand2(q,p) is important     */
+	double r;
+	r = (p + 3.14159265) * (q + 3.14159265);
+	return(2. * (r - (int)r) - 1.);
+}
+
+void planet0(planetcontext *pc, double x, double y, double z, int i, int j) {
+	double alt;
+	double planet1(planetcontext *pc, double x, double y, double z),
+	       planetpath(planetcontext *pc, double x, double y, double z),
+	       mastersample(planetcontext *pc, double x, double y, double z),
+	       climateshadow(planetcontext *pc, double x, double y, double z);
+	int colourpoint(planetcontext *pc, double x, double y, double z, double *altp);
+	unsigned short gridcell(double a, double grid, unsigned short nan);
+	int colour;
+
+	i -= pc->planeX; /* (i,j) are map coordinates, the arrays only hold the plane */
+	j -= pc->planeY;
+
+	if (pc->erodeAlt != NULL && x == x && y == y && z == z) { /* coloured by erode() */
+		size_t k = (size_t)i * pc->planeH + j;
+		pc->erodeAlt[k] = pc->masterAlt != NULL ? mastersample(pc, x, y, z) :
+		              pc->superN > 1 ? planetpath(pc, x, y, z) : planet1(pc, x, y, z);
+		pc->erodeShadow[k] = pc->climateGrid != NULL ? climateshadow(pc, x, y, z) : rainShadow;
+		pc->erodeY[k] = y;
+	} else {
+		colour = colourpoint(pc, x, y, z, &alt);
+
+		/* store height for heightfield (or --mips) */
+		if (pc->heights != NULL) {pc->heights[i][j] = 10000000 * alt;}
+		if (pc->altPlane != NULL) {pc->altPlane[(size_t)i * pc->planeH + j] = alt;}
+
+		/* store colour */
+		pc->col[i][j] = colour;
+	}
+
+	/* store grid cells for grid drawing */
+	if (pc->vgrid != 0.0) {
+		pc->lonCells[i][j] = gridcell(atan2(x, z), pc->vgrid, 0x7fff) | (fabs(y) == 1.0 ? 0x8000 : 0);
+	}
+	if (pc->hgrid != 0.0) {pc->latCells[i][j] = gridcell(asin(y), pc->hgrid, 0xffff);}
+	/* store point for distances in km and areas, unless rounding at */
+	/* the rim of the globe made it NaN */
+	if (pc->globePos != NULL && x == x && y == y && z == z) {
+		float *p = pc->globePos + 3 * ((size_t)i * pc->planeH + j);
+		p[0] = x;
+		p[1] = y;
+		p[2] = z;
+	}
+	/* store shading info */
+	if (pc->doshade > 0) {pc->shades[i][j] = shade;}
+}
+
+int colourpoint(planetcontext *pc, double x, double y, double z, double *altp) { /* colour of point on globe */
+	double alt;
+	double planet1(planetcontext *pc, double x, double y, double z),
+	       planetpath(planetcontext *pc, double x, double y, double z),
+	       mastersample(planetcontext *pc, double x, double y, double z),
+	       climateshadow(planetcontext *pc, double x, double y, double z);
+	int altcolour(planetcontext *pc, double y, double alt, double shadow, double *altp);
+
+	alt = pc->masterAlt != NULL ? mastersample(pc, x, y, z) :
+	      pc->superN > 1 ? planetpath(pc, x, y, z) : planet1(pc, x, y, z);
+	return(altcolour(pc, y, alt, pc->climateGrid != NULL ? climateshadow(pc, x, y, z) : rainShadow, altp));
+}
+
+double capacity(double temp) { /* water air can hold at temperature temp */
+	double t = 300.0 * temp; /* in degrees Celsius, as in altcolour() */
+
+	return(exp(17.67 * t / (t + 243.5))); /* Magnus formula */
+}
+
+void climate(planetcontext *pc) {
+	/* Moisture carried by the prevailing winds, on a grid of climateRows */
+	/* latitudes and twice as many longitudes. The winds blow along the   */
+	/* latitude circles, from the east within 30 degrees of the equator   */
+	/* and beyond 60, and from the west in between, so each row is swept  */
+	/* on its own, twice round so the start does not matter. Over sea the */
+	/* air takes up water towards 80% of what it can hold; over land it   */
+	/* rains out at a rate per radian, and when lifted onto high, colder  */
+	/* ground it loses what it can no longer hold, so the lee of          */
+	/* mountains is dry. The moisture relative to air at sea level stands */
+	/* in for the rain shadow of planet(), which is then not computed.    */
+	int w = 2 * pc->climateRows, h = pc->climateRows, j, depth = Depth;
+	float *alts;
+	double planet1(planetcontext *pc, double x, double y, double z), capacity(double temp);
+	void progresstick(planetcontext *pc, int total);
+
+	pc->climateGrid = (float*)malloc((size_t)w * h * sizeof(float));
+	alts = (float*)malloc((size_t)w * h * sizeof(float));
+	if (pc->climateGrid == 0 || alts == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	Depth = 3 * ((int)(log_2(h))) + 6;
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) copyin(Depth)
+#endif
+	for (j = 0; j < h; j++) {
+		int i, k, step;
+		double la = PI * (0.5 - (j + 0.5) / h), lo, sun, d, q, c, a;
+		for (i = 0; i < w; i++) {
+			lo = 2.0 * PI * i / w - PI;
+			alts[(size_t)j * w + i] = planet1(pc, sin(lo) * cos(la), -sin(la), cos(lo) * cos(la));
+		}
+		sun = cos(la);
+		d = 2.0 * PI * sun / w; /* radians from one point to the next */
+		step = fabs(la) < PI / 6.0 || fabs(la) > PI / 3.0 ? w - 1 : 1; /* easterlies go west */
+		q = 0.8 * capacity(sun / 8.0);
+		for (k = 0, i = 0; k < 2 * w; k++, i = (i + step) % w) {
+			a = alts[(size_t)j * w + i];
+			c = capacity(a > 0.0 ? sun / 8.0 - a * 1.2 : sun / 8.0);
+			if (a <= 0.0) q += (0.8 * c - q) * (1.0 - exp(-10.0 * d));
+			else q *= exp(-2.0 * d);
+			if (q > c) q = c;
+			/* 0.8 of sea level is 1, dry air is -1.5 */
+			pc->climateGrid[(size_t)j * w + i] = (float)(2.5 * q / (0.8 * capacity(sun / 8.0)) - 1.5);
+		}
+		progresstick(pc, h);
+	}
+	free(alts);
+	Depth = depth;
+}
+
+double climateshadow(planetcontext *pc, double x, double y, double z) { /* climateGrid at point */
+	double u, v;
+	int i0, i1, j0, j1, w = 2 * pc->climateRows, h = pc->climateRows;
+
+	if (x != x || y != y || z != z) return(0.0); /* rounding at edge of globe can give NaN */
+	if (y < -1.0) y = -1.0;
+	if (y > 1.0) y = 1.0;
+	u = (atan2(x, z) + PI) / (2.0 * PI) * w;
+	v = (0.5 + asin(y) / PI) * h - 0.5; /* north is y = -1 */
+	if (v < 0.0) v = 0.0;
+	if (v > h - 1) v = h - 1;
+	i0 = (int)floor(u);
+	j0 = (int)v;
+	u -= i0;
+	v -= j0;
+	i0 = (i0 % w + w) % w;
+	if (i0 < 0 || i0 > w - 1) i0 = 0;
+	i1 = (i0 + 1) % w;
+	j1 = j0 + 1 < h ? j0 + 1 : j0;
+	return((1.0 - v) * ((1.0 - u) * pc->climateGrid[(size_t)j0 * w + i0] + u * pc->climateGrid[(size_t)j0 * w + i1]) +
+	       v * ((1.0 - u) * pc->climateGrid[(size_t)j1 * w + i0] + u * pc->climateGrid[(size_t)j1 * w + i1]));
+}
+
+int altcolour(planetcontext *pc, double y, double alt, double shadow, double *altp) {
+	/* colour of point at altitude alt and rain shadow shadow */
+	double y2, sun, temp, rain;
+	int colour;
+
+	/* calculate temperature based on altitude and latitude */
+	/* scale: -0.1 to 0.1 corresponds to -30 to +30 degrees Celsius */
+	sun = sqrt(1.0 - y * y); /* approximate amount of sunlight at latitude ranged from 0.1 to 1.1 */
+	if (alt < 0) {
+		temp = sun / 8.0 + alt * 0.3; /* deep water colder */
+	} else {
+		temp = sun / 8.0 - alt * 1.2; /* high altitudes colder */
+	}
+	if (temp < tempMin && alt > 0) {tempMin = temp;}
+	if (temp > tempMax && alt > 0) {tempMax = temp;}
+	if (pc->temperature) {alt = temp - 0.05;}
+
+	/* calculate rainfall based on temperature and latitude */
+	/* rainfall approximately proportional to temperature but reduced near
+	   horse latitudes (+/- 30 degrees, y=0.5) and reduced for rain shadow */
+	y2 = fabs(y) - 0.5;
+	rain = temp * 0.65 + 0.1 - 0.011 / (y2 * y2 + 0.1);
+	rain += 0.03 * shadow;
+	if (rain < 0.0) {rain = 0.0;}
+	if (rain < rainMin && alt > 0) {rainMin = rain;}
+	if (rain > rainMax && alt > 0) {rainMax = rain;}
+	if (pc->rainfall) {alt = rain - 0.02;}
+	/* non-linear scaling to make flatter near sea level */
+	if (pc->nonLinear) {alt = alt * alt * alt * 300;}
+
+	/* altitude as stored for heightfield */
+	*altp = alt;
+
+	y2 = y * y;
+	y2 = y2 * y2;
+	y2 = y2 * y2;
+
+	/* calculate colour */
+
+	if (pc->makeBiomes) { /* make biome colours */
+		int tt = min(44, max(0, (int)(rain * 300.0 - 9)));
+		int rr = min(44, max(0, (int)(temp * 300.0 + 10)));
+		char bio = biomes[tt][rr];
+		if (alt <= 0.0) {
+			colour = pc->SEA + (int)((pc->SEA - pc->LOWEST + 1) * (10 * alt));
+			if (colour < pc->LOWEST) colour = pc->LOWEST;
+		} else {
+			colour = bio - 64 + pc->LAND; /* from LAND+2 to LAND+23 */
+		}
+	} else if (alt <= 0.0) { /* if below sea level then */
+		if (pc->latic > 0 && y2 + alt >= 1.0 - 0.02 * pc->latic * pc->latic) {
+			colour = pc->HIGHEST; /* icecap if close to poles */
+		} else {
+			colour = pc->SEA + (int)((pc->SEA - pc->LOWEST + 1) * (10 * alt));
+			if (colour < pc->LOWEST) {colour = pc->LOWEST;}
+		}
+	} else {
+		if (pc->latic) {alt += 0.1 * pc->latic * y2;} /* altitude adjusted with latitude */
+		if (alt >= 0.1) { /* if high then */
+			colour = pc->HIGHEST;
+		} else {
+			colour = pc->LAND + (int)((pc->HIGHEST - pc->LAND + 1) * (10 * alt));
+			if (colour > pc->HIGHEST) {colour = pc->HIGHEST;}
+		}
+	}
+
+	return colour;
+}
+
+vertex ssa, ssb, ssc, ssd;
+int ssDepth = -1; /* Depth of the descent that cached ssa, ssb, ssc, ssd */
+int ssMade = 0; /* and tetraMade at the time */
+#ifdef _OPENMP
+#pragma omp threadprivate(ssa, ssb, ssc, ssd, ssDepth, ssMade)
+#endif
+
+#define PATHMAX 100
+vertex pathT[PATHMAX][4], pathE[PATHMAX]; /* tetrahedra of the last descent of */
+char pathIn[PATHMAX];                     /* planetpath(), their cuts and halves */
+int pathLen = 0, pathDepth = -1; /* levels kept, and Depth they were made at */
+int pathMade = 0; /* and tetraMade */
+#ifdef _OPENMP
+#pragma omp threadprivate(pathT, pathE, pathIn, pathLen, pathDepth, pathMade)
+#endif
+
+vertex cutedge(planetcontext *pc, vertex a, vertex b, double lab, double x, double y, double z)
+/* vertex a,b;    ends of longest edge of tetrahedron */
+/* double lab;    squared length of ab */
+/* double x,y,z;  goal point */
+{
+	vertex e;
+	double es1, es2, es3;
+	double x1, y1, z1, z2, l1, tmp;
+
+	/* cut ab */
+	e.s = rand2(a.s, b.s);
+	es1 = rand2(e.s, e.s);
+	es2 = 0.5 + 0.1 * rand2(es1, es1); /* find cut point */
+	es3 = 1.0 - es2;
+
+	if (a.s < b.s) {
+		e.x = es2 * a.x + es3 * b.x;
+		e.y = es2 * a.y + es3 * b.y;
+		e.z = es2 * a.z + es3 * b.z;
+	} else if (a.s > b.s) {
+		e.x = es3 * a.x + es2 * b.x;
+		e.y = es3 * a.y + es2 * b.y;
+		e.z = es3 * a.z + es2 * b.z;
+	} else { /* as==bs, very unlikely to ever happen */
+		e.x = 0.5 * a.x + 0.5 * b.x;
+		e.y = 0.5 * a.y + 0.5 * b.y;
+		e.z = 0.5 * a.z + 0.5 * b.z;
+	}
+
+	/* new altitude is: */
+	if (pc->matchMap && lab > pc->matchSize) { /* use map height */
+		double l, xx, yy;
+		l = sqrt(e.x * e.x + e.y * e.y + e.z * e.z);
+		yy = asin(e.y / l) * (pc->MatchHeight - 1) / PI + (pc->MatchHeight - 1) / 2.0;
+		xx = atan2(e.x, e.z) * (pc->MatchWidth - 1) / 2.0 / PI + (pc->MatchWidth - 1) / 2.0;
+		e.h = pc->cl0[(int)(xx + 0.5)][(int)(yy + 0.5)] * 0.1 / 8.0;
+	} else {
+		if (lab > 1.0) {lab = pow(lab, 0.5);}
+		/* decrease contribution for very long distances */
+		e.h = 0.5 * (a.h + b.h) /* average of end points */
+		      + e.s * pc->dd1 * pow(fabs(a.h - b.h), pc->POWA) /* plus contribution for altitude diff */
+		      + es1 * pc->dd2 * pow(lab, pc->POW); /* plus contribution for distance */
+	}
+
+	/* calculate approximate rain shadow for new point */
+	if (e.h <= 0.0 || !(pc->rainfall || pc->makeBiomes) || pc->climateRows > 0) {e.shadow = 0.0;}
+	else {
+		x1 = 0.5 * (a.x + b.x);
+		x1 = a.h * (x1 - a.x) + b.h * (x1 - b.x);
+		y1 = 0.5 * (a.y + b.y);
+		y1 = a.h * (y1 - a.y) + b.h * (y1 - b.y);
+		z1 = 0.5 * (a.z + b.z);
+		z1 = a.h * (z1 - a.z) + b.h * (z1 - b.z);
+		l1 = sqrt(x1 * x1 + y1 * y1 + z1 * z1);
+		if (l1 == 0.0) l1 = 1.0;
+		tmp = sqrt(1.0 - y * y);
+		if (tmp < 0.0001) tmp = 0.0001;
+		z2 = -z / tmp * x1 + x / tmp * z1;
+		if (lab > 0.04) {
+			e.shadow = (a.shadow + b.shadow - cos(PI * pc->shade_angle / 180.0) * z2 / l1) / 3.0;
+		} else {
+			e.shadow = (a.shadow + b.shadow) / 2.0;
+		}
+	}
+	return(e);
+}
+
+int insideacde(vertex a, vertex c, vertex d, vertex e, double x, double y, double z) {
+	/* is goal point in acde rather than bcde (a, b, c, d cut at e)? */
+	double eax, eay, eaz, epx, epy, epz;
+	double ecx, ecy, ecz, edx, edy, edz;
+
+	eax = a.x - e.x;
+	eay = a.y - e.y;
+	eaz = a.z - e.z;
+	ecx = c.x - e.x;
+	ecy = c.y - e.y;
+	ecz = c.z - e.z;
+	edx = d.x - e.x;
+	edy = d.y - e.y;
+	edz = d.z - e.z;
+	epx =   x - e.x;
+	epy =   y - e.y;
+	epz =   z - e.z;
+	return((eax*ecy*edz + eay*ecz*edx + eaz*ecx*edy
+	      - eaz*ecy*edx - eay*ecx*edz - eax*ecz*edy) *
+	       (epx*ecy*edz + epy*ecz*edx + epz*ecx*edy
+	      - epz*ecy*edx - epy*ecx*edz - epx*ecz*edy) > 0.0);
+}
+
+double planet(planetcontext *pc, vertex a, vertex b, vertex c, vertex d, double x, double y, double z, int level)
+/* vertex a,b,c,d;    tetrahedron vertices */
+/* double x,y,z;      goal point */
+/* int level;         levels to go */
+{
+	vertex e;
+	double lab, lac, lad, lbc, lbd, lcd, maxlength;
+	double x1, y1, z1, x2, y2, z2, l1, tmp;
+	vertex cutedge(planetcontext *pc, vertex a, vertex b, double lab, double x, double y, double z);
+	int insideacde(vertex a, vertex c, vertex d, vertex e, double x, double y, double z);
+
+	if (level > 0) {
+		/* make sure ab is longest edge */
+		lab = dist2(a, b);
+		lac = dist2(a, c);
+		lad = dist2(a, d);
+		lbc = dist2(b, c);
+		lbd = dist2(b, d);
+		lcd = dist2(c, d);
+
+		maxlength = lab;
+		if (lac > maxlength) maxlength = lac;
+		if (lad > maxlength) maxlength = lad;
+		if (lbc > maxlength) maxlength = lbc;
+		if (lbd > maxlength) maxlength = lbd;
+		if (lcd > maxlength) maxlength = lcd;
+
+		if (lac == maxlength) return(planet(pc, a,c,b,d, x,y,z, level));
+		if (lad == maxlength) return(planet(pc, a,d,b,c, x,y,z, level));
+		if (lbc == maxlength) return(planet(pc, b,c,a,d, x,y,z, level));
+		if (lbd == maxlength) return(planet(pc, b,d,a,c, x,y,z, level));
+		if (lcd == maxlength) return(planet(pc, c,d,a,b, x,y,z, level));
+
+		if (level == 11) { /* save tetrahedron for caching */
+			ssa = a;
+			ssb = b;
+			ssc = c;
+			ssd = d;
+			ssDepth = Depth;
+			ssMade = pc->tetraMade;
+		}
+
+		/* ab is longest, so cut ab */
+		e = cutedge(pc, a, b, lab, x, y, z);
+
+		/* find out in which new tetrahedron target point is */
+		if (insideacde(a, c, d, e, x, y, z)) {
+			/* point is inside acde */
+			return(planet(pc, c, d, a, e, x, y, z, level - 1));
+		} else {
+			/* point is inside bcde */
+			return(planet(pc, c, d, b, e, x, y, z, level - 1));
+		}
+	} else { /* level == 0 */
+		if (pc->doshade == 1 || pc->doshade == 2) { /* bump map */
+			x1 = 0.25 * (a.x + b.x + c.x + d.x);
+			x1 = a.h * (x1 - a.x) + b.h * (x1 - b.x) + c.h * (x1 - c.x) + d.h * (x1 - d.x);
+			y1 = 0.25 * (a.y + b.y + c.y + d.y);
+			y1 = a.h * (y1 - a.y) + b.h * (y1 - b.y) + c.h * (y1 - c.y) + d.h * (y1 - d.y);
+			z1 = 0.25 * (a.z + b.z + c.z + d.z);
+			z1 = a.h * (z1 - a.z) + b.h * (z1 - b.z) + c.h * (z1 - c.z) + d.h * (z1 - d.z);
+			l1 = sqrt(x1 * x1 + y1 * y1 + z1 * z1);
+			if (l1 == 0.0) {l1 = 1.0;}
+			tmp = sqrt(1.0 - y * y);
 			if (tmp < 0.0001) {tmp = 0.0001;}
 			y2 = -x * y / tmp * x1 + tmp * y1 - z * y / tmp * z1;
 			z2 = -z / tmp * x1 + x / tmp * z1;
 			shade =
-				(int)((-sin(PI * shade_angle / 180.0) * y2 - cos(PI * shade_angle / 180.0) * z2)
+				(int)((-sin(PI * pc->shade_angle / 180.0) * y2 - cos(PI * pc->shade_angle / 180.0) * z2)
 				      / l1 * 48.0 + 128.0);
 			if (shade < 10) {shade = 10;}
 			if (shade > 255) {shade = 255;}
-			if (doshade == 2 && (a.h + b.h + c.h + d.h) < 0.0) {shade = 150;}
-		} else if (doshade == 3) { /* daylight shading */
+			if (pc->doshade == 2 && (a.h + b.h + c.h + d.h) < 0.0) {shade = 150;}
+		} else if (pc->doshade == 3) { /* daylight shading */
 			double hh = a.h + b.h + c.h + d.h;
 			if (hh <= 0.0) { /* sea */
 				x1 = x;
@@ -2050,492 +5579,2603 @@ double planet(vertex a, vertex b, vertex c, vertex d, double x, double y, double
 				y1 += y * l1;
 				z1 += z * l1;
 			}
-			l1 = sqrt(x1 * x1 + y1 * y1 + z1 * z1);
-			if (l1 == 0.0) l1 = 1.0;
-			x2 = cos(PI * shade_angle / 180.0 - 0.5 * PI) * cos(PI * shade_angle2 / 180.0);
-			y2 = -sin(PI * shade_angle2 / 180.0);
-			z2 = -sin(PI * shade_angle / 180.0 - 0.5 * PI) * cos(PI * shade_angle2 / 180.0);
-			shade = (int)((x1 * x2 + y1 * y2 + z1 * z2) / l1 * 170.0 + 10);
-			if (shade < 10) {shade = 10;}
-			if (shade > 255) {shade = 255;}
+			l1 = sqrt(x1 * x1 + y1 * y1 + z1 * z1);
+			if (l1 == 0.0) l1 = 1.0;
+			x2 = cos(PI * pc->shade_angle / 180.0 - 0.5 * PI) * cos(PI * pc->shade_angle2 / 180.0);
+			y2 = -sin(PI * pc->shade_angle2 / 180.0);
+			z2 = -sin(PI * pc->shade_angle / 180.0 - 0.5 * PI) * cos(PI * pc->shade_angle2 / 180.0);
+			shade = (int)((x1 * x2 + y1 * y2 + z1 * z2) / l1 * 170.0 + 10);
+			if (shade < 10) {shade = 10;}
+			if (shade > 255) {shade = 255;}
+		}
+		rainShadow  = 0.25 * (a.shadow + b.shadow + c.shadow + d.shadow);
+		return 0.25 * (a.h + b.h + c.h + d.h);
+	}
+}
+
+double planet1(planetcontext *pc, double x, double y, double z) {
+	double abx,aby,abz, acx,acy,acz, adx,ady,adz, apx,apy,apz;
+	double bax,bay,baz, bcx,bcy,bcz, bdx,bdy,bdz, bpx,bpy,bpz;
+
+	/* check if point is inside cached tetrahedron */
+	/* (only valid if it was made at the same depth, */
+	/* else the result would depend on earlier pixels) */
+	if (ssDepth != Depth || ssMade != pc->tetraMade) {
+		return(planet(pc, pc->tetra[0], pc->tetra[1], pc->tetra[2], pc->tetra[3], x, y, z, Depth));
+	}
+	abx = ssb.x - ssa.x;
+	aby = ssb.y - ssa.y;
+	abz = ssb.z - ssa.z;
+	acx = ssc.x - ssa.x;
+	acy = ssc.y - ssa.y;
+	acz = ssc.z - ssa.z;
+	adx = ssd.x - ssa.x;
+	ady = ssd.y - ssa.y;
+	adz = ssd.z - ssa.z;
+	apx = x - ssa.x;
+	apy = y - ssa.y;
+	apz = z - ssa.z;
+
+	if ((adx*aby*acz + ady*abz*acx + adz*abx*acy
+	   - adz*aby*acx - ady*abx*acz - adx*abz*acy) *
+	    (apx*aby*acz + apy*abz*acx + apz*abx*acy
+	   - apz*aby*acx - apy*abx*acz - apx*abz*acy) > 0.0) {
+		/* p is on same side of abc as d */
+		if ((acx*aby*adz + acy*abz*adx + acz*abx*ady
+		    -acz*aby*adx - acy*abx*adz - acx*abz*ady) *
+		    (apx*aby*adz + apy*abz*adx + apz*abx*ady
+		    -apz*aby*adx - apy*abx*adz - apx*abz*ady) > 0.0) {
+			/* p is on same side of abd as c */
+			if ((abx*ady*acz + aby*adz*acx + abz*adx*acy
+		        -abz*ady*acx - aby*adx*acz - abx*adz*acy)*
+			    (apx*ady*acz + apy*adz*acx + apz*adx*acy
+			    -apz*ady*acx - apy*adx*acz - apx*adz*acy) > 0.0) {
+				/* p is on same side of acd as b */
+				bax = -abx;
+				bay = -aby;
+				baz = -abz;
+				bcx = ssc.x - ssb.x;
+				bcy = ssc.y - ssb.y;
+				bcz = ssc.z - ssb.z;
+				bdx = ssd.x - ssb.x;
+				bdy = ssd.y - ssb.y;
+				bdz = ssd.z - ssb.z;
+				bpx = x - ssb.x;
+				bpy = y - ssb.y;
+				bpz = z - ssb.z;
+				if ((bax*bcy*bdz + bay*bcz*bdx + baz*bcx*bdy
+			        -baz*bcy*bdx - bay*bcx*bdz - bax*bcz*bdy) *
+			        (bpx*bcy*bdz + bpy*bcz*bdx + bpz*bcx*bdy
+			        -bpz*bcy*bdx - bpy*bcx*bdz - bpx*bcz*bdy) > 0.0) {
+					/* p is on same side of bcd as a */
+					/* Hence, p is inside cached tetrahedron */
+					/* so we start from there */
+					return(planet(pc, ssa, ssb, ssc, ssd, x, y, z, 11));
+				}
+			}
+		}
+	}
+	/* otherwise, we start from scratch */
+
+	return(planet(pc, pc->tetra[0], pc->tetra[1], pc->tetra[2], pc->tetra[3], /* vertices of tetrahedron */
+	              x, y, z, /* coordinates of point we want colour of */
+	              Depth)); /* subdivision depth */
+
+}
+
+double planetpath(planetcontext *pc, double x, double y, double z) {
+	/* planet1() for points close to the last one, as the subsamples of   */
+	/* --supersample: the whole descent of the last point is kept, and    */
+	/* the new point follows it, only testing which half of each cut it   */
+	/* is in, until it goes the other way. As in planet1(), vertices made */
+	/* for an earlier point keep the rain shadow they got for it.         */
+	int l, in;
+	vertex t[4];
+	double planet1(planetcontext *pc, double x, double y, double z);
+	void splittetra(planetcontext *pc, vertex *t, vertex *o, vertex *e, double x, double y, double z);
+	void halftetra(vertex *o, vertex *e, int first, vertex *t);
+	int insideacde(vertex a, vertex c, vertex d, vertex e, double x, double y, double z);
+
+	if (Depth > PATHMAX) return(planet1(pc, x, y, z));
+	if (pathDepth != Depth || pathMade != pc->tetraMade) {
+		pathLen = 0;
+		pathDepth = Depth;
+		pathMade = pc->tetraMade;
+	}
+	for (l = 0; l < pathLen; l++) {
+		in = insideacde(pathT[l][0], pathT[l][2], pathT[l][3], pathE[l], x, y, z);
+		if (in != pathIn[l]) {
+			pathIn[l] = in;
+			break;
+		}
+	}
+	if (pathLen == 0) {
+		t[0] = pc->tetra[0];
+		t[1] = pc->tetra[1];
+		t[2] = pc->tetra[2];
+		t[3] = pc->tetra[3];
+	} else {
+		if (l == pathLen) l--; /* same leaf as the last point */
+		halftetra(pathT[l], &pathE[l], pathIn[l], t);
+		l++;
+	}
+	for (; l < Depth; l++) { /* new part of the descent */
+		splittetra(pc, t, pathT[l], &pathE[l], x, y, z);
+		pathIn[l] = insideacde(pathT[l][0], pathT[l][2], pathT[l][3], pathE[l], x, y, z);
+		halftetra(pathT[l], &pathE[l], pathIn[l], t);
+	}
+	pathLen = Depth;
+	return(planet(pc, t[0], t[1], t[2], t[3], x, y, z, 0));
+}
+
+void splittetra(planetcontext *pc, vertex *t, vertex *o, vertex *e, double x, double y, double z) {
+	/* cut tetrahedron t as planet() does for goal point (x,y,z): o is t */
+	/* reordered so o[0]o[1] is the longest edge, and e is the new      */
+	/* vertex on it. The halves are o[2]o[3]o[0]e and o[2]o[3]o[1]e     */
+	vertex a, b, c, d, tmp;
+	double lab, lac, lad, lbc, lbd, lcd, maxlength;
+	vertex cutedge(planetcontext *pc, vertex a, vertex b, double lab, double x, double y, double z);
+
+	a = t[0];
+	b = t[1];
+	c = t[2];
+	d = t[3];
+	for (;;) { /* make sure ab is longest edge, in the same way as planet() */
+		lab = dist2(a, b);
+		lac = dist2(a, c);
+		lad = dist2(a, d);
+		lbc = dist2(b, c);
+		lbd = dist2(b, d);
+		lcd = dist2(c, d);
+
+		maxlength = lab;
+		if (lac > maxlength) maxlength = lac;
+		if (lad > maxlength) maxlength = lad;
+		if (lbc > maxlength) maxlength = lbc;
+		if (lbd > maxlength) maxlength = lbd;
+		if (lcd > maxlength) maxlength = lcd;
+
+		if (lac == maxlength) {tmp = b; b = c; c = tmp;}
+		else if (lad == maxlength) {tmp = b; b = d; d = c; c = tmp;}
+		else if (lbc == maxlength) {tmp = a; a = b; b = c; c = tmp;}
+		else if (lbd == maxlength) {tmp = a; a = b; b = d; d = c; c = tmp;}
+		else if (lcd == maxlength) {tmp = a; a = c; c = tmp; tmp = b; b = d; d = tmp;}
+		else break;
+	}
+	o[0] = a;
+	o[1] = b;
+	o[2] = c;
+	o[3] = d;
+	*e = cutedge(pc, a, b, lab, x, y, z);
+}
+
+void halftetra(vertex *o, vertex *e, int first, vertex *t) {
+	/* t is the half o[2]o[3]o[0]e (if first) or o[2]o[3]o[1]e of a cut */
+	t[0] = o[2];
+	t[1] = o[3];
+	t[2] = first ? o[0] : o[1];
+	t[3] = *e;
+}
+
+int tetrasphere(vertex *t) { /* can tetrahedron t touch the sphere? */
+	double cx, cy, cz, r, rmax = 0.0, far = 0.0;
+	int k;
+
+	/* compare the sphere with a ball around t */
+	cx = 0.25 * (t[0].x + t[1].x + t[2].x + t[3].x);
+	cy = 0.25 * (t[0].y + t[1].y + t[2].y + t[3].y);
+	cz = 0.25 * (t[0].z + t[1].z + t[2].z + t[3].z);
+	for (k = 0; k < 4; k++) {
+		r = (t[k].x - cx) * (t[k].x - cx) + (t[k].y - cy) * (t[k].y - cy) + (t[k].z - cz) * (t[k].z - cz);
+		if (r > rmax) rmax = r;
+		r = t[k].x * t[k].x + t[k].y * t[k].y + t[k].z * t[k].z;
+		if (r > far) far = r;
+	}
+	return(far >= 1.0 && sqrt(cx * cx + cy * cy + cz * cz) - sqrt(rmax) <= 1.0);
+}
+
+int reliefbuild(planetcontext *pc, vertex *t, int levels) {
+	/* make node of the bound tree for tetrahedron t and levels more */
+	/* levels below it, or return -1 if t can not touch the sphere   */
+	double top, kidtop = 0.0;
+	vertex o[4], e, half[4];
+	int k, n, kid, kids = 0;
+	void splittetra(planetcontext *pc, vertex *t, vertex *o, vertex *e, double x, double y, double z);
+	void halftetra(vertex *o, vertex *e, int first, vertex *t);
+	double reliefbound(planetcontext *pc, vertex *t, int levels);
+	int tetrasphere(vertex *t);
+
+	if (!tetrasphere(t)) return(-1);
+
+	if (pc->reliefNodes == pc->reliefSize) {
+		pc->reliefSize = 2 * pc->reliefSize + 1024;
+		pc->reliefTop = (double*)realloc(pc->reliefTop, pc->reliefSize * sizeof(double));
+		pc->reliefKids = (int*)realloc(pc->reliefKids, 2 * pc->reliefSize * sizeof(int));
+		if (pc->reliefTop == 0 || pc->reliefKids == 0) {
+			fprintf(stderr, "Memory allocation failed.");
+			exit(1);
+		}
+	}
+	n = pc->reliefNodes++;
+	pc->reliefKids[2 * n] = pc->reliefKids[2 * n + 1] = -1;
+	top = reliefbound(pc, t, Depth - pc->reliefLevels + levels);
+	if (levels > 0) { /* the highest of the halves is a tighter bound */
+		splittetra(pc, t, o, &e, 0.0, 0.0, 0.0); /* rain shadow of e is not used */
+		for (k = 0; k < 2; k++) {
+			halftetra(o, &e, k == 0, half);
+			kid = reliefbuild(pc, half, levels - 1);
+			pc->reliefKids[2 * n + k] = kid;
+			if (kid >= 0 && (kids++ == 0 || pc->reliefTop[kid] > kidtop)) kidtop = pc->reliefTop[kid];
+		}
+		if (kids > 0 && kidtop < top) top = kidtop;
+	}
+	pc->reliefTop[n] = top;
+	return(n);
+}
+
+double reliefbound(planetcontext *pc, vertex *t, int levels) {
+	/* upper bound of the altitudes planet() can give for points in */
+	/* tetrahedron t when subdividing it levels more times          */
+	double l = 0.0, h = t[0].h, m, f, tail;
+	int a, b;
+
+	for (a = 0; a < 4; a++) {
+		if (t[a].h > h) h = t[a].h;
+		for (b = a + 1; b < 4; b++) {
+			if (dist2(t[a], t[b]) > l) l = dist2(t[a], t[b]);
+		}
+	}
+	if (levels == 0) return(h);
+
+	/* a cut raises the highest vertex by at most dd2 * l^POW (the */
+	/* altitude difference term stays between the ends when dd1 <= */
+	/* 0.5, else reliefSlack is added), and the longest edge never */
+	/* grows and in 3 levels shrinks to at most 0.76 of its squared */
+	/* length, so the sum is bounded by a geometric series.         */
+	/* cutedge() puts the new vertex e at t a + (1 - t) b with t in */
+	/* [0.4, 0.6], so by Stewart's theorem e is at most             */
+	/* (1 - t (1 - t)) L^2 <= 0.76 L^2 from any other vertex, if ab */
+	/* of squared length L^2 is the longest edge, and the parts of  */
+	/* ab are shorter. So only edges of the tetrahedron we started  */
+	/* from can be longer than 0.76 of its longest; each child has  */
+	/* the three between its three old vertices, and while one of   */
+	/* them is the longest it is cut, leaving each grandchild one   */
+	/* and each great-grandchild none.                              */
+	if (l > 1.0) { /* as in cutedge() */
+		m = fabs(pc->dd2) * pow(sqrt(l), pc->POW);
+		f = pow(0.76, 0.5 * pc->POW);
+	} else {
+		m = fabs(pc->dd2) * pow(l, pc->POW);
+		f = pow(0.76, pc->POW);
+	}
+	tail = 3.0 * m / (1.0 - f);
+	if (levels * m < tail) tail = levels * m;
+	return(h + tail + levels * pc->reliefSlack);
+}
+
+double reliefstep(double *q, double *v, double *d, vertex *t, double top, double enough) {
+	/* how far the ray from q in direction v can go while staying above */
+	/* radius top and in the cone from the centre through tetrahedron t */
+	/* (d is the direction of q, and is inside t), or 0 if less than    */
+	/* enough                                                           */
+	static const int face[4][3] = {{0, 1, 2}, {0, 1, 3}, {0, 2, 3}, {1, 2, 3}};
+	double ux, uy, uz, wx, wy, wz, nx, ny, nz, dist, delta = 1.0, r, vr, vt, b, c, s = 1.0e30;
+	int f;
+
+	/* distance to where the ray goes below radius top */
+	r = q[0] * d[0] + q[1] * d[1] + q[2] * d[2];
+	vr = v[0] * d[0] + v[1] * d[1] + v[2] * d[2];
+	b = r * vr;
+	c = r * r - top * top;
+	if (b < 0.0 && b * b > c) s = -b - sqrt(b * b - c);
+	if (s < enough) return(0.0);
+
+	/* directions closer to d than its distance to the faces of t are in t */
+	for (f = 0; f < 4; f++) {
+		vertex *p0 = &t[face[f][0]], *p1 = &t[face[f][1]], *p2 = &t[face[f][2]];
+		ux = p1->x - p0->x;
+		uy = p1->y - p0->y;
+		uz = p1->z - p0->z;
+		wx = p2->x - p0->x;
+		wy = p2->y - p0->y;
+		wz = p2->z - p0->z;
+		nx = uy * wz - uz * wy;
+		ny = uz * wx - ux * wz;
+		nz = ux * wy - uy * wx;
+		dist = fabs(nx * (d[0] - p0->x) + ny * (d[1] - p0->y) + nz * (d[2] - p0->z))
+		       / sqrt(nx * nx + ny * ny + nz * nz);
+		if (dist < delta) delta = dist;
+	}
+
+	/* after going s the direction has turned atan(s vt / (r + s vr)), */
+	/* which (and so the chord) is at most delta while s is below this */
+	vt = sqrt(vr * vr < 1.0 ? 1.0 - vr * vr : 0.0);
+	delta = tan(delta);
+	if (vt - delta * vr > 0.0 && delta * r / (vt - delta * vr) < s) {
+		s = delta * r / (vt - delta * vr);
+	}
+	return(s < enough ? 0.0 : s);
+}
+
+int reliefhit(planetcontext *pc, double *p, double *v, double pixel, vertex *path, int *side, double *hit) {
+	/* march the ray from p in direction v (of length 1) to the surface */
+	/* at radius 1 + relief * altitude (sea level for altitudes below   */
+	/* 0), where pixel is the angle seen by one pixel. At each step the */
+	/* subdivision goes down until the ray is above the bound of a      */
+	/* tetrahedron, so far from the surface the steps are long. path    */
+	/* holds the tetrahedra of the last descent (9 * (Depth + 1)), and  */
+	/* side (2 * (Depth + 1)) which half was taken and the tree nodes  */
+	vertex *t, *o;
+	double q[3], d[3], r, b, c, t0, t1, top, step, minstep, alt;
+	int n, s, steps, known = 0, *node = side + Depth + 1;
+	void splittetra(planetcontext *pc, vertex *t, vertex *o, vertex *e, double x, double y, double z);
+	double reliefbound(planetcontext *pc, vertex *t, int levels);
+	double reliefstep(double *q, double *v, double *d, vertex *t, double top, double enough);
+	void halftetra(vertex *o, vertex *e, int first, vertex *t);
+	int insideacde(vertex a, vertex c, vertex d, vertex e, double x, double y, double z);
+
+	/* only the part of the ray inside the highest possible shell matters */
+	top = 1.0 + pc->relief * (pc->reliefTop[0] > 0.0 ? pc->reliefTop[0] : 0.0);
+	b = p[0] * v[0] + p[1] * v[1] + p[2] * v[2];
+	c = p[0] * p[0] + p[1] * p[1] + p[2] * p[2] - top * top;
+	if (b * b <= c) return(0);
+	t0 = -b - sqrt(b * b - c);
+	t1 = -b + sqrt(b * b - c);
+	if (t0 < 0.0) t0 = 0.0;
+
+	path[0] = pc->tetra[0];
+	path[1] = pc->tetra[1];
+	path[2] = pc->tetra[2];
+	path[3] = pc->tetra[3];
+	node[0] = 0;
+	for (steps = 0; t0 <= t1 && steps < 100000; steps++) {
+		q[0] = p[0] + t0 * v[0];
+		q[1] = p[1] + t0 * v[1];
+		q[2] = p[2] + t0 * v[2];
+		r = sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2]);
+		d[0] = q[0] / r;
+		d[1] = q[1] / r;
+		d[2] = q[2] / r;
+		minstep = 0.5 * pixel * (t0 > 0.001 ? t0 : 0.001); /* half a pixel */
+		for (n = 0; ; n++) {
+			t = path + 9 * n;
+			o = t + 4;
+			step = 0.0;
+			/* can we step over this tetrahedron? (below the bound */
+			/* tree the bound is only worth finding every 3 levels) */
+			if (node[n] >= 0 || n % 3 == 0 || n == Depth) {
+				top = node[n] >= 0 ? pc->reliefTop[node[n]] : reliefbound(pc, t, Depth - n);
+				top = 1.0 + pc->relief * (top > 0.0 ? top : 0.0);
+				if (r > top) {
+					step = reliefstep(q, v, d, t, top, minstep);
+					if (step > 0.0) break;
+				}
+			}
+			if (n == Depth) { /* as far down as planet() goes */
+				alt = 0.25 * (t[0].h + t[1].h + t[2].h + t[3].h);
+				if (r <= 1.0 + pc->relief * (alt > 0.0 ? alt : 0.0)) {
+					hit[0] = d[0];
+					hit[1] = d[1];
+					hit[2] = d[2];
+					return(1);
+				}
+				step = minstep;
+				break;
+			}
+			/* go down to the half the ray is in now, reusing the */
+			/* last descent as far as the ray is in the same half */
+			if (n >= known) {
+				splittetra(pc, t, o, o + 4, 0.0, 0.0, 0.0); /* rain shadow of e is not used */
+				side[n] = -1;
+				known = n + 1;
+			}
+			s = insideacde(o[0], o[2], o[3], o[4], d[0], d[1], d[2]);
+			if (s != side[n]) {
+				side[n] = s;
+				halftetra(o, o + 4, s, t + 9);
+				node[n + 1] = node[n] >= 0 && n < pc->reliefLevels ? pc->reliefKids[2 * node[n] + (s ? 0 : 1)] : -1;
+				known = n + 1;
+			}
+		}
+		t0 += step;
+	}
+	return(0);
+}
+
+void loadmaster(planetcontext *pc) { /* read master texture, or make it if the file is */
+	FILE *mf;                /* missing or was made for another planet        */
+	char magic[8];
+	int head[3], i, j;
+	long n;
+	double params[12], fparams[12];
+	double planet1(planetcontext *pc, double x, double y, double z);
+	void progresstick(planetcontext *pc, int total);
+
+	pc->masterW = 2 * pc->masterH;
+	/* the depth an exact rendering with pixels of this size would use */
+	pc->masterDepth = 3 * ((int)(log_2((double)pc->masterH))) + 6;
+	n = (long)pc->masterW * pc->masterH;
+
+	/* everything that planet() depends on */
+	params[0] = pc->rseed;
+	params[1] = pc->M;
+	params[2] = pc->dd1;
+	params[3] = pc->POWA;
+	params[4] = pc->dd2;
+	params[5] = pc->POW;
+	params[6] = pc->rotate1;
+	params[7] = pc->rotate2;
+	params[8] = pc->shade_angle;
+	params[9] = pc->shade_angle2;
+	params[10] = pc->doshade;
+	params[11] = (pc->rainfall || pc->makeBiomes) && pc->climateRows == 0; /* rain shadows kept */
+
+	pc->masterAlt = (float*)malloc(n * sizeof(float));
+	pc->masterShadow = (float*)malloc(n * sizeof(float));
+	pc->masterShade = (unsigned char*)malloc(n);
+	if (pc->masterAlt == 0 || pc->masterShadow == 0 || pc->masterShade == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+
+	mf = fopen(pc->masterName, "rb");
+	if (mf != NULL) {
+		if (fread(magic, 1, 8, mf) == 8 && memcmp(magic, "PLMASTER", 8) == 0 &&
+		    fread(head, sizeof(int), 3, mf) == 3 &&
+		    head[0] == pc->masterW && head[1] == pc->masterH && head[2] == pc->masterDepth &&
+		    fread(fparams, sizeof(double), 12, mf) == 12 &&
+		    memcmp(params, fparams, sizeof(params)) == 0 &&
+		    fread(pc->masterAlt, sizeof(float), n, mf) == (size_t)n &&
+		    fread(pc->masterShadow, sizeof(float), n, mf) == (size_t)n &&
+		    fread(pc->masterShade, 1, n, mf) == (size_t)n) {
+			fclose(mf);
+			return;
+		}
+		fclose(mf);
+	}
+
+	if (!pc->library) fprintf(stderr, "Making master texture %s:\n0----------50---------100%%\n", pc->masterName);
+	progresstick(pc, 0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1) private(i)
+#endif
+	for (j = 0; j < pc->masterH; j++) {
+		double colat = PI * (j + 0.5) / pc->masterH, lon, alt;
+		long k;
+		Depth = pc->masterDepth;
+		for (i = 0; i < pc->masterW; i++) {
+			lon = 2.0 * PI * (i + 0.5) / pc->masterW - PI;
+			/* north (colatitude 0) is y = -1, longitude is atan2(x,z) */
+			alt = planet1(pc, sin(colat) * sin(lon), -cos(colat), sin(colat) * cos(lon));
+			k = (long)j * pc->masterW + i;
+			pc->masterAlt[k] = (float)alt;
+			pc->masterShadow[k] = (float)rainShadow;
+			pc->masterShade[k] = pc->doshade > 0 ? shade : 0;
+		}
+		progresstick(pc, pc->masterH);
+	}
+	fprintf(stderr, "\n");
+
+	/* the cache is in the byte order of this machine */
+	mf = fopen(pc->masterName, "wb");
+	if (mf == NULL) {
+		fprintf(stderr, "Could not open master texture file %s, error code = %d\n", pc->masterName, errno);
+		exit(1);
+	}
+	head[0] = pc->masterW;
+	head[1] = pc->masterH;
+	head[2] = pc->masterDepth;
+	fwrite("PLMASTER", 1, 8, mf);
+	fwrite(head, sizeof(int), 3, mf);
+	fwrite(params, sizeof(double), 12, mf);
+	fwrite(pc->masterAlt, sizeof(float), n, mf);
+	fwrite(pc->masterShadow, sizeof(float), n, mf);
+	fwrite(pc->masterShade, 1, n, mf);
+	fclose(mf);
+}
+
+void cubicweights(double t, double *w) { /* Catmull-Rom weights of 4 texels */
+	w[0] = ((-t + 2.0) * t - 1.0) * t * 0.5;
+	w[1] = ((3.0 * t - 5.0) * t * t + 2.0) * 0.5;
+	w[2] = ((-3.0 * t + 4.0) * t + 1.0) * t * 0.5;
+	w[3] = (t - 1.0) * t * t * 0.5;
+}
+
+double mastersample(planetcontext *pc, double x, double y, double z) { /* planet1 by resampling master */
+	double u, v, w, wu[4], wv[4], alt = 0.0, sh = 0.0, rs = 0.0;
+	int i0, j0, a, b, n, ii, jj;
+	long k;
+	double planet1(planetcontext *pc, double x, double y, double z);
+	void cubicweights(double t, double *w);
+
+	if (Depth > pc->masterDepth) { /* master has too little detail for this point */
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+		pc->masterMisses++;
+		return(planet1(pc, x, y, z));
+	}
+	if (x != x || y != y || z != z) { /* rounding at edge of globe can give NaN */
+		return(planet1(pc, x, y, z));
+	}
+
+	if (y < -1.0) y = -1.0;
+	if (y > 1.0) y = 1.0;
+	u = (atan2(x, z) + PI) * pc->masterW / (2.0 * PI) - 0.5;
+	v = acos(-y) * pc->masterH / PI - 0.5;
+	i0 = (int)floor(u);
+	j0 = (int)floor(v);
+	if (pc->masterCubic) {
+		n = 4;
+		cubicweights(u - i0, wu);
+		cubicweights(v - j0, wv);
+		i0--;
+		j0--;
+	} else {
+		n = 2;
+		wu[1] = u - i0;
+		wu[0] = 1.0 - wu[1];
+		wv[1] = v - j0;
+		wv[0] = 1.0 - wv[1];
+	}
+	for (b = 0; b < n; b++) {
+		jj = min(pc->masterH - 1, max(0, j0 + b)); /* clamp at poles */
+		for (a = 0; a < n; a++) {
+			ii = (i0 + a + pc->masterW) % pc->masterW; /* wrap around in longitude */
+			k = (long)jj * pc->masterW + ii;
+			w = wu[a] * wv[b];
+			alt += w * pc->masterAlt[k];
+			rs += w * pc->masterShadow[k];
+			sh += w * pc->masterShade[k];
+		}
+	}
+
+	/* leave shade and rain shadow as planet() would */
+	rainShadow = rs;
+	shade = (int)(sh + 0.5);
+	if (shade < 10) {shade = 10;}
+	if (shade > 255) {shade = 255;}
+	return(alt);
+}
+
+void shaderow(planetcontext *pc, unsigned char *p, int i0, int w, int j, int bgr) {
+	/* colours of w points of row j of the arrays, from column i0 */
+	int i, c, s, r, g, b;
+
+	r = bgr ? 2 : 0;
+	b = 2 - r;
+	if (pc->doshade) {
+		for (i = i0; i < i0 + w; i++, p += 3) {
+			s = pc->shades[i][j];
+			c = pc->col[i][j];
+			g = s * pc->rtable[c] / 150;
+			p[r] = g > 255 ? 255 : g;
+			g = s * pc->gtable[c] / 150;
+			p[1] = g > 255 ? 255 : g;
+			g = s * pc->btable[c] / 150;
+			p[b] = g > 255 ? 255 : g;
+		}
+	} else {
+		for (i = i0; i < i0 + w; i++, p += 3) {
+			c = pc->col[i][j];
+			p[r] = pc->rtable[c];
+			p[1] = pc->gtable[c];
+			p[b] = pc->btable[c];
+		}
+	}
+}
+
+void superrow(planetcontext *pc, unsigned char *p, int j, int bgr) { /* row j of --supersample window */
+	/* the superN x superN points of each pixel are averaged, or with   */
+	/* --lanczos the 5 x 5 pixels around it are filtered by Lanczos-2;  */
+	/* the rows of points are coloured by shaderow(), and filtered down */
+	/* the columns and then along the row, clamped at the map's edges.  */
+	/* Grid and outline points are left out of the colours filtered and */
+	/* drawn over each pixel they are in, so lines stay solid.          */
+	int i, k, t, taps, lo, r, ox = pc->winX - pc->planeX, oy = pc->winY - pc->planeY;
+	double wt[40], sum = 0.0, d, v, *acc;
+	unsigned char *row;
+	void shaderow(planetcontext *pc, unsigned char *p, int i0, int w, int j, int bgr);
+
+	taps = pc->superLanczos ? 5 * pc->superN : pc->superN;
+	lo = pc->superLanczos ? -2 * pc->superN : 0; /* first point from superN * pixel */
+	for (t = 0; t < taps; t++) {
+		d = PI * ((lo + t + 0.5) / pc->superN - 0.5);
+		wt[t] = !pc->superLanczos || d == 0.0 ? 1.0 :
+		        fabs(d) >= 2.0 * PI ? 0.0 : 2.0 * sin(d) * sin(0.5 * d) / (d * d);
+		sum += wt[t];
+	}
+	for (t = 0; t < taps; t++) wt[t] /= sum;
+
+	row = (unsigned char*)malloc((size_t)3 * pc->planeW);
+	acc = (double*)calloc((size_t)3 * pc->planeW, sizeof(double));
+	if (row == 0 || acc == 0) { /* rows are made in parallel loops */
+		free(row);
+		free(acc);
+		planetfail(pc);
+		return;
+	}
+	for (t = 0; t < taps; t++) {
+		k = oy + pc->superN * j + lo + t;
+		shaderow(pc, row, 0, pc->planeW, k < 0 ? 0 : k >= pc->planeH ? pc->planeH - 1 : k, 0);
+		for (i = 0; i < 3 * pc->planeW; i++) acc[i] += wt[t] * row[i];
+	}
+	r = bgr ? 2 : 0;
+	for (i = 0; i < pc->winW / pc->superN; i++, p += 3) {
+		for (k = 0; k < 3; k++) {
+			v = 0.5;
+			for (t = 0; t < taps; t++) {
+				int c = ox + pc->superN * i + lo + t;
+				v += wt[t] * acc[3 * (c < 0 ? 0 : c >= pc->planeW ? pc->planeW - 1 : c) + k];
+			}
+			p[k == 1 ? 1 : k == 0 ? r : 2 - r] = v < 0.0 ? 0 : v > 255.0 ? 255 : (int)v;
+		}
+		if (pc->lineCols != NULL) { /* the grid over outlines, as they are drawn */
+			int a, b, c = 0, s;
+			unsigned short *l = pc->lineCols + (size_t)(ox + pc->superN * i) * pc->planeH + oy + pc->superN * j;
+			for (a = 0; a < pc->superN && c != pc->GRID + 1; a++) {
+				for (b = 0; b < pc->superN; b++) {
+					if (l[(size_t)a * pc->planeH + b] == pc->GRID + 1 || c == 0) c = l[(size_t)a * pc->planeH + b];
+				}
+			}
+			if (c > 0) {
+				c--;
+				/* shaded as lines drawn into col (the grid at 255) */
+				s = pc->doshade == 0 ? 150 : c == pc->GRID ? 255 : pc->shades[ox + pc->superN * i][oy + pc->superN * j];
+				p[r] = min(255, s * pc->rtable[c] / 150);
+				p[1] = min(255, s * pc->gtable[c] / 150);
+				p[2 - r] = min(255, s * pc->btable[c] / 150);
+			}
+		}
+	}
+	free(row);
+	free(acc);
+}
+
+void maprow(planetcontext *pc, unsigned char *p, int j, int bgr) { /* colours of row j of printed map */
+	int i;
+	unsigned char *q;
+	void shaderow(planetcontext *pc, unsigned char *p, int i0, int w, int j, int bgr),
+	     superrow(planetcontext *pc, unsigned char *p, int j, int bgr);
+
+	if (pc->mipW > 0) {
+		q = pc->mipRGB + (size_t)3 * pc->mipW * j;
+		for (i = 0; i < pc->mipW; i++, p += 3, q += 3) {
+			p[0] = q[bgr ? 2 : 0];
+			p[1] = q[1];
+			p[2] = q[bgr ? 0 : 2];
+		}
+	} else if (pc->superN > 1) {
+		superrow(pc, p, j, bgr);
+	} else {
+		shaderow(pc, p, pc->winX - pc->planeX, pc->winW, j + pc->winY - pc->planeY, bgr);
+	}
+}
+
+void mapsize(planetcontext *pc, int *w, int *h) { /* size of printed map */
+	*w = pc->mipW > 0 ? pc->mipW : pc->winW / pc->superN;
+	*h = pc->mipW > 0 ? pc->mipH : pc->winH / pc->superN;
+}
+
+void printrows(planetcontext *pc, FILE *outfile, int W1, int bgr) { /* rows of window, bottom up if bgr */
+	int k, n, w, h;
+	unsigned char *rows;
+	void maprow(planetcontext *pc, unsigned char *p, int j, int bgr),
+	     mapsize(planetcontext *pc, int *w, int *h);
+
+	/* rows are coloured 64 at a time in parallel and written in one go */
+	mapsize(pc, &w, &h);
+	rows = (unsigned char*)calloc((size_t)64 * W1, 1);
+	if (rows == 0) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	for (k = 0; k < h; k += n) {
+		int r;
+		n = min(64, h - k);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (r = 0; r < n; r++) {
+			maprow(pc, rows + (size_t)r * W1, bgr ? h - 1 - k - r : k + r, bgr);
+		}
+		if (pc->failed) free(rows);
+		planetcheck(pc);
+		fwrite(rows, W1, n, outfile);
+	}
+	free(rows);
+}
+
+void printppm(planetcontext *pc, FILE *outfile) { /* prints picture in PPM (portable pixel map) format */
+	int w, h;
+	void printrows(planetcontext *pc, FILE *outfile, int W1, int bgr),
+	     mapsize(planetcontext *pc, int *w, int *h);
+
+	fprintf(outfile, "P6\n");
+	fprintf(outfile, "#fractal planet image\n");
+	fprintf(outfile, "# Command line:\n# %s\n", pc->cmdLine);
+	mapsize(pc, &w, &h);
+	fprintf(outfile, "%d %d 255\n", w, h);
+
+	printrows(pc, outfile, 3 * w, 0);
+	fclose(outfile);
+}
+
+void printppmBW(planetcontext *pc, FILE *outfile) { /* prints picture in b/w PPM format */
+	int i, j, c;
+	int ox = pc->winX - pc->planeX, oy = pc->winY - pc->planeY; /* window in arrays */
+
+	fprintf(outfile, "P6\n");
+	fprintf(outfile, "#fractal planet image\n");
+	fprintf(outfile, "# Command line:\n# %s\n", pc->cmdLine);
+	fprintf(outfile, "%d %d 1\n", pc->winW, pc->winH);
+
+	for (j = 0; j < pc->winH; j++) {
+		for (i = 0; i < pc->winW; i++) {
+			if (INK(i + ox, j + oy)) {
+				c = 0;
+			} else {
+				c = 1;
+			}
+			putc(c, outfile);
+			putc(c, outfile);
+			putc(c, outfile);
+		}
+	}
+	fclose(outfile);
+}
+
+void printbmp(planetcontext *pc, FILE *outfile) { /* prints picture in BMP format */
+	int s0, s, W1, w, h;
+	void printrows(planetcontext *pc, FILE *outfile, int W1, int bgr),
+	     mapsize(planetcontext *pc, int *w, int *h);
+
+	mapsize(pc, &w, &h);
+	fprintf(outfile, "BM");
+
+	W1 = (3 * w + 3);
+	W1 -= W1 % 4;
+	s0 = (strlen(pc->cmdLine) + strlen("Command line:\n\n") + 3) & 0xffc;
+	s = s0 + 54 + W1 * h; /* file size */
+	putc(s & 255, outfile);
+	putc((s >> 8) & 255, outfile);
+	putc((s >> 16) & 255, outfile);
+	putc(s >> 24, outfile);
+
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(54, outfile); /* offset to data */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(40, outfile); /* size of infoheader */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(w & 255, outfile);
+	putc((w >> 8) & 255, outfile);
+	putc((w >> 16) & 255, outfile);
+	putc(w >> 24, outfile);
+
+	putc(h & 255, outfile);
+	putc((h >> 8) & 255, outfile);
+	putc((h >> 16) & 255, outfile);
+	putc(h >> 24, outfile);
+
+	putc(1, outfile); /* no. of planes = 1 */
+	putc(0, outfile);
+
+	putc(24, outfile); /* bpp */
+	putc(0, outfile);
+
+	putc(0, outfile); /* no compression */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* image size (unspecified) */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* h. pixels/m */
+	putc(32, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* v. pixels/m */
+	putc(32, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* colours used (unspecified) */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* important colours (all) */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	printrows(pc, outfile, W1, 1);
+	fprintf(outfile, "Command line:\n%s\n", pc->cmdLine);
+	fclose(outfile);
+}
+
+void printbmpBW(planetcontext *pc, FILE *outfile) { /* prints picture in b/w BMP format */
+	int i, j, c, s, s0, W1;
+	int ox = pc->winX - pc->planeX, oy = pc->winY - pc->planeY; /* window in arrays */
+
+	fprintf(outfile, "BM");
+
+	W1 = (pc->winW + 31);
+	W1 -= W1 % 32;
+	s0 = (strlen(pc->cmdLine) + strlen("Command line:\n\n") + 3) & 0xffc;
+	s = s0 + 62 + (W1 * pc->winH) / 8; /* file size */
+	putc(s & 255, outfile);
+	putc((s >> 8) & 255, outfile);
+	putc((s >> 16) & 255, outfile);
+	putc(s >> 24, outfile);
+
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(62, outfile); /* offset to data */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(40, outfile); /* size of infoheader */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(pc->winW & 255, outfile);
+	putc((pc->winW >> 8) & 255, outfile);
+	putc((pc->winW >> 16) & 255, outfile);
+	putc(pc->winW >> 24, outfile);
+
+	putc(pc->winH & 255, outfile);
+	putc((pc->winH >> 8) & 255, outfile);
+	putc((pc->winH >> 16) & 255, outfile);
+	putc(pc->winH >> 24, outfile);
+
+	putc(1, outfile); /* no. of planes = 1 */
+	putc(0, outfile);
+
+	putc(1, outfile); /* bpp */
+	putc(0, outfile);
+
+	putc(0, outfile); /* no compression */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* image size (unspecified) */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* h. pixels/m */
+	putc(32, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* v. pixels/m */
+	putc(32, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(2, outfile); /* colours used */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(2, outfile); /* important colours (2) */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(0, outfile); /* colour 0 = black */
+	putc(0, outfile);
+	putc(0, outfile);
+	putc(0, outfile);
+
+	putc(255, outfile); /* colour 1 = white */
+	putc(255, outfile);
+	putc(255, outfile);
+	putc(255, outfile);
+
+	for (j = pc->winH - 1; j >= 0; j--) {
+		for (i = 0; i < W1; i += 8) {
+			if (i < pc->winW && !INK(i + ox, j + oy)) {c = 128;} else {c = 0;}
+			if (i + 1 < pc->winW && !INK(i + 1 + ox, j + oy)) {c += 64;}
+			if (i + 2 < pc->winW && !INK(i + 2 + ox, j + oy)) {c += 32;}
+			if (i + 3 < pc->winW && !INK(i + 3 + ox, j + oy)) {c += 16;}
+			if (i + 4 < pc->winW && !INK(i + 4 + ox, j + oy)) {c += 8;}
+			if (i + 5 < pc->winW && !INK(i + 5 + ox, j + oy)) {c += 4;}
+			if (i + 6 < pc->winW && !INK(i + 6 + ox, j + oy)) {c += 2;}
+			if (i + 7 < pc->winW && !INK(i + 7 + ox, j + oy)) {c += 1;}
+			putc(c, outfile);
+		}
+	}
+	fprintf(outfile, "Command line:\n%s\n", pc->cmdLine);
+	fclose(outfile);
+}
+
+char *nletters(int n, int c) {
+	int i;
+	static char buffer[8];
+	buffer[n] = '\0';
+	for (i = n - 1; i >= 0; i--) {
+		buffer[i] = letters[c & 0x001F];
+		c >>= 5;
+	}
+	return buffer;
+}
+
+void printxpm(planetcontext *pc, FILE *outfile) { /* prints picture in XPM (X-windows pixel map) format */
+	int x, y, i, nbytes;
+	int ox = pc->winX - pc->planeX, oy = pc->winY - pc->planeY; /* window in arrays */
+
+	x = pc->nocols - 1;
+	for (nbytes = 0; x != 0; nbytes++) {x >>= 5;}
+
+	fprintf(outfile, "/* XPM */\n");
+	fprintf(outfile, "/* Command line: */\n/* %s*/\n", pc->cmdLine);
+	fprintf(outfile, "static char *xpmdata[] = {\n");
+	fprintf(outfile, "/* width height ncolors chars_per_pixel */\n");
+	fprintf(outfile, "\"%d %d %d %d\",\n", pc->winW, pc->winH, pc->nocols, nbytes);
+	fprintf(outfile, "/* colors */\n");
+	for (i = 0; i < pc->nocols; i++) {
+		fprintf(outfile, "\"%s c #%2.2X%2.2X%2.2X\",\n", nletters(nbytes, i), pc->rtable[i], pc->gtable[i], pc->btable[i]);
+	}
+
+	fprintf(outfile, "/* pixels */\n");
+	for (y = 0 ; y < pc->winH; y++) {
+		fprintf(outfile, "\"");
+		for (x = 0; x < pc->winW; x++) {
+			fprintf(outfile, "%s", nletters(nbytes, pc->col[x + ox][y + oy]));
+		}
+		fprintf(outfile, "\",\n");
+	}
+	fprintf(outfile, "};\n");
+	fclose(outfile);
+}
+
+void printxpmBW(planetcontext *pc, FILE *outfile) { /* prints picture in XPM (X-windows pixel map) format */
+	int x, y, nbytes;
+	int ox = pc->winX - pc->planeX, oy = pc->winY - pc->planeY; /* window in arrays */
+	nbytes = 1;
+
+	fprintf(outfile, "/* XPM */\n");
+	fprintf(outfile, "/* Command line: */\n/* %s*/\n", pc->cmdLine);
+	fprintf(outfile, "static char *xpmdata[] = {\n");
+	fprintf(outfile, "/* width height ncolors chars_per_pixel */\n");
+	fprintf(outfile, "\"%d %d %d %d\",\n", pc->winW, pc->winH, 2, nbytes);
+	fprintf(outfile, "/* colors */\n");
+	fprintf(outfile, "\". c #FFFFFF\",\n");
+	fprintf(outfile, "\"X c #000000\",\n");
+	fprintf(outfile, "/* pixels */\n");
+	for (y = 0 ; y < pc->winH; y++) {
+		fprintf(outfile, "\"");
+		for (x = 0; x < pc->winW; x++) {
+			fprintf(outfile, "%s", INK(x + ox, y + oy) ? "X" : ".");
+		}
+		fprintf(outfile, "\",\n");
+	}
+	fprintf(outfile, "};\n");
+	fclose(outfile);
+}
+
+void printheights(planetcontext *pc, FILE *outfile) { /* prints heightfield */
+	int i, j;
+	int ox = pc->winX - pc->planeX, oy = pc->winY - pc->planeY; /* window in arrays */
+
+	if (pc->mipW > 0) {
+		for (j = 0; j < pc->mipH; j++) {
+			for (i = 0; i < pc->mipW; i++) {
+				fprintf(outfile, "%d ", pc->mipHeights[(size_t)j * pc->mipW + i]);
+			}
+			putc('\n', outfile);
 		}
-		rainShadow  = 0.25 * (a.shadow + b.shadow + c.shadow + d.shadow);
-		return 0.25 * (a.h + b.h + c.h + d.h);
+		fclose(outfile);
+		return;
+	}
+	for (j = 0; j < pc->winH; j++) {
+		for (i = 0; i < pc->winW; i++) {
+			fprintf(outfile, "%d ", pc->heights[i + ox][j + oy]);
+		}
+		putc('\n', outfile);
+	}
+	fclose(outfile);
+}
+
+void print_help(void) {
+	fprintf(stdout, "Basic usage: planet -s [seed] -w [width] -h [height] -p[projection] -o [outfile]\n");
+	fprintf(stdout, "The command-line options are:\n");
+	fprintf(stdout, "	 -s [seed]\t\tSpecifies seed as number between 0.0 and 1.0\n");
+	fprintf(stdout, "	 -w [width]\t\tSpecifies width in pixels, default = 800\n");
+	fprintf(stdout, "	 -h [height]\t\tSpecifies height in pixels, default = 600\n");
+	fprintf(stdout, "	 -m [magnification]\tSpecifies magnification, default = 1.0\n");
+	fprintf(stdout, "	 -o [output-file]\tSpecifies output file, default is standard output\n");
+	fprintf(stdout, "	 -l [longitude]\t\tSpecifies longitude of centre in degrees, default = 0.0\n");
+	fprintf(stdout, "	 -L [latitude]\t\tSpecifies latitude of centre in degrees, default = 0.0\n");
+	fprintf(stdout, "	 -g [gridsize]\t\tSpecifies vertical gridsize in degrees, default = 0.0 (no grid)\n");
+	fprintf(stdout, "	 -G [gridsize]\t\tSpecifies horisontal gridsize in degrees, default = 0.0 (no grid)\n");
+	fprintf(stdout, "	 -i [init-alt]\t\tSpecifies initial altitude (default = -0.02)\n");
+	fprintf(stdout, "	 -c\t\t\tColour depends on latitude (cumulative, default: only altitude)\n");
+	fprintf(stdout, "	 -n\t\t\tApply non-linear scaling to altitude. This makes land flatter near sea level\n");
+	fprintf(stdout, "	 -S\t\t\tMake more \"wrinkly\" maps\n");
+	fprintf(stdout, "	 -C file\t\tRead colour definitions from file\n");
+	fprintf(stdout, "	 -O\t\t\tProduce a black and white outline map\n");
+	fprintf(stdout, "	 -E\t\t\tTrace the edges of land in black on colour map\n");
+	fprintf(stdout, "	 -B\t\t\tUse \"bumpmap\" shading\n");
+	fprintf(stdout, "	 -b\t\t\tUse \"bumpmap\" shading on land only\n");
+	fprintf(stdout, "	 -d\t\t\tUse \"daylight\" shading\n");
+	fprintf(stdout, "	 -a [angle]\t\tAngle of \"light\" in bumpmap shading or longitude of sun in daylight shading\n");
+	fprintf(stdout, "	 -A [latitude]\t\tLatitude of sun in daylight shading\n");
+	fprintf(stdout, "	 -M [delta]\t\tRead map from standard input and match new points to map\n");
+	fprintf(stdout, "	 \t\t\tif edge length greater than delta (default = 0.1)\n");
+	fprintf(stdout, "	 -V [number]\t\tDistance contribution to variation (default = 0.035)\n");
+	fprintf(stdout, "	 -v [number]\t\tAltitude contribution to variation (default = -0.45)\n");
+	fprintf(stdout, "	 -T [lo] [la]\t\tRotate map so what would otherwise be at latitude [la] and longitude [lo] is moved to (0,0).\n");
+	fprintf(stdout, "	 \t\t\tThis is different from using -l and -L because this rotation is done before applying \n");
+	fprintf(stdout, "	 \t\t\tgridlines and latitude-based effects.\n");
+	fprintf(stdout, "	 -P\t\t\tUse PPM file format (default is BMP)\n");
+	fprintf(stdout, "	 -x\t\t\tUse XPM file format (default is BMP)\n");
+	fprintf(stdout, "	 -H\t\t\tOutput heightfield (default is BMP)\n");
+	fprintf(stdout, "	 -z\t\t\tShow biomes using the default palette.\n");
+	fprintf(stdout, "	 \t\t\t(Use -z -z to use Ian's palette from: https://space.geometrian.com/calcs/climate-sim.php)\n");
+	fprintf(stdout, "	 -Z file\t\tShow biomes using custom biomes palette file\n");
+	fprintf(stdout, "	 -R\t\t\tPrint version info\n");
+	fprintf(stdout, "	 --window [x] [y] [w] [h]\n");
+	fprintf(stdout, "	 \t\t\tOnly render and output the w x h pixels at (x,y) of the map (not with -pH)\n");
+	fprintf(stdout, "	 --cubefaces\t\tWrite the faces of a cube map (-pX) to six files named after -o\n");
+	fprintf(stdout, "	 --nside [n]\t\tHEALPix (-pH) resolution, 12*n*n pixels (default from -h)\n");
+	fprintf(stdout, "	 --nested\t\tWrite HEALPix pixels in nested order (default ring order)\n");
+	fprintf(stdout, "	 --master [file]\tResample a cached equirectangular master texture instead of\n");
+	fprintf(stdout, "	 \t\t\tsubdividing for every point (made if missing or for another planet)\n");
+	fprintf(stdout, "	 --mastersize [h]\tHeight of master texture, width is 2*h (default = 1024)\n");
+	fprintf(stdout, "	 --bicubic\t\tUse bicubic instead of bilinear interpolation in master texture\n");
+	fprintf(stdout, "	 --camera [distance]\tDistance from centre to camera in perspective view, in radii (default = 3.0)\n");
+	fprintf(stdout, "	 --relief [scale]\tScale of altitudes in perspective view, --light and --horizons\n");
+	fprintf(stdout, "	 \t\t\t(default = 0.3)\n");
+	fprintf(stdout, "	 --session [file]\tKeep the map in file, and reuse it when the next map of the same planet\n");
+	fprintf(stdout, "	 \t\t\twith -pm, -pp or -pq is only moved by a whole number of columns with -l\n");
+	fprintf(stdout, "	 --contours [file]\tWrite coastline and contour lines (see -E) as longitude/latitude\n");
+	fprintf(stdout, "	 \t\t\tpolylines traced on a w x h grid (its --window part), GeoJSON or SVG if file ends in .svg\n");
+	fprintf(stdout, "	 --coast [file]\t\tWrite coastline traced on the sphere, found through the subdivision\n");
+	fprintf(stdout, "	 \t\t\t(from the w x h grid with -M, --master, -t or -r; GeoJSON or SVG as --contours)\n");
+	fprintf(stdout, "	 --coastres [degrees]\tGrid spacing of traced coastline, kept to within a quarter of it\n");
+	fprintf(stdout, "	 \t\t\twith fewer points where it is straight (default = 0.01)\n");
+	fprintf(stdout, "	 --coastdist [file]\tWrite signed distance from coast of each pixel (positive on land)\n");
+	fprintf(stdout, "	 \t\t\tas PFM, in pixels or with --coastkm in km\n");
+	fprintf(stdout, "	 --coastkm [radius]\tGive distances from coast in km on a planet of this radius\n");
+	fprintf(stdout, "	 --coastrings [n] [d]\tOutline n rings at sea d pixels (or km) apart around the coast\n");
+	fprintf(stdout, "	 --components [file]\tWrite count, area and centre of connected land and sea areas as JSON\n");
+	fprintf(stdout, "	 --labels [file]\tWrite number of the land or sea area of each pixel as 16 bit PGM,\n");
+	fprintf(stdout, "	 \t\t\tnumbered by size as in --components\n");
+	fprintf(stdout, "	 --rivers [n]\t\tDraw rivers where n pixels drain through, and lakes they go through\n");
+	fprintf(stdout, "	 \t\t\t(found in the --window only, so not a crop of the rivers of the whole map)\n");
+	fprintf(stdout, "	 --flow [file]\t\tWrite number of pixels draining through each pixel as PFM\n");
+	fprintf(stdout, "	 --normals [file]\tWrite normal map of the altitudes as PPM (x right, y up)\n");
+	fprintf(stdout, "	 --light [az] [el]\tShade from the altitudes with a light at azimuth az and elevation el\n");
+	fprintf(stdout, "	 \t\t\tin degrees; give it up to 16 times for more lights\n");
+	fprintf(stdout, "	 --horizons [k]\t\tShade as -d from the altitudes, with shadows cast by the relief, from\n");
+	fprintf(stdout, "	 \t\t\thorizons in k directions (4 to 64)\n");
+	fprintf(stdout, "	 --daycycle [n]\t\tWith --horizons, write n maps file_000.ext ... with the sun going west\n");
+	fprintf(stdout, "	 \t\t\tround the planet from longitude -a\n");
+	fprintf(stdout, "	 --supersample [n]\tAverage n x n points for each pixel of the map (2 to 8)\n");
+	fprintf(stdout, "	 --lanczos\t\tFilter the points of --supersample by Lanczos-2 instead of averaging\n");
+	fprintf(stdout, "	 --climate [n]\t\tWith -r or -z, carry moisture with the prevailing winds on a grid of\n");
+	fprintf(stdout, "	 \t\t\tn latitudes, in place of the rain shadow (8 to 4096)\n");
+	fprintf(stdout, "	 --mips [n]\t\tAlso write the map halved n times, as file_1.ext ... file_n.ext, with the\n");
+	fprintf(stdout, "	 \t\t\theights (the colours with -H) and shades of each size\n");
+	fprintf(stdout, "	 --erode [n]\t\tErode land with n droplets per pixel before colouring\n");
+	fprintf(stdout, "	 \t\t\t(within the --window only, so not a crop of the whole map eroded)\n");
+	fprintf(stdout, "	 --nomap\t\tOnly write the --contours or --coast file, no map\n");
+	fprintf(stdout, "	 --serve [socket]\tKeep planets open and render the requests sent to the Unix socket\n");
+	fprintf(stdout, "	 \t\t\t(one JSON object per line, see --serve in planet_mod.c); no other options\n");
+	fprintf(stdout, "	 --tiles [port]\t\tServe Mercator map tiles of the planet as http://localhost:port/z/x/y.bmp\n");
+	fprintf(stdout, "	 --tilecache [dir]\tKeep the tiles of --tiles in dir/z/x/y.bmp between runs\n");
+	fprintf(stdout, "	 --tilequit\t\tLet GET /quit stop the --tiles server (anyone who can reach the port can)\n");
+	fprintf(stdout, "	 --pyramid [dir] [n]\tWrite all the tiles of --tiles from zoom 0 to n to dir/z/x/y.bmp;\n");
+	fprintf(stdout, "	 \t\t\tan interrupted run goes on where it stopped\n");
+	fprintf(stdout, "	 -p[projection]\t\tSpecifies projection:\n");
+	fprintf(stdout, "	 \t\t	   m = Mercator (default)\n");
+	fprintf(stdout, "	 \t\t	   p = Peters\n");
+	fprintf(stdout, "	 \t\t	   q = Square\n");
+	fprintf(stdout, "	 \t\t	   s = Stereographic\n");
+	fprintf(stdout, "	 \t\t	   o = Orthographic\n");
+	fprintf(stdout, "	 \t\t	   O = Double orthographic\n");
+	fprintf(stdout, "	 \t\t	   g = Gnomonic\n");
+	fprintf(stdout, "	 \t\t	   a = Area preserving azimuthal\n");
+	fprintf(stdout, "	 \t\t	   c = Conical (conformal)\n");
+	fprintf(stdout, "	 \t\t	   M = Mollweide\n");
+	fprintf(stdout, "	 \t\t	   S = Sinusoidal\n");
+	fprintf(stdout, "	 \t\t	   h = Heightfield (obsolete. Use -H option instead)\n");
+	fprintf(stdout, "	 \t\t	   i = Icosahedral\n");
+	fprintf(stdout, "	 \t\t	   X = Cube map (six h x h faces laid out in a cross)\n");
+	fprintf(stdout, "	 \t\t	   H = HEALPix (equal area pixels, binary file, see --nside)\n");
+	fprintf(stdout, "	 \t\t	   P = Perspective view with relief (see --camera and --relief)\n");
+	fprintf(stdout, "\nSee Manual.pdf for detailed help.\n");
+	exit(0);
+}
+
+void print_error(void) {
+	fprintf(stderr, "Basic usage: planet -s [seed] -w [width] -h [height] -p[projection] -o [outfile]\n");
+	fprintf(stderr, "Try \'planet -?\' for basic help, and \'planet -R\' for version information.\n");
+	fprintf(stderr, "See Manual.pdf for detailed help.\n");
+	exit(1);
+}
+
+void print_error_args(char c) {
+	fprintf(stderr, "Missing or bad argument to option -%c\n\n", c);
+	fprintf(stderr, "Basic usage: planet -s [seed] -w [width] -h [height] -p[projection] -o [outfile]\n");
+	fprintf(stderr, "Try \'planet -?\' for basic help, and \'planet -R\' for version information.\n");
+	fprintf(stderr, "See Manual.pdf for detailed help.\n");
+	exit(2);
+}
+
+void print_error_option(const char *option) {
+	fprintf(stderr, "Missing or bad argument to option %s\n\n", option);
+	fprintf(stderr, "Basic usage: planet -s [seed] -w [width] -h [height] -p[projection] -o [outfile]\n");
+	fprintf(stderr, "Try \'planet -?\' for basic help, and \'planet -R\' for version information.\n");
+	fprintf(stderr, "See Manual.pdf for detailed help.\n");
+	exit(2);
+}
+
+/* Library interface (planet.h). All a planet is rendered from is in its */
+/* context, so contexts can be used by different threads at the same */
+/* time. Depth is per thread, so each call sets it from the context. */
+
+void freeplanet(planetcontext *pc) { /* free what setup() made */
+	free(pc->climateGrid);
+	free(pc->masterAlt);
+	free(pc->masterShadow);
+	free(pc->masterShade);
+	free(pc->cl0);
+	pc->climateGrid = pc->masterAlt = pc->masterShadow = NULL;
+	pc->masterShade = NULL;
+	pc->cl0 = NULL;
+}
+
+planetcontext *planet_open(int ac, char **av) {
+	jmp_buf env;
+	planetcontext *pc;
+	char filename[256];
+	int do_file = 0;
+	void setup(planetcontext *pc, int ac, char **av, char *filename, int *do_file),
+	     freeplanet(planetcontext *pc);
+	planetcontext *newplanet(void);
+
+	if (ac < 2) {
+		fprintf(stderr, "planet_open needs some options\n");
+		return(NULL);
+	}
+	pc = newplanet();
+	if (pc == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		return(NULL);
+	}
+	pc->library = 1;
+
+	planetcatch(&env);
+	if (setjmp(env)) {
+		planetcatch(NULL);
+		freeplanet(pc);
+		free(pc);
+		return(NULL);
+	}
+	setup(pc, ac, av, filename, &do_file);
+	if (pc->view == 'H' || pc->do_bw || pc->noMap || pc->cubeFiles || pc->dayFrames > 0 || pc->mipLevels > 0) {
+		fprintf(stderr, "-pH, -O, --nomap, --cubefaces, --daycycle and --mips can not be used with planet_open\n");
+		exit(1);
 	}
+	planetcatch(NULL);
+
+	pc->depth = Depth;
+	pc->x0 = pc->winX;
+	pc->y0 = pc->winY;
+	pc->w0 = pc->winW;
+	pc->h0 = pc->winH;
+	return(pc);
 }
 
-double planet1(double x, double y, double z) {
-	double abx,aby,abz, acx,acy,acz, adx,ady,adz, apx,apy,apz;
-	double bax,bay,baz, bcx,bcy,bcz, bdx,bdy,bdz, bpx,bpy,bpz;
+void planet_size(planetcontext *pc, int *w, int *h) {
+	void mapsize(planetcontext *pc, int *w, int *h);
 
-	/* check if point is inside cached tetrahedron */
-	abx = ssb.x - ssa.x;
-	aby = ssb.y - ssa.y;
-	abz = ssb.z - ssa.z;
-	acx = ssc.x - ssa.x;
-	acy = ssc.y - ssa.y;
-	acz = ssc.z - ssa.z;
-	adx = ssd.x - ssa.x;
-	ady = ssd.y - ssa.y;
-	adz = ssd.z - ssa.z;
-	apx = x - ssa.x;
-	apy = y - ssa.y;
-	apz = z - ssa.z;
+	mapsize(pc, w, h);
+}
 
-	if ((adx*aby*acz + ady*abz*acx + adz*abx*acy
-	   - adz*aby*acx - ady*abx*acz - adx*abz*acy) *
-	    (apx*aby*acz + apy*abz*acx + apz*abx*acy
-	   - apz*aby*acx - apy*abx*acz - apx*abz*acy) > 0.0) {
-		/* p is on same side of abc as d */
-		if ((acx*aby*adz + acy*abz*adx + acz*abx*ady
-		    -acz*aby*adx - acy*abx*adz - acx*abz*ady) *
-		    (apx*aby*adz + apy*abz*adx + apz*abx*ady
-		    -apz*aby*adx - apy*abx*adz - apx*abz*ady) > 0.0) {
-			/* p is on same side of abd as c */
-			if ((abx*ady*acz + aby*adz*acx + abz*adx*acy
-		        -abz*ady*acx - aby*adx*acz - abx*adz*acy)*
-			    (apx*ady*acz + apy*adz*acx + apz*adx*acy
-			    -apz*ady*acx - apy*adx*acz - apx*adz*acy) > 0.0) {
-				/* p is on same side of acd as b */
-				bax = -abx;
-				bay = -aby;
-				baz = -abz;
-				bcx = ssc.x - ssb.x;
-				bcy = ssc.y - ssb.y;
-				bcz = ssc.z - ssb.z;
-				bdx = ssd.x - ssb.x;
-				bdy = ssd.y - ssb.y;
-				bdz = ssd.z - ssb.z;
-				bpx = x - ssb.x;
-				bpy = y - ssb.y;
-				bpz = z - ssb.z;
-				if ((bax*bcy*bdz + bay*bcz*bdx + baz*bcx*bdy
-			        -baz*bcy*bdx - bay*bcx*bdz - bax*bcz*bdy) *
-			        (bpx*bcy*bdz + bpy*bcz*bdx + bpz*bcx*bdy
-			        -bpz*bcy*bdx - bpy*bcx*bdz - bpx*bcz*bdy) > 0.0) {
-					/* p is on same side of bcd as a */
-					/* Hence, p is inside cached tetrahedron */
-					/* so we start from there */
-					return(planet(ssa, ssb, ssc, ssd, x, y, z, 11));
-				}
+int planet_window(planetcontext *pc, int x, int y, int w, int h) {
+	void windowplane(planetcontext *pc);
+
+	if (w == 0 && h == 0) {
+		pc->winX = pc->x0;
+		pc->winY = pc->y0;
+		pc->winW = pc->w0;
+		pc->winH = pc->h0;
+	} else if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+	           x + w > pc->Width / pc->superN || y + h > pc->Height / pc->superN) {
+		fprintf(stderr, "Window %d %d %d %d is not inside the %d x %d map\n",
+		        x, y, w, h, pc->Width / pc->superN, pc->Height / pc->superN);
+		return(-1);
+	} else {
+		pc->winX = x * pc->superN;
+		pc->winY = y * pc->superN;
+		pc->winW = w * pc->superN;
+		pc->winH = h * pc->superN;
+	}
+	windowplane(pc);
+	return(0);
+}
+
+int planet_render(planetcontext *pc, unsigned char *rgb, long stride, float *alt, long altStride) {
+	jmp_buf env;
+	int j, w, h;
+	int makemap(planetcontext *pc, FILE *outfile);
+	void freeplanes(planetcontext *pc);
+	void maprow(planetcontext *pc, unsigned char *p, int j, int bgr),
+	     mapsize(planetcontext *pc, int *w, int *h);
+
+	if (alt != NULL && (pc->superN > 1 || pc->riverMin > 0 || pc->flowName[0] != '\0')) {
+		fprintf(stderr, "Altitudes can not be rendered with --supersample, --rivers or --flow\n");
+		return(-1);
+	}
+	Depth = pc->depth;
+	pc->keepAlt = alt != NULL;
+	planetcatch(&env);
+	if (setjmp(env)) {
+		planetcatch(NULL);
+		freeplanes(pc);
+		pc->keepAlt = 0;
+		return(-1);
+	}
+	makemap(pc, NULL);
+	planetcatch(NULL);
+
+	mapsize(pc, &w, &h);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (j = 0; j < h; j++) {
+		int i;
+		maprow(pc, rgb + j * stride, j, 0);
+		if (alt != NULL) {
+			for (i = 0; i < w; i++) {
+				alt[j * altStride + i] = pc->altPlane[(size_t)(i + pc->winX - pc->planeX) * pc->planeH + j + pc->winY - pc->planeY];
 			}
 		}
 	}
-	/* otherwise, we start from scratch */
+	if (pc->failed) { /* memory ran out in a row of --supersample */
+		pc->failed = 0;
+		fprintf(stderr, "Memory allocation failed.");
+		freeplanes(pc);
+		pc->keepAlt = 0;
+		return(-1);
+	}
+	freeplanes(pc);
+	pc->keepAlt = 0;
+	return(0);
+}
 
-	return(planet(tetra[0], tetra[1], tetra[2], tetra[3], /* vertices of tetrahedron */
-	              x, y, z, /* coordinates of point we want colour of */
-	              Depth)); /* subdivision depth */
+int planet_point(planetcontext *pc, double lon, double lat, unsigned char *rgb, double *alt) {
+	jmp_buf env;
+	double a, lo, la;
+	int c;
+	int colourpoint(planetcontext *pc, double x, double y, double z, double *altp);
+
+	Depth = pc->depth;
+	planetcatch(&env);
+	if (setjmp(env)) {
+		planetcatch(NULL);
+		return(-1);
+	}
+	lo = lon * DEG2RAD;
+	la = lat * DEG2RAD;
+	c = colourpoint(pc, sin(lo) * cos(la), -sin(la), cos(lo) * cos(la), &a);
+	planetcatch(NULL);
+	if (rgb != NULL) {
+		rgb[0] = pc->rtable[c];
+		rgb[1] = pc->gtable[c];
+		rgb[2] = pc->btable[c];
+	}
+	if (alt != NULL) *alt = a;
+	return(0);
+}
 
+void planet_close(planetcontext *pc) {
+	void freeplanet(planetcontext *pc);
+
+	if (pc == NULL) return;
+	freeplanet(pc);
+	free(pc);
 }
 
-void printppm(FILE *outfile) { /* prints picture in PPM (portable pixel map) format */
-	int i, j, c, s;
 
-	fprintf(outfile, "P6\n");
-	fprintf(outfile, "#fractal planet image\n");
-	fprintf(outfile, "# Command line:\n# %s\n", cmdLine);
-	fprintf(outfile, "%d %d 255\n", Width, Height);
-
-	if (doshade) {
-		for (j = 0; j < Height; j++) {
-			for (i = 0; i < Width; i++) {
-				s = shades[i][j];
-				c = s * rtable[col[i][j]] / 150;
-				if (c > 255) {c = 255;}
-				putc(c, outfile);
-				c = s * gtable[col[i][j]] / 150;
-				if (c > 255) {c = 255;}
-				putc(c, outfile);
-				c = s * btable[col[i][j]] / 150;
-				if (c > 255) {c = 255;}
-				putc(c, outfile);
+#ifdef SERVE
+/* --serve: planets kept open between requests on a Unix socket. Each */
+/* request is one line with a JSON object: */
+/*   {"args": ["-s", "0.2", "-pq"], "window": [x, y, w, h], */
+/*    "format": "rgb" or "ppm", "altitude": true} renders the map, */
+/*   {"args": [...], "point": [lon, lat]} colours one point, and */
+/*   {"quit": true} stops the server. */
+/* A map is answered by a line {"ok": true, "width": w, "height": h, */
+/* "bytes": n} followed by n bytes: the rows of red, green and blue */
+/* (after a PPM header with "ppm"), then with "altitude" the rows of */
+/* altitudes as floats in the byte order of the server. Errors are */
+/* answered by {"ok": false, "error": "..."}, as are lines nested more */
+/* than SERVEDEPTH deep and numbers that are not finite or too large. */
+/* Options that write files or read standard input are refused. The requests of a connection */
+/* are answered in turn, and those of different connections at the */
+/* same time by tasks of OpenMP; the answers are sent as the clients */
+/* take them, so a slow client does not hold up the others. */
+
+#define SERVEPLANETS 8 /* planets kept open, least recently used closed */
+#define SERVECLIENTS 32 /* connections at a time */
+#define SERVEARGS 100 /* options in a request */
+#define SERVETHREADS 4 /* requests answered at the same time */
+#define SERVEDEPTH 64 /* arrays and objects nested deeper are refused */
+
+typedef struct ServePlanet {
+	char *key; /* its options, separated by newlines */
+	planetcontext *pc; /* NULL until the request that made key opens it */
+	long used; /* number of the request that last used it */
+	int busy; /* if 1, a request is using it */
+} serveplanet;
+
+typedef struct ServeClient {
+	int fd; /* -1 if unused */
+	char *line; /* what has been read of the next requests */
+	size_t len, size;
+	char *out; /* answer being sent, and how much of it is sent */
+	size_t outLen, outDone;
+	int busy; /* if 1, a request of it is being answered */
+	int ended; /* if 1, nothing more is read from it */
+	int gone; /* if 1, it can not be answered, and is closed */
+} serveclient;
+
+typedef struct ServeJob { /* request given to a task */
+	char *line; /* the request */
+	char args[4096], *av[SERVEARGS + 1]; /* its options */
+	int ac;
+	int client, planet; /* places in clients and planets of serve() */
+	int threads; /* of OpenMP, to render with */
+	char *answer; /* made by the task, NULL if out of memory */
+	size_t len;
+	struct ServeJob *next; /* in the list of answered jobs */
+} servejob;
+
+char *jsonspace(char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+	return(p);
+}
+
+char *jsonstring(char *p, char *out, size_t size) {
+	/* read the string at p into out, return what follows it, or NULL */
+	size_t n = 0;
+	int c;
+
+	p = jsonspace(p);
+	if (*p++ != '"') return(NULL);
+	while (*p != '"') {
+		c = *p++;
+		if (c == '\0') return(NULL);
+		if (c == '\\') {
+			c = *p++;
+			switch (c) {
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case 'r': c = '\r'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case '"': case '\\': case '/': break;
+			case 'u': { /* only ASCII is needed in options */
+				char hex[5];
+				if (strlen(p) < 4) return(NULL);
+				memcpy(hex, p, 4);
+				hex[4] = '\0';
+				c = (int)strtol(hex, NULL, 16);
+				if (c <= 0 || c > 127) return(NULL);
+				p += 4;
+				break;
 			}
-		}
-	} else {
-		for (j = 0; j < Height; j++) {
-			for (i = 0; i < Width; i++) {
-				putc(rtable[col[i][j]], outfile);
-				putc(gtable[col[i][j]], outfile);
-				putc(btable[col[i][j]], outfile);
+			default: return(NULL);
 			}
 		}
+		if (n + 1 >= size) return(NULL);
+		out[n++] = c;
 	}
-	fclose(outfile);
+	out[n] = '\0';
+	return(p + 1);
 }
 
-void printppmBW(FILE *outfile) { /* prints picture in b/w PPM format */
-	int i, j, c;
-
-	fprintf(outfile, "P6\n");
-	fprintf(outfile, "#fractal planet image\n");
-	fprintf(outfile, "# Command line:\n# %s\n", cmdLine);
-	fprintf(outfile, "%d %d 1\n", Width, Height);
+char *jsonskip(char *p, int depth) { /* what follows the value at p, or NULL */
+	/* (also if arrays and objects are nested more than depth deep) */
+	char close;
+	char *jsonspace(char *p);
 
-	for (j = 0; j < Height; j++) {
-		for (i = 0; i < Width; i++) {
-			if (col[i][j] < WHITE) {
-				c = 0;
-			} else {
-				c = 1;
+	p = jsonspace(p);
+	if (*p == '"') {
+		for (p++; *p != '"'; p++) {
+			if (*p == '\0') return(NULL);
+			if (*p == '\\' && p[1] != '\0') p++;
+		}
+		return(p + 1);
+	}
+	if (*p == '[' || *p == '{') {
+		if (depth <= 0) return(NULL);
+		close = *p == '[' ? ']' : '}';
+		p = jsonspace(p + 1);
+		if (*p == close) return(p + 1);
+		for (;;) {
+			if (close == '}') { /* key of member */
+				p = jsonskip(p, depth - 1);
+				if (p == NULL) return(NULL);
+				p = jsonspace(p);
+				if (*p++ != ':') return(NULL);
 			}
-			putc(c, outfile);
-			putc(c, outfile);
-			putc(c, outfile);
+			p = jsonskip(p, depth - 1);
+			if (p == NULL) return(NULL);
+			p = jsonspace(p);
+			if (*p == close) return(p + 1);
+			if (*p++ != ',') return(NULL);
 		}
 	}
-	fclose(outfile);
+	if (*p == '\0' || strchr("-0123456789tfn", *p) == NULL) return(NULL);
+	while (*p != '\0' && strchr(",]} \t\r\n", *p) == NULL) p++; /* number, true, false or null */
+	return(p);
 }
 
-void printbmp(FILE *outfile) { /* prints picture in BMP format */
-	int i, j, c, s0, s, W1;
-
-	fprintf(outfile, "BM");
+char *jsonfind(char *p, const char *key) { /* value of key in the object at p, or NULL */
+	char name[256];
+	char *jsonspace(char *p), *jsonstring(char *p, char *out, size_t size), *jsonskip(char *p, int depth);
+
+	p = jsonspace(p);
+	if (*p++ != '{') return(NULL);
+	p = jsonspace(p);
+	if (*p == '}') return(NULL);
+	for (;;) {
+		p = jsonstring(p, name, sizeof(name));
+		if (p == NULL) return(NULL);
+		p = jsonspace(p);
+		if (*p++ != ':') return(NULL);
+		p = jsonspace(p);
+		if (strcmp(name, key) == 0) return(p);
+		p = jsonskip(p, SERVEDEPTH);
+		if (p == NULL) return(NULL);
+		p = jsonspace(p);
+		if (*p++ != ',') return(NULL);
+	}
+}
 
-	W1 = (3 * Width + 3);
-	W1 -= W1 % 4;
-	s0 = (strlen(cmdLine) + strlen("Command line:\n\n") + 3) & 0xffc;
-	s = s0 + 54 + W1 * Height; /* file size */
-	putc(s & 255, outfile);
-	putc((s >> 8) & 255, outfile);
-	putc((s >> 16) & 255, outfile);
-	putc(s >> 24, outfile);
+int jsonnumbers(char *p, double *x, int n) { /* read an array of n numbers, */
+	/* which must be finite and small enough to be cast to int */
+	int k;
+	char *e;
+	char *jsonspace(char *p);
+
+	if (p == NULL || *p++ != '[') return(0);
+	for (k = 0; k < n; k++) {
+		x[k] = strtod(p, &e);
+		if (e == p || !(fabs(x[k]) <= 1e9)) return(0); /* also NaN */
+		p = jsonspace(e);
+		if (*p++ != (k < n - 1 ? ',' : ']')) return(0);
+	}
+	return(1);
+}
 
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+int servewrite(int fd, const char *p, size_t n) { /* send all of p, 0 if the client is gone */
+	ssize_t k;
 
-	putc(54, outfile); /* offset to data */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+	while (n > 0) {
+		k = write(fd, p, n);
+		if (k < 0 && errno == EINTR) continue;
+		if (k <= 0) return(0);
+		p += k;
+		n -= k;
+	}
+	return(1);
+}
 
-	putc(40, outfile); /* size of infoheader */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+char *serveerror(const char *message, size_t *len) { /* answer of an error, or NULL */
+	char *line = (char*)malloc(300);
 
-	putc(Width & 255, outfile);
-	putc((Width >> 8) & 255, outfile);
-	putc((Width >> 16) & 255, outfile);
-	putc(Width >> 24, outfile);
+	if (line == NULL) return(NULL);
+	sprintf(line, "{\"ok\": false, \"error\": \"%.250s\"}\n", message);
+	*len = strlen(line);
+	return(line);
+}
 
-	putc(Height & 255, outfile);
-	putc((Height >> 8) & 255, outfile);
-	putc((Height >> 16) & 255, outfile);
-	putc(Height >> 24, outfile);
+int serveargs(servejob *job, char *line, char *key, const char **error) {
+	/* read the options of the request into job, and make its key */
+	/* (the options separated by newlines); 0 and an error if bad */
+	static const char *refused[] = { /* write files or read standard input */
+		"--contours", "--coast", "--coastdist", "--components", "--labels",
+		"--flow", "--normals", "--session", "--master", "-M"
+	};
+	size_t n = 0, r;
+	int k;
+	char *p;
+	char *jsonspace(char *p), *jsonstring(char *p, char *out, size_t size), *jsonfind(char *p, const char *key);
+	char *jsonskip(char *p, int depth);
+
+	if (jsonskip(line, SERVEDEPTH) == NULL) {
+		*error = "not JSON, or nested too deep";
+		return(0);
+	}
+	p = jsonfind(line, "args");
+	if (p == NULL || *p++ != '[') {
+		*error = "no \\\"args\\\"";
+		return(0);
+	}
+	job->av[0] = "planet";
+	job->ac = 1;
+	p = jsonspace(p);
+	if (*p == ']') {
+		*error = "no options in \\\"args\\\"";
+		return(0);
+	}
+	for (;;) {
+		if (job->ac > SERVEARGS) {
+			*error = "too many options";
+			return(0);
+		}
+		p = jsonstring(p, job->args + n, sizeof(job->args) - n);
+		if (p == NULL) {
+			*error = "bad \\\"args\\\"";
+			return(0);
+		}
+		for (r = 0; r < sizeof(refused) / sizeof(refused[0]); r++) {
+			if (strcmp(job->args + n, refused[r]) == 0) {
+				*error = "options that write files or read standard input can not be used";
+				return(0);
+			}
+		}
+		job->av[job->ac++] = job->args + n;
+		n += strlen(job->args + n) + 1;
+		p = jsonspace(p);
+		if (*p == ']') break;
+		if (*p++ != ',') {
+			*error = "bad \\\"args\\\"";
+			return(0);
+		}
+	}
+	for (k = 0; k < (int)n - 1; k++) key[k] = job->args[k] != '\0' ? job->args[k] : '\n';
+	key[n - 1] = '\0';
+	return(1);
+}
 
-	putc(1, outfile); /* no. of planes = 1 */
-	putc(0, outfile);
+int serveplace(serveplanet *planets, char *key, long request) {
+	/* place of the planet of key, taken for a request: -1 if it (or */
+	/* every place) is taken by other requests, -2 if out of memory */
+	int k, last = -1;
+
+	for (k = 0; k < SERVEPLANETS; k++) {
+		if (planets[k].key != NULL && strcmp(planets[k].key, key) == 0) {
+			if (planets[k].busy) return(-1);
+			planets[k].busy = 1;
+			planets[k].used = request;
+			return(k);
+		}
+	}
+	for (k = 0; k < SERVEPLANETS; k++) { /* free place, or the least recently used */
+		if (planets[k].key == NULL) {
+			last = k;
+			break;
+		}
+		if (!planets[k].busy && (last < 0 || planets[k].used < planets[last].used)) last = k;
+	}
+	if (last < 0) return(-1);
+	if (planets[last].key != NULL) {
+		planet_close(planets[last].pc);
+		free(planets[last].key);
+	}
+	planets[last].pc = NULL; /* opened by the request */
+	planets[last].key = (char*)malloc(strlen(key) + 1);
+	if (planets[last].key == NULL) return(-2);
+	strcpy(planets[last].key, key);
+	planets[last].busy = 1;
+	planets[last].used = request;
+	return(last);
+}
 
-	putc(24, outfile); /* bpp */
-	putc(0, outfile);
+void serveanswer(servejob *job, serveplanet *planet) {
+	/* answer the request of job with its planet (a task of serve()) */
+	char header[120], ppm[40], *p;
+	double v[4];
+	float *alt = NULL;
+	int head, w, h, k;
+	size_t n, hn, an;
+	planetcontext *pc;
+	int jsonnumbers(char *p, double *x, int n);
+	char *jsonfind(char *p, const char *key), *serveerror(const char *message, size_t *len);
+
+#ifdef _OPENMP
+	omp_set_num_threads(job->threads);
+#endif
+	if (planet->pc == NULL) planet->pc = planet_open(job->ac, job->av);
+	pc = planet->pc;
+	if (pc == NULL) {
+		job->answer = serveerror("could not make the planet (see the log of the server)", &job->len);
+		return;
+	}
 
-	putc(0, outfile); /* no compression */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+	p = jsonfind(job->line, "point");
+	if (p != NULL) {
+		unsigned char c[3];
+		double a;
+		if (!jsonnumbers(p, v, 2)) {
+			job->answer = serveerror("bad \\\"point\\\"", &job->len);
+		} else if (planet_point(pc, v[0], v[1], c, &a) != 0) {
+			job->answer = serveerror("could not colour the point", &job->len);
+		} else {
+			sprintf(header, "{\"ok\": true, \"rgb\": [%d, %d, %d], \"altitude\": %.9g}\n", c[0], c[1], c[2], a);
+			job->len = strlen(header);
+			job->answer = (char*)malloc(job->len);
+			if (job->answer != NULL) memcpy(job->answer, header, job->len);
+		}
+		return;
+	}
 
-	putc(0, outfile); /* image size (unspecified) */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+	p = jsonfind(job->line, "window");
+	if (p != NULL) {
+		if (!jsonnumbers(p, v, 4)) {
+			job->answer = serveerror("bad \\\"window\\\"", &job->len);
+			return;
+		}
+		k = planet_window(pc, (int)v[0], (int)v[1], (int)v[2], (int)v[3]);
+	} else {
+		k = planet_window(pc, 0, 0, 0, 0);
+	}
+	if (k != 0) {
+		job->answer = serveerror("window is not inside the map", &job->len);
+		return;
+	}
+	planet_size(pc, &w, &h);
+	/* the answer is the line, the PPM header (if any), the colours and */
+	/* the altitudes (if asked for) */
+	p = jsonfind(job->line, "format");
+	head = p != NULL && strncmp(p, "\"ppm\"", 5) == 0 ? sprintf(ppm, "P6\n%d %d 255\n", w, h) : 0;
+	n = (size_t)3 * w * h;
+	p = jsonfind(job->line, "altitude");
+	an = p != NULL && strncmp(p, "true", 4) == 0 ? (size_t)w * h * sizeof(float) : 0;
+	if (an > 0) {
+		alt = (float*)malloc(an);
+		if (alt == NULL) {
+			job->answer = serveerror("out of memory", &job->len);
+			return;
+		}
+	}
+	hn = sprintf(header, "{\"ok\": true, \"width\": %d, \"height\": %d, \"bytes\": %lu}\n",
+	             w, h, (unsigned long)(head + n + an));
+	job->len = hn + head + n + an;
+	job->answer = (char*)malloc(job->len);
+	if (job->answer == NULL) {
+		free(alt);
+		job->answer = serveerror("out of memory", &job->len);
+		return;
+	}
+	memcpy(job->answer, header, hn);
+	memcpy(job->answer + hn, ppm, head);
+	if (planet_render(pc, (unsigned char*)job->answer + hn + head, 3L * w, alt, w) != 0) {
+		free(alt);
+		free(job->answer);
+		job->answer = serveerror("could not render the map (see the log of the server)", &job->len);
+		return;
+	}
+	if (alt != NULL) memcpy(job->answer + hn + head + n, alt, an);
+	free(alt);
+}
 
-	putc(0, outfile); /* h. pixels/m */
-	putc(32, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+void serveclose(serveclient *c) {
+	close(c->fd);
+	free(c->line);
+	free(c->out);
+	c->fd = -1;
+	c->line = c->out = NULL;
+	c->len = c->size = c->outLen = c->outDone = 0;
+	c->busy = c->ended = c->gone = 0;
+}
 
-	putc(0, outfile); /* v. pixels/m */
-	putc(32, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+int serve(const char *path) {
+	struct sockaddr_un addr;
+	struct stat st;
+	serveplanet planets[SERVEPLANETS];
+	serveclient clients[SERVECLIENTS];
+	servejob *done = NULL; /* answered jobs, not yet given to their clients */
+	int wake[2]; /* written by each answered job, to end select() */
+	int listener, k, stop = 0;
+	long request = 0;
+	char *serveerror(const char *message, size_t *len);
+	int serveargs(servejob *job, char *line, char *key, const char **error);
+	int serveplace(serveplanet *planets, char *key, long request);
+	void serveanswer(servejob *job, serveplanet *planet), serveclose(serveclient *c);
+	int servewrite(int fd, const char *p, size_t n);
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket name %s is too long\n", path);
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); /* left by an earlier server */
+	signal(SIGPIPE, SIG_IGN); /* clients that leave are found by write() */
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+		fprintf(stderr, "Could not listen on %s, error code = %d\n", path, errno);
+		exit(1);
+	}
+	if (pipe(wake) < 0 || fcntl(wake[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(wake[1], F_SETFL, O_NONBLOCK) < 0) {
+		fprintf(stderr, "Could not make a pipe, error code = %d\n", errno);
+		exit(1);
+	}
+	fprintf(stderr, "Serving on %s\n", path);
 
-	putc(0, outfile); /* colours used (unspecified) */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+	memset(planets, 0, sizeof(planets));
+	memset(clients, 0, sizeof(clients));
+	for (k = 0; k < SERVECLIENTS; k++) clients[k].fd = -1;
 
-	putc(0, outfile); /* important colours (all) */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+#ifdef _OPENMP
+	omp_set_max_active_levels(2); /* the requests render in parallel too */
+#pragma omp parallel num_threads(SERVETHREADS + 1)
+#pragma omp single
+#endif
+	while (!stop) {
+		fd_set readable, writable;
+		int fd, top, running = 0;
+		char buffer[64];
+
+		/* answered jobs: send their answers, and free their planets */
+#ifdef _OPENMP
+#pragma omp critical (servedone)
+#endif
+		{
+			while (done != NULL) {
+				servejob *job = done;
+				serveclient *c = clients + job->client;
+				done = job->next;
+				c->busy = 0;
+				if (job->answer == NULL) c->gone = 1; /* out of memory */
+				c->out = job->answer;
+				c->outLen = job->len;
+				c->outDone = 0;
+				planets[job->planet].busy = 0;
+				if (planets[job->planet].pc == NULL) { /* could not be opened */
+					free(planets[job->planet].key);
+					planets[job->planet].key = NULL;
+				}
+				free(job->line);
+				free(job);
+			}
+		}
+		while (read(wake[0], buffer, sizeof(buffer)) > 0) ;
+
+		/* give the next request of each idle client to a task */
+		for (k = 0; k < SERVECLIENTS; k++) running += clients[k].fd >= 0 && clients[k].busy;
+		for (k = 0; k < SERVECLIENTS && !stop; k++) {
+			serveclient *c = clients + k;
+			servejob *job;
+			char key[4096], *nl, *p;
+			const char *error;
+			size_t start;
+			if (c->fd < 0 || c->busy || c->gone || c->out != NULL) continue;
+			while (!c->busy && c->out == NULL && c->len > 0 && (nl = (char*)memchr(c->line, '\n', c->len)) != NULL) {
+				*nl = '\0';
+				start = nl + 1 - c->line;
+				if (*jsonspace(c->line) == '\0') { /* blank lines are skipped */
+					memmove(c->line, c->line + start, c->len - start);
+					c->len -= start;
+					continue;
+				}
+				p = jsonfind(c->line, "quit");
+				if (p != NULL && strncmp(p, "true", 4) == 0) {
+					stop = 1;
+					break;
+				}
+				job = (servejob*)malloc(sizeof(servejob));
+				if (job == NULL) {
+					c->gone = 1;
+					break;
+				}
+				if (!serveargs(job, c->line, key, &error)) {
+					free(job);
+					c->out = serveerror(error, &c->outLen);
+					c->outDone = 0;
+					if (c->out == NULL) c->gone = 1;
+				} else if ((job->planet = serveplace(planets, key, request + 1)) == -1) {
+					free(job); /* wait for the planet */
+					*nl = '\n';
+					break;
+				} else if (job->planet < 0) {
+					free(job);
+					c->out = serveerror("out of memory", &c->outLen);
+					c->outDone = 0;
+					if (c->out == NULL) c->gone = 1;
+				} else {
+					job->line = (char*)malloc(start);
+					if (job->line == NULL) {
+						planets[job->planet].busy = 0;
+						free(job);
+						c->gone = 1;
+						break;
+					}
+					memcpy(job->line, c->line, start);
+					job->client = k;
+					job->threads = 1;
+#ifdef _OPENMP
+					job->threads = max(1, omp_get_num_procs() / (running + 1));
+#endif
+					job->answer = NULL;
+					job->len = 0;
+					c->busy = 1;
+					running++;
+					request++;
+#ifdef _OPENMP
+#pragma omp task firstprivate(job)
+#endif
+					{
+						serveanswer(job, planets + job->planet);
+#ifdef _OPENMP
+#pragma omp critical (servedone)
+#endif
+						{
+							job->next = done;
+							done = job;
+						}
+						while (write(wake[1], "", 1) < 0 && errno == EINTR) ;
+					}
+				}
+				memmove(c->line, c->line + start, c->len - start);
+				c->len -= start;
+			}
+		}
+		if (stop) break;
+
+		/* clients that have left, or have nothing more to be answered */
+		for (k = 0; k < SERVECLIENTS; k++) {
+			serveclient *c = clients + k;
+			if (c->fd < 0 || c->busy) continue;
+			if (c->gone || (c->ended && c->out == NULL && (c->len == 0 || memchr(c->line, '\n', c->len) == NULL))) {
+				serveclose(c);
+			}
+		}
 
-	if (doshade) {
-		for (j = Height - 1; j >= 0; j--) {
-			for (i = 0; i < Width; i++) {
-				s = shades[i][j];
-				c = s * btable[col[i][j]] / 150;
-				if (c > 255) {c = 255;}
-				putc(c, outfile);
-				c = s * gtable[col[i][j]] / 150;
-				if (c > 255) {c = 255;}
-				putc(c, outfile);
-				c = s * rtable[col[i][j]] / 150;
-				if (c > 255) {c = 255;}
-				putc(c, outfile);
-			}
-			for (i = 3 * Width; i < W1; i++) putc(0, outfile);
+		FD_ZERO(&readable);
+		FD_ZERO(&writable);
+		FD_SET(listener, &readable);
+		FD_SET(wake[0], &readable);
+		top = max(listener, wake[0]);
+		for (k = 0; k < SERVECLIENTS; k++) {
+			serveclient *c = clients + k;
+			if (c->fd < 0) continue;
+			/* the next request is read when the last one is answered */
+			if (!c->ended && !c->busy && c->out == NULL && (c->len == 0 || memchr(c->line, '\n', c->len) == NULL)) {
+				FD_SET(c->fd, &readable);
+			}
+			if (c->out != NULL) FD_SET(c->fd, &writable);
+			top = max(top, c->fd);
 		}
-	} else {
-		for (j = Height - 1; j >= 0; j--) {
-			for (i = 0; i < Width; i++) {
-				putc(btable[col[i][j]], outfile);
-				putc(gtable[col[i][j]], outfile);
-				putc(rtable[col[i][j]], outfile);
+		if (select(top + 1, &readable, &writable, NULL, NULL) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "select() failed, error code = %d\n", errno);
+			break;
+		}
+		if (FD_ISSET(listener, &readable) && (fd = accept(listener, NULL, NULL)) >= 0) {
+			for (k = 0; k < SERVECLIENTS && clients[k].fd >= 0; k++) ;
+			if (k < SERVECLIENTS && fd < FD_SETSIZE && fcntl(fd, F_SETFL, O_NONBLOCK) == 0) {
+				clients[k].fd = fd;
+			} else {
+				const char *full = "{\"ok\": false, \"error\": \"too many connections\"}\n";
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				servewrite(fd, full, strlen(full));
+				close(fd);
+			}
+		}
+		for (k = 0; k < SERVECLIENTS; k++) {
+			serveclient *c = clients + k;
+			ssize_t n;
+			if (c->fd < 0) continue;
+			if (c->out != NULL && FD_ISSET(c->fd, &writable)) {
+				n = write(c->fd, c->out + c->outDone, c->outLen - c->outDone);
+				if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) n = 0;
+				if (n < 0) {
+					c->gone = 1;
+				} else {
+					c->outDone += n;
+				}
+				if (c->gone || c->outDone == c->outLen) {
+					free(c->out);
+					c->out = NULL;
+					c->outLen = c->outDone = 0;
+				}
 			}
-			for (i = 3 * Width; i < W1; i++) putc(0, outfile);
+			if (c->ended || c->gone || !FD_ISSET(c->fd, &readable)) continue;
+			if (c->size - c->len < 4096) {
+				char *line = NULL;
+				if (c->size < (1 << 20)) line = (char*)realloc(c->line, c->size + 65536);
+				if (line == NULL) { /* no request is that long */
+					c->out = serveerror("request too long", &c->outLen);
+					c->outDone = 0;
+					c->len = 0;
+					c->ended = 1;
+					if (c->out == NULL) c->gone = 1;
+					continue;
+				}
+				c->line = line;
+				c->size += 65536;
+			}
+			n = read(c->fd, c->line + c->len, c->size - c->len - 1);
+			if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+			if (n <= 0) { /* requests already read are still answered */
+				c->ended = 1;
+				continue;
+			}
+			c->len += n;
 		}
 	}
-	fprintf(outfile, "Command line:\n%s\n", cmdLine);
-	fclose(outfile);
-}
 
-void printbmpBW(FILE *outfile) { /* prints picture in b/w BMP format */
-	int i, j, c, s, s0, W1;
+	while (done != NULL) { /* answers of clients that were not waited for */
+		servejob *job = done;
+		done = job->next;
+		free(job->answer);
+		free(job->line);
+		free(job);
+	}
+	for (k = 0; k < SERVECLIENTS; k++) {
+		if (clients[k].fd >= 0) serveclose(clients + k);
+	}
+	for (k = 0; k < SERVEPLANETS; k++) {
+		if (planets[k].key != NULL) {
+			planet_close(planets[k].pc);
+			free(planets[k].key);
+		}
+	}
+	close(wake[0]);
+	close(wake[1]);
+	close(listener);
+	unlink(path);
+	return(0);
+}
 
-	fprintf(outfile, "BM");
+/* --tiles: a local HTTP server of the Web Mercator tiles of a planet, */
+/* GET /z/x/y.bmp giving the 256 x 256 window at (256x, 256y) of the */
+/* Mercator map 256 * 2^z pixels wide and high (the latitudes of the */
+/* map reach 85.05 degrees, so it is square). The last TILEMEMORY tiles */
+/* are kept in memory, and with --tilecache the last TILEDISK on disk, */
+/* together with the options, so tiles of another planet are not used. */
+/* Requests are read from all connections before a tile is rendered, */
+/* and the tile of lowest zoom asked for is rendered first, answering */
+/* all requests for it. Other paths are answered 404. Only with */
+/* --tilequit does GET /quit stop the server, as any local user can send it. */
+
+#define TILESIZE 256
+#define TILEZOOMS 21 /* zoom levels 0 to 20 */
+#define TILEMEMORY 256 /* tiles kept in memory */
+#define TILEDISK 65536 /* tiles kept on disk */
+#define TILEBYTES (54 + 3 * TILESIZE * TILESIZE) /* size of BMP of a tile */
+
+typedef struct TileEntry { /* tile in memory or on disk */
+	int z, x, y; /* z = -1 if unused */
+	long used; /* number of the request that last asked for it */
+	unsigned char *bmp; /* the BMP file, if in memory */
+} tileentry;
+
+typedef struct TileClient {
+	int fd; /* -1 if unused */
+	char request[2048];
+	int len;
+	int z, x, y; /* tile waited for, z = -1 while the request is read */
+} tileclient;
+
+tileentry *tilefind(tileentry *t, int n, int z, int x, int y, long used) {
+	/* the entry of the tile (marked as used), or NULL */
+	int k;
+
+	for (k = 0; k < n; k++) {
+		if (t[k].z == z && t[k].x == x && t[k].y == y) {
+			t[k].used = used;
+			return(t + k);
+		}
+	}
+	return(NULL);
+}
 
-	W1 = (Width + 31);
-	W1 -= W1 % 32;
-	s0 = (strlen(cmdLine) + strlen("Command line:\n\n") + 3) & 0xffc;
-	s = s0 + 62 + (W1 * Height) / 8; /* file size */
-	putc(s & 255, outfile);
-	putc((s >> 8) & 255, outfile);
-	putc((s >> 16) & 255, outfile);
-	putc(s >> 24, outfile);
+tileentry *tileslot(tileentry *t, int n) { /* an unused entry, or the least recently used */
+	int k, last = 0;
 
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+	for (k = 0; k < n; k++) {
+		if (t[k].z < 0) return(t + k);
+		if (t[k].used < t[last].used) last = k;
+	}
+	return(t + last);
+}
 
-	putc(62, outfile); /* offset to data */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+void tilepath(char *path, const char *dir, int z, int x, int y, int make) {
+	/* name of the tile file, making its directories if make */
+	sprintf(path, "%s/%d", dir, z);
+	if (make) mkdir(path, 0777);
+	sprintf(path + strlen(path), "/%d", x);
+	if (make) mkdir(path, 0777);
+	sprintf(path + strlen(path), "/%d.bmp", y);
+}
 
-	putc(40, outfile); /* size of infoheader */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+void tilebmp(unsigned char *bmp, unsigned char *rgb) { /* BMP file of the colours of a tile */
+	int i, j, k;
+	static const unsigned char head[54] = {
+		'B', 'M', TILEBYTES & 255, (TILEBYTES >> 8) & 255, (TILEBYTES >> 16) & 255, 0,
+		0, 0, 0, 0, 54, 0, 0, 0, /* offset to data */
+		40, 0, 0, 0, TILESIZE & 255, TILESIZE >> 8, 0, 0, TILESIZE & 255, TILESIZE >> 8, 0, 0,
+		1, 0, 24, 0, 0, 0, 0, 0, /* planes, bpp, no compression */
+		0, 0, 0, 0, 0x13, 0x0b, 0, 0, 0x13, 0x0b, 0, 0, /* 72 dpi */
+		0, 0, 0, 0, 0, 0, 0, 0
+	};
+
+	memcpy(bmp, head, 54);
+	bmp += 54;
+	for (j = TILESIZE - 1; j >= 0; j--) { /* rows are bottom up, as bgr */
+		for (i = 0; i < TILESIZE; i++, bmp += 3) {
+			k = 3 * (j * TILESIZE + i);
+			bmp[0] = rgb[k + 2];
+			bmp[1] = rgb[k + 1];
+			bmp[2] = rgb[k];
+		}
+	}
+}
 
-	putc(Width & 255, outfile);
-	putc((Width >> 8) & 255, outfile);
-	putc((Width >> 16) & 255, outfile);
-	putc(Width >> 24, outfile);
+void tileoptions(const char *dir, int ac, char **av) {
+	/* make dir for tiles of the options av[1] .. av[ac - 1], or stop */
+	/* if it holds tiles of other options */
+	char path[1024], options[1000], *have = NULL;
+	size_t n = 0;
+	int i;
+	FILE *f;
 
-	putc(Height & 255, outfile);
-	putc((Height >> 8) & 255, outfile);
-	putc((Height >> 16) & 255, outfile);
-	putc(Height >> 24, outfile);
+	options[0] = '\0';
+	for (i = 1; i < ac; i++) {
+		if (strlen(options) + strlen(av[i]) + 2 > sizeof(options)) break;
+		strcat(options, av[i]);
+		strcat(options, " ");
+	}
+	mkdir(dir, 0777);
+	sprintf(path, "%s/options.txt", dir);
+	f = fopen(path, "r");
+	if (f != NULL) {
+		have = (char*)calloc(sizeof(options) + 1, 1);
+		if (have != NULL) n = fread(have, 1, sizeof(options), f);
+		fclose(f);
+		if (have == NULL || n != strlen(options) || strncmp(have, options, n) != 0) {
+			fprintf(stderr, "%s holds tiles made with other options:\n%s\n", dir, have != NULL ? have : "");
+			exit(1);
+		}
+		free(have);
+	} else {
+		f = fopen(path, "w");
+		if (f == NULL) {
+			fprintf(stderr, "Could not open file %s, error code = %d\n", path, errno);
+			exit(1);
+		}
+		fputs(options, f);
+		fclose(f);
+	}
+}
 
-	putc(1, outfile); /* no. of planes = 1 */
-	putc(0, outfile);
+int tileanswer(int fd, const char *status, const char *type, const unsigned char *body, size_t n) {
+	char head[256];
+	int servewrite(int fd, const char *p, size_t n);
 
-	putc(1, outfile); /* bpp */
-	putc(0, outfile);
+	sprintf(head, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+	        status, type, (unsigned long)n);
+	return(servewrite(fd, head, strlen(head)) && servewrite(fd, (const char*)body, n));
+}
 
-	putc(0, outfile); /* no compression */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+planetcontext *tileplanet(planetcontext **zooms, int ac, char **av, int z) {
+	/* the Mercator map of zoom level z, or NULL */
+	char size[20];
+
+	if (zooms[z] == NULL) {
+		sprintf(size, "%d", TILESIZE << z);
+		av[ac] = "-pm";
+		av[ac + 1] = "-m";
+		av[ac + 2] = "1";
+		av[ac + 3] = "-L";
+		av[ac + 4] = "0";
+		av[ac + 5] = "-w";
+		av[ac + 6] = size;
+		av[ac + 7] = "-h";
+		av[ac + 8] = size;
+		zooms[z] = planet_open(ac + 9, av);
+	}
+	return(zooms[z]);
+}
 
-	putc(0, outfile); /* image size (unspecified) */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+unsigned char *tilerender(planetcontext **zooms, int ac, char **av, int z, int x, int y) {
+	/* BMP file of the tile, or NULL */
+	unsigned char *rgb, *bmp;
+	planetcontext *tileplanet(planetcontext **zooms, int ac, char **av, int z);
+	void tilebmp(unsigned char *bmp, unsigned char *rgb);
+
+	if (tileplanet(zooms, ac, av, z) == NULL) return(NULL);
+	rgb = (unsigned char*)malloc(3 * TILESIZE * TILESIZE);
+	bmp = (unsigned char*)malloc(TILEBYTES);
+	if (rgb == NULL || bmp == NULL || planet_window(zooms[z], TILESIZE * x, TILESIZE * y, TILESIZE, TILESIZE) != 0 ||
+	    planet_render(zooms[z], rgb, 3 * TILESIZE, NULL, 0) != 0) {
+		free(rgb);
+		free(bmp);
+		return(NULL);
+	}
+	tilebmp(bmp, rgb);
+	free(rgb);
+	return(bmp);
+}
 
-	putc(0, outfile); /* h. pixels/m */
-	putc(32, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+int tileserve(int ac, char **av) {
+	struct sockaddr_in addr;
+	planetcontext *zooms[TILEZOOMS];
+	tileentry *memory, *disk, *e;
+	tileclient clients[SERVECLIENTS];
+	fd_set ready;
+	struct timeval now;
+	char **pav, *dir = NULL, path[1024];
+	int pac, port = 0, listener, fd, top, waiting, busy, quit = 0, canQuit = 0, i, k, z, x, y, digits, end;
+	long request = 0;
+	unsigned char *bmp;
+	FILE *f;
+	void print_error_option(const char *option);
+	void tilepath(char *path, const char *dir, int z, int x, int y, int make);
+	void tileoptions(const char *dir, int ac, char **av);
+	tileentry *tilefind(tileentry *t, int n, int z, int x, int y, long used), *tileslot(tileentry *t, int n);
+	int tileanswer(int fd, const char *status, const char *type, const unsigned char *body, size_t n);
+	unsigned char *tilerender(planetcontext **zooms, int ac, char **av, int z, int x, int y);
+	planetcontext *tileplanet(planetcontext **zooms, int ac, char **av, int z);
+	static const char *notFound = "Tiles are at /z/x/y.bmp, with zoom z from 0 to 20\n";
+
+	/* the options of the planet, with room for those of tilerender() */
+	pav = (char**)malloc((ac + 10) * sizeof(char*));
+	memory = (tileentry*)malloc(TILEMEMORY * sizeof(tileentry));
+	disk = (tileentry*)malloc(TILEDISK * sizeof(tileentry));
+	if (pav == NULL || memory == NULL || disk == NULL) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	pac = 0;
+	for (i = 0; i < ac; i++) {
+		if (strcmp(av[i], "--tiles") == 0) {
+			if (++i < ac && sscanf(av[i], "%d", &port) && port > 0 && port < 65536) continue;
+			print_error_option("--tiles");
+		}
+		if (strcmp(av[i], "--tilecache") == 0) {
+			if (++i < ac && strlen(av[i]) < 900) {
+				dir = av[i];
+				continue;
+			}
+			print_error_option("--tilecache");
+		}
+		if (strcmp(av[i], "--tilequit") == 0) {
+			canQuit = 1;
+			continue;
+		}
+		pav[pac++] = av[i];
+	}
 
-	putc(0, outfile); /* v. pixels/m */
-	putc(32, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+	for (z = 0; z < TILEZOOMS; z++) zooms[z] = NULL;
+	/* the options are checked now, not at the first request */
+	if (tileplanet(zooms, pac, pav, 0) == NULL) exit(1);
+	if (dir != NULL) tileoptions(dir, pac, pav);
 
-	putc(2, outfile); /* colours used */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+	for (k = 0; k < TILEMEMORY; k++) {
+		memory[k].z = -1;
+		memory[k].used = 0;
+		memory[k].bmp = NULL;
+	}
+	for (k = 0; k < TILEDISK; k++) {
+		disk[k].z = -1;
+		disk[k].used = 0;
+		disk[k].bmp = NULL;
+	}
+	for (k = 0; k < SERVECLIENTS; k++) clients[k].fd = -1;
+
+	signal(SIGPIPE, SIG_IGN); /* clients that leave are found by write() */
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((unsigned short)port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); /* only local clients */
+	k = 1;
+	if (listener >= 0) setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (char*)&k, sizeof(k));
+	if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+		fprintf(stderr, "Could not listen on port %d, error code = %d\n", port, errno);
+		exit(1);
+	}
+	fprintf(stderr, "\nServing tiles on http://localhost:%d/z/x/y.bmp\n", port);
+
+	while (!quit) {
+		FD_ZERO(&ready);
+		FD_SET(listener, &ready);
+		top = listener;
+		waiting = 0;
+		for (k = 0; k < SERVECLIENTS; k++) {
+			if (clients[k].fd < 0) continue;
+			if (clients[k].z >= 0) {
+				waiting = 1;
+			} else {
+				FD_SET(clients[k].fd, &ready);
+				top = max(top, clients[k].fd);
+			}
+		}
+		now.tv_sec = now.tv_usec = 0; /* with tiles to render, only see what has come */
+		if (select(top + 1, &ready, NULL, NULL, waiting ? &now : NULL) < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "select() failed, error code = %d\n", errno);
+			break;
+		}
+		busy = 0; /* a tile is rendered when all requests that came are read */
+		if (FD_ISSET(listener, &ready) && (fd = accept(listener, NULL, NULL)) >= 0) {
+			for (k = 0; k < SERVECLIENTS && clients[k].fd >= 0; k++) ;
+			if (k < SERVECLIENTS && fd < FD_SETSIZE) {
+				busy = 1;
+				clients[k].fd = fd;
+				clients[k].len = 0;
+				clients[k].z = -1;
+			} else {
+				tileanswer(fd, "503 Service Unavailable", "text/plain", (const unsigned char*)"Busy\n", 5);
+				close(fd);
+			}
+		}
 
-	putc(2, outfile); /* important colours (2) */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+		for (k = 0; k < SERVECLIENTS; k++) { /* read requests */
+			tileclient *c = clients + k;
+			ssize_t n;
+			if (c->fd < 0 || c->z >= 0 || !FD_ISSET(c->fd, &ready)) continue;
+			n = read(c->fd, c->request + c->len, sizeof(c->request) - 1 - c->len);
+			busy = 1;
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR) continue;
+				close(c->fd);
+				c->fd = -1;
+				continue;
+			}
+			c->len += n;
+			c->request[c->len] = '\0';
+			if (strstr(c->request, "\r\n\r\n") == NULL && strstr(c->request, "\n\n") == NULL) {
+				if (c->len < (int)sizeof(c->request) - 1) continue; /* not all read */
+			}
+			/* the path must be z/x/y.bmp in digits, short enough not to overflow */
+			digits = (int)strspn(c->request + 5, "0123456789/");
+			end = 0;
+			if (canQuit && strncmp(c->request, "GET /quit HTTP/", 15) == 0) {
+				tileanswer(c->fd, "200 OK", "text/plain", (const unsigned char*)"Stopped\n", 8);
+				quit = 1;
+			} else if (strncmp(c->request, "GET /", 5) != 0 || digits > 18 ||
+			           strncmp(c->request + 5 + digits, ".bmp HTTP/", 10) != 0 ||
+			           sscanf(c->request + 5, "%d/%d/%d%n", &z, &x, &y, &end) != 3 || end != digits ||
+			           z < 0 || z >= TILEZOOMS || x < 0 || y < 0 || x >= 1 << z || y >= 1 << z) {
+				tileanswer(c->fd, "404 Not Found", "text/plain", (const unsigned char*)notFound, strlen(notFound));
+			} else {
+				e = tilefind(memory, TILEMEMORY, z, x, y, ++request);
+				if (e == NULL && dir != NULL) { /* read from disk into memory */
+					tilepath(path, dir, z, x, y, 0);
+					f = fopen(path, "rb");
+					if (f != NULL) {
+						bmp = (unsigned char*)malloc(TILEBYTES);
+						if (bmp != NULL && fread(bmp, 1, TILEBYTES, f) == TILEBYTES) {
+							e = tileslot(memory, TILEMEMORY);
+							free(e->bmp);
+							e->z = z;
+							e->x = x;
+							e->y = y;
+							e->used = request;
+							e->bmp = bmp;
+							if (tilefind(disk, TILEDISK, z, x, y, request) == NULL) {
+								/* left by an earlier run */
+								tileentry *d = tileslot(disk, TILEDISK);
+								if (d->z >= 0) {
+									tilepath(path, dir, d->z, d->x, d->y, 0);
+									remove(path);
+								}
+								d->z = z;
+								d->x = x;
+								d->y = y;
+								d->used = request;
+							}
+						} else {
+							free(bmp);
+						}
+						fclose(f);
+					}
+				}
+				if (e == NULL) {
+					c->z = z; /* to be rendered */
+					c->x = x;
+					c->y = y;
+					continue;
+				}
+				tileanswer(c->fd, "200 OK", "image/bmp", e->bmp, TILEBYTES);
+			}
+			close(c->fd);
+			c->fd = -1;
+		}
 
-	putc(0, outfile); /* colour 0 = black */
-	putc(0, outfile);
-	putc(0, outfile);
-	putc(0, outfile);
+		/* render the tile of lowest zoom waited for */
+		z = TILEZOOMS;
+		x = y = 0;
+		for (k = 0; k < SERVECLIENTS; k++) {
+			if (clients[k].fd >= 0 && clients[k].z >= 0 && clients[k].z < z) {
+				z = clients[k].z;
+				x = clients[k].x;
+				y = clients[k].y;
+			}
+		}
+		if (quit || busy || z == TILEZOOMS) continue;
+		bmp = tilerender(zooms, pac, pav, z, x, y);
+		if (bmp != NULL) {
+			e = tileslot(memory, TILEMEMORY);
+			free(e->bmp);
+			e->z = z;
+			e->x = x;
+			e->y = y;
+			e->used = ++request;
+			e->bmp = bmp;
+			if (dir != NULL) {
+				tileentry *d = tileslot(disk, TILEDISK);
+				if (d->z >= 0) {
+					tilepath(path, dir, d->z, d->x, d->y, 0);
+					remove(path);
+				}
+				tilepath(path, dir, z, x, y, 1);
+				f = fopen(path, "wb");
+				if (f != NULL && fwrite(bmp, 1, TILEBYTES, f) == TILEBYTES) {
+					d->z = z;
+					d->x = x;
+					d->y = y;
+					d->used = request;
+				} else {
+					d->z = -1;
+					fprintf(stderr, "Could not write tile %s, error code = %d\n", path, errno);
+				}
+				if (f != NULL) fclose(f);
+			}
+		}
+		for (k = 0; k < SERVECLIENTS; k++) { /* answer all asking for it */
+			tileclient *c = clients + k;
+			if (c->fd < 0 || c->z != z || c->x != x || c->y != y) continue;
+			if (bmp != NULL) tileanswer(c->fd, "200 OK", "image/bmp", bmp, TILEBYTES);
+			else tileanswer(c->fd, "500 Internal Server Error", "text/plain", (const unsigned char*)"Failed\n", 7);
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
 
-	putc(255, outfile); /* colour 1 = white */
-	putc(255, outfile);
-	putc(255, outfile);
-	putc(255, outfile);
+	for (k = 0; k < SERVECLIENTS; k++) {
+		if (clients[k].fd >= 0) close(clients[k].fd);
+	}
+	for (k = 0; k < TILEMEMORY; k++) free(memory[k].bmp);
+	for (z = 0; z < TILEZOOMS; z++) planet_close(zooms[z]);
+	close(listener);
+	free(memory);
+	free(disk);
+	free(pav);
+	return(0);
+}
 
-	for (j = Height - 1; j >= 0; j--) {
-		for (i = 0; i < W1; i += 8) {
-			if (i < Width && col[i][j] >= WHITE) {c = 128;} else {c = 0;}
-			if (i + 1 < Width && col[i + 1][j] >= WHITE) {c += 64;}
-			if (i + 2 < Width && col[i + 2][j] >= WHITE) {c += 32;}
-			if (i + 3 < Width && col[i + 3][j] >= WHITE) {c += 16;}
-			if (i + 4 < Width && col[i + 4][j] >= WHITE) {c += 8;}
-			if (i + 5 < Width && col[i + 5][j] >= WHITE) {c += 4;}
-			if (i + 6 < Width && col[i + 6][j] >= WHITE) {c += 2;}
-			if (i + 7 < Width && col[i + 7][j] >= WHITE) {c += 1;}
-			putc(c, outfile);
+/* --pyramid: all the tiles of --tiles from zoom 0 to n, written to */
+/* dir/z/x/y.bmp. The tiles of zoom n are rendered a block of BxB at a */
+/* time (B = 4, or less for n < 2), and each tile of lower zoom is made */
+/* by halving the four tiles under it, averaging in linear light as */
+/* --mips, so the planet is only rendered once. The tiles are made */
+/* depth first, so only the tiles on the way down to the block being */
+/* rendered are kept in memory. A tile is written (through a temporary */
+/* file) after all tiles under it, so an interrupted run is taken up */
+/* where it stopped by reading the tiles found instead of making them; */
+/* as they are read back at 8 bits, the tiles are the same either way. */
+
+typedef struct TilePyramid {
+	planetcontext *pc; /* Mercator map of zoom n */
+	const char *dir;
+	int n, b; /* deepest zoom, and blocks of 2^b x 2^b tiles */
+	long blocks, done; /* blocks to render, and rendered or found */
+} tilepyramid;
+
+int tileread(const char *path, unsigned char *rgb) { /* colours of a tile file */
+	unsigned char *bmp;
+	int i, j, k, ok;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) return(0);
+	bmp = (unsigned char*)malloc(TILEBYTES);
+	ok = bmp != NULL && fread(bmp, 1, TILEBYTES, f) == TILEBYTES && bmp[0] == 'B' && bmp[1] == 'M';
+	fclose(f);
+	if (ok) {
+		for (j = 0; j < TILESIZE; j++) { /* rows are bottom up, as bgr */
+			for (i = 0; i < TILESIZE; i++) {
+				k = 54 + 3 * ((TILESIZE - 1 - j) * TILESIZE + i);
+				rgb[3 * (j * TILESIZE + i)] = bmp[k + 2];
+				rgb[3 * (j * TILESIZE + i) + 1] = bmp[k + 1];
+				rgb[3 * (j * TILESIZE + i) + 2] = bmp[k];
+			}
 		}
 	}
-	fprintf(outfile, "Command line:\n%s\n", cmdLine);
-	fclose(outfile);
+	free(bmp);
+	return(ok);
 }
 
-char *nletters(int n, int c) {
-	int i;
-	static char buffer[8];
-	buffer[n] = '\0';
-	for (i = n - 1; i >= 0; i--) {
-		buffer[i] = letters[c & 0x001F];
-		c >>= 5;
+void tilewrite(const char *dir, int z, int x, int y, unsigned char *rgb, long stride) {
+	/* write the tile at rgb, with rows stride bytes apart */
+	unsigned char *bmp, *tile;
+	char path[1024], temp[1040];
+	int j;
+	FILE *f;
+	void tilepath(char *path, const char *dir, int z, int x, int y, int make);
+	void tilebmp(unsigned char *bmp, unsigned char *rgb);
+
+	bmp = (unsigned char*)malloc(TILEBYTES);
+	tile = (unsigned char*)malloc(3 * TILESIZE * TILESIZE);
+	if (bmp == NULL || tile == NULL) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
 	}
-	return buffer;
+	for (j = 0; j < TILESIZE; j++) memcpy(tile + 3 * TILESIZE * j, rgb + j * stride, 3 * TILESIZE);
+	tilebmp(bmp, tile);
+	tilepath(path, dir, z, x, y, 1);
+	sprintf(temp, "%s.tmp", path); /* so a tile file is whole if there */
+	f = fopen(temp, "wb");
+	if (f == NULL || fwrite(bmp, 1, TILEBYTES, f) != TILEBYTES || fclose(f) != 0 || rename(temp, path) != 0) {
+		fprintf(stderr, "Could not write tile %s, error code = %d\n", path, errno);
+		exit(1);
+	}
+	free(tile);
+	free(bmp);
 }
 
-void printxpm(FILE *outfile) { /* prints picture in XPM (X-windows pixel map) format */
-	int x, y, i, nbytes;
-
-	x = nocols - 1;
-	for (nbytes = 0; x != 0; nbytes++) {x >>= 5;}
+void tilehalve(unsigned char *half, long halfStride, unsigned char *rgb, long stride, int w) {
+	/* halve the w x w colours at rgb, averaging 2 x 2 pixels in linear */
+	/* light as --mips */
+	static float lin[256];
+	static int made = 0;
+	int i, j, c;
+	double v;
 
-	fprintf(outfile, "/* XPM */\n");
-	fprintf(outfile, "/* Command line: */\n/* %s*/\n", cmdLine);
-	fprintf(outfile, "static char *xpmdata[] = {\n");
-	fprintf(outfile, "/* width height ncolors chars_per_pixel */\n");
-	fprintf(outfile, "\"%d %d %d %d\",\n", Width, Height, nocols, nbytes);
-	fprintf(outfile, "/* colors */\n");
-	for (i = 0; i < nocols; i++) {
-		fprintf(outfile, "\"%s c #%2.2X%2.2X%2.2X\",\n", nletters(nbytes, i), rtable[i], gtable[i], btable[i]);
+	if (!made) {
+		for (c = 0; c < 256; c++) {
+			v = c / 255.0;
+			lin[c] = (float)(v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+		}
+		made = 1;
 	}
-
-	fprintf(outfile, "/* pixels */\n");
-	for (y = 0 ; y < Height; y++) {
-		fprintf(outfile, "\"");
-		for (x = 0; x < Width; x++) {
-			fprintf(outfile, "%s", nletters(nbytes, col[x][y]));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) private(i, c, v)
+#endif
+	for (j = 0; j < w / 2; j++) {
+		unsigned char *p = rgb + 2 * j * stride, *q = half + j * halfStride;
+		for (i = 0; i < 3 * (w / 2); i++) {
+			c = 3 * (i / 3) + i; /* same channel of pixel 2 * (i / 3) */
+			v = 0.25 * (lin[p[c]] + lin[p[c + 3]] + lin[p[c + stride]] + lin[p[c + stride + 3]]);
+			v = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+			q[i] = (unsigned char)(255.0 * v + 0.5);
 		}
-		fprintf(outfile, "\",\n");
 	}
-	fprintf(outfile, "};\n");
-	fclose(outfile);
 }
 
-void printxpmBW(FILE *outfile) { /* prints picture in XPM (X-windows pixel map) format */
-	int x, y, nbytes;
-	nbytes = 1;
+unsigned char *pyramidtile(tilepyramid *py, int z, int x, int y) {
+	/* colours of tile (z, x, y), made and written with all tiles under it */
+	/* if not found in the directory */
+	unsigned char *rgb, *block, *half, *t;
+	char path[1024];
+	int s, c, w, i, j, d;
+	int tileread(const char *path, unsigned char *rgb);
+	void tilepath(char *path, const char *dir, int z, int x, int y, int make);
+	void tilewrite(const char *dir, int z, int x, int y, unsigned char *rgb, long stride);
+	void tilehalve(unsigned char *half, long halfStride, unsigned char *rgb, long stride, int w);
+
+	rgb = (unsigned char*)malloc(3 * TILESIZE * TILESIZE);
+	if (rgb == NULL) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	tilepath(path, py->dir, z, x, y, 0);
+	if (tileread(path, rgb)) {
+		if (z <= py->n - py->b) py->done += 1L << 2 * (py->n - py->b - z);
+		return(rgb);
+	}
 
-	fprintf(outfile, "/* XPM */\n");
-	fprintf(outfile, "/* Command line: */\n/* %s*/\n", cmdLine);
-	fprintf(outfile, "static char *xpmdata[] = {\n");
-	fprintf(outfile, "/* width height ncolors chars_per_pixel */\n");
-	fprintf(outfile, "\"%d %d %d %d\",\n", Width, Height, 2, nbytes);
-	fprintf(outfile, "/* colors */\n");
-	fprintf(outfile, "\". c #FFFFFF\",\n");
-	fprintf(outfile, "\"X c #000000\",\n");
-	fprintf(outfile, "/* pixels */\n");
-	for (y = 0 ; y < Height; y++) {
-		fprintf(outfile, "\"");
-		for (x = 0; x < Width; x++) {
-			fprintf(outfile, "%s", (col[x][y] < WHITE)? "X" : ".");
+	if (z < py->n - py->b) { /* from the four tiles under it */
+		for (d = 0; d < 4; d++) {
+			t = pyramidtile(py, z + 1, 2 * x + (d & 1), 2 * y + (d >> 1));
+			tilehalve(rgb + 3 * (TILESIZE / 2) * ((d & 1) + TILESIZE * (d >> 1)), 3 * TILESIZE,
+			          t, 3 * TILESIZE, TILESIZE);
+			free(t);
 		}
-		fprintf(outfile, "\",\n");
+		tilewrite(py->dir, z, x, y, rgb, 3 * TILESIZE);
+		return(rgb);
 	}
-	fprintf(outfile, "};\n");
-	fclose(outfile);
-}
-
-void printheights(FILE *outfile) { /* prints heightfield */
-	int i, j;
 
-	for (j = 0; j < Height; j++) {
-		for (i = 0; i < Width; i++) {
-			fprintf(outfile, "%d ", heights[i][j]);
+	/* render a block, and halve it down to this tile */
+	s = TILESIZE << py->b;
+	block = (unsigned char*)malloc((size_t)3 * s * s);
+	half = (unsigned char*)malloc((size_t)3 * (s / 2) * (s / 2));
+	if (block == NULL || half == NULL) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	fprintf(stderr, "\nBlock %ld of %ld", py->done + 1, py->blocks);
+	/* the rows of the block are shared out among the threads by mercator() */
+	if (planet_window(py->pc, s * x, s * y, s, s) != 0 || planet_render(py->pc, block, 3L * s, NULL, 0) != 0) exit(1);
+	for (c = py->b; c >= 0; c--) {
+		w = TILESIZE << c;
+		for (j = 0; j < 1 << c; j++) {
+			for (i = 0; i < 1 << c; i++) {
+				tilewrite(py->dir, z + c, (x << c) + i, (y << c) + j,
+				          block + 3L * TILESIZE * (j * w + i), 3L * w);
+			}
+		}
+		if (c > 0) {
+			tilehalve(half, 3L * w / 2, block, 3L * w, w);
+			t = block;
+			block = half;
+			half = t;
 		}
-		putc('\n', outfile);
 	}
-	fclose(outfile);
-}
-
-void print_help(void) {
-	fprintf(stdout, "Basic usage: planet -s [seed] -w [width] -h [height] -p[projection] -o [outfile]\n");
-	fprintf(stdout, "The command-line options are:\n");
-	fprintf(stdout, "	 -s [seed]\t\tSpecifies seed as number between 0.0 and 1.0\n");
-	fprintf(stdout, "	 -w [width]\t\tSpecifies width in pixels, default = 800\n");
-	fprintf(stdout, "	 -h [height]\t\tSpecifies height in pixels, default = 600\n");
-	fprintf(stdout, "	 -m [magnification]\tSpecifies magnification, default = 1.0\n");
-	fprintf(stdout, "	 -o [output-file]\tSpecifies output file, default is standard output\n");
-	fprintf(stdout, "	 -l [longitude]\t\tSpecifies longitude of centre in degrees, default = 0.0\n");
-	fprintf(stdout, "	 -L [latitude]\t\tSpecifies latitude of centre in degrees, default = 0.0\n");
-	fprintf(stdout, "	 -g [gridsize]\t\tSpecifies vertical gridsize in degrees, default = 0.0 (no grid)\n");
-	fprintf(stdout, "	 -G [gridsize]\t\tSpecifies horisontal gridsize in degrees, default = 0.0 (no grid)\n");
-	fprintf(stdout, "	 -i [init-alt]\t\tSpecifies initial altitude (default = -0.02)\n");
-	fprintf(stdout, "	 -c\t\t\tColour depends on latitude (cumulative, default: only altitude)\n");
-	fprintf(stdout, "	 -n\t\t\tApply non-linear scaling to altitude. This makes land flatter near sea level\n");
-	fprintf(stdout, "	 -S\t\t\tMake more \"wrinkly\" maps\n");
-	fprintf(stdout, "	 -C file\t\tRead colour definitions from file\n");
-	fprintf(stdout, "	 -O\t\t\tProduce a black and white outline map\n");
-	fprintf(stdout, "	 -E\t\t\tTrace the edges of land in black on colour map\n");
-	fprintf(stdout, "	 -B\t\t\tUse \"bumpmap\" shading\n");
-	fprintf(stdout, "	 -b\t\t\tUse \"bumpmap\" shading on land only\n");
-	fprintf(stdout, "	 -d\t\t\tUse \"daylight\" shading\n");
-	fprintf(stdout, "	 -a [angle]\t\tAngle of \"light\" in bumpmap shading or longitude of sun in daylight shading\n");
-	fprintf(stdout, "	 -A [latitude]\t\tLatitude of sun in daylight shading\n");
-	fprintf(stdout, "	 -M [delta]\t\tRead map from standard input and match new points to map\n");
-	fprintf(stdout, "	 \t\t\tif edge length greater than delta (default = 0.1)\n");
-	fprintf(stdout, "	 -V [number]\t\tDistance contribution to variation (default = 0.035)\n");
-	fprintf(stdout, "	 -v [number]\t\tAltitude contribution to variation (default = -0.45)\n");
-	fprintf(stdout, "	 -T [lo] [la]\t\tRotate map so what would otherwise be at latitude [la] and longitude [lo] is moved to (0,0).\n");
-	fprintf(stdout, "	 \t\t\tThis is different from using -l and -L because this rotation is done before applying \n");
-	fprintf(stdout, "	 \t\t\tgridlines and latitude-based effects.\n");
-	fprintf(stdout, "	 -P\t\t\tUse PPM file format (default is BMP)\n");
-	fprintf(stdout, "	 -x\t\t\tUse XPM file format (default is BMP)\n");
-	fprintf(stdout, "	 -H\t\t\tOutput heightfield (default is BMP)\n");
-	fprintf(stdout, "	 -z\t\t\tShow biomes using the default palette.\n");
-	fprintf(stdout, "	 \t\t\t(Use -z -z to use Ian's palette from: https://space.geometrian.com/calcs/climate-sim.php)\n");
-	fprintf(stdout, "	 -Z file\t\tShow biomes using custom biomes palette file\n");
-	fprintf(stdout, "	 -R\t\t\tPrint version info\n");
-	fprintf(stdout, "	 -p[projection]\t\tSpecifies projection:\n");
-	fprintf(stdout, "	 \t\t	   m = Mercator (default)\n");
-	fprintf(stdout, "	 \t\t	   p = Peters\n");
-	fprintf(stdout, "	 \t\t	   q = Square\n");
-	fprintf(stdout, "	 \t\t	   s = Stereographic\n");
-	fprintf(stdout, "	 \t\t	   o = Orthographic\n");
-	fprintf(stdout, "	 \t\t	   O = Double orthographic\n");
-	fprintf(stdout, "	 \t\t	   g = Gnomonic\n");
-	fprintf(stdout, "	 \t\t	   a = Area preserving azimuthal\n");
-	fprintf(stdout, "	 \t\t	   c = Conical (conformal)\n");
-	fprintf(stdout, "	 \t\t	   M = Mollweide\n");
-	fprintf(stdout, "	 \t\t	   S = Sinusoidal\n");
-	fprintf(stdout, "	 \t\t	   h = Heightfield (obsolete. Use -H option instead)\n");
-	fprintf(stdout, "	 \t\t	   i = Icosahedral\n");
-	fprintf(stdout, "\nSee Manual.pdf for detailed help.\n");
-	exit(0);
+	memcpy(rgb, block, 3 * TILESIZE * TILESIZE);
+	free(block);
+	free(half);
+	py->done++;
+	return(rgb);
 }
 
-void print_error(void) {
-	fprintf(stderr, "Basic usage: planet -s [seed] -w [width] -h [height] -p[projection] -o [outfile]\n");
-	fprintf(stderr, "Try \'planet -?\' for basic help, and \'planet -R\' for version information.\n");
-	fprintf(stderr, "See Manual.pdf for detailed help.\n");
-	exit(1);
-}
+int pyramid(int ac, char **av) {
+	planetcontext *zooms[TILEZOOMS];
+	tilepyramid py;
+	char **pav;
+	int pac, i, z;
+	void print_error_option(const char *option);
+	void tileoptions(const char *dir, int ac, char **av);
+	planetcontext *tileplanet(planetcontext **zooms, int ac, char **av, int z);
+	unsigned char *pyramidtile(tilepyramid *py, int z, int x, int y);
+
+	pav = (char**)malloc((ac + 10) * sizeof(char*));
+	if (pav == NULL) {
+		fprintf(stderr, "Memory allocation failed.");
+		exit(1);
+	}
+	py.dir = NULL;
+	py.n = 0;
+	pac = 0;
+	for (i = 0; i < ac; i++) {
+		if (strcmp(av[i], "--pyramid") == 0) {
+			if (i + 2 < ac && strlen(av[i + 1]) < 900 && sscanf(av[i + 2], "%d", &py.n) &&
+			    py.n >= 0 && py.n < TILEZOOMS) {
+				py.dir = av[i + 1];
+				i += 2;
+				continue;
+			}
+			print_error_option("--pyramid");
+		}
+		pav[pac++] = av[i];
+	}
 
-void print_error_args(char c) {
-	fprintf(stderr, "Missing or bad argument to option -%c\n\n", c);
-	fprintf(stderr, "Basic usage: planet -s [seed] -w [width] -h [height] -p[projection] -o [outfile]\n");
-	fprintf(stderr, "Try \'planet -?\' for basic help, and \'planet -R\' for version information.\n");
-	fprintf(stderr, "See Manual.pdf for detailed help.\n");
-	exit(2);
+	for (z = 0; z < TILEZOOMS; z++) zooms[z] = NULL;
+	py.pc = tileplanet(zooms, pac, pav, py.n);
+	if (py.pc == NULL) exit(1);
+	tileoptions(py.dir, pac, pav);
+	py.b = min(py.n, 2);
+	py.blocks = 1L << 2 * (py.n - py.b);
+	py.done = 0;
+	free(pyramidtile(&py, 0, 0, 0));
+	fprintf(stderr, "\nTiles of zoom 0 to %d are in %s\n", py.n, py.dir);
+	planet_close(py.pc);
+	free(pav);
+	return(0);
 }
+#endif